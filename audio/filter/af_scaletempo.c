@@ -37,7 +37,10 @@
 #include <assert.h>
 #include <math.h>
 
+#include <libavutil/cpu.h>
+
 #include "audio/aframe.h"
+#include "audio/filter/af_scaletempo_kernels.h"
 #include "audio/format.h"
 #include "common/common.h"
 #include "filters/f_autoconvert.h"
@@ -89,6 +92,7 @@ struct priv {
     int frames_search;
     int num_channels;
     int (*best_overlap_offset)(struct priv *s);
+    const struct mp_scaletempo_kernels *kernels;
 };
 
 static bool reinit(struct mp_filter *f);
@@ -188,9 +192,8 @@ static int best_overlap_offset_float(struct priv *s)
     float best_distance = FLT_MAX;
     int best_offset_approx = 0;
     for (int offset = 0; offset < frames_search; offset += step_size) {
-        float distance = 0;
-        for (int i = 0; i < num_samples; i++)
-            distance += fabsf(target[i] - source[offset * num_channels + i]);
+        float distance = s->kernels->sad_float(target,
+                            source + offset * num_channels, num_samples);
 
         int offset_approx = offset;
         history[0] = history[1];
@@ -213,9 +216,8 @@ static int best_overlap_offset_float(struct priv *s)
     int min_offset = MPMAX(0, best_offset_approx - step_size + 1);
     int max_offset = MPMIN(frames_search, best_offset_approx + step_size);
     for (int offset = min_offset; offset < max_offset; offset++) {
-        float distance = 0;
-        for (int i = 0; i < num_samples; i++)
-            distance += fabsf(target[i] - source[offset * num_channels + i]);
+        float distance = s->kernels->sad_float(target,
+                            source + offset * num_channels, num_samples);
         if (distance < best_distance) {
             best_distance = distance;
             best_offset  = offset;
@@ -237,9 +239,8 @@ static int best_overlap_offset_s16(struct priv *s)
     int32_t best_distance = INT32_MAX;
     int best_offset_approx = 0;
     for (int offset = 0; offset < frames_search; offset += step_size) {
-        int32_t distance = 0;
-        for (int i = 0; i < num_samples; i++)
-            distance += abs((int32_t)target[i] - source[offset * num_channels + i]);
+        int32_t distance = s->kernels->sad_s16(target,
+                            source + offset * num_channels, num_samples);
 
         int offset_approx = offset;
         history[0] = history[1];
@@ -262,9 +263,8 @@ static int best_overlap_offset_s16(struct priv *s)
     int min_offset = MPMAX(0, best_offset_approx - step_size + 1);
     int max_offset = MPMIN(frames_search, best_offset_approx + step_size);
     for (int offset = min_offset; offset < max_offset; offset++) {
-        int32_t distance = 0;
-        for (int i = 0; i < num_samples; i++)
-            distance += abs((int32_t)target[i] - source[offset * num_channels + i]);
+        int32_t distance = s->kernels->sad_s16(target,
+                            source + offset * num_channels, num_samples);
         if (distance < best_distance) {
             best_distance = distance;
             best_offset  = offset;
@@ -277,29 +277,19 @@ static int best_overlap_offset_s16(struct priv *s)
 static void output_overlap_float(struct priv *s, void *buf_out,
                                  int bytes_off)
 {
-    float *pout = buf_out;
-    float *pb   = s->table_blend;
-    float *po   = s->buf_overlap;
-    float *pin  = (float *)(s->buf_queue + bytes_off);
-    for (int i = 0; i < s->samples_overlap; i++) {
-        // the math is equal to *po * (1 - *pb) + *pin * *pb
-        float o = *po++;
-        *pout++ = o - *pb++ * (o - *pin++);
-    }
+    // the math is equal to overlap * (1 - blend) + in * blend
+    s->kernels->blend_float(buf_out, s->buf_overlap,
+                            (float *)(s->buf_queue + bytes_off),
+                            s->table_blend, s->samples_overlap);
 }
 
 static void output_overlap_s16(struct priv *s, void *buf_out,
                                int bytes_off)
 {
-    int16_t *pout = buf_out;
-    int32_t *pb   = s->table_blend;
-    int16_t *po   = s->buf_overlap;
-    int16_t *pin  = (int16_t *)(s->buf_queue + bytes_off);
-    for (int i = 0; i < s->samples_overlap; i++) {
-        // the math is equal to *po * (1 - *pb) + *pin * *pb
-        int32_t o = *po++;
-        *pout++ = o - ((*pb++ *(o - *pin++)) >> 16);
-    }
+    // the math is equal to overlap * (1 - blend) + in * blend
+    s->kernels->blend_s16(buf_out, s->buf_overlap,
+                          (int16_t *)(s->buf_queue + bytes_off),
+                          s->table_blend, s->samples_overlap);
 }
 
 static void af_scaletempo_process(struct mp_filter *f)
@@ -541,14 +531,14 @@ static bool reinit(struct mp_filter *f)
 
     MP_DBG(f, ""
            "%.2f stride_in, %i stride_out, %i standing, "
-           "%i overlap, %i search, %i queue, %s mode\n",
+           "%i overlap, %i search, %i queue, %s mode, %s kernels\n",
            s->frames_stride_scaled,
            (int)(s->bytes_stride / nch / bps),
            (int)(s->bytes_standing / nch / bps),
            (int)(s->bytes_overlap / nch / bps),
            s->frames_search,
            (int)(s->bytes_queue / nch / bps),
-           (use_int ? "s16" : "float"));
+           (use_int ? "s16" : "float"), s->kernels->name);
 
     mp_aframe_config_copy(s->cur_format, s->in);
 
@@ -620,6 +610,7 @@ static struct mp_filter *af_scaletempo_create(struct mp_filter *parent,
 
     struct priv *s = f->priv;
     s->opts = talloc_steal(s, options);
+    s->kernels = mp_scaletempo_kernels_get(av_get_cpu_flags());
     s->speed = 1.0;
     s->cur_format = talloc_steal(s, mp_aframe_create());
     s->out_pool = mp_aframe_pool_create(s);
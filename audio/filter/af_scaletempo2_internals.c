@@ -1,6 +1,9 @@
 #include <float.h>
 #include <math.h>
 
+#include <libavutil/mem.h>
+#include <libavutil/tx.h>
+
 #include "audio/chmap.h"
 #include "audio/filter/af_scaletempo2_internals.h"
 
@@ -52,6 +55,66 @@ static void alloc_sample_buffer(struct mp_scaletempo2 *p, float ***ptr, size_t s
     *ptr = buff;
 }
 
+// State for computing the dot products of |target_block| with all candidate
+// blocks at once, as cross-correlation in the frequency domain.
+struct mp_scaletempo2_fft {
+    int size;
+    AVTXContext *fwd, *inv;
+    av_tx_fn fwd_fn, inv_fn;
+    // Real input/output of the transforms, |size| + 2 floats.
+    float *buf;
+    // Spectra of search and target block, |size| / 2 + 1 bins each.
+    AVComplexFloat *search;
+    AVComplexFloat *target;
+};
+
+static void fft_destroy(void *ptr)
+{
+    struct mp_scaletempo2_fft *fft = ptr;
+    av_tx_uninit(&fft->fwd);
+    av_tx_uninit(&fft->inv);
+    av_freep(&fft->buf);
+    av_freep(&fft->search);
+    av_freep(&fft->target);
+}
+
+static struct mp_scaletempo2_fft *fft_create(void *ta_parent, int size)
+{
+    struct mp_scaletempo2_fft *fft = talloc_zero(ta_parent, struct mp_scaletempo2_fft);
+    talloc_set_destructor(fft, fft_destroy);
+    fft->size = size;
+
+    // The inverse transform is unnormalized; fold the 1/N into it.
+    float scale = 1.0f, inv_scale = 1.0f / size;
+    if (av_tx_init(&fft->fwd, &fft->fwd_fn, AV_TX_FLOAT_RDFT, 0, size, &scale, 0) < 0 ||
+        av_tx_init(&fft->inv, &fft->inv_fn, AV_TX_FLOAT_RDFT, 1, size, &inv_scale, 0) < 0)
+        goto error;
+
+    fft->buf = av_malloc_array(size + 2, sizeof(float));
+    fft->search = av_malloc_array(size / 2 + 1, sizeof(AVComplexFloat));
+    fft->target = av_malloc_array(size / 2 + 1, sizeof(AVComplexFloat));
+    if (!fft->buf || !fft->search || !fft->target)
+        goto error;
+
+    return fft;
+
+error:
+    talloc_free(fft);
+    return NULL;
+}
+
+// Whether the FFT path is expected to be faster than direct dot products for
+// |num_candidate_blocks| candidates of |block_frames| frames each. The direct
+// cost is that of compute_optimal_index() (decimated search plus the full
+// search around its result); the FFT needs three real transforms per channel.
+// The constant factor was determined with test/scaletempo2_bench.c.
+static bool fft_is_faster(int num_candidate_blocks, int block_frames, int fft_size)
+{
+    double direct = (num_candidate_blocks / 5.0 + 11) * block_frames;
+    double fft = 3 * 0.75 * fft_size * log2(fft_size);
+    return fft < direct;
+}
+
 static void zero_2d_partial(float **a, int x, int y)
 {
     for (int i = 0; i < x; ++i) {
@@ -88,6 +151,46 @@ static void multi_channel_moving_block_energies(
     }
 }
 
+// Dot products of |target_block| with every candidate block in |search_block|,
+// computed as cross-correlation in the frequency domain. The correlation of
+// channels is interleaved like the energies, so |correlation| must have at
+// least size (|search_block_frames| - (|target_block_frames| - 1)) * |channels|.
+static void multi_channel_cross_correlation(
+    struct mp_scaletempo2_fft *fft,
+    float **search_block, int search_block_frames,
+    float **target_block, int target_block_frames,
+    int channels, float *correlation)
+{
+    int num_candidate_blocks = search_block_frames - (target_block_frames - 1);
+    mp_assert(search_block_frames <= fft->size);
+
+    for (int k = 0; k < channels; ++k) {
+        float *buf = fft->buf;
+
+        memcpy(buf, search_block[k], search_block_frames * sizeof(float));
+        memset(buf + search_block_frames, 0,
+               (fft->size - search_block_frames) * sizeof(float));
+        fft->fwd_fn(fft->fwd, fft->search, buf, sizeof(float));
+
+        memcpy(buf, target_block[k], target_block_frames * sizeof(float));
+        memset(buf + target_block_frames, 0,
+               (fft->size - target_block_frames) * sizeof(float));
+        fft->fwd_fn(fft->fwd, fft->target, buf, sizeof(float));
+
+        // search * conj(target). The search block is at most |size| frames,
+        // so the circular correlation does not wrap around for valid offsets.
+        for (int n = 0; n <= fft->size / 2; ++n) {
+            AVComplexFloat s = fft->search[n], t = fft->target[n];
+            fft->search[n].re = s.re * t.re + s.im * t.im;
+            fft->search[n].im = s.im * t.re - s.re * t.im;
+        }
+        fft->inv_fn(fft->inv, buf, fft->search, sizeof(AVComplexFloat));
+
+        for (int n = 0; n < num_candidate_blocks; ++n)
+            correlation[n * channels + k] = buf[n];
+    }
+}
+
 static float multi_channel_similarity_measure(
     const float* dot_prod,
     const float* energy_target, const float* energy_candidate,
@@ -191,6 +294,23 @@ static void multi_channel_dot_product(
 
 #endif // HAVE_VECTOR
 
+// Dot-product of |target_block| and the candidate block at frame |n| of
+// |search_block|, taken from |correlation| if it was precomputed.
+static void candidate_dot_product(
+    const float *correlation,
+    float **target_block, int target_block_frames,
+    float **search_block, int n,
+    int channels, float *dot_product)
+{
+    if (correlation) {
+        memcpy(dot_product, &correlation[n * channels],
+               channels * sizeof(float));
+    } else {
+        multi_channel_dot_product(target_block, 0, search_block, n, channels,
+            target_block_frames, dot_product);
+    }
+}
+
 // Fit the curve f(x) = a * x^2 + b * x + c such that
 //   f(-1) = y[0]
 //   f(0) = y[1]
@@ -222,18 +342,18 @@ static int decimated_search(
     float **target_block, int target_block_frames,
     float **search_segment, int search_segment_frames,
     int channels,
-    const float *energy_target_block, const float *energy_candidate_blocks)
+    const float *energy_target_block, const float *energy_candidate_blocks,
+    const float *correlation)
 {
     int num_candidate_blocks = search_segment_frames - (target_block_frames - 1);
     float dot_prod [MP_NUM_CHANNELS];
     float similarity[3];  // Three elements for cubic interpolation.
 
     int n = 0;
-    multi_channel_dot_product(
-        target_block, 0,
+    candidate_dot_product(correlation,
+        target_block, target_block_frames,
         search_segment, n,
-        channels,
-        target_block_frames, dot_prod);
+        channels, dot_prod);
     similarity[0] = multi_channel_similarity_measure(
         dot_prod, energy_target_block,
         &energy_candidate_blocks[n * channels], channels);
@@ -247,11 +367,10 @@ static int decimated_search(
         return 0;
     }
 
-    multi_channel_dot_product(
-        target_block, 0,
+    candidate_dot_product(correlation,
+        target_block, target_block_frames,
         search_segment, n,
-        channels,
-        target_block_frames, dot_prod);
+        channels, dot_prod);
     similarity[1] = multi_channel_similarity_measure(
         dot_prod, energy_target_block,
         &energy_candidate_blocks[n * channels], channels);
@@ -264,11 +383,10 @@ static int decimated_search(
     }
 
     for (; n < num_candidate_blocks; n += decimation) {
-        multi_channel_dot_product(
-            target_block, 0,
+        candidate_dot_product(correlation,
+            target_block, target_block_frames,
             search_segment, n,
-            channels,
-            target_block_frames, dot_prod);
+            channels, dot_prod);
 
         similarity[2] = multi_channel_similarity_measure(
             dot_prod, energy_target_block,
@@ -316,7 +434,8 @@ static int full_search(
     float **search_block, int search_block_frames,
     int channels,
     const float* energy_target_block,
-    const float* energy_candidate_blocks)
+    const float* energy_candidate_blocks,
+    const float* correlation)
 {
     // int block_size = target_block->frames;
     float dot_prod [sizeof(float) * MP_NUM_CHANNELS];
@@ -328,8 +447,8 @@ static int full_search(
         if (in_interval(n, exclude_interval)) {
             continue;
         }
-        multi_channel_dot_product(target_block, 0, search_block, n, channels,
-            target_block_frames, dot_prod);
+        candidate_dot_product(correlation, target_block, target_block_frames,
+            search_block, n, channels, dot_prod);
 
         float similarity = multi_channel_similarity_measure(
             dot_prod, energy_target_block,
@@ -347,10 +466,13 @@ static int full_search(
 // Find the index of the block, within |search_block|, that is most similar
 // to |target_block|. Obviously, the returned index is w.r.t. |search_block|.
 // |exclude_interval| is an interval that is excluded from the search.
+// If |fft| is set, the dot products of all candidate blocks are computed at
+// once into |correlation|, instead of one by one as needed.
 static int compute_optimal_index(
     float **search_block, int search_block_frames,
     float **target_block, int target_block_frames,
     float *energy_candidate_blocks,
+    struct mp_scaletempo2_fft *fft, float *correlation,
     int channels,
     struct interval exclude_interval)
 {
@@ -383,13 +505,23 @@ static int compute_optimal_index(
         channels,
         target_block_frames, energy_target_block);
 
+    if (fft) {
+        multi_channel_cross_correlation(fft,
+            search_block, search_block_frames,
+            target_block, target_block_frames,
+            channels, correlation);
+    } else {
+        correlation = NULL;
+    }
+
     int optimal_index = decimated_search(
         search_decimation, exclude_interval,
         target_block, target_block_frames,
         search_block, search_block_frames,
         channels,
         energy_target_block,
-        energy_candidate_blocks);
+        energy_candidate_blocks,
+        correlation);
 
     int lim_low = MPMAX(0, optimal_index - search_decimation);
     int lim_high = MPMIN(num_candidate_blocks - 1,
@@ -399,7 +531,8 @@ static int compute_optimal_index(
         target_block, target_block_frames,
         search_block, search_block_frames,
         channels,
-        energy_target_block, energy_candidate_blocks);
+        energy_target_block, energy_candidate_blocks,
+        correlation);
 }
 
 static void peek_buffer(struct mp_scaletempo2 *p,
@@ -578,6 +711,7 @@ static void get_optimal_block(struct mp_scaletempo2 *p)
             p->search_block, p->search_block_size,
             p->target_block, p->ola_window_size,
             p->energy_candidate_blocks,
+            p->fft, p->correlation,
             p->channels,
             exclude_iterval);
 
@@ -841,4 +975,16 @@ void mp_scaletempo2_init(struct mp_scaletempo2 *p, int channels, int rate)
 
     MP_RESIZE_ARRAY(p, p->energy_candidate_blocks,
         p->channels * p->num_candidate_blocks);
+
+    // With large search intervals, computing all candidate dot products at
+    // once in the frequency domain is cheaper than the decimated search.
+    TA_FREEP(&p->fft);
+    int fft_size = mp_round_next_power_of_2(p->search_block_size);
+    bool use_fft = p->force_fft > 0 || (p->force_fft == 0 &&
+        fft_is_faster(p->num_candidate_blocks, p->ola_window_size, fft_size));
+    if (use_fft) {
+        p->fft = fft_create(p, fft_size);
+        MP_RESIZE_ARRAY(p, p->correlation,
+            p->channels * p->num_candidate_blocks);
+    }
 }
@@ -119,6 +119,14 @@ struct mp_scaletempo2 {
     // for padding after the final packet.
     int input_buffer_added_silence;
     float *energy_candidate_blocks;
+    // Frequency domain cross-correlation, set up by mp_scaletempo2_init() if
+    // it is cheaper than computing dot products for the candidate blocks one
+    // by one. |correlation| holds the result, interleaved like the energies.
+    struct mp_scaletempo2_fft *fft;
+    float *correlation;
+    // 1: always use |fft|, -1: never, 0: decide from the search interval.
+    // Must be set before mp_scaletempo2_init(); mostly for benchmarking.
+    int force_fft;
 };
 
 void mp_scaletempo2_destroy(struct mp_scaletempo2 *p);
@@ -0,0 +1,186 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <libavutil/cpu.h>
+
+#include "audio/filter/af_scaletempo_kernels.h"
+
+#include "config.h"
+
+#if HAVE_VECTOR && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+static float sad_float_c(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += fabsf(a[i] - b[i]);
+    return sum;
+}
+
+static int32_t sad_s16_c(const int16_t *a, const int16_t *b, int n)
+{
+    int32_t sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += abs((int32_t)a[i] - b[i]);
+    return sum;
+}
+
+static void blend_float_c(float *out, const float *a, const float *b,
+                          const float *blend, int n)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = a[i] - blend[i] * (a[i] - b[i]);
+}
+
+static void blend_s16_c(int16_t *out, const int16_t *a, const int16_t *b,
+                        const int32_t *blend, int n)
+{
+    for (int i = 0; i < n; i++) {
+        // Full scale input can overflow the product; let it wrap.
+        int32_t o = a[i];
+        int32_t p = (uint32_t)blend[i] * (uint32_t)(o - b[i]);
+        out[i] = o - (p >> 16);
+    }
+}
+
+const struct mp_scaletempo_kernels mp_scaletempo_kernels_c = {
+    .name = "c",
+    .sad_float = sad_float_c,
+    .sad_s16 = sad_s16_c,
+    .blend_float = blend_float_c,
+    .blend_s16 = blend_s16_c,
+};
+
+#if HAVE_VECTOR
+
+// Define the kernels with GCC vector extensions, |N| samples per vector, and
+// compiled with the function attributes |ATTR|. The remainder of each loop is
+// left to the C functions. Accumulating the s16 distance in 32 bit lanes gives
+// the same result as the C code regardless of summation order.
+#define VECTOR_KERNELS(NAME, ATTR, N)                                       \
+    typedef float NAME##_vf __attribute__((vector_size(N * 4), aligned(1)));\
+    typedef int32_t NAME##_vi __attribute__((vector_size(N * 4), aligned(1)));\
+    typedef uint32_t NAME##_vu __attribute__((vector_size(N * 4), aligned(1)));\
+    typedef int16_t NAME##_vh __attribute__((vector_size(N * 2), aligned(1)));\
+                                                                            \
+    ATTR static float NAME##_sad_float(const float *a, const float *b, int n)\
+    {                                                                       \
+        NAME##_vf sum[2] = {0};                                             \
+        int i = 0;                                                          \
+        for (; i + 2 * N <= n; i += 2 * N) {                                \
+            for (int k = 0; k < 2; k++) {                                   \
+                NAME##_vf d = *(const NAME##_vf *)(a + i + k * N)           \
+                            - *(const NAME##_vf *)(b + i + k * N);          \
+                sum[k] += (NAME##_vf)((NAME##_vi)d & 0x7fffffff);           \
+            }                                                               \
+        }                                                                   \
+        sum[0] += sum[1];                                                   \
+        float res = 0;                                                      \
+        for (int k = 0; k < N; k++)                                         \
+            res += sum[0][k];                                               \
+        return res + sad_float_c(a + i, b + i, n - i);                      \
+    }                                                                       \
+                                                                            \
+    ATTR static int32_t NAME##_sad_s16(const int16_t *a, const int16_t *b,  \
+                                       int n)                               \
+    {                                                                       \
+        NAME##_vu sum = {0};                                                \
+        int i = 0;                                                          \
+        for (; i + N <= n; i += N) {                                        \
+            NAME##_vi d =                                                   \
+                __builtin_convertvector(*(const NAME##_vh *)(a + i), NAME##_vi)\
+              - __builtin_convertvector(*(const NAME##_vh *)(b + i), NAME##_vi);\
+            NAME##_vi m = d >> 31;                                          \
+            sum += (NAME##_vu)((d ^ m) - m);                                \
+        }                                                                   \
+        uint32_t res = 0;                                                   \
+        for (int k = 0; k < N; k++)                                         \
+            res += sum[k];                                                  \
+        return (int32_t)(res + sad_s16_c(a + i, b + i, n - i));             \
+    }                                                                       \
+                                                                            \
+    ATTR static void NAME##_blend_float(float *out, const float *a,         \
+                                        const float *b, const float *blend, \
+                                        int n)                              \
+    {                                                                       \
+        int i = 0;                                                          \
+        for (; i + N <= n; i += N) {                                        \
+            NAME##_vf o = *(const NAME##_vf *)(a + i);                      \
+            *(NAME##_vf *)(out + i) = o - *(const NAME##_vf *)(blend + i)   \
+                                    * (o - *(const NAME##_vf *)(b + i));    \
+        }                                                                   \
+        blend_float_c(out + i, a + i, b + i, blend + i, n - i);             \
+    }                                                                       \
+                                                                            \
+    ATTR static void NAME##_blend_s16(int16_t *out, const int16_t *a,       \
+                                      const int16_t *b, const int32_t *blend,\
+                                      int n)                                \
+    {                                                                       \
+        int i = 0;                                                          \
+        for (; i + N <= n; i += N) {                                        \
+            NAME##_vi o =                                                   \
+                __builtin_convertvector(*(const NAME##_vh *)(a + i), NAME##_vi);\
+            NAME##_vi d = o                                                 \
+              - __builtin_convertvector(*(const NAME##_vh *)(b + i), NAME##_vi);\
+            NAME##_vu p = (NAME##_vu)*(const NAME##_vi *)(blend + i)        \
+                        * (NAME##_vu)d;                                     \
+            *(NAME##_vh *)(out + i) =                                       \
+                __builtin_convertvector(o - ((NAME##_vi)p >> 16), NAME##_vh);\
+        }                                                                   \
+        blend_s16_c(out + i, a + i, b + i, blend + i, n - i);               \
+    }                                                                       \
+                                                                            \
+    static const struct mp_scaletempo_kernels NAME##_kernels = {            \
+        .name = #NAME,                                                      \
+        .sad_float = NAME##_sad_float,                                      \
+        .sad_s16 = NAME##_sad_s16,                                          \
+        .blend_float = NAME##_blend_float,                                  \
+        .blend_s16 = NAME##_blend_s16,                                      \
+    };
+
+// Baseline of the target architecture, e.g. SSE2 on x86-64 or NEON on
+// aarch64.
+VECTOR_KERNELS(vec, , 8)
+
+#if HAVE_X86_KERNELS
+VECTOR_KERNELS(avx2, __attribute__((target("avx2"))), 8)
+VECTOR_KERNELS(avx512, __attribute__((target("avx512f,avx512bw"))), 16)
+#endif
+
+#endif // HAVE_VECTOR
+
+const struct mp_scaletempo_kernels *mp_scaletempo_kernels_get(int cpu_flags)
+{
+#if HAVE_X86_KERNELS
+    if (cpu_flags & AV_CPU_FLAG_AVX512)
+        return &avx512_kernels;
+    if (cpu_flags & AV_CPU_FLAG_AVX2)
+        return &avx2_kernels;
+#endif
+#if HAVE_VECTOR
+    return &vec_kernels;
+#else
+    return &mp_scaletempo_kernels_c;
+#endif
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Inner loops of af_scaletempo, selected at runtime for the CPU.
+struct mp_scaletempo_kernels {
+    const char *name;
+    // Sum of absolute differences of a[0..n) and b[0..n).
+    float (*sad_float)(const float *a, const float *b, int n);
+    int32_t (*sad_s16)(const int16_t *a, const int16_t *b, int n);
+    // out[i] = a[i] - blend[i] * (a[i] - b[i]), i.e. a crossfade from a to b.
+    // For s16, blend is in 16.16 fixed point.
+    void (*blend_float)(float *out, const float *a, const float *b,
+                        const float *blend, int n);
+    void (*blend_s16)(int16_t *out, const int16_t *a, const int16_t *b,
+                      const int32_t *blend, int n);
+};
+
+// Plain C reference implementation.
+extern const struct mp_scaletempo_kernels mp_scaletempo_kernels_c;
+
+// Return the fastest kernels that can be used with the given CPU flags, as
+// returned by av_get_cpu_flags(). The s16 kernels are bit-exact with the
+// reference, the float ones may differ in rounding.
+const struct mp_scaletempo_kernels *mp_scaletempo_kernels_get(int cpu_flags);
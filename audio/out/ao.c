@@ -21,16 +21,18 @@
 #include <math.h>
 #include <assert.h>
 
+#include <libavutil/cpu.h>
+
 #include "mpv_talloc.h"
 
 #include "config.h"
 #include "ao.h"
 #include "internal.h"
 #include "audio/format.h"
+#include "audio/out/kernels.h"
 
 #include "options/options.h"
 #include "options/m_config_frontend.h"
-#include "osdep/endian.h"
 #include "common/msg.h"
 #include "common/common.h"
 #include "common/global.h"
@@ -180,6 +182,7 @@ static struct ao *ao_alloc(bool probing, struct mpv_global *global,
         .log = mp_log_new(ao, log, name),
         .def_buffer = opts->audio_buffer,
         .client_name = talloc_strdup(ao, opts->audio_client_name),
+        .kernels = ao_kernels_get(av_get_cpu_flags()),
     };
     talloc_free(opts);
     ao->priv = m_config_group_from_desc(ao, ao->log, global, &desc, name);
@@ -608,37 +611,28 @@ void ao_set_gain(struct ao *ao, float gain)
     atomic_store(&ao->gain, gain);
 }
 
-#define MUL_GAIN_i(d, num_samples, gain, low, center, high)                     \
-    for (int n = 0; n < (num_samples); n++)                                     \
-        (d)[n] = MPCLAMP(                                                       \
-            ((((int64_t)((d)[n]) - (center)) * (gain) + 128) >> 8) + (center),  \
-            (low), (high))
-
-#define MUL_GAIN_f(d, num_samples, gain)                                        \
-    for (int n = 0; n < (num_samples); n++)                                     \
-        (d)[n] = (d)[n] * (gain)
-
 static void process_plane(struct ao *ao, void *data, int num_samples)
 {
     float gain = atomic_load_explicit(&ao->gain, memory_order_relaxed);
     int gi = lrint(256.0 * gain);
     if (gi == 256)
         return;
+    const struct ao_kernels *k = ao->kernels;
     switch (af_fmt_from_planar(ao->format)) {
     case AF_FORMAT_U8:
-        MUL_GAIN_i((uint8_t *)data, num_samples, gi, 0, 128, 255);
+        k->gain_u8(data, num_samples, gi);
         break;
     case AF_FORMAT_S16:
-        MUL_GAIN_i((int16_t *)data, num_samples, gi, INT16_MIN, 0, INT16_MAX);
+        k->gain_s16(data, num_samples, gi);
         break;
     case AF_FORMAT_S32:
-        MUL_GAIN_i((int32_t *)data, num_samples, gi, INT32_MIN, 0, INT32_MAX);
+        k->gain_s32(data, num_samples, gi);
         break;
     case AF_FORMAT_FLOAT:
-        MUL_GAIN_f((float *)data, num_samples, gain);
+        k->gain_float(data, num_samples, gain);
         break;
     case AF_FORMAT_DOUBLE:
-        MUL_GAIN_f((double *)data, num_samples, gain);
+        k->gain_double(data, num_samples, gain);
         break;
     default:;
         // all other sample formats are simply not supported
@@ -678,32 +672,18 @@ bool ao_need_conversion(struct ao_convert_fmt *fmt)
     return get_conv_type(fmt) != 0;
 }
 
-// The LSB is always ignored.
-#if BYTE_ORDER == BIG_ENDIAN
-#define SHIFT24(x) ((3-(x))*8)
-#else
-#define SHIFT24(x) (((x)+1)*8)
-#endif
-
-static void convert_plane(int type, void *data, int num_samples)
+static void convert_plane(const struct ao_kernels *k, int type, void *data,
+                          int num_samples)
 {
     switch (type) {
     case 0:
         break;
-    case 1: /* fall through */
-    case 2: {
-        int bytes = type == 1 ? 3 : 4;
-        for (int s = 0; s < num_samples; s++) {
-            uint32_t val = *((uint32_t *)data + s);
-            uint8_t *ptr = (uint8_t *)data + s * bytes;
-            ptr[0] = val >> SHIFT24(0);
-            ptr[1] = val >> SHIFT24(1);
-            ptr[2] = val >> SHIFT24(2);
-            if (type == 2)
-                ptr[3] = 0;
-        }
+    case 1:
+        k->pack_s24(data, num_samples);
+        break;
+    case 2:
+        k->pad_s24(data, num_samples);
         break;
-    }
     default:
         MP_ASSERT_UNREACHABLE();
     }
@@ -712,12 +692,13 @@ static void convert_plane(int type, void *data, int num_samples)
 // data[n] contains the pointer to the first sample of the n-th plane, in the
 // format implied by fmt->src_fmt. src_fmt also controls whether the data is
 // all in one plane, or if there is a plane per channel.
-void ao_convert_inplace(struct ao_convert_fmt *fmt, void **data, int num_samples)
+void ao_convert_inplace(struct ao *ao, struct ao_convert_fmt *fmt, void **data,
+                        int num_samples)
 {
     int type = get_conv_type(fmt);
     bool planar = af_fmt_is_planar(fmt->src_fmt);
     int planes = planar ? fmt->channels : 1;
     int plane_samples = num_samples * (planar ? 1: fmt->channels);
     for (int n = 0; n < planes; n++)
-        convert_plane(type, data[n], plane_samples);
+        convert_plane(ao->kernels, type, data[n], plane_samples);
 }
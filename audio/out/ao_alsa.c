@@ -1081,7 +1081,7 @@ static bool audio_write(struct ao *ao, void **data, int samples)
 {
     struct priv *p = ao->priv;
 
-    ao_convert_inplace(&p->convert, data, samples);
+    ao_convert_inplace(ao, &p->convert, data, samples);
 
     if (!recover_and_get_state(ao, NULL))
         return false;
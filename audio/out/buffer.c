@@ -20,6 +20,7 @@
 #include <math.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include "ao.h"
 #include "internal.h"
@@ -28,6 +29,7 @@
 
 #include "common/msg.h"
 #include "common/common.h"
+#include "common/stats.h"
 
 #include "filters/f_async_queue.h"
 #include "filters/filter_internal.h"
@@ -35,6 +37,35 @@
 #include "osdep/timer.h"
 #include "osdep/threads.h"
 
+// Sample ring between the AO thread and the audio callback of pull AOs. The
+// producer is whoever holds buffer_state.lock, the consumer is ao_read_data().
+// Positions only grow; each side writes its own position, and releases the
+// samples before it to the other side.
+struct pcm_ring {
+    uint8_t *planes[MP_NUM_CHANNELS];
+    int64_t size;                       // in samples
+    atomic_int_least64_t write_pos;     // written by the producer
+    atomic_int_least64_t read_pos;      // written by the consumer
+    atomic_int_least64_t eof_pos;       // write_pos when EOF was read, or -1
+    atomic_int gate;                    // RING_*
+};
+
+enum {
+    RING_IDLE,
+    RING_READING,           // held by the consumer
+    RING_READING_WAITED,    // held by the consumer, flush_ring() waits for it
+    RING_FLUSHING,          // held by the producer while it discards the contents
+};
+
+// What the audio callback of pull AOs is supposed to do. Published by the
+// player from buffer_state.playing/paused, except for CB_UNDERRUN.
+enum {
+    CB_STOPPED,     // output silence
+    CB_RUNNING,     // play from the ring
+    CB_UNDERRUN,    // like CB_STOPPED; the callback ran out of data while
+                    // running, and check_underrun() has to handle it
+};
+
 struct buffer_state {
     // Buffer and AO
     mp_mutex lock;
@@ -44,9 +75,34 @@ struct buffer_state {
     mp_mutex pt_lock;
     mp_cond pt_wakeup;
 
+    // Pull AOs only: flush_ring() waiting for ao_read_data() to release the
+    // ring. The audio callback only takes the lock if the gate tells it that
+    // flush_ring() is waiting, at which point it's (about to be) released.
+    mp_mutex flush_lock;
+    mp_cond flush_wakeup;
+
     // Access from AO driver's thread only.
     char *convert_buffer;
 
+    // Pull AOs only: access from ao_read_data() with ring.gate held only.
+    int64_t last_callback_ns;
+    int last_callback_samples;
+    int64_t num_underruns;
+    int64_t num_late_callbacks;
+
+    // Immutable, thread-safe.
+    struct stats_ctx *stats;
+    struct stat_entry *stat_callback;
+    struct stat_entry *stat_underruns;
+    struct stat_entry *stat_late_callbacks;
+
+    // Pull AOs only. The buffer is immutable, the state is atomic.
+    struct pcm_ring ring;
+    atomic_int cb_state;                // CB_*
+    atomic_int_least64_t end_time_ns;   // absolute output time of last played
+                                        // sample
+    atomic_bool cb_wakeup;              // ring was read since the last refill
+
     // Immutable.
     struct mp_async_queue *queue;
 
@@ -61,7 +117,6 @@ struct buffer_state {
     bool paused;                // logically paused
     bool hw_paused;             // driver->set_pause() was used successfully
 
-    int64_t end_time_ns;        // absolute output time of last played sample
     int64_t queued_time_ns;     // duration of samples that have been queued to
                                 // the device but have not been played.
                                 // This field is only set in ao_set_paused(),
@@ -70,11 +125,12 @@ struct buffer_state {
 
     bool initial_unblocked;
 
+    mp_thread thread;           // thread shoveling data to AO or ring
+    bool thread_valid;          // thread is running
+
     // "Push" AOs only (AOs with driver->write).
     bool recover_pause;         // non-hw_paused: needs to recover delay
     struct mp_pcm_state prepause_state;
-    mp_thread thread;           // thread shoveling data to AO
-    bool thread_valid;          // thread is running
     struct mp_aframe *temp_buf;
 
     // --- protected by pt_lock
@@ -93,11 +149,44 @@ void ao_wakeup(struct ao *ao)
     mp_mutex_unlock(&p->pt_lock);
 }
 
+// Like ao_wakeup(), but for the audio callback, which must not block. If the
+// AO thread holds pt_lock, it may miss the wakeup, and notices cb_wakeup on
+// its next timeout instead.
+static void wakeup_from_callback(struct ao *ao)
+{
+    struct buffer_state *p = ao->buffer_state;
+    atomic_store(&p->cb_wakeup, true);
+    if (mp_mutex_trylock(&p->pt_lock) == 0) {
+        p->need_wakeup = true;
+        mp_cond_broadcast(&p->pt_wakeup);
+        mp_mutex_unlock(&p->pt_lock);
+    }
+}
+
+static int64_t ring_get_samples(struct pcm_ring *r)
+{
+    return atomic_load(&r->write_pos) - atomic_load(&r->read_pos);
+}
+
 // called locked
 static void get_dev_state(struct ao *ao, struct mp_pcm_state *state)
 {
     struct buffer_state *p = ao->buffer_state;
 
+    if (!ao->driver->write) {
+        // Assembled from what the audio callback published.
+        int64_t queued = ring_get_samples(&p->ring);
+        int64_t end = atomic_load(&p->end_time_ns);
+        *state = (struct mp_pcm_state){
+            .free_samples = p->ring.size - queued,
+            .queued_samples = queued,
+            .delay = MPMAX(0, MP_TIME_NS_TO_S(end - mp_time_ns())) +
+                     queued / (double)ao->samplerate,
+            .playing = atomic_load(&p->cb_state) == CB_RUNNING,
+        };
+        return;
+    }
+
     if (p->paused && p->playing && !ao->stream_silence) {
         *state = p->prepause_state;
         return;
@@ -111,6 +200,121 @@ static void get_dev_state(struct ao *ao, struct mp_pcm_state *state)
     ao->driver->get_state(ao, state);
 }
 
+// called locked
+// Make the audio callback of pull AOs follow the playing and paused state.
+static void update_cb_state(struct ao *ao)
+{
+    struct buffer_state *p = ao->buffer_state;
+    bool run = p->playing && !p->paused;
+    atomic_store(&p->cb_state, run ? CB_RUNNING : CB_STOPPED);
+}
+
+// called locked
+// Apply an underrun reported by the audio callback of pull AOs.
+static void check_underrun(struct ao *ao)
+{
+    struct buffer_state *p = ao->buffer_state;
+    int state = CB_UNDERRUN;
+    if (atomic_compare_exchange_strong(&p->cb_state, &state, CB_STOPPED) &&
+        p->playing && !p->paused)
+    {
+        p->playing = false;
+        ao->wakeup_cb(ao->wakeup_ctx);
+        // For ao_drain().
+        mp_cond_broadcast(&p->wakeup);
+    }
+}
+
+// called locked
+// Move as much audio as fits from the queue to the ring.
+static void fill_ring(struct ao *ao)
+{
+    struct buffer_state *p = ao->buffer_state;
+    struct pcm_ring *r = &p->ring;
+
+    int64_t wpos = atomic_load_explicit(&r->write_pos, memory_order_relaxed);
+    int64_t rpos = atomic_load_explicit(&r->read_pos, memory_order_acquire);
+
+    while (wpos - rpos < r->size) {
+        if (!p->pending || !mp_aframe_get_size(p->pending)) {
+            TA_FREEP(&p->pending);
+            struct mp_frame frame = mp_pin_out_read(p->input->pins[0]);
+            if (!frame.type)
+                break;
+            if (frame.type != MP_FRAME_AUDIO) {
+                if (frame.type == MP_FRAME_EOF)
+                    atomic_store(&r->eof_pos, wpos);
+                mp_frame_unref(&frame);
+                continue;
+            }
+            p->pending = frame.data;
+        }
+
+        int64_t index = wpos % r->size;
+        int copy = mp_aframe_get_size(p->pending);
+        copy = MPMIN(copy, r->size - (wpos - rpos));
+        copy = MPMIN(copy, r->size - index);
+        uint8_t **fdata = mp_aframe_get_data_ro(p->pending);
+        for (int n = 0; n < ao->num_planes; n++) {
+            memcpy(r->planes[n] + index * ao->sstride, fdata[n],
+                   copy * ao->sstride);
+        }
+        mp_aframe_skip_samples(p->pending, copy);
+        wpos += copy;
+        atomic_store_explicit(&r->write_pos, wpos, memory_order_release);
+    }
+}
+
+// called locked
+// Discard the contents of the ring. If the audio callback is reading from it,
+// wait until it is done, which takes at most one memcpy().
+static void flush_ring(struct ao *ao)
+{
+    struct buffer_state *p = ao->buffer_state;
+    struct pcm_ring *r = &p->ring;
+    mp_mutex_lock(&p->flush_lock);
+    while (1) {
+        int gate = RING_IDLE;
+        if (atomic_compare_exchange_strong(&r->gate, &gate, RING_FLUSHING))
+            break;
+        // Ask ao_read_data() to wake us up when it releases the ring.
+        if (gate == RING_READING &&
+            !atomic_compare_exchange_strong(&r->gate, &gate, RING_READING_WAITED))
+            continue;
+        mp_cond_wait(&p->flush_wakeup, &p->flush_lock);
+    }
+    mp_mutex_unlock(&p->flush_lock);
+    atomic_store(&r->read_pos, atomic_load(&r->write_pos));
+    atomic_store(&r->eof_pos, -1);
+    atomic_store(&r->gate, RING_IDLE);
+}
+
+// Consumer side of the ring; call with ring.gate held.
+static int read_ring(struct ao *ao, void **data, int samples, bool *eof)
+{
+    struct pcm_ring *r = &ao->buffer_state->ring;
+
+    int64_t rpos = atomic_load_explicit(&r->read_pos, memory_order_relaxed);
+    int64_t wpos = atomic_load_explicit(&r->write_pos, memory_order_acquire);
+
+    int pos = 0;
+    while (pos < samples && rpos < wpos) {
+        int64_t index = rpos % r->size;
+        int copy = MPMIN(samples - pos, wpos - rpos);
+        copy = MPMIN(copy, r->size - index);
+        for (int n = 0; n < ao->num_planes; n++) {
+            memcpy((char *)data[n] + pos * ao->sstride,
+                   r->planes[n] + index * ao->sstride, copy * ao->sstride);
+        }
+        rpos += copy;
+        pos += copy;
+    }
+    atomic_store_explicit(&r->read_pos, rpos, memory_order_release);
+
+    *eof = pos < samples && atomic_load(&r->eof_pos) == rpos;
+    return pos;
+}
+
 struct mp_async_queue *ao_get_queue(struct ao *ao)
 {
     struct buffer_state *p = ao->buffer_state;
@@ -177,25 +381,20 @@ static int read_buffer(struct ao *ao, void **data, int samples, bool *eof,
     return pos;
 }
 
-static int ao_read_data_locked(struct ao *ao, void **data, int samples,
-                               int64_t out_time_ns, bool *eof, bool pad_silence)
+// Count callbacks that come more than twice the duration of the previous
+// request after the previous callback. The device likely played silence.
+static void check_late_callback(struct ao *ao, int samples)
 {
     struct buffer_state *p = ao->buffer_state;
-    mp_assert(!ao->driver->write);
-
-    int pos = read_buffer(ao, data, samples, eof, pad_silence);
-
-    if (pos > 0)
-        p->end_time_ns = out_time_ns;
-
-    if (pos < samples && p->playing && !p->paused) {
-        p->playing = false;
-        ao->wakeup_cb(ao->wakeup_ctx);
-        // For ao_drain().
-        mp_cond_broadcast(&p->wakeup);
+    int64_t now = mp_time_ns();
+    int64_t period = MP_TIME_S_TO_NS(p->last_callback_samples /
+                                     (double)ao->samplerate);
+    if (p->last_callback_ns && now - p->last_callback_ns > 2 * period) {
+        p->num_late_callbacks++;
+        stats_entry_value(p->stat_late_callbacks, p->num_late_callbacks);
     }
-
-    return pos;
+    p->last_callback_ns = now;
+    p->last_callback_samples = samples;
 }
 
 // Read the given amount of samples in the user-provided data buffer. Returns
@@ -206,25 +405,67 @@ static int ao_read_data_locked(struct ao *ao, void **data, int samples,
 // If this is called in paused mode, it will always return 0.
 // The caller should set out_time_ns to the expected delay until the last sample
 // reaches the speakers, in nanoseconds, using mp_time_ns() as reference.
+// This never blocks: the data comes from a ring that the AO thread refills.
+// blocking is ignored.
 int ao_read_data(struct ao *ao, void **data, int samples, int64_t out_time_ns, bool *eof, bool pad_silence, bool blocking)
 {
     struct buffer_state *p = ao->buffer_state;
+    mp_assert(!ao->driver->write);
 
-    if (blocking) {
-        mp_mutex_lock(&p->lock);
-    } else if (mp_mutex_trylock(&p->lock)) {
-        return 0;
-    }
+    stats_entry_time_start(p->stat_callback);
 
     bool eof_buf;
     if (eof == NULL) {
         // This is a public API. We want to reduce the cognitive burden of the caller.
         eof = &eof_buf;
     }
+    *eof = false;
 
-    int pos = ao_read_data_locked(ao, data, samples, out_time_ns, eof, pad_silence);
+    int pos = 0;
+    int gate = RING_IDLE;
+    // If this fails, ao_reset() is discarding the ring; output silence.
+    if (atomic_compare_exchange_strong(&p->ring.gate, &gate, RING_READING)) {
+        if (atomic_load(&p->cb_state) == CB_RUNNING) {
+            check_late_callback(ao, samples);
+
+            pos = read_ring(ao, data, samples, eof);
+
+            if (pos > 0)
+                atomic_store(&p->end_time_ns, out_time_ns);
+
+            if (pos < samples) {
+                int state = CB_RUNNING;
+                atomic_compare_exchange_strong(&p->cb_state, &state, CB_UNDERRUN);
+                if (!*eof) {
+                    p->num_underruns++;
+                    stats_entry_value(p->stat_underruns, p->num_underruns);
+                }
+            }
+        } else {
+            p->last_callback_ns = 0;
+        }
+        if (atomic_exchange(&p->ring.gate, RING_IDLE) == RING_READING_WAITED) {
+            mp_mutex_lock(&p->flush_lock);
+            mp_cond_broadcast(&p->flush_wakeup);
+            mp_mutex_unlock(&p->flush_lock);
+        }
+    }
 
-    mp_mutex_unlock(&p->lock);
+    // pad with silence (underflow/paused/eof)
+    if (pad_silence) {
+        for (int n = 0; n < ao->num_planes; n++) {
+            af_fill_silence((char *)data[n] + pos * ao->sstride,
+                    (samples - pos) * ao->sstride,
+                    ao->format);
+        }
+    }
+
+    ao_post_process_data(ao, data, pos);
+
+    // Refill the ring, or handle the underrun.
+    wakeup_from_callback(ao);
+
+    stats_entry_time_end(p->stat_callback);
 
     return pos;
 }
@@ -260,7 +501,7 @@ int ao_read_data_converted(struct ao *ao, struct ao_convert_fmt *fmt,
 
     int res = ao_read_data(ao, ndata, samples, out_time_ns, NULL, true, true);
 
-    ao_convert_inplace(fmt, ndata, samples);
+    ao_convert_inplace(ao, fmt, ndata, samples);
     for (int n = 0; n < planes; n++)
         memcpy(data[n], ndata[n], dst_plane_size);
 
@@ -300,16 +541,9 @@ double ao_get_delay(struct ao *ao)
 
     mp_mutex_lock(&p->lock);
 
-    double driver_delay;
-    if (ao->driver->write) {
-        struct mp_pcm_state state;
-        get_dev_state(ao, &state);
-        driver_delay = state.delay;
-    } else {
-        int64_t end = p->end_time_ns;
-        int64_t now = mp_time_ns();
-        driver_delay = MPMAX(0, MP_TIME_NS_TO_S(end - now));
-    }
+    struct mp_pcm_state state;
+    get_dev_state(ao, &state);
+    double driver_delay = state.delay;
 
     int64_t pending = mp_async_queue_get_samples(p->queue);
     if (p->pending)
@@ -332,6 +566,8 @@ void ao_reset(struct ao *ao)
     mp_async_queue_reset(p->queue);
     mp_filter_reset(p->filter_root);
     mp_async_queue_resume_reading(p->queue);
+    if (!ao->driver->write)
+        flush_ring(ao);
 
     if (!ao->stream_silence && ao->driver->reset) {
         if (ao->driver->write) {
@@ -345,9 +581,10 @@ void ao_reset(struct ao *ao)
     }
     wakeup = p->playing;
     p->playing = false;
+    update_cb_state(ao);
     p->recover_pause = false;
     p->hw_paused = false;
-    p->end_time_ns = 0;
+    atomic_store(&p->end_time_ns, 0);
 
     mp_mutex_unlock(&p->lock);
 
@@ -371,9 +608,14 @@ void ao_start(struct ao *ao)
 
     p->playing = true;
 
-    if (!ao->driver->write && !p->paused && !p->streaming) {
-        p->streaming = true;
-        do_start = true;
+    if (!ao->driver->write) {
+        // Let the first callback find all the queued data.
+        fill_ring(ao);
+        update_cb_state(ao);
+        if (!p->paused && !p->streaming) {
+            p->streaming = true;
+            do_start = true;
+        }
     }
 
     mp_mutex_unlock(&p->lock);
@@ -399,6 +641,9 @@ void ao_set_paused(struct ao *ao, bool paused, bool eof)
 
     mp_mutex_lock(&p->lock);
 
+    if (!ao->driver->write)
+        check_underrun(ao);
+
     if ((p->playing || !ao->driver->write) && !p->paused && paused) {
         if (p->streaming && !ao->stream_silence) {
             if (ao->driver->write) {
@@ -434,6 +679,8 @@ void ao_set_paused(struct ao *ao, bool paused, bool eof)
         wakeup = true;
     }
     p->paused = paused;
+    if (!ao->driver->write)
+        update_cb_state(ao);
 
     mp_mutex_unlock(&p->lock);
 
@@ -441,9 +688,9 @@ void ao_set_paused(struct ao *ao, bool paused, bool eof)
         if (is_hw_paused) {
             if (paused) {
                 ao->driver->set_pause(ao, true);
-                p->queued_time_ns = p->end_time_ns - mp_time_ns();
+                p->queued_time_ns = atomic_load(&p->end_time_ns) - mp_time_ns();
             } else {
-                p->end_time_ns = p->queued_time_ns + mp_time_ns();
+                atomic_store(&p->end_time_ns, p->queued_time_ns + mp_time_ns());
                 ao->driver->set_pause(ao, false);
             }
         } else {
@@ -467,6 +714,8 @@ bool ao_is_playing(struct ao *ao)
     struct buffer_state *p = ao->buffer_state;
 
     mp_mutex_lock(&p->lock);
+    if (!ao->driver->write)
+        check_underrun(ao);
     bool playing = p->playing;
     mp_mutex_unlock(&p->lock);
 
@@ -479,7 +728,11 @@ void ao_drain(struct ao *ao)
     struct buffer_state *p = ao->buffer_state;
 
     mp_mutex_lock(&p->lock);
-    while (!p->paused && p->playing) {
+    while (1) {
+        if (!ao->driver->write)
+            check_underrun(ao);
+        if (p->paused || !p->playing)
+            break;
         mp_mutex_unlock(&p->lock);
         double delay = ao_get_delay(ao);
         mp_mutex_lock(&p->lock);
@@ -492,7 +745,11 @@ void ao_drain(struct ao *ao)
             break;
         }
 
-        if (!p->playing && mp_async_queue_get_samples(p->queue)) {
+        if (!ao->driver->write)
+            check_underrun(ao);
+        if (!p->playing && (mp_async_queue_get_samples(p->queue) ||
+                            (!ao->driver->write && ring_get_samples(&p->ring))))
+        {
             MP_WARN(ao, "underrun during draining\n");
             mp_mutex_unlock(&p->lock);
             ao_start(ao);
@@ -527,6 +784,11 @@ void ao_uninit(struct ao *ao)
     if (ao->driver_initialized)
         ao->driver->uninit(ao);
 
+    if (p && (p->num_underruns || p->num_late_callbacks)) {
+        MP_VERBOSE(ao, "%"PRId64" underruns, %"PRId64" late callbacks.\n",
+                   p->num_underruns, p->num_late_callbacks);
+    }
+
     if (p) {
         talloc_free(p->filter_root);
         talloc_free(p->queue);
@@ -539,6 +801,9 @@ void ao_uninit(struct ao *ao)
 
         mp_cond_destroy(&p->pt_wakeup);
         mp_mutex_destroy(&p->pt_lock);
+
+        mp_cond_destroy(&p->flush_wakeup);
+        mp_mutex_destroy(&p->flush_lock);
     }
 
     talloc_free(ao);
@@ -565,32 +830,51 @@ bool init_buffer_post(struct ao *ao)
     mp_mutex_init(&p->pt_lock);
     mp_cond_init(&p->pt_wakeup);
 
+    mp_mutex_init(&p->flush_lock);
+    mp_cond_init(&p->flush_wakeup);
+
+    p->stats = stats_ctx_create(p, ao->global, "ao");
+    p->stat_callback = stats_entry(p->stats, "callback");
+    p->stat_underruns = stats_entry(p->stats, "underruns");
+    p->stat_late_callbacks = stats_entry(p->stats, "late callbacks");
+
     p->queue = mp_async_queue_create();
     p->filter_root = mp_filter_create_root(ao->global);
     p->input = mp_async_queue_create_filter(p->filter_root, MP_PIN_OUT, p->queue);
 
     mp_async_queue_resume_reading(p->queue);
 
+    // Pull AOs split ao->buffer between the ring and the queue feeding it.
+    int queue_samples = ao->buffer;
+    if (!ao->driver->write) {
+        // Enough to cover any period the device requests.
+        struct pcm_ring *r = &p->ring;
+        r->size = MPMAX(ao->device_buffer, ao->buffer / 2);
+        r->size = MPCLAMP(r->size, 1, ao->buffer);
+        queue_samples = ao->buffer - r->size;
+        for (int n = 0; n < ao->num_planes; n++)
+            r->planes[n] = talloc_zero_size(p, r->size * ao->sstride);
+        atomic_store(&r->eof_pos, -1);
+    }
+
     struct mp_async_queue_config cfg = {
         .sample_unit = AQUEUE_UNIT_SAMPLES,
-        .max_samples = ao->buffer,
+        .max_samples = queue_samples,
         .max_bytes = INT64_MAX,
     };
     mp_async_queue_set_config(p->queue, cfg);
 
-    if (ao->driver->write) {
-        mp_filter_graph_set_wakeup_cb(p->filter_root, wakeup_filters, ao);
+    mp_filter_graph_set_wakeup_cb(p->filter_root, wakeup_filters, ao);
 
-        p->thread_valid = true;
-        if (mp_thread_create(&p->thread, ao_thread, ao)) {
-            p->thread_valid = false;
-            return false;
-        }
-    } else {
-        if (ao->stream_silence) {
-            ao->driver->start(ao);
-            p->streaming = true;
-        }
+    p->thread_valid = true;
+    if (mp_thread_create(&p->thread, ao_thread, ao)) {
+        p->thread_valid = false;
+        return false;
+    }
+
+    if (!ao->driver->write && ao->stream_silence) {
+        ao->driver->start(ao);
+        p->streaming = true;
     }
 
     if (ao->stream_silence) {
@@ -714,17 +998,28 @@ static MP_THREAD_VOID ao_thread(void *arg)
         mp_mutex_lock(&p->lock);
 
         bool retry = false;
-        if (!ao->driver->initially_blocked || p->initial_unblocked)
-            retry = ao_play_data(ao);
-
-        // Wait until the device wants us to write more data to it.
-        // Fallback to guessing.
         int64_t timeout = INT64_MAX;
-        if (p->streaming && !retry && (!p->paused || ao->stream_silence)) {
-            // Wake up again if half of the audio buffer has been played.
-            // Since audio could play at a faster or slower pace, wake up twice
-            // as often as ideally needed.
-            timeout = MP_TIME_S_TO_NS(ao->device_buffer / (double)ao->samplerate * 0.25);
+        if (ao->driver->write) {
+            if (!ao->driver->initially_blocked || p->initial_unblocked)
+                retry = ao_play_data(ao);
+
+            // Wait until the device wants us to write more data to it.
+            // Fallback to guessing.
+            if (p->streaming && !retry && (!p->paused || ao->stream_silence)) {
+                // Wake up again if half of the audio buffer has been played.
+                // Since audio could play at a faster or slower pace, wake up
+                // twice as often as ideally needed.
+                timeout = MP_TIME_S_TO_NS(ao->device_buffer / (double)ao->samplerate * 0.25);
+            }
+        } else {
+            atomic_store(&p->cb_wakeup, false);
+            check_underrun(ao);
+            fill_ring(ao);
+
+            // The callback wakes us up after reading, but the wakeup can get
+            // lost; see wakeup_from_callback().
+            if (p->playing && !p->paused)
+                timeout = MP_TIME_S_TO_NS(p->ring.size / (double)ao->samplerate * 0.25);
         }
 
         mp_mutex_unlock(&p->lock);
@@ -734,7 +1029,7 @@ static MP_THREAD_VOID ao_thread(void *arg)
             mp_mutex_unlock(&p->pt_lock);
             break;
         }
-        if (!p->need_wakeup && !retry) {
+        if (!p->need_wakeup && !retry && !atomic_load(&p->cb_wakeup)) {
             MP_STATS(ao, "start audio wait");
             mp_cond_timedwait(&p->pt_wakeup, &p->pt_lock, timeout);
             MP_STATS(ao, "end audio wait");
@@ -64,6 +64,9 @@ struct ao {
     // Float gain multiplicator
     _Atomic float gain;
 
+    // Per-sample processing for this CPU, resolved once on creation
+    const struct ao_kernels *kernels;
+
     int buffer;
     double def_buffer;
     struct buffer_state *buffer_state;
@@ -118,9 +121,10 @@ struct mp_pcm_state {
  *          get_state
  *  b) ->write must be NULL. ->start must be provided, and should make the
  *     audio API start calling the audio callback. Your audio callback should
- *     in turn call ao_read_data() to get audio data. Most functions are
- *     optional and will be emulated if missing (e.g. pausing is emulated as
- *     silence).
+ *     in turn call ao_read_data() to get audio data. This never blocks; a
+ *     thread refills the data it reads from in the background. Most functions
+ *     are optional and will be emulated if missing (e.g. pausing is emulated
+ *     as silence).
  *     Also, the following optional callbacks can be provided:
  *          reset       (stops the audio callback, start() restarts it)
  */
@@ -227,7 +231,8 @@ struct ao_convert_fmt {
 
 bool ao_can_convert_inplace(struct ao_convert_fmt *fmt);
 bool ao_need_conversion(struct ao_convert_fmt *fmt);
-void ao_convert_inplace(struct ao_convert_fmt *fmt, void **data, int num_samples);
+void ao_convert_inplace(struct ao *ao, struct ao_convert_fmt *fmt, void **data,
+                        int num_samples);
 
 void ao_wakeup(struct ao *ao);
 
@@ -0,0 +1,279 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <libavutil/cpu.h>
+
+#include "audio/out/kernels.h"
+#include "common/common.h"
+#include "osdep/endian.h"
+
+#include "config.h"
+
+#if HAVE_VECTOR && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#define MUL_GAIN_i(d, num_samples, gain, low, center, high)                     \
+    for (int n = 0; n < (num_samples); n++)                                     \
+        (d)[n] = MPCLAMP(                                                       \
+            ((((int64_t)((d)[n]) - (center)) * (gain) + 128) >> 8) + (center),  \
+            (low), (high))
+
+#define MUL_GAIN_f(d, num_samples, gain)                                        \
+    for (int n = 0; n < (num_samples); n++)                                     \
+        (d)[n] = (d)[n] * (gain)
+
+static void gain_u8_c(uint8_t *data, int num_samples, int gain)
+{
+    MUL_GAIN_i(data, num_samples, gain, 0, 128, 255);
+}
+
+static void gain_s16_c(int16_t *data, int num_samples, int gain)
+{
+    MUL_GAIN_i(data, num_samples, gain, INT16_MIN, 0, INT16_MAX);
+}
+
+static void gain_s32_c(int32_t *data, int num_samples, int gain)
+{
+    MUL_GAIN_i(data, num_samples, gain, INT32_MIN, 0, INT32_MAX);
+}
+
+static void gain_float_c(float *data, int num_samples, float gain)
+{
+    MUL_GAIN_f(data, num_samples, gain);
+}
+
+static void gain_double_c(double *data, int num_samples, float gain)
+{
+    MUL_GAIN_f(data, num_samples, gain);
+}
+
+// The LSB is always ignored.
+#if BYTE_ORDER == BIG_ENDIAN
+#define SHIFT24(x) ((3-(x))*8)
+#else
+#define SHIFT24(x) (((x)+1)*8)
+#endif
+
+static void convert_s24_c(void *data, int num_samples, int bytes)
+{
+    for (int s = 0; s < num_samples; s++) {
+        uint32_t val = *((uint32_t *)data + s);
+        uint8_t *ptr = (uint8_t *)data + s * bytes;
+        ptr[0] = val >> SHIFT24(0);
+        ptr[1] = val >> SHIFT24(1);
+        ptr[2] = val >> SHIFT24(2);
+        if (bytes == 4)
+            ptr[3] = 0;
+    }
+}
+
+static void pack_s24_c(void *data, int num_samples)
+{
+    convert_s24_c(data, num_samples, 3);
+}
+
+static void pad_s24_c(void *data, int num_samples)
+{
+    convert_s24_c(data, num_samples, 4);
+}
+
+const struct ao_kernels ao_kernels_c = {
+    .name = "c",
+    .gain_u8 = gain_u8_c,
+    .gain_s16 = gain_s16_c,
+    .gain_s32 = gain_s32_c,
+    .gain_float = gain_float_c,
+    .gain_double = gain_double_c,
+    .pack_s24 = pack_s24_c,
+    .pad_s24 = pad_s24_c,
+};
+
+#if HAVE_VECTOR
+
+// Pack 4 samples into 3 words at a time. The output never overtakes the
+// input, so this works in-place.
+static void pack_s24_words(void *data, int num_samples)
+{
+    int s = 0;
+#if BYTE_ORDER == LITTLE_ENDIAN
+    uint8_t *ptr = data;
+    for (; s + 4 <= num_samples; s += 4) {
+        uint32_t in[4];
+        memcpy(in, ptr + s * 4, sizeof(in));
+        uint32_t out0 = (in[0] >> 8) | ((in[1] & 0x0000FF00) << 16);
+        uint32_t out1 = (in[1] >> 16) | ((in[2] & 0x00FFFF00) << 8);
+        uint32_t out2 = (in[2] >> 24) | (in[3] & 0xFFFFFF00);
+        memcpy(ptr + s * 3 + 0, &out0, 4);
+        memcpy(ptr + s * 3 + 4, &out1, 4);
+        memcpy(ptr + s * 3 + 8, &out2, 4);
+    }
+#endif
+    for (; s < num_samples; s++) {
+        uint32_t val = *((uint32_t *)data + s);
+        uint8_t *ptr = (uint8_t *)data + s * 3;
+        ptr[0] = val >> SHIFT24(0);
+        ptr[1] = val >> SHIFT24(1);
+        ptr[2] = val >> SHIFT24(2);
+    }
+}
+
+// There are only 256 possible u8 samples, so look them up from a table.
+static void gain_u8_lut(uint8_t *data, int num_samples, int gain)
+{
+    if (num_samples < 256) {
+        gain_u8_c(data, num_samples, gain);
+        return;
+    }
+    uint8_t lut[256];
+    for (int n = 0; n < 256; n++)
+        lut[n] = n;
+    gain_u8_c(lut, 256, gain);
+    for (int n = 0; n < num_samples; n++)
+        data[n] = lut[data[n]];
+}
+
+// Largest gain for which s16 products and the 16 bit halves of s32 products
+// fit into 32 bit lanes.
+#define GAIN_MAX_S16 ((1 << 16) - 1)
+
+// Replace lanes of v outside of [lo, hi].
+#define VCLAMP(v, lo, hi) do {                                              \
+        __typeof__(v) m_ = (v) < (lo);                                      \
+        (v) = ((v) & ~m_) | (m_ & (lo));                                    \
+        m_ = (v) > (hi);                                                    \
+        (v) = ((v) & ~m_) | (m_ & (hi));                                    \
+    } while (0)
+
+// Define the kernels with GCC vector extensions, |N| samples per vector, and
+// compiled with the function attributes |ATTR|. The remainder of each loop is
+// left to the C functions. The integer gain is computed exactly as in C; for
+// s32, the 64 bit product is split into products of the 16 bit halves, and the
+// result is clipped based on the high half.
+#define VECTOR_KERNELS(NAME, ATTR, N)                                       \
+    typedef int16_t NAME##_vh __attribute__((vector_size(N * 2), aligned(1)));\
+    typedef int32_t NAME##_vi __attribute__((vector_size(N * 4), aligned(1)));\
+    typedef uint32_t NAME##_vu __attribute__((vector_size(N * 4), aligned(1)));\
+    typedef float NAME##_vf __attribute__((vector_size(N * 4), aligned(1)));\
+    typedef double NAME##_vd __attribute__((vector_size(N * 8), aligned(1)));\
+                                                                            \
+    ATTR static void NAME##_gain_s16(int16_t *data, int num_samples, int gain)\
+    {                                                                       \
+        int n = 0;                                                          \
+        int end = (unsigned)gain <= GAIN_MAX_S16 ? num_samples : 0;         \
+        for (; n + N <= end; n += N) {                                      \
+            NAME##_vi v = __builtin_convertvector(*(NAME##_vh *)(data + n), \
+                                                  NAME##_vi);               \
+            v = (v * gain + 128) >> 8;                                      \
+            VCLAMP(v, INT16_MIN, INT16_MAX);                                \
+            *(NAME##_vh *)(data + n) = __builtin_convertvector(v, NAME##_vh);\
+        }                                                                   \
+        gain_s16_c(data + n, num_samples - n, gain);                        \
+    }                                                                       \
+                                                                            \
+    ATTR static void NAME##_gain_s32(int32_t *data, int num_samples, int gain)\
+    {                                                                       \
+        int n = 0;                                                          \
+        int end = (unsigned)gain <= GAIN_MAX_S16 ? num_samples : 0;         \
+        for (; n + N <= end; n += N) {                                      \
+            NAME##_vi v = *(NAME##_vi *)(data + n);                         \
+            NAME##_vi hi = (v >> 16) * gain;                                \
+            NAME##_vu lo = (((NAME##_vu)v & 0xFFFF) * gain + 128) >> 8;     \
+            NAME##_vi q = hi + (NAME##_vi)(lo >> 8);                        \
+            NAME##_vi r = (NAME##_vi)(((NAME##_vu)q << 8) | (lo & 0xFF));   \
+            NAME##_vi m = q >= (1 << 23);                                   \
+            r = (r & ~m) | (m & INT32_MAX);                                 \
+            m = q < -(1 << 23);                                             \
+            r = (r & ~m) | (m & INT32_MIN);                                 \
+            *(NAME##_vi *)(data + n) = r;                                   \
+        }                                                                   \
+        gain_s32_c(data + n, num_samples - n, gain);                        \
+    }                                                                       \
+                                                                            \
+    ATTR static void NAME##_gain_float(float *data, int num_samples, float gain)\
+    {                                                                       \
+        int n = 0;                                                          \
+        for (; n + N <= num_samples; n += N)                                \
+            *(NAME##_vf *)(data + n) *= gain;                               \
+        gain_float_c(data + n, num_samples - n, gain);                      \
+    }                                                                       \
+                                                                            \
+    ATTR static void NAME##_gain_double(double *data, int num_samples,      \
+                                        float gain)                         \
+    {                                                                       \
+        int n = 0;                                                          \
+        for (; n + N <= num_samples; n += N)                                \
+            *(NAME##_vd *)(data + n) *= (double)gain;                       \
+        gain_double_c(data + n, num_samples - n, gain);                     \
+    }                                                                       \
+                                                                            \
+    ATTR static void NAME##_pad_s24(void *data, int num_samples)            \
+    {                                                                       \
+        uint32_t *d = data;                                                 \
+        int n = 0;                                                          \
+        for (; n + N <= num_samples; n += N) {                              \
+            if (BYTE_ORDER == BIG_ENDIAN) {                                 \
+                *(NAME##_vu *)(d + n) &= 0xFFFFFF00;                        \
+            } else {                                                        \
+                *(NAME##_vu *)(d + n) >>= 8;                                \
+            }                                                               \
+        }                                                                   \
+        pad_s24_c(d + n, num_samples - n);                                  \
+    }                                                                       \
+                                                                            \
+    static const struct ao_kernels NAME##_kernels = {                       \
+        .name = #NAME,                                                      \
+        .gain_u8 = gain_u8_lut,                                             \
+        .gain_s16 = NAME##_gain_s16,                                        \
+        .gain_s32 = NAME##_gain_s32,                                        \
+        .gain_float = NAME##_gain_float,                                    \
+        .gain_double = NAME##_gain_double,                                  \
+        .pack_s24 = pack_s24_words,                                         \
+        .pad_s24 = NAME##_pad_s24,                                          \
+    };
+
+#if HAVE_X86_KERNELS
+// SSE2 lacks 32 bit multiplies and sign extension, which makes the integer
+// kernels slower than C.
+VECTOR_KERNELS(sse4, __attribute__((target("sse4.1"))), 4)
+VECTOR_KERNELS(avx2, __attribute__((target("avx2"))), 8)
+VECTOR_KERNELS(avx512, __attribute__((target("avx512f,avx512bw"))), 16)
+#else
+// Baseline of the target architecture, e.g. NEON on aarch64.
+VECTOR_KERNELS(vec, , 4)
+#endif
+
+#endif // HAVE_VECTOR
+
+const struct ao_kernels *ao_kernels_get(int cpu_flags)
+{
+#if HAVE_X86_KERNELS
+    if (cpu_flags & AV_CPU_FLAG_AVX512)
+        return &avx512_kernels;
+    if (cpu_flags & AV_CPU_FLAG_AVX2)
+        return &avx2_kernels;
+    if (cpu_flags & AV_CPU_FLAG_SSE4)
+        return &sse4_kernels;
+#elif HAVE_VECTOR
+    return &vec_kernels;
+#endif
+    return &ao_kernels_c;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Per-sample processing done by ao.c on the audio thread, selected at runtime
+// for the CPU. All functions work in-place on num_samples samples.
+struct ao_kernels {
+    const char *name;
+    // Multiply by gain, which is 8.8 fixed point for the integer formats.
+    // Integer results are rounded and clipped.
+    void (*gain_u8)(uint8_t *data, int num_samples, int gain);
+    void (*gain_s16)(int16_t *data, int num_samples, int gain);
+    void (*gain_s32)(int32_t *data, int num_samples, int gain);
+    void (*gain_float)(float *data, int num_samples, float gain);
+    void (*gain_double)(double *data, int num_samples, float gain);
+    // Convert 32 bit samples to 24 bit by dropping the LSB. pack_s24 writes
+    // 3 bytes per sample, pad_s24 writes 4 bytes with the MSB set to 0.
+    void (*pack_s24)(void *data, int num_samples);
+    void (*pad_s24)(void *data, int num_samples);
+};
+
+// Plain C reference implementation.
+extern const struct ao_kernels ao_kernels_c;
+
+// Return the fastest kernels that can be used with the given CPU flags, as
+// returned by av_get_cpu_flags(). All of them give the same results as the
+// reference.
+const struct ao_kernels *ao_kernels_get(int cpu_flags);
@@ -40,8 +40,13 @@
 #include "msg.h"
 #include "msg_control.h"
 
-// log buffer size (lines) logfile level
-#define FILE_BUF 100
+// Number of messages which can be queued for the log thread. Must be a power
+// of 2. If it's full, mp_msg() waits until the log thread has caught up.
+#define MSG_RING_SIZE 512
+
+// Messages up to this size (including the terminating \0) are formatted into
+// a stack buffer and copied into the ring. Longer ones are allocated.
+#define MSG_INLINE_SIZE 256
 
 // lines to accumulate before any client requests the terminal loglevel
 #define EARLY_TERM_BUF 100
@@ -52,11 +57,22 @@
 // overwritten, then the first (virtual) log line indicates how many were lost.
 #define EARLY_FILE_BUF 5000
 
+// A queued message. Uses the bounded MPMC queue scheme by Dmitry Vyukov: seq is
+// the position the slot is free for (seq == pos), or pos + 1 once the message
+// at pos has been written to the slot.
+struct msg_slot {
+    atomic_uint_least64_t seq;
+    struct mp_log *log;
+    int lev;
+    int len;
+    double time;
+    char *heap_text;            // if not NULL, the text, else inline_text
+    char inline_text[MSG_INLINE_SIZE];
+};
+
 struct mp_log_root {
     struct mpv_global *global;
     mp_mutex lock;
-    mp_mutex log_file_lock;
-    mp_cond log_file_wakeup;
     // --- protected by lock
     char **msg_levels;
     bool use_terminal;  // make accesses to stderr/stdout
@@ -80,21 +96,34 @@ struct mp_log_root {
     bstr status_line;
     struct mp_log *status_log;
     bstr term_status_msg;
+    int module_indent;
+    double msg_time;    // time the message being written was logged at
+    bool term_dirty[STDERR_FILENO + 1];
+    bool log_file_dirty;
+    // --- written by the owner thread with lock held
+    FILE *log_file;
     // --- must be accessed atomically
     /* This is incremented every time the msglevels must be reloaded.
      * (This is perhaps better than maintaining a globally accessible and
      * synchronized mp_log tree.) */
     atomic_ulong reload_counter;
+    atomic_uint_least64_t ring_write;   // next position to be claimed
+    atomic_uint_least64_t ring_done;    // messages before it were written
+    atomic_bool ring_idle;              // log thread is going to sleep
+    atomic_int ring_waiters;            // threads blocked in wait_done()
     // --- owner thread only (caller of mp_msg_init() etc.)
     char *log_path;
     char *stats_path;
-    mp_thread log_file_thread;
-    // --- owner thread only, but frozen while log_file_thread is running
-    FILE *log_file;
-    struct mp_log_buffer *log_file_buffer;
-    // --- protected by log_file_lock
-    bool log_file_thread_active; // also termination signal for the thread
-    int module_indent;
+    mp_thread ring_thread;
+    // --- immutable while other threads can log
+    struct msg_slot *ring;
+    bool have_ring_thread;
+    // --- log thread only
+    uint64_t ring_read;
+    // --- protected by ring_lock
+    mp_mutex ring_lock;
+    mp_cond ring_wakeup;
+    bool ring_thread_active; // also termination signal for the thread
 };
 
 struct mp_log {
@@ -105,6 +134,7 @@ struct mp_log {
     int level;                  // minimum log level for any outputs
     int terminal_level;         // minimum log level for terminal output
     atomic_ulong reload_counter;
+    atomic_uint_least64_t last_queued;  // ring position after the last message
     bstr partial[MSGL_MAX + 1];
 };
 
@@ -191,6 +221,28 @@ int mp_msg_level(struct mp_log *log)
     return log->level;
 }
 
+// Wait until the log thread has written all messages before ring position pos.
+static void wait_done(struct mp_log_root *root, uint64_t pos)
+{
+    if (atomic_load(&root->ring_done) >= pos)
+        return;
+
+    mp_mutex_lock(&root->ring_lock);
+    atomic_fetch_add(&root->ring_waiters, 1);
+    while (atomic_load(&root->ring_done) < pos && root->ring_thread_active)
+        mp_cond_wait(&root->ring_wakeup, &root->ring_lock);
+    atomic_fetch_add(&root->ring_waiters, -1);
+    mp_mutex_unlock(&root->ring_lock);
+}
+
+// Wait until everything queued so far has been written. Needed before anything
+// else accesses the terminal, so that output isn't reordered.
+static void msg_drain(struct mp_log_root *root)
+{
+    if (root->have_ring_thread)
+        wait_done(root, atomic_load(&root->ring_write));
+}
+
 static inline int term_msg_fileno(struct mp_log_root *root, int lev)
 {
     return root->force_stderr ? STDERR_FILENO : STDOUT_FILENO;
@@ -290,6 +342,7 @@ void mp_msg_flush_status_line(struct mp_log *log, bool clear)
     if (!log->root)
         return;
 
+    msg_drain(log->root);
     mp_mutex_lock(&log->root->lock);
     msg_flush_status_line(log->root, clear);
     mp_mutex_unlock(&log->root->lock);
@@ -298,6 +351,7 @@ void mp_msg_flush_status_line(struct mp_log *log, bool clear)
 void mp_msg_set_term_title(struct mp_log *log, const char *title)
 {
     if (log->root && title) {
+        msg_drain(log->root);
         // Lock because printf to terminal is not necessarily atomic.
         mp_mutex_lock(&log->root->lock);
         fprintf(term_msg_fp(log->root, MSGL_STATUS), "\033]0;%s\007", title);
@@ -381,7 +435,7 @@ static void append_terminal_line(struct mp_log *log, int lev,
     size_t start = term_msg->len;
 
     if (root->show_time)
-        bstr_xappend_asprintf(root, term_msg, "[%10.6f] ", mp_time_sec());
+        bstr_xappend_asprintf(root, term_msg, "[%10.6f] ", root->msg_time);
 
     const char *log_prefix = (lev >= MSGL_V) || root->verbose || root->module
                                 ? log->verbose_prefix : log->prefix;
@@ -452,25 +506,6 @@ static void write_msg_to_buffers(struct mp_log *log, int lev, bstr text)
         if (buffer_level == MP_LOG_BUFFER_MSGL_LOGFILE)
             buffer_level = MPMAX(log->terminal_level, MSGL_DEBUG);
         if (lev <= buffer_level && lev != MSGL_STATUS) {
-            if (buffer->level == MP_LOG_BUFFER_MSGL_LOGFILE) {
-                // If the buffer is full, block until we can write again,
-                // unless there's no write thread (died, or early filebuffer)
-                bool dead = false;
-                while (buffer->num_entries == buffer->capacity && !dead) {
-                    // Temporary unlock is OK; buffer->level is immutable, and
-                    // buffer can't go away because the global log lock is held.
-                    mp_mutex_unlock(&buffer->lock);
-                    mp_mutex_lock(&root->log_file_lock);
-                    if (root->log_file_thread_active) {
-                        mp_cond_wait(&root->log_file_wakeup,
-                                          &root->log_file_lock);
-                    } else {
-                        dead = true;
-                    }
-                    mp_mutex_unlock(&root->log_file_lock);
-                    mp_mutex_lock(&buffer->lock);
-                }
-            }
             if (buffer->num_entries == buffer->capacity) {
                 struct mp_log_buffer_entry *skip = log_buffer_read(buffer);
                 talloc_free(skip);
@@ -494,6 +529,17 @@ static void write_msg_to_buffers(struct mp_log *log, int lev, bstr text)
     }
 }
 
+static void write_log_file(struct mp_log *log, int lev, bstr text)
+{
+    struct mp_log_root *root = log->root;
+    if (!root->log_file || lev == MSGL_STATUS ||
+        lev > MPMAX(log->terminal_level, MSGL_DEBUG))
+        return;
+    fprintf(root->log_file, "[%8.3f][%c][%s] %.*s", root->msg_time,
+            mp_log_levels[lev][0], log->verbose_prefix, BSTR_P(text));
+    root->log_file_dirty = true;
+}
+
 static void dump_stats(struct mp_log *log, int lev, bstr text)
 {
     struct mp_log_root *root = log->root;
@@ -535,6 +581,7 @@ static void write_term_msg(struct mp_log *log, int lev, bstr text, bstr *out)
                                 ? 1 : (line_w + term_w - 1) / term_w;
         }
         write_msg_to_buffers(log, lev, line);
+        write_log_file(log, lev, line);
     }
 
     if (lev == MSGL_STATUS) {
@@ -559,25 +606,19 @@ static void write_term_msg(struct mp_log *log, int lev, bstr text, bstr *out)
     }
 }
 
-void mp_msg_va(struct mp_log *log, int lev, const char *format, va_list va)
+// Write a message to the terminal and all other outputs. Streams are flushed
+// with flush_msgs(). root->lock must be held.
+static void write_msg(struct mp_log *log, int lev, bstr text)
 {
-    if (!mp_msg_test(log, lev))
-        return; // do not display
-
     struct mp_log_root *root = log->root;
 
-    mp_mutex_lock(&root->lock);
-
     root->buffer.len = 0;
 
     if (log->partial[lev].len)
         bstr_xappend(root, &root->buffer, log->partial[lev]);
     log->partial[lev].len = 0;
 
-    if (bstr_xappend_vasprintf(root, &root->buffer, format, va) < 0) {
-        bstr_xappend(root, &root->buffer, bstr0("format error: "));
-        bstr_xappend(root, &root->buffer, bstr0(format));
-    }
+    bstr_xappend(root, &root->buffer, text);
 
     // Remember last status message and restore it to ensure that it is
     // always displayed
@@ -608,20 +649,193 @@ void mp_msg_va(struct mp_log *log, int lev, const char *format, va_list va)
             fwrite(root->term_msg.start, root->term_msg.len, 1, stream);
             if (root->term_status_msg.len)
                 fwrite(root->term_status_msg.start, root->term_status_msg.len, 1, stream);
-            fflush(stream);
+            root->term_dirty[term_msg_fileno(root, lev)] = true;
+        }
+    }
+}
+
+static void flush_msgs(struct mp_log_root *root)
+{
+    for (int n = STDOUT_FILENO; n <= STDERR_FILENO; n++) {
+        if (root->term_dirty[n])
+            fflush(n == STDERR_FILENO ? stderr : stdout);
+        root->term_dirty[n] = false;
+    }
+    if (root->log_file_dirty && root->log_file)
+        fflush(root->log_file);
+    root->log_file_dirty = false;
+}
+
+// Hand the message to the log thread. If text is not NULL, the slot takes
+// ownership of it, otherwise it's copied from buf.
+static void queue_msg(struct mp_log *log, int lev, char *buf, char *text, int len)
+{
+    struct mp_log_root *root = log->root;
+
+    uint64_t pos = atomic_load_explicit(&root->ring_write, memory_order_relaxed);
+    struct msg_slot *slot;
+    while (1) {
+        slot = &root->ring[pos & (MSG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&root->ring_write, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else {
+            // If seq < pos, the ring is full.
+            if (seq < pos)
+                wait_done(root, pos - MSG_RING_SIZE + 1);
+            pos = atomic_load_explicit(&root->ring_write, memory_order_relaxed);
         }
     }
 
+    slot->log = log;
+    slot->lev = lev;
+    slot->len = len;
+    slot->time = mp_time_sec();
+    slot->heap_text = text;
+    if (!text)
+        memcpy(slot->inline_text, buf, len + 1);
+
+    // Pairs with the ring_idle store and the seq check in msg_thread().
+    atomic_store(&slot->seq, pos + 1);
+    if (atomic_load(&root->ring_idle)) {
+        mp_mutex_lock(&root->ring_lock);
+        mp_cond_broadcast(&root->ring_wakeup);
+        mp_mutex_unlock(&root->ring_lock);
+    }
+
+    uint64_t last = atomic_load_explicit(&log->last_queued, memory_order_relaxed);
+    while (last < pos + 1 &&
+           !atomic_compare_exchange_weak_explicit(&log->last_queued, &last,
+                pos + 1, memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    // Fatal errors are often followed by abort() or exit().
+    if (lev == MSGL_FATAL)
+        wait_done(root, pos + 1);
+}
+
+static bool ring_ready(struct mp_log_root *root)
+{
+    struct msg_slot *slot = &root->ring[root->ring_read & (MSG_RING_SIZE - 1)];
+    return atomic_load(&slot->seq) == root->ring_read + 1;
+}
+
+// Write the next queued message, if there is one. root->lock must be held.
+static bool read_msg(struct mp_log_root *root)
+{
+    if (!ring_ready(root))
+        return false;
+
+    struct msg_slot *slot = &root->ring[root->ring_read & (MSG_RING_SIZE - 1)];
+    char *text = slot->heap_text ? slot->heap_text : slot->inline_text;
+    root->msg_time = slot->time;
+    write_msg(slot->log, slot->lev, (bstr){text, slot->len});
+    talloc_free(slot->heap_text);
+    slot->heap_text = NULL;
+
+    atomic_store_explicit(&slot->seq, root->ring_read + MSG_RING_SIZE,
+                          memory_order_release);
+    root->ring_read += 1;
+    return true;
+}
+
+static MP_THREAD_VOID msg_thread(void *p)
+{
+    struct mp_log_root *root = p;
+
+    mp_thread_set_name("log");
+
+    while (1) {
+        // Write everything that's available and flush once, but don't starve
+        // the waiting threads if messages keep coming in.
+        mp_mutex_lock(&root->lock);
+        int num = 0;
+        while (num < MSG_RING_SIZE && read_msg(root))
+            num++;
+        if (num)
+            flush_msgs(root);
+        mp_mutex_unlock(&root->lock);
+
+        if (num) {
+            atomic_store(&root->ring_done, root->ring_read);
+            if (atomic_load(&root->ring_waiters)) {
+                mp_mutex_lock(&root->ring_lock);
+                mp_cond_broadcast(&root->ring_wakeup);
+                mp_mutex_unlock(&root->ring_lock);
+            }
+            continue;
+        }
+
+        mp_mutex_lock(&root->ring_lock);
+        atomic_store(&root->ring_idle, true);
+        while (root->ring_thread_active && !ring_ready(root))
+            mp_cond_wait(&root->ring_wakeup, &root->ring_lock);
+        atomic_store(&root->ring_idle, false);
+        bool active = root->ring_thread_active;
+        mp_mutex_unlock(&root->ring_lock);
+
+        if (!active && !ring_ready(root))
+            break;
+    }
+
+    MP_THREAD_RETURN();
+}
+
+// Messages are formatted on the calling thread, and then written by the log
+// thread, so that the caller never waits for terminal or file I/O. (Unless the
+// message ring is full, or for fatal errors.)
+void mp_msg_va(struct mp_log *log, int lev, const char *format, va_list va)
+{
+    if (!mp_msg_test(log, lev))
+        return; // do not display
+
+    struct mp_log_root *root = log->root;
+
+    char buf[MSG_INLINE_SIZE];
+    char *text = NULL;
+    va_list copy;
+    va_copy(copy, va);
+    int len = vsnprintf(buf, sizeof(buf), format, copy);
+    va_end(copy);
+    if (len >= (int)sizeof(buf)) {
+        text = talloc_size(NULL, len + 1);
+        vsnprintf(text, len + 1, format, va);
+    } else if (len < 0) {
+        text = talloc_asprintf(NULL, "format error: %s", format);
+        len = strlen(text);
+    }
+
+    if (root->have_ring_thread) {
+        queue_msg(log, lev, buf, text, len);
+        return;
+    }
+
+    mp_mutex_lock(&root->lock);
+    root->msg_time = mp_time_sec();
+    write_msg(log, lev, (bstr){text ? text : buf, len});
+    flush_msgs(root);
     mp_mutex_unlock(&root->lock);
+    talloc_free(text);
 }
 
 static void destroy_log(void *ptr)
 {
     struct mp_log *log = ptr;
+    struct mp_log_root *root = log->root;
+    // Queued messages still reference the log.
+    uint64_t last_queued = atomic_load(&log->last_queued);
+    if (last_queued)
+        wait_done(root, last_queued);
+    mp_mutex_lock(&root->lock);
+    if (root->status_log == log)
+        root->status_log = NULL;
     // This is not managed via talloc itself, because mp_msg calls must be
     // thread-safe, while talloc is not thread-safe.
     for (int lvl = 0; lvl <= MSGL_MAX; ++lvl)
         talloc_free(log->partial[lvl].start);
+    mp_mutex_unlock(&root->lock);
 }
 
 // Create a new log context, which uses talloc_ctx as talloc parent, and parent
@@ -676,11 +890,21 @@ void mp_msg_init(struct mpv_global *global)
     *root = (struct mp_log_root){
         .global = global,
         .reload_counter = 1,
+        .ring = talloc_zero_array(root, struct msg_slot, MSG_RING_SIZE),
     };
 
     mp_mutex_init(&root->lock);
-    mp_mutex_init(&root->log_file_lock);
-    mp_cond_init(&root->log_file_wakeup);
+    mp_mutex_init(&root->ring_lock);
+    mp_cond_init(&root->ring_wakeup);
+
+    for (int n = 0; n < MSG_RING_SIZE; n++)
+        atomic_init(&root->ring[n].seq, n);
+
+    // If this fails, messages are written directly by the logging thread.
+    root->ring_thread_active = true;
+    if (mp_thread_create(&root->ring_thread, msg_thread, root))
+        root->ring_thread_active = false;
+    root->have_ring_thread = root->ring_thread_active;
 
     struct mp_log dummy = { .root = root };
     struct mp_log *log = mp_log_new(root, &dummy, "");
@@ -688,68 +912,20 @@ void mp_msg_init(struct mpv_global *global)
     global->log = log;
 }
 
-static MP_THREAD_VOID log_file_thread(void *p)
+// Write all queued messages and stop the log thread. Only to be called from the
+// main thread, when no other threads can log anymore.
+static void terminate_msg_thread(struct mp_log_root *root)
 {
-    struct mp_log_root *root = p;
-
-    mp_thread_set_name("log");
-
-    mp_mutex_lock(&root->log_file_lock);
-
-    while (root->log_file_thread_active) {
-        struct mp_log_buffer_entry *e =
-            mp_msg_log_buffer_read(root->log_file_buffer);
-        if (e) {
-            mp_mutex_unlock(&root->log_file_lock);
-            fprintf(root->log_file, "[%8.3f][%c][%s] %s",
-                    mp_time_sec(),
-                    mp_log_levels[e->level][0], e->prefix, e->text);
-            fflush(root->log_file);
-            mp_mutex_lock(&root->log_file_lock);
-            talloc_free(e);
-            // Multiple threads might be blocked if the log buffer was full.
-            mp_cond_broadcast(&root->log_file_wakeup);
-        } else {
-            mp_cond_wait(&root->log_file_wakeup, &root->log_file_lock);
-        }
-    }
-
-    mp_mutex_unlock(&root->log_file_lock);
-
-    MP_THREAD_RETURN();
-}
-
-static void wakeup_log_file(void *p)
-{
-    struct mp_log_root *root = p;
-
-    mp_mutex_lock(&root->log_file_lock);
-    mp_cond_broadcast(&root->log_file_wakeup);
-    mp_mutex_unlock(&root->log_file_lock);
-}
-
-// Only to be called from the main thread.
-static void terminate_log_file_thread(struct mp_log_root *root)
-{
-    bool wait_terminate = false;
-
-    mp_mutex_lock(&root->log_file_lock);
-    if (root->log_file_thread_active) {
-        root->log_file_thread_active = false;
-        mp_cond_broadcast(&root->log_file_wakeup);
-        wait_terminate = true;
-    }
-    mp_mutex_unlock(&root->log_file_lock);
-
-    if (wait_terminate)
-        mp_thread_join(root->log_file_thread);
+    if (!root->have_ring_thread)
+        return;
 
-    mp_msg_log_buffer_destroy(root->log_file_buffer);
-    root->log_file_buffer = NULL;
+    mp_mutex_lock(&root->ring_lock);
+    root->ring_thread_active = false;
+    mp_cond_broadcast(&root->ring_wakeup);
+    mp_mutex_unlock(&root->ring_lock);
 
-    if (root->log_file)
-        fclose(root->log_file);
-    root->log_file = NULL;
+    mp_thread_join(root->ring_thread);
+    root->have_ring_thread = false;
 }
 
 // If opt is different from *current_path, update *current_path and return true.
@@ -805,49 +981,37 @@ void mp_msg_update_msglevels(struct mpv_global *global, struct MPOpts *opts)
     mp_mutex_unlock(&root->lock);
 
     if (check_new_path(global, opts->log_file, &root->log_path)) {
-        terminate_log_file_thread(root);
-        if (root->log_path) {
-            root->log_file = fopen(root->log_path, "wb");
-            if (root->log_file) {
-
-                // if a logfile is created and the early filebuf still exists,
-                // flush and destroy the early buffer
-                mp_mutex_lock(&root->lock);
-                struct mp_log_buffer *earlybuf = root->early_filebuffer;
-                if (earlybuf)
-                    root->early_filebuffer = NULL;  // but it still logs msgs
-                mp_mutex_unlock(&root->lock);
-
-                if (earlybuf) {
-                    // flush, destroy before creating the normal logfile buf,
-                    // as once the new one is created (specifically, its write
-                    // thread), then MSGL_LOGFILE messages become blocking, but
-                    // the early logfile buf is without dequeue - can deadlock.
-                    // note: timestamp is unknown, we use 0.000 as indication.
-                    // note: new messages while iterating are still flushed.
-                    struct mp_log_buffer_entry *e;
-                    while ((e = mp_msg_log_buffer_read(earlybuf))) {
-                        fprintf(root->log_file, "[%8.3f][%c][%s] %s", 0.0,
-                                mp_log_levels[e->level][0], e->prefix, e->text);
-                        talloc_free(e);
-                    }
-                    mp_msg_log_buffer_destroy(earlybuf);  // + remove from root
-                }
+        FILE *log_file = root->log_path ? fopen(root->log_path, "wb") : NULL;
+        struct mp_log_buffer *earlybuf = NULL;
 
-                root->log_file_buffer =
-                    mp_msg_log_buffer_new(global, FILE_BUF, MP_LOG_BUFFER_MSGL_LOGFILE,
-                                          wakeup_log_file, root);
-                root->log_file_thread_active = true;
-                if (mp_thread_create(&root->log_file_thread, log_file_thread,
-                                   root))
-                {
-                    root->log_file_thread_active = false;
-                    terminate_log_file_thread(root);
-                }
-            } else {
-                mp_err(global->log, "Failed to open log file '%s'\n",
-                       root->log_path);
+        mp_mutex_lock(&root->lock);
+        if (root->log_file)
+            fclose(root->log_file);
+        root->log_file = log_file;
+        root->log_file_dirty = false;
+        if (log_file) {
+            // if a logfile is created and the early filebuf still exists,
+            // flush and destroy the early buffer. messages which are written
+            // after this go to the log file directly.
+            // note: timestamp is unknown, we use 0.000 as indication.
+            earlybuf = root->early_filebuffer;
+            root->early_filebuffer = NULL;  // but it still logs msgs
+            struct mp_log_buffer_entry *e;
+            while (earlybuf && (e = mp_msg_log_buffer_read(earlybuf))) {
+                fprintf(log_file, "[%8.3f][%c][%s] %s", 0.0,
+                        mp_log_levels[e->level][0], e->prefix, e->text);
+                talloc_free(e);
             }
+            fflush(log_file);
+        }
+        atomic_fetch_add(&root->reload_counter, 1);
+        mp_mutex_unlock(&root->lock);
+
+        mp_msg_log_buffer_destroy(earlybuf);  // + remove from root
+
+        if (root->log_path && !log_file) {
+            mp_err(global->log, "Failed to open log file '%s'\n",
+                   root->log_path);
         }
     }
 
@@ -891,21 +1055,24 @@ bool mp_msg_has_log_file(struct mpv_global *global)
 void mp_msg_uninit(struct mpv_global *global)
 {
     struct mp_log_root *root = global->log->root;
+    terminate_msg_thread(root);
     mp_msg_flush_status_line(global->log, true);
     if (root->really_quiet && root->isatty[term_msg_fileno(root, MSGL_STATUS)])
         fprintf(term_msg_fp(root, MSGL_STATUS), TERM_ESC_RESTORE_CURSOR);
-    terminate_log_file_thread(root);
     mp_msg_log_buffer_destroy(root->early_buffer);
     mp_msg_log_buffer_destroy(root->early_filebuffer);
     mp_assert(root->num_buffers == 0);
+    if (root->log_file)
+        fclose(root->log_file);
     if (root->stats_file)
         fclose(root->stats_file);
     talloc_free(root->stats_path);
     talloc_free(root->log_path);
     m_option_type_msglevels.free(&root->msg_levels);
+    talloc_free(global->log);
     mp_mutex_destroy(&root->lock);
-    mp_mutex_destroy(&root->log_file_lock);
-    mp_cond_destroy(&root->log_file_wakeup);
+    mp_mutex_destroy(&root->ring_lock);
+    mp_cond_destroy(&root->ring_wakeup);
     talloc_free(root);
     global->log = NULL;
 }
@@ -924,9 +1091,8 @@ void mp_msg_uninit(struct mpv_global *global)
 //   main cases where meaningful messages are accumulated before the filename
 //   is known are when log-file is set at mpv.conf, or from script/client init.
 //   once a file name is known, the early buffer is flushed and destroyed.
-//   unlike the "proper" log-file buffer, the early filebuffer is not backed by
-//   a write thread, and hence non-blocking (can overwrite old messages).
-//   it's also bigger than the actual file buffer (early: 5000, actual: 100).
+//   unlike the log file itself, which the log thread writes to directly, the
+//   early filebuffer is a ring buffer, and can overwrite old messages.
 
 static void mp_msg_set_early_logging_raw(struct mpv_global *global, bool enable,
                                          struct mp_log_buffer **root_logbuf,
@@ -962,7 +1128,7 @@ void mp_msg_set_early_logging(struct mpv_global *global, bool enable)
     mp_msg_set_early_logging_raw(global, enable, &root->early_buffer,
                                  EARLY_TERM_BUF, MP_LOG_BUFFER_MSGL_TERM);
 
-    // normally MSGL_LOGFILE buffer gets a write thread, but not the early buf
+    // only the early buf uses MSGL_LOGFILE, the log file is written directly
     mp_msg_set_early_logging_raw(global, enable, &root->early_filebuffer,
                                  EARLY_FILE_BUF, MP_LOG_BUFFER_MSGL_LOGFILE);
 }
@@ -12,6 +12,7 @@
 #include "osdep/threads.h"
 #include "osdep/timer.h"
 #include "stats.h"
+#include "trace.h"
 
 struct stats_base {
     struct mpv_global *global;
@@ -28,6 +29,10 @@ struct stats_base {
     int num_entries;
 
     int64_t last_time;
+
+    // Created on first use, and never destroyed before stats_base.
+    struct mp_trace *trace;
+    _Atomic(struct mp_trace *) active_trace; // trace if enabled, else NULL
 };
 
 struct stats_ctx {
@@ -51,22 +56,102 @@ enum val_type {
     VAL_THREAD_CPU_TIME,
 };
 
+// Latency histogram with logarithmic buckets. Each power of 2 is split into
+// HIST_SUB linear sub-buckets, so values are recorded with a relative error of
+// at most 1/HIST_SUB, using a fixed amount of memory.
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 // values are clamped to 2^40-1 ns (~18 minutes)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct stat_hist {
+    atomic_uint_least32_t buckets[HIST_BUCKETS];
+    atomic_int_least64_t max;
+};
+
+// The entry list is protected by stats_base.lock, but the values are atomic,
+// so that updating them through a stat_entry handle doesn't need the lock.
+// Except for events, an entry is normally updated by a single thread only.
 struct stat_entry {
     char name[32];
     const char *full_name; // including stats_ctx.prefix
+    struct stats_base *base;
 
-    enum val_type type;
-    double val_d;
-    int64_t val_rt;
-    int64_t val_th;
-    int64_t time_start_ns;
-    int64_t cpu_start_ns;
-    mp_thread_id thread_id;
+    atomic_int type; // enum val_type
+    _Atomic double val_d;
+    atomic_int_least64_t val_inc;
+    atomic_int_least64_t val_rt;
+    atomic_int_least64_t val_th;
+    atomic_int_least64_t time_start_ns;
+    atomic_int_least64_t cpu_start_ns;
+    atomic_int_least64_t span_start_ns; // like time_start_ns, but never split
+    _Atomic mp_thread_id thread_id;
+    struct stat_hist hist; // of VAL_TIME real time durations
 };
 
 #define IS_ACTIVE(ctx) \
     (atomic_load_explicit(&(ctx)->base->active, memory_order_relaxed))
 
+static int hist_index(uint64_t v)
+{
+    v = MPMIN(v, (UINT64_C(1) << HIST_MAX_BITS) - 1);
+    if (v < HIST_SUB)
+        return v;
+    int e = v >> 32 ? 32 + mp_log2(v >> 32) : mp_log2(v);
+    int shift = e - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+}
+
+// Highest value that maps to the given bucket.
+static uint64_t hist_bucket_value(int idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+    int shift = idx / HIST_SUB - 1;
+    uint64_t m = idx % HIST_SUB + HIST_SUB;
+    return ((m + 1) << shift) - 1;
+}
+
+static void hist_add(struct stat_hist *h, int64_t v)
+{
+    v = MPMAX(v, 0);
+    atomic_fetch_add_explicit(&h->buckets[hist_index(v)], 1,
+                              memory_order_relaxed);
+    int64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (v > max && !atomic_compare_exchange_weak(&h->max, &max, v)) {}
+}
+
+// Add the histogram as percentiles (in ms) to the given stat node. If reset is
+// set, the histogram is cleared as it is read.
+static void hist_query(struct stat_hist *h, struct mpv_node *ne, bool reset)
+{
+    uint32_t buckets[HIST_BUCKETS];
+    uint64_t total = 0;
+    for (int n = 0; n < HIST_BUCKETS; n++) {
+        buckets[n] = reset ? atomic_exchange(&h->buckets[n], 0)
+                           : atomic_load(&h->buckets[n]);
+        total += buckets[n];
+    }
+    int64_t max = reset ? atomic_exchange(&h->max, 0) : atomic_load(&h->max);
+    if (!total)
+        return;
+
+    static const struct { const char *name; int p; } percentiles[] = {
+        {"p50", 50}, {"p95", 95}, {"p99", 99},
+    };
+    int idx = 0;
+    uint64_t count = buckets[0];
+    for (int n = 0; n < MP_ARRAY_SIZE(percentiles); n++) {
+        uint64_t rank = (total * percentiles[n].p + 99) / 100;
+        while (count < rank)
+            count += buckets[++idx];
+        uint64_t v = MPMIN(hist_bucket_value(idx), max);
+        node_map_add_double(ne, percentiles[n].name, MP_TIME_NS_TO_MS(v));
+    }
+    node_map_add_double(ne, "max", MP_TIME_NS_TO_MS(max));
+    node_map_add_int64(ne, "samples", total);
+}
+
 static void stats_destroy(void *p)
 {
     struct stats_base *stats = p;
@@ -88,8 +173,8 @@ void stats_global_init(struct mpv_global *global)
     stats->global = global;
 }
 
-static void add_stat(struct mpv_node *list, struct stat_entry *e,
-                     const char *suffix, double num_val, char *text)
+static struct mpv_node *add_stat(struct mpv_node *list, struct stat_entry *e,
+                                 const char *suffix, double num_val, char *text)
 {
     struct mpv_node *ne = node_array_add(list, MPV_FORMAT_NODE_MAP);
 
@@ -98,6 +183,7 @@ static void add_stat(struct mpv_node *list, struct stat_entry *e,
     node_map_add_double(ne, "value", num_val);
     if (text)
         node_map_add_string(ne, "text", text);
+    return ne;
 }
 
 static int cmp_entry(const void *p1, const void *p2)
@@ -107,7 +193,8 @@ static int cmp_entry(const void *p1, const void *p2)
     return strcmp((*e1)->full_name, (*e2)->full_name);
 }
 
-void stats_global_query(struct mpv_global *global, struct mpv_node *out)
+void stats_global_query(struct mpv_global *global, struct mpv_node *out,
+                        bool reset_histograms)
 {
     struct stats_base *stats = global->stats;
     mp_assert(stats);
@@ -150,10 +237,13 @@ void stats_global_query(struct mpv_global *global, struct mpv_node *out)
             for (int n = 0; n < stats->num_entries; n++) {
                 struct stat_entry *e = stats->entries[n];
 
-                e->cpu_start_ns = e->time_start_ns = 0;
-                e->val_rt = e->val_th = 0;
-                if (e->type != VAL_THREAD_CPU_TIME)
-                    e->type = 0;
+                atomic_store(&e->cpu_start_ns, 0);
+                atomic_store(&e->time_start_ns, 0);
+                atomic_store(&e->val_rt, 0);
+                atomic_store(&e->val_th, 0);
+                atomic_store(&e->val_inc, 0);
+                if (atomic_load(&e->type) != VAL_THREAD_CPU_TIME)
+                    atomic_store(&e->type, VAL_UNSET);
             }
         }
     }
@@ -162,44 +252,50 @@ void stats_global_query(struct mpv_global *global, struct mpv_node *out)
     for (int n = 0; n < stats->num_entries; n++) {
         struct stat_entry *e = stats->entries[n];
 
-        switch (e->type) {
+        switch (atomic_load(&e->type)) {
         case VAL_STATIC:
-            add_stat(out, e, NULL, e->val_d, NULL);
+            add_stat(out, e, NULL, atomic_load(&e->val_d), NULL);
             break;
         case VAL_STATIC_SIZE: {
-            char *s = format_file_size(e->val_d);
-            add_stat(out, e, NULL, e->val_d, s);
+            double val = atomic_load(&e->val_d);
+            char *s = format_file_size(val);
+            add_stat(out, e, NULL, val, s);
             talloc_free(s);
             break;
         }
         case VAL_INC:
-            add_stat(out, e, NULL, e->val_d, NULL);
-            e->val_d = 0;
+            add_stat(out, e, NULL, atomic_exchange(&e->val_inc, 0), NULL);
             break;
         case VAL_TIME: {
-            if (e->time_start_ns) {  // ongoing. effectively do end+start
-                e->val_rt += now - e->time_start_ns;
-                e->time_start_ns = now;
-                int64_t t = mp_thread_cpu_time_ns(e->thread_id);
-                e->val_th += t - e->cpu_start_ns;
-                e->cpu_start_ns = t;
+            // If ongoing, effectively do end+start. Whoever resets the start
+            // time accounts for the interval, so this can't race with the
+            // thread calling stats_entry_time_end().
+            int64_t start = atomic_load(&e->time_start_ns);
+            if (start && atomic_compare_exchange_strong(&e->time_start_ns,
+                                                        &start, now))
+            {
+                atomic_fetch_add(&e->val_rt, now - start);
+                int64_t t = mp_thread_cpu_time_ns(atomic_load(&e->thread_id));
+                atomic_fetch_add(&e->val_th,
+                                 t - atomic_exchange(&e->cpu_start_ns, t));
             }
-            double t_cpu = MP_TIME_NS_TO_MS(e->val_th);
-            if (e->cpu_start_ns >= 0)
+            double t_cpu = MP_TIME_NS_TO_MS(atomic_exchange(&e->val_th, 0));
+            if (atomic_load(&e->cpu_start_ns) >= 0)
                 add_stat(out, e, "cpu", t_cpu, FMT_T(t_cpu, t_ms));
-            double t_rt = MP_TIME_NS_TO_MS(e->val_rt);
-            add_stat(out, e, "time", t_rt, FMT_T(t_rt, t_ms));
-            e->val_rt = e->val_th = 0;
+            double t_rt = MP_TIME_NS_TO_MS(atomic_exchange(&e->val_rt, 0));
+            struct mpv_node *ne = add_stat(out, e, "time", t_rt, FMT_T(t_rt, t_ms));
+            hist_query(&e->hist, ne, reset_histograms);
             break;
         }
         case VAL_THREAD_CPU_TIME: {
-            int64_t t = mp_thread_cpu_time_ns(e->thread_id);
-            if (!e->cpu_start_ns)
-                e->cpu_start_ns = t;
-            double t_msec = MP_TIME_NS_TO_MS(t - e->cpu_start_ns);
-            if (e->cpu_start_ns >= 0)
+            int64_t t = mp_thread_cpu_time_ns(atomic_load(&e->thread_id));
+            int64_t cpu_start = atomic_load(&e->cpu_start_ns);
+            if (!cpu_start)
+                cpu_start = t;
+            double t_msec = MP_TIME_NS_TO_MS(t - cpu_start);
+            if (cpu_start >= 0)
                 add_stat(out, e, NULL, t_msec, FMT_T(t_msec, t_ms));
-            e->cpu_start_ns = t;
+            atomic_store(&e->cpu_start_ns, t);
             break;
         }
         default: ;
@@ -250,6 +346,7 @@ static struct stat_entry *find_entry(struct stats_ctx *ctx, const char *name)
     mp_assert(strcmp(e->name, name) == 0); // make e->name larger and don't complain
 
     e->full_name = talloc_asprintf(e, "%s/%s", ctx->prefix, e->name);
+    e->base = ctx->base;
 
     MP_TARRAY_APPEND(ctx, ctx->entries, ctx->num_entries, e);
     ctx->base->num_entries = 0; // invalidate
@@ -257,66 +354,125 @@ static struct stat_entry *find_entry(struct stats_ctx *ctx, const char *name)
     return e;
 }
 
-static void static_value(struct stats_ctx *ctx, const char *name, double val,
-                         enum val_type type)
+struct stat_entry *stats_entry(struct stats_ctx *ctx, const char *name)
 {
-    if (!IS_ACTIVE(ctx))
-        return;
     mp_mutex_lock(&ctx->base->lock);
     struct stat_entry *e = find_entry(ctx, name);
-    e->val_d = val;
-    e->type = type;
     mp_mutex_unlock(&ctx->base->lock);
+    return e;
+}
+
+// Find the entry for the legacy string based API. This takes the lock only if
+// stats are active.
+static struct stat_entry *lookup_active(struct stats_ctx *ctx, const char *name)
+{
+    if (!IS_ACTIVE(ctx))
+        return NULL;
+    return stats_entry(ctx, name);
+}
+
+static void static_value(struct stat_entry *e, double val, enum val_type type)
+{
+    if (!e || !IS_ACTIVE(e))
+        return;
+    atomic_store(&e->val_d, val);
+    atomic_store(&e->type, type);
+}
+
+void stats_entry_value(struct stat_entry *e, double val)
+{
+    static_value(e, val, VAL_STATIC);
+}
+
+void stats_entry_size_value(struct stat_entry *e, double val)
+{
+    static_value(e, val, VAL_STATIC_SIZE);
 }
 
 void stats_value(struct stats_ctx *ctx, const char *name, double val)
 {
-    static_value(ctx, name, val, VAL_STATIC);
+    static_value(lookup_active(ctx, name), val, VAL_STATIC);
 }
 
 void stats_size_value(struct stats_ctx *ctx, const char *name, double val)
 {
-    static_value(ctx, name, val, VAL_STATIC_SIZE);
+    static_value(lookup_active(ctx, name), val, VAL_STATIC_SIZE);
+}
+
+static void trace_span(struct stats_base *base, const char *prefix,
+                       const char *name, bool begin)
+{
+    struct mp_trace *trace =
+        atomic_load_explicit(&base->active_trace, memory_order_relaxed);
+    if (trace)
+        mp_trace_span(trace, prefix, name, begin);
+}
+
+void stats_entry_time_start(struct stat_entry *e)
+{
+    MP_STATS(e->base->global, "start %s", e->name);
+    trace_span(e->base, NULL, e->full_name, true);
+    if (!IS_ACTIVE(e))
+        return;
+    mp_thread_id thread_id = mp_thread_current_id();
+    atomic_store(&e->thread_id, thread_id);
+    atomic_store(&e->cpu_start_ns, mp_thread_cpu_time_ns(thread_id));
+    int64_t now = mp_time_ns();
+    atomic_store_explicit(&e->span_start_ns, now, memory_order_relaxed);
+    atomic_store(&e->time_start_ns, now);
+    atomic_store(&e->type, VAL_TIME);
+}
+
+void stats_entry_time_end(struct stat_entry *e)
+{
+    MP_STATS(e->base->global, "end %s", e->name);
+    trace_span(e->base, NULL, e->full_name, false);
+    if (!IS_ACTIVE(e))
+        return;
+    int64_t start = atomic_exchange(&e->time_start_ns, 0);
+    if (atomic_load(&e->type) == VAL_TIME && start) {
+        int64_t now = mp_time_ns();
+        int64_t cpu = mp_thread_cpu_time_ns(atomic_load(&e->thread_id));
+        atomic_fetch_add(&e->val_th, cpu - atomic_load(&e->cpu_start_ns));
+        atomic_fetch_add(&e->val_rt, now - start);
+        hist_add(&e->hist, now - atomic_load_explicit(&e->span_start_ns,
+                                                      memory_order_relaxed));
+    }
 }
 
 void stats_time_start(struct stats_ctx *ctx, const char *name)
 {
-    MP_STATS(ctx->base->global, "start %s", name);
-    if (!IS_ACTIVE(ctx))
+    if (!IS_ACTIVE(ctx)) {
+        MP_STATS(ctx->base->global, "start %s", name);
+        trace_span(ctx->base, ctx->prefix, name, true);
         return;
-    mp_mutex_lock(&ctx->base->lock);
-    struct stat_entry *e = find_entry(ctx, name);
-    e->type = VAL_TIME;
-    e->thread_id = mp_thread_current_id();
-    e->cpu_start_ns = mp_thread_cpu_time_ns(e->thread_id);
-    e->time_start_ns = mp_time_ns();
-    mp_mutex_unlock(&ctx->base->lock);
+    }
+    stats_entry_time_start(stats_entry(ctx, name));
 }
 
 void stats_time_end(struct stats_ctx *ctx, const char *name)
 {
-    MP_STATS(ctx->base->global, "end %s", name);
-    if (!IS_ACTIVE(ctx))
+    if (!IS_ACTIVE(ctx)) {
+        MP_STATS(ctx->base->global, "end %s", name);
+        trace_span(ctx->base, ctx->prefix, name, false);
         return;
-    mp_mutex_lock(&ctx->base->lock);
-    struct stat_entry *e = find_entry(ctx, name);
-    if (e->type == VAL_TIME && e->time_start_ns) {
-        e->val_th += mp_thread_cpu_time_ns(e->thread_id) - e->cpu_start_ns;
-        e->val_rt += mp_time_ns() - e->time_start_ns;
-        e->time_start_ns = 0;
     }
-    mp_mutex_unlock(&ctx->base->lock);
+    stats_entry_time_end(stats_entry(ctx, name));
 }
 
-void stats_event(struct stats_ctx *ctx, const char *name)
+void stats_entry_event(struct stat_entry *e)
 {
-    if (!IS_ACTIVE(ctx))
+    if (!IS_ACTIVE(e))
         return;
-    mp_mutex_lock(&ctx->base->lock);
-    struct stat_entry *e = find_entry(ctx, name);
-    e->val_d += 1;
-    e->type = VAL_INC;
-    mp_mutex_unlock(&ctx->base->lock);
+    atomic_fetch_add_explicit(&e->val_inc, 1, memory_order_relaxed);
+    atomic_store_explicit(&e->type, VAL_INC, memory_order_relaxed);
+}
+
+void stats_event(struct stats_ctx *ctx, const char *name)
+{
+    struct stat_entry *e = lookup_active(ctx, name);
+    if (e)
+        stats_entry_event(e);
 }
 
 static void register_thread(struct stats_ctx *ctx, const char *name,
@@ -324,8 +480,8 @@ static void register_thread(struct stats_ctx *ctx, const char *name,
 {
     mp_mutex_lock(&ctx->base->lock);
     struct stat_entry *e = find_entry(ctx, name);
-    e->type = type;
-    e->thread_id = mp_thread_current_id();
+    atomic_store(&e->thread_id, mp_thread_current_id());
+    atomic_store(&e->type, type);
     mp_mutex_unlock(&ctx->base->lock);
 }
 
@@ -338,3 +494,25 @@ void stats_unregister_thread(struct stats_ctx *ctx, const char *name)
 {
     register_thread(ctx, name, 0);
 }
+
+void stats_set_trace(struct mpv_global *global, bool enable)
+{
+    struct stats_base *stats = global->stats;
+
+    mp_mutex_lock(&stats->lock);
+    if (enable && !stats->trace)
+        stats->trace = mp_trace_create(stats);
+    atomic_store(&stats->active_trace, enable ? stats->trace : NULL);
+    mp_mutex_unlock(&stats->lock);
+}
+
+bool stats_write_trace(struct mpv_global *global, const char *filename)
+{
+    struct stats_base *stats = global->stats;
+
+    mp_mutex_lock(&stats->lock);
+    struct mp_trace *trace = stats->trace;
+    mp_mutex_unlock(&stats->lock);
+
+    return trace && mp_trace_write(trace, filename);
+}
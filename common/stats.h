@@ -1,11 +1,15 @@
 #pragma once
 
+#include <stdbool.h>
+
 struct mpv_global;
 struct mpv_node;
 struct stats_ctx;
+struct stat_entry;
 
 void stats_global_init(struct mpv_global *global);
-void stats_global_query(struct mpv_global *global, struct mpv_node *out);
+void stats_global_query(struct mpv_global *global, struct mpv_node *out,
+                        bool reset_histograms);
 
 // stats_ctx can be free'd with ta_free(), or by using the ta_parent.
 struct stats_ctx *stats_ctx_create(void *ta_parent, struct mpv_global *global,
@@ -18,7 +22,8 @@ void stats_value(struct stats_ctx *ctx, const char *name, double val);
 void stats_size_value(struct stats_ctx *ctx, const char *name, double val);
 
 // Report the real time and CPU time in seconds between _start and _end calls
-// as value, and report the average and number of all times.
+// as value, and report the average and number of all times. The distribution
+// of the real time durations is reported as percentiles.
 void stats_time_start(struct stats_ctx *ctx, const char *name);
 void stats_time_end(struct stats_ctx *ctx, const char *name);
 
@@ -32,3 +37,24 @@ void stats_register_thread_cputime(struct stats_ctx *ctx, const char *name);
 
 // Remove reference to the current thread.
 void stats_unregister_thread(struct stats_ctx *ctx, const char *name);
+
+// Start (or stop) recording timed entries as trace events. Recording is
+// independent from the stats query. Stopping keeps the recorded events.
+void stats_set_trace(struct mpv_global *global, bool enable);
+
+// Write the recorded trace events as Chrome Trace Event JSON. Returns false if
+// there is no trace, or on I/O errors.
+bool stats_write_trace(struct mpv_global *global, const char *filename);
+
+// Return a handle to the named entry, creating it if needed. The handle stays
+// valid until the stats_ctx is destroyed. Unlike the functions above, using a
+// handle does not need to look up the name or take a lock, so this is meant
+// for frequently updated entries.
+struct stat_entry *stats_entry(struct stats_ctx *ctx, const char *name);
+
+// Like the functions above, but on a handle returned by stats_entry().
+void stats_entry_value(struct stat_entry *e, double val);
+void stats_entry_size_value(struct stat_entry *e, double val);
+void stats_entry_time_start(struct stat_entry *e);
+void stats_entry_time_end(struct stat_entry *e);
+void stats_entry_event(struct stat_entry *e);
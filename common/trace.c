@@ -0,0 +1,198 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "common/common.h"
+#include "osdep/io.h"
+#include "osdep/threads.h"
+#include "osdep/timer.h"
+#include "trace.h"
+
+// Events kept per thread. Must be a power of 2.
+#define RING_SIZE (1 << 13)
+
+struct trace_event {
+    int64_t time_ns;
+    bool begin;
+    char name[47];
+};
+
+struct trace_ring {
+    mp_thread_id thread_id;
+    int tid;
+    char thread_name[32];
+    atomic_uint_least64_t written; // total number of events ever written
+    struct trace_event events[RING_SIZE];
+};
+
+struct mp_trace {
+    uint64_t id;
+    int64_t start_ns;
+
+    mp_mutex lock;
+    struct trace_ring **rings;
+    int num_rings;
+};
+
+// Each thread caches its ring for the most recently used trace. (If several
+// mpv instances in the same process trace on the same thread, the ring is
+// searched again whenever the instance changes.)
+static atomic_uint_least64_t trace_id_counter;
+static thread_local struct {
+    uint64_t trace_id;
+    struct trace_ring *ring;
+} thread_ring;
+
+static void destroy_trace(void *p)
+{
+    struct mp_trace *t = p;
+    mp_mutex_destroy(&t->lock);
+}
+
+struct mp_trace *mp_trace_create(void *ta_parent)
+{
+    struct mp_trace *t = talloc_zero(ta_parent, struct mp_trace);
+    talloc_set_destructor(t, destroy_trace);
+    t->id = atomic_fetch_add(&trace_id_counter, 1) + 1;
+    t->start_ns = mp_time_ns();
+    mp_mutex_init(&t->lock);
+    return t;
+}
+
+static struct trace_ring *get_thread_ring(struct mp_trace *t)
+{
+    if (thread_ring.trace_id == t->id)
+        return thread_ring.ring;
+
+    mp_thread_id self = mp_thread_current_id();
+
+    mp_mutex_lock(&t->lock);
+    struct trace_ring *ring = NULL;
+    for (int n = 0; n < t->num_rings; n++) {
+        if (mp_thread_id_equal(t->rings[n]->thread_id, self))
+            ring = t->rings[n];
+    }
+    if (!ring) {
+        ring = talloc_zero(t, struct trace_ring);
+        ring->thread_id = self;
+        ring->tid = t->num_rings + 1;
+#if HAVE_GLIBC_THREAD_NAME || HAVE_MAC_THREAD_NAME
+        pthread_getname_np(pthread_self(), ring->thread_name,
+                           sizeof(ring->thread_name));
+#endif
+        MP_TARRAY_APPEND(t, t->rings, t->num_rings, ring);
+    }
+    mp_mutex_unlock(&t->lock);
+
+    thread_ring.trace_id = t->id;
+    thread_ring.ring = ring;
+    return ring;
+}
+
+void mp_trace_span(struct mp_trace *t, const char *prefix, const char *name,
+                   bool begin)
+{
+    struct trace_ring *ring = get_thread_ring(t);
+    uint64_t pos = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    struct trace_event *ev = &ring->events[pos & (RING_SIZE - 1)];
+
+    ev->time_ns = mp_time_ns();
+    ev->begin = begin;
+    if (prefix) {
+        snprintf(ev->name, sizeof(ev->name), "%s/%s", prefix, name);
+    } else {
+        snprintf(ev->name, sizeof(ev->name), "%s", name);
+    }
+
+    atomic_store_explicit(&ring->written, pos + 1, memory_order_release);
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// Write the events of one ring. The owning thread may write new events while
+// this is running; events which might have been overwritten are dropped.
+static void write_ring(struct mp_trace *t, struct trace_ring *ring, FILE *f,
+                       struct trace_event *tmp, bool *first)
+{
+    uint64_t end = atomic_load_explicit(&ring->written, memory_order_acquire);
+    uint64_t start = end > RING_SIZE ? end - RING_SIZE : 0;
+    for (uint64_t n = start; n < end; n++)
+        tmp[n - start] = ring->events[n & (RING_SIZE - 1)];
+    uint64_t now = atomic_load_explicit(&ring->written, memory_order_acquire);
+    uint64_t valid = now >= RING_SIZE ? now - RING_SIZE + 1 : 0;
+
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+               "\"tid\":%d,\"args\":{\"name\":", *first ? "" : ",\n", ring->tid);
+    write_json_string(f, ring->thread_name[0] ? ring->thread_name
+                                              : mp_tprintf(32, "thread %d", ring->tid));
+    fprintf(f, "}}");
+    *first = false;
+
+    int depth = 0;
+    for (uint64_t n = MPMAX(start, valid); n < end; n++) {
+        struct trace_event *ev = &tmp[n - start];
+        // Skip ends of spans whose start was dropped.
+        if (!ev->begin && !depth)
+            continue;
+        depth += ev->begin ? 1 : -1;
+        fprintf(f, ",\n{\"name\":");
+        write_json_string(f, ev->name);
+        fprintf(f, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                ev->begin ? "B" : "E", (ev->time_ns - t->start_ns) / 1e3,
+                ring->tid);
+    }
+}
+
+bool mp_trace_write(struct mp_trace *t, const char *filename)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return false;
+
+    struct trace_event *tmp = talloc_array(NULL, struct trace_event, RING_SIZE);
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    mp_mutex_lock(&t->lock);
+    for (int n = 0; n < t->num_rings; n++)
+        write_ring(t, t->rings[n], f, tmp, &first);
+    mp_mutex_unlock(&t->lock);
+    fprintf(f, "\n]}\n");
+
+    talloc_free(tmp);
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
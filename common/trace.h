@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+struct mp_trace;
+
+// Recorder for timed spans, which can be written as Chrome Trace Event JSON
+// (also readable by Perfetto). Each thread records into its own ring buffer,
+// so only the most recent events per thread are kept.
+struct mp_trace *mp_trace_create(void *ta_parent);
+
+// Record the start (begin=true) or end of a span for the current thread. The
+// name is prefix/name, or only name if prefix is NULL. Thread-safe.
+void mp_trace_span(struct mp_trace *t, const char *prefix, const char *name,
+                   bool begin);
+
+// Write all recorded events to the given file. Thread-safe, and can be called
+// while events are recorded. Returns success.
+bool mp_trace_write(struct mp_trace *t, const char *filename);
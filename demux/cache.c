@@ -17,10 +17,21 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "config.h"
+
+#if HAVE_POSIX
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+
+#include <libavutil/md5.h>
+
 #include "cache.h"
 #include "common/msg.h"
 #include "common/av_common.h"
@@ -35,6 +46,15 @@
 struct demux_cache_opts {
     char *cache_dir;
     int unlink_files;
+    int backend;
+    int64_t segment_size;
+    int64_t max_disk_bytes;
+    bool persist;
+};
+
+enum {
+    BACKEND_FILE,
+    BACKEND_SEGMENTS,
 };
 
 #define OPT_BASE_STRUCT struct demux_cache_opts
@@ -45,25 +65,61 @@ const struct m_sub_options demux_cache_conf = {
         {"demuxer-cache-unlink-files", OPT_CHOICE(unlink_files,
             {"immediate", 2}, {"whendone", 1}, {"no", 0}),
         },
+        {"demuxer-cache-backend", OPT_CHOICE(backend,
+            {"file", BACKEND_FILE}, {"segments", BACKEND_SEGMENTS})},
+        {"demuxer-cache-segment-size", OPT_BYTE_SIZE(segment_size),
+            M_RANGE(1024 * 1024, 1024 * 1024 * 1024)},
+        {"demuxer-cache-max-disk-bytes", OPT_BYTE_SIZE(max_disk_bytes),
+            M_RANGE(0, M_MAX_MEM_BYTES)},
+        {"demuxer-cache-persist", OPT_BOOL(persist)},
         {0}
     },
     .size = sizeof(struct demux_cache_opts),
     .defaults = &(const struct demux_cache_opts){
         .unlink_files = 2,
+        .segment_size = 64 * 1024 * 1024,
     },
     .change_flags = UPDATE_DEMUXER,
 };
 
+// A fixed-size, memory mapped file used by the "segments" backend. Packets
+// read from the cache reference the mapping directly, so a segment can outlive
+// the cache and is freed when the last reference goes away.
+struct cache_segment {
+    atomic_int refcount;
+    uint8_t *map;
+    size_t size;
+    int fd;
+    char *filename;     // set if the file must be deleted on destruction
+};
+
 struct demux_cache {
     struct mp_log *log;
     struct demux_packet_pool *packet_pool;
     struct demux_cache_opts *opts;
+    char *cache_dir;
 
+    // BACKEND_FILE
     char *filename;
+    char *index_filename;       // set if the cache is persistent
     bool need_unlink;
     int fd;
     int64_t file_pos;
     uint64_t file_size;
+
+    // BACKEND_SEGMENTS
+    // Positions returned by demux_cache_write() are byte offsets into the
+    // virtual concatenation of all segments ever created, so the segment
+    // holding a position is found with a single division.
+    struct cache_segment **segments; // oldest first
+    int num_segments;
+    uint64_t first_segment;     // sequence number of segments[0]
+    size_t write_offset;        // append position in the last segment
+    bool evicted;               // segments were dropped since last query
+    bool warned_too_large;
+    // See demux_cache_set_evict_cb().
+    bool (*can_evict)(void *ctx, uint64_t end_pos);
+    void *can_evict_ctx;
 };
 
 struct pkt_header {
@@ -77,6 +133,18 @@ struct sd_header {
     uint32_t len;
 };
 
+static void segment_unref(struct cache_segment *seg)
+{
+    if (atomic_fetch_sub(&seg->refcount, 1) > 1)
+        return;
+
+    munmap(seg->map, seg->size);
+    close(seg->fd);
+    if (seg->filename)
+        unlink(seg->filename);
+    talloc_free(seg);
+}
+
 static void cache_destroy(void *p)
 {
     struct demux_cache *cache = p;
@@ -84,17 +152,80 @@ static void cache_destroy(void *p)
     if (cache->fd >= 0)
         close(cache->fd);
 
+    for (int n = 0; n < cache->num_segments; n++)
+        segment_unref(cache->segments[n]);
+
     if (cache->need_unlink && cache->opts->unlink_files >= 1) {
         if (unlink(cache->filename))
             MP_ERR(cache, "Failed to delete cache temporary file.\n");
     }
 }
 
+// Open (or create) the cache file belonging to key, which is kept on disk
+// after the cache is destroyed. The file is locked for as long as the cache
+// exists, so that other instances can't append to it concurrently.
+static bool open_persistent(struct demux_cache *cache, const char *key)
+{
+#if HAVE_POSIX
+    uint8_t md5[16];
+    av_md5_sum(md5, key, strlen(key));
+    char *name = talloc_strdup(NULL, "mpv-cache-");
+    for (int i = 0; i < 16; i++)
+        name = talloc_asprintf_append(name, "%02X", md5[i]);
+
+    cache->filename = mp_path_join(cache, cache->cache_dir,
+                                   mp_tprintf(80, "%s.dat", name));
+    cache->index_filename = mp_path_join(cache, cache->cache_dir,
+                                         mp_tprintf(80, "%s.idx", name));
+    talloc_free(name);
+
+    cache->fd = open(cache->filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (cache->fd < 0) {
+        MP_ERR(cache, "Failed to open persistent cache file.\n");
+        goto fail;
+    }
+
+    if (flock(cache->fd, LOCK_EX | LOCK_NB)) {
+        if (errno == EWOULDBLOCK) {
+            MP_WARN(cache, "Persistent cache file is in use by another "
+                    "instance, using a temporary cache file.\n");
+        } else {
+            MP_ERR(cache, "Failed to lock persistent cache file: %s\n",
+                   mp_strerror(errno));
+        }
+        goto fail;
+    }
+
+    off_t size = lseek(cache->fd, 0, SEEK_END);
+    if (size == (off_t)-1) {
+        MP_ERR(cache, "Failed to seek in cache file.\n");
+        goto fail;
+    }
+    cache->file_pos = cache->file_size = size;
+
+    MP_VERBOSE(cache, "Using persistent cache file %s\n", cache->filename);
+    return true;
+
+fail:
+    if (cache->fd >= 0)
+        close(cache->fd);
+    cache->fd = -1;
+    TA_FREEP(&cache->filename);
+    TA_FREEP(&cache->index_filename);
+    return false;
+#else
+    MP_WARN(cache, "Persistent cache not supported on this platform.\n");
+    return false;
+#endif
+}
+
 // Create a cache. This also initializes the cache file from the options. The
-// log parameter must stay valid until demux_cache is destroyed.
+// log parameter must stay valid until demux_cache is destroyed. If key is not
+// NULL and --demuxer-cache-persist is enabled, the cache file is reused by
+// later caches created with the same key.
 // Free with talloc_free().
 struct demux_cache *demux_cache_create(struct mpv_global *global,
-                                       struct mp_log *log)
+                                       struct mp_log *log, const char *key)
 {
     struct demux_cache *cache = talloc_zero(NULL, struct demux_cache);
     talloc_set_destructor(cache, cache_destroy);
@@ -110,10 +241,23 @@ struct demux_cache *demux_cache_create(struct mpv_global *global,
         cache_dir = mp_find_user_file(NULL, global, "cache", "");
     }
 
+    talloc_steal(cache, cache_dir);
     if (!cache_dir || !cache_dir[0])
         goto fail;
 
     mp_mkdirp(cache_dir);
+    cache->cache_dir = cache_dir;
+
+    // Segment files are created lazily on the first write.
+    if (cache->opts->backend == BACKEND_SEGMENTS) {
+        if (cache->opts->persist)
+            MP_WARN(cache, "Persistent cache not supported with segments.\n");
+        return cache;
+    }
+
+    if (cache->opts->persist && key && open_persistent(cache, key))
+        return cache;
+
     cache->filename = mp_path_join(cache, cache_dir, "mpv-cache-XXXXXX.dat");
     cache->fd = mp_mkostemps(cache->filename, 4, O_CLOEXEC);
     if (cache->fd < 0) {
@@ -137,9 +281,77 @@ fail:
 
 uint64_t demux_cache_get_size(struct demux_cache *cache)
 {
+    if (cache->opts->backend == BACKEND_SEGMENTS)
+        return (uint64_t)cache->num_segments * cache->opts->segment_size;
     return cache->file_size;
 }
 
+// Return whether the cache file outlives this cache instance. Only then the
+// demux_cache_*_index() functions can be used.
+bool demux_cache_is_persistent(struct demux_cache *cache)
+{
+    return !!cache->index_filename;
+}
+
+// Read the sidecar index written by demux_cache_save_index(). Returns an empty
+// bstr if there is none. The format of the data is up to the caller.
+struct bstr demux_cache_load_index(struct demux_cache *cache, void *talloc_ctx)
+{
+    mp_assert(cache->index_filename);
+
+    struct bstr res = {0};
+    FILE *f = fopen(cache->index_filename, "rb");
+    if (!f)
+        return res;
+
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0 && st.st_size < INT_MAX) {
+        res.start = talloc_size(talloc_ctx, st.st_size);
+        res.len = fread(res.start, 1, st.st_size, f);
+    }
+    fclose(f);
+    return res;
+}
+
+// Atomically replace the sidecar index with the given data.
+bool demux_cache_save_index(struct demux_cache *cache, void *data, size_t size)
+{
+    mp_assert(cache->index_filename);
+
+    if (!mp_save_to_file(cache->index_filename, data, size)) {
+        MP_ERR(cache, "Failed to write cache index file.\n");
+        return false;
+    }
+    return true;
+}
+
+// Set a callback that is asked before a segment is evicted. end_pos is the
+// position after the segment's last byte; if the callback returns false, the
+// segment and all newer ones are kept, even if that exceeds the size limit.
+void demux_cache_set_evict_cb(struct demux_cache *cache,
+                              bool (*cb)(void *ctx, uint64_t end_pos), void *ctx)
+{
+    cache->can_evict = cb;
+    cache->can_evict_ctx = ctx;
+}
+
+// Return whether segments were evicted since the last call. If so, packets
+// whose position is rejected by demux_cache_is_valid() should be discarded.
+bool demux_cache_take_evicted(struct demux_cache *cache)
+{
+    bool evicted = cache->evicted;
+    cache->evicted = false;
+    return evicted;
+}
+
+// Return whether pos (as returned by demux_cache_write()) can still be read.
+bool demux_cache_is_valid(struct demux_cache *cache, uint64_t pos)
+{
+    if (cache->opts->backend != BACKEND_SEGMENTS)
+        return true;
+    return pos / cache->opts->segment_size >= cache->first_segment;
+}
+
 static bool do_seek(struct demux_cache *cache, uint64_t pos)
 {
     if (cache->file_pos == pos)
@@ -200,6 +412,216 @@ static bool read_raw(struct demux_cache *cache, void *ptr, size_t len)
     return true;
 }
 
+// Every record in a segment is a pkt_header, the packet data, zeroed input
+// padding, and the side data entries. Records start on an aligned offset.
+#define SEG_ALIGN 16
+#define SEG_HEADER_SIZE MP_ALIGN_UP(sizeof(struct pkt_header), SEG_ALIGN)
+
+static size_t segment_record_size(struct demux_packet *dp)
+{
+    size_t size = SEG_HEADER_SIZE + dp->len + AV_INPUT_BUFFER_PADDING_SIZE;
+    for (int n = 0; n < dp->avpacket->side_data_elems; n++)
+        size += sizeof(struct sd_header) + dp->avpacket->side_data[n].size;
+    return MP_ALIGN_UP(size, SEG_ALIGN);
+}
+
+static void segment_buffer_free(void *opaque, uint8_t *data)
+{
+    segment_unref(opaque);
+}
+
+static void evict_segment(struct demux_cache *cache)
+{
+    mp_assert(cache->num_segments > 0);
+
+    segment_unref(cache->segments[0]);
+    MP_TARRAY_REMOVE_AT(cache->segments, cache->num_segments, 0);
+    cache->first_segment += 1;
+    cache->evicted = true;
+}
+
+static struct cache_segment *new_segment(struct demux_cache *cache)
+{
+    size_t size = cache->opts->segment_size;
+
+    if (cache->opts->max_disk_bytes) {
+        while (cache->num_segments &&
+               (cache->num_segments + 1) * size > cache->opts->max_disk_bytes)
+        {
+            uint64_t end_pos = (cache->first_segment + 1) * size;
+            if (cache->can_evict &&
+                !cache->can_evict(cache->can_evict_ctx, end_pos))
+                break;
+            evict_segment(cache);
+        }
+    }
+
+    struct cache_segment *seg = talloc_zero(NULL, struct cache_segment);
+    seg->size = size;
+    seg->map = MAP_FAILED;
+    seg->filename = mp_path_join(seg, cache->cache_dir, "mpv-cache-XXXXXX.seg");
+    seg->fd = mp_mkostemps(seg->filename, 4, O_CLOEXEC);
+    if (seg->fd < 0) {
+        MP_ERR(cache, "Failed to create cache segment file.\n");
+        goto fail;
+    }
+
+    if (cache->opts->unlink_files >= 2) {
+        if (unlink(seg->filename))
+            MP_ERR(cache, "Failed to unlink cache segment file after creation.\n");
+        TA_FREEP(&seg->filename);
+    } else if (cache->opts->unlink_files == 0) {
+        TA_FREEP(&seg->filename);
+    }
+
+    // A freshly extended file reads as zeros, so nothing needs to be cleared.
+    if (ftruncate(seg->fd, size)) {
+        MP_ERR(cache, "Failed to resize cache segment file: %s\n",
+               mp_strerror(errno));
+        goto fail;
+    }
+
+    seg->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        MP_ERR(cache, "Failed to map cache segment file: %s\n",
+               mp_strerror(errno));
+        goto fail;
+    }
+
+    atomic_init(&seg->refcount, 1);
+    MP_TARRAY_APPEND(cache, cache->segments, cache->num_segments, seg);
+    cache->write_offset = 0;
+    return seg;
+
+fail:
+    if (seg->fd >= 0) {
+        close(seg->fd);
+        if (seg->filename)
+            unlink(seg->filename);
+    }
+    talloc_free(seg);
+    return NULL;
+}
+
+static int64_t segments_write(struct demux_cache *cache, struct demux_packet *dp)
+{
+    size_t size = segment_record_size(dp);
+    if (size > cache->opts->segment_size) {
+        // The caller keeps such packets in memory, so this is not an error.
+        if (!cache->warned_too_large)
+            MP_WARN(cache, "Packet too large for cache segment, keeping it in memory.\n");
+        cache->warned_too_large = true;
+        return -1;
+    }
+
+    if (!cache->num_segments || cache->write_offset + size > cache->opts->segment_size) {
+        if (!new_segment(cache))
+            return -1;
+    }
+
+    struct cache_segment *seg = cache->segments[cache->num_segments - 1];
+    uint8_t *rec = seg->map + cache->write_offset;
+
+    struct pkt_header hd = {
+        .data_len  = dp->len,
+        .av_flags = dp->avpacket->flags,
+        .num_sd = dp->avpacket->side_data_elems,
+    };
+    memcpy(rec, &hd, sizeof(hd));
+
+    uint8_t *p = rec + SEG_HEADER_SIZE;
+    memcpy(p, dp->buffer, dp->len);
+    p += dp->len;
+    memset(p, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    p += AV_INPUT_BUFFER_PADDING_SIZE;
+
+    // See demux_cache_write() for why dumping side data like this is "fine".
+    for (int n = 0; n < dp->avpacket->side_data_elems; n++) {
+        AVPacketSideData *sd = &dp->avpacket->side_data[n];
+
+        mp_assert(sd->size <= INT32_MAX);
+        mp_assert(sd->type >= 0 && sd->type <= INT32_MAX);
+
+        struct sd_header sd_hd = {
+            .av_type = sd->type,
+            .len = sd->size,
+        };
+        memcpy(p, &sd_hd, sizeof(sd_hd));
+        p += sizeof(sd_hd);
+        memcpy(p, sd->data, sd->size);
+        p += sd->size;
+    }
+
+    uint64_t seq = cache->first_segment + cache->num_segments - 1;
+    int64_t pos = seq * cache->opts->segment_size + cache->write_offset;
+    cache->write_offset += size;
+    return pos;
+}
+
+static struct demux_packet *segments_read(struct demux_cache *cache, uint64_t pos)
+{
+    uint64_t seq = pos / cache->opts->segment_size;
+    size_t offset = pos % cache->opts->segment_size;
+
+    if (seq < cache->first_segment ||
+        seq - cache->first_segment >= cache->num_segments)
+    {
+        MP_ERR(cache, "Packet was evicted from cache.\n");
+        return NULL;
+    }
+
+    struct cache_segment *seg = cache->segments[seq - cache->first_segment];
+    uint8_t *rec = seg->map + offset;
+
+    struct pkt_header hd;
+    memcpy(&hd, rec, sizeof(hd));
+
+    if (offset + SEG_HEADER_SIZE + hd.data_len > seg->size)
+        return NULL;
+
+    // The packet references the mapped bytes directly. The segment stays
+    // mapped until the last such packet is freed, even if it is evicted.
+    atomic_fetch_add(&seg->refcount, 1);
+    AVBufferRef *buf = av_buffer_create(rec + SEG_HEADER_SIZE, hd.data_len,
+                                        segment_buffer_free, seg,
+                                        AV_BUFFER_FLAG_READONLY);
+    if (!buf) {
+        segment_unref(seg);
+        return NULL;
+    }
+
+    struct demux_packet *dp = new_demux_packet_from_buf(cache->packet_pool, buf);
+    av_buffer_unref(&buf);
+    if (!dp)
+        return NULL;
+
+    dp->avpacket->flags = hd.av_flags;
+
+    uint8_t *p = rec + SEG_HEADER_SIZE + hd.data_len + AV_INPUT_BUFFER_PADDING_SIZE;
+    for (uint32_t n = 0; n < hd.num_sd; n++) {
+        struct sd_header sd_hd;
+        memcpy(&sd_hd, p, sizeof(sd_hd));
+        p += sizeof(sd_hd);
+
+        if (sd_hd.len > INT_MAX || p + sd_hd.len > seg->map + seg->size)
+            goto fail;
+
+        uint8_t *sd = av_packet_new_side_data(dp->avpacket, sd_hd.av_type,
+                                              sd_hd.len);
+        if (!sd)
+            goto fail;
+
+        memcpy(sd, p, sd_hd.len);
+        p += sd_hd.len;
+    }
+
+    return dp;
+
+fail:
+    talloc_free(dp);
+    return NULL;
+}
+
 // Serialize a packet to the cache file. Returns the packet position, which can
 // be passed to demux_cache_read() to read the packet again.
 // Returns a negative value on errors, i.e. writing the file failed.
@@ -222,6 +644,9 @@ int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *dp)
     mp_assert(dp->avpacket->side_data_elems >= 0 &&
            dp->avpacket->side_data_elems <= INT32_MAX);
 
+    if (cache->opts->backend == BACKEND_SEGMENTS)
+        return segments_write(cache, dp);
+
     if (!do_seek(cache, cache->file_size))
         return -1;
 
@@ -288,6 +713,9 @@ fail:
 
 struct demux_packet *demux_cache_read(struct demux_cache *cache, uint64_t pos)
 {
+    if (cache->opts->backend == BACKEND_SEGMENTS)
+        return segments_read(cache, pos);
+
     if (!do_seek(cache, pos))
         return NULL;
 
@@ -329,3 +757,96 @@ fail:
     talloc_free(dp);
     return NULL;
 }
+
+// Cut the persistent cache file to size bytes, which discards all packets
+// written after that position.
+bool demux_cache_truncate(struct demux_cache *cache, uint64_t size)
+{
+    mp_assert(cache->index_filename);
+    mp_assert(size <= cache->file_size);
+
+    if (ftruncate(cache->fd, size)) {
+        MP_ERR(cache, "Failed to truncate cache file: %s\n", mp_strerror(errno));
+        return false;
+    }
+    cache->file_size = size;
+    cache->file_pos = -1;
+    return true;
+}
+
+// Replace the persistent cache file with a new file that contains only the
+// given packets, in this order. On success, their positions are updated to
+// point into the new file. On failure, the old file is still used.
+bool demux_cache_compact(struct demux_cache *cache, struct demux_packet **pkts,
+                         size_t num_pkts)
+{
+    mp_assert(cache->index_filename);
+
+    bool ok = false;
+    void *tmp = talloc_new(NULL);
+    uint64_t *new_pos = talloc_array(tmp, uint64_t, num_pkts);
+    int old_fd = cache->fd;
+    uint64_t old_size = cache->file_size;
+
+    char *filename = mp_path_join(tmp, cache->cache_dir, "mpv-cache-XXXXXX.tmp");
+    int fd = mp_mkostemps(filename, 4, O_CLOEXEC);
+    if (fd < 0) {
+        MP_ERR(cache, "Failed to create cache temporary file.\n");
+        goto done;
+    }
+
+#if HAVE_POSIX
+    // Nobody else can open the new file before the rename, so this succeeds.
+    flock(fd, LOCK_EX | LOCK_NB);
+#endif
+
+    uint64_t new_size = 0;
+    for (size_t n = 0; n < num_pkts; n++) {
+        mp_assert(pkts[n]->is_cached);
+
+        cache->fd = old_fd;
+        cache->file_size = old_size;
+        cache->file_pos = -1;
+        struct demux_packet *dp = demux_cache_read(cache, pkts[n]->cached_data.pos);
+
+        cache->fd = fd;
+        cache->file_size = new_size;
+        cache->file_pos = -1;
+        int64_t pos = dp ? demux_cache_write(cache, dp) : -1;
+        new_size = cache->file_size;
+        talloc_free(dp);
+
+        if (pos < 0)
+            goto done;
+        new_pos[n] = pos;
+    }
+
+    // The old index refers to the old file; don't leave it behind if the
+    // player dies before writing the new one.
+    unlink(cache->index_filename);
+    if (rename(filename, cache->filename)) {
+        MP_ERR(cache, "Failed to replace cache file: %s\n", mp_strerror(errno));
+        goto done;
+    }
+
+    for (size_t n = 0; n < num_pkts; n++)
+        pkts[n]->cached_data.pos = new_pos[n];
+
+    MP_VERBOSE(cache, "Compacted cache file from %"PRIu64" to %"PRIu64" bytes.\n",
+               old_size, new_size);
+    close(old_fd);
+    fd = -1;
+    cache->file_size = new_size;
+    ok = true;
+
+done:
+    if (fd >= 0) {
+        close(fd);
+        unlink(filename);
+        cache->fd = old_fd;
+        cache->file_size = old_size;
+    }
+    cache->file_pos = -1;
+    talloc_free(tmp);
+    return ok;
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "misc/bstr.h"
+
 struct demux_packet;
 struct mp_log;
 struct mpv_global;
@@ -9,8 +12,18 @@ struct mpv_global;
 struct demux_cache;
 
 struct demux_cache *demux_cache_create(struct mpv_global *global,
-                                       struct mp_log *log);
+                                       struct mp_log *log, const char *key);
 
 int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *pkt);
 struct demux_packet *demux_cache_read(struct demux_cache *cache, uint64_t pos);
 uint64_t demux_cache_get_size(struct demux_cache *cache);
+bool demux_cache_is_persistent(struct demux_cache *cache);
+struct bstr demux_cache_load_index(struct demux_cache *cache, void *talloc_ctx);
+bool demux_cache_save_index(struct demux_cache *cache, void *data, size_t size);
+bool demux_cache_truncate(struct demux_cache *cache, uint64_t size);
+bool demux_cache_compact(struct demux_cache *cache, struct demux_packet **pkts,
+                         size_t num_pkts);
+void demux_cache_set_evict_cb(struct demux_cache *cache,
+                              bool (*cb)(void *ctx, uint64_t end_pos), void *ctx);
+bool demux_cache_take_evicted(struct demux_cache *cache);
+bool demux_cache_is_valid(struct demux_cache *cache, uint64_t pos);
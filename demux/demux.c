@@ -37,6 +37,7 @@
 #include "common/global.h"
 #include "common/recorder.h"
 #include "common/stats.h"
+#include "common/version.h"
 #include "misc/charset_conv.h"
 #include "misc/thread_tools.h"
 #include "osdep/timer.h"
@@ -155,6 +156,7 @@ struct demux_internal {
     struct mpv_global *global;
     struct demux_packet_pool *packet_pool;
     struct stats_ctx *stats;
+    struct stat_entry *stat_ring_hit, *stat_lock_contended;
 
     bool can_cache;             // not a slave demuxer; caching makes sense
     bool can_record;            // stream recording is allowed
@@ -190,6 +192,8 @@ struct demux_internal {
     int events;
 
     struct demux_cache *cache;
+    bool cache_index_pending;   // persistent cache index not loaded yet
+    uint64_t cache_index_size;  // cache file size the loaded index refers to
 
     bool warned_queue_overflow;
     bool eof;                   // whether we're in EOF state
@@ -280,6 +284,19 @@ struct demux_internal {
     int64_t hack_unbuffered_read_bytes;  // for demux_get_bytes_read_hack()
     int64_t cache_unbuffered_read_bytes; // for demux_reader_state.bytes_per_second
     int64_t byte_level_seeks;            // for demux_reader_state.byte_level_seeks
+
+    // for demux_reader_state.index_lookups/index_lookup_steps
+    uint64_t index_lookups;
+    uint64_t index_lookup_steps;
+
+    // for demux_reader_state.reader_lock_contended (incremented unlocked)
+    _Atomic uint64_t reader_lock_contended;
+
+    // Packets removed from the cache, but not yet returned to the packet pool.
+    // See take_pruned_packets().
+    struct pruned_packets {
+        struct demux_packet *head, *tail;
+    } pruned;
 };
 
 struct timed_metadata {
@@ -306,22 +323,22 @@ struct demux_cached_range {
     int num_metadata;
 };
 
-#define QUEUE_INDEX_SIZE_MASK(queue) ((queue)->index_size - 1)
-
-// Access the idx-th entry in the given demux_queue.
-// Requirement: idx >= 0 && idx < queue->num_index
-#define QUEUE_INDEX_ENTRY(queue, idx) \
-    ((queue)->index[((queue)->index0 + (idx)) & QUEUE_INDEX_SIZE_MASK(queue)])
-
-// Don't index packets whose timestamps that are within the last index entry by
-// this amount of time (it's better to seek them manually).
-#define INDEX_STEP_SIZE 1.0
+// Number of keyframe entries per index block.
+#define INDEX_BLOCK_SIZE 256
 
 struct index_entry {
     double pts;
     struct demux_packet *pkt;
 };
 
+// A run of consecutive keyframe entries. Entries are only appended at the end
+// of the last block, and removed from the start of the first block, so all
+// blocks except the first and last are always full.
+struct index_block {
+    struct index_entry entries[INDEX_BLOCK_SIZE];
+    int start, end;         // valid entries are entries[start..end)
+};
+
 // A continuous list of cached packets for a single stream/range. There is one
 // for each stream and range. Also contains some state for use during demuxing
 // (keeping it across seeks makes it easier to resume demuxing).
@@ -352,11 +369,28 @@ struct demux_queue {
     bool is_bof;            // started demuxing at beginning of file
     bool is_eof;            // received true EOF here
 
-    // Complete index, though it may skip some entries to reduce density.
-    struct index_entry *index;  // ring buffer
-    size_t index_size;          // size of index[] (0 or a power of 2)
-    size_t index0;              // first index entry
-    size_t num_index;           // number of index entries (wraps on index_size)
+    // Index of all keyframes with known timestamps. This is a two-level
+    // structure: seeking searches the blocks by their first entry, and then
+    // the dense entry array within the block.
+    struct index_block **index; // index[index0..num_index_blocks) are used
+    size_t num_index_blocks;
+    size_t index0;              // first used block
+    size_t num_index;           // number of index entries in all blocks
+};
+
+// Number of packets that can be handed to the reader without locking.
+// Must be a power of 2.
+#define READER_RING_SIZE 8
+
+struct reader_ring_entry {
+    struct demux_packet *pkt;
+    uint64_t gen;
+    // For the effects of returning the packet, which are applied only once
+    // the reader has taken it.
+    double ts;
+    size_t len;
+    bool keyframe;
+    int64_t stream_size;
 };
 
 struct demux_stream {
@@ -433,6 +467,17 @@ struct demux_stream {
     // for closed captions (demuxer_feed_caption)
     struct sh_stream *cc;
     bool ignore_eof;        // ignore stream in underrun detection
+
+    // Single-producer/single-consumer ring of packets already dequeued for the
+    // reader. The producer is whoever holds in->lock, the consumer is the
+    // reader, which pops packets without taking the lock. Entries from before
+    // the last reader state reset are stale and discarded by the consumer.
+    struct reader_ring_entry ring[READER_RING_SIZE];
+    atomic_size_t ring_read;
+    atomic_size_t ring_write;
+    _Atomic uint64_t ring_gen;
+    bool ring_active;       // reader read since last reset; prefetch for it
+    size_t ring_applied;    // entries before this were accounted (in->lock)
 };
 
 static void switch_to_fresh_cache_range(struct demux_internal *in);
@@ -450,6 +495,10 @@ static void find_backward_restart_pos(struct demux_stream *ds);
 static struct demux_packet *find_seek_target(struct demux_queue *queue,
                                              double pts, int flags);
 static void prune_old_packets(struct demux_internal *in);
+static void prune_evicted_packets(struct demux_internal *in);
+static bool fill_reader_rings(struct demux_internal *in);
+static void save_cache_index(struct demux_internal *in);
+static void load_cache_index(struct demux_internal *in);
 static void dumper_close(struct demux_internal *in);
 static void demux_convert_tags_charset(struct demuxer *demuxer);
 
@@ -460,6 +509,15 @@ static uint64_t get_forward_buffered_bytes(struct demux_stream *ds)
     return ds->queue->tail_cum_pos - ds->reader_head->cum_pos;
 }
 
+// Access the idx-th entry in the given demux_queue's index.
+// Requirement: idx >= 0 && idx < queue->num_index
+static struct index_entry *index_entry_at(struct demux_queue *queue, size_t idx)
+{
+    idx += queue->index[queue->index0]->start;
+    struct index_block *block = queue->index[queue->index0 + idx / INDEX_BLOCK_SIZE];
+    return &block->entries[idx % INDEX_BLOCK_SIZE];
+}
+
 #if 0
 // very expensive check for redundant cached queue state
 static void check_queue_consistency(struct demux_internal *in)
@@ -505,7 +563,7 @@ static void check_queue_consistency(struct demux_internal *in)
                     mp_assert(queue->tail == dp);
 
                 if (next_index < queue->num_index &&
-                    QUEUE_INDEX_ENTRY(queue, next_index).pkt == dp)
+                    index_entry_at(queue, next_index)->pkt == dp)
                     next_index += 1;
             }
             if (!queue->head)
@@ -536,7 +594,8 @@ static void check_queue_consistency(struct demux_internal *in)
             if (queue->keyframe_latest)
                 mp_assert(queue->keyframe_latest->keyframe);
 
-            total_bytes += queue->index_size * sizeof(struct index_entry);
+            total_bytes += (queue->num_index_blocks - queue->index0) *
+                           sizeof(struct index_block);
         }
 
         // Invariant needed by pruning; violation has worse effects than just
@@ -681,31 +740,92 @@ broken:
     prune_metadata(range);
 }
 
-// Remove queue->head from the queue.
-static void remove_head_packet(struct demux_queue *queue)
+static void remove_first_index_entry(struct demux_queue *queue)
 {
-    struct demux_packet *dp = queue->head;
+    struct demux_internal *in = queue->ds->in;
+    struct index_block *block = queue->index[queue->index0];
+
+    block->start += 1;
+    queue->num_index -= 1;
+    if (block->start < block->end)
+        return;
 
-    mp_assert(queue->ds->reader_head != dp);
-    if (queue->keyframe_first == dp)
+    talloc_free(block);
+    in->total_bytes -= sizeof(struct index_block);
+    queue->index0 += 1;
+
+    // Compact the block list once the unused part dominates it.
+    size_t used = queue->num_index_blocks - queue->index0;
+    if (queue->index0 > used) {
+        memmove(queue->index, queue->index + queue->index0,
+                used * sizeof(queue->index[0]));
+        queue->num_index_blocks = used;
+        queue->index0 = 0;
+    }
+}
+
+// Remove all packets from queue->head up to and including last from the queue.
+// The packets are only freed with the next take_pruned_packets() and
+// release_pruned_packets(). Apart from removing index entries, this does not
+// need to visit the removed packets: their cum_pos values are enough to check
+// which queue state is affected.
+static void remove_head_packets(struct demux_queue *queue,
+                                struct demux_packet *last)
+{
+    struct demux_internal *in = queue->ds->in;
+    struct demux_packet *head = queue->head;
+    struct demux_packet *end = last->next;
+
+    uint64_t end_pos = end ? end->cum_pos : queue->tail_cum_pos;
+    mp_assert(queue->ds->reader_head != head);
+
+    if (queue->keyframe_first && queue->keyframe_first->cum_pos < end_pos)
         queue->keyframe_first = NULL;
-    if (queue->keyframe_latest == dp)
+    if (queue->keyframe_latest && queue->keyframe_latest->cum_pos < end_pos)
         queue->keyframe_latest = NULL;
     queue->is_bof = false;
 
-    uint64_t end_pos = dp->next ? dp->next->cum_pos : queue->tail_cum_pos;
-    queue->ds->in->total_bytes -= end_pos - dp->cum_pos;
+    in->total_bytes -= end_pos - head->cum_pos;
 
-    if (queue->num_index && queue->index[queue->index0].pkt == dp) {
-        queue->index0 = (queue->index0 + 1) & QUEUE_INDEX_SIZE_MASK(queue);
-        queue->num_index -= 1;
-    }
+    while (queue->num_index && index_entry_at(queue, 0)->pkt->cum_pos < end_pos)
+        remove_first_index_entry(queue);
+
+    last->next = NULL;
 
-    queue->head = dp->next;
+    queue->head = end;
     if (!queue->head)
         queue->tail = NULL;
 
-    demux_packet_pool_push(queue->ds->in->packet_pool, dp);
+    if (in->pruned.tail) {
+        in->pruned.tail->next = head;
+    } else {
+        in->pruned.head = head;
+    }
+    in->pruned.tail = last;
+}
+
+// Remove queue->head from the queue.
+static void remove_head_packet(struct demux_queue *queue)
+{
+    remove_head_packets(queue, queue->head);
+}
+
+// Must be called locked. Return the packets removed by remove_head_packets()
+// since the last call. Returning them to the packet pool can take a while with
+// large batches, so the caller should use release_pruned_packets() after
+// unlocking in->lock.
+static struct pruned_packets take_pruned_packets(struct demux_internal *in)
+{
+    struct pruned_packets res = in->pruned;
+    in->pruned = (struct pruned_packets){0};
+    return res;
+}
+
+// Can be called unlocked.
+static void release_pruned_packets(struct demux_internal *in,
+                                   struct pruned_packets pruned)
+{
+    demux_packet_pool_prepend(in->packet_pool, pruned.head, pruned.tail);
 }
 
 static void free_index(struct demux_queue *queue)
@@ -713,8 +833,11 @@ static void free_index(struct demux_queue *queue)
     struct demux_stream *ds = queue->ds;
     struct demux_internal *in = ds->in;
 
-    in->total_bytes -= queue->index_size * sizeof(queue->index[0]);
-    queue->index_size = 0;
+    for (size_t n = queue->index0; n < queue->num_index_blocks; n++) {
+        in->total_bytes -= sizeof(struct index_block);
+        talloc_free(queue->index[n]);
+    }
+    queue->num_index_blocks = 0;
     queue->index0 = 0;
     queue->num_index = 0;
     TA_FREEP(&queue->index);
@@ -798,6 +921,10 @@ static void free_empty_cached_ranges(struct demux_internal *in)
 
 static void ds_clear_reader_queue_state(struct demux_stream *ds)
 {
+    // Invalidate packets prefetched for the old reader position.
+    atomic_fetch_add(&ds->ring_gen, 1);
+    ds->ring_active = false;
+
     ds->reader_head = NULL;
     ds->eof = false;
     ds->need_wakeup = true;
@@ -899,6 +1026,13 @@ static void update_stream_selection_state(struct demux_internal *in,
 
     ds_clear_reader_state(ds, true);
 
+    // Restored ranges are dropped if no stream contributes to their seek range,
+    // so they can only be loaded once streams are selected.
+    if (in->cache_index_pending && ds->selected) {
+        in->cache_index_pending = false;
+        load_cache_index(in);
+    }
+
     // Make sure any stream reselection or addition is reflected in the seek
     // ranges, and also get rid of data that is not needed anymore (or
     // rather, which can't be kept consistent). This has to happen after we've
@@ -1082,6 +1216,10 @@ static void demux_shutdown(struct demux_internal *in)
     demuxer->priv = NULL;
     in->d_thread->priv = NULL;
 
+    if (in->cache && demux_cache_is_persistent(in->cache) &&
+        !in->cache_index_pending)
+        save_cache_index(in);
+
     demux_flush(demuxer);
     mp_assert(in->total_bytes == 0);
 
@@ -1098,8 +1236,14 @@ static void demux_shutdown(struct demux_internal *in)
 
 static void demux_dealloc(struct demux_internal *in)
 {
-    for (int n = 0; n < in->num_streams; n++)
+    for (int n = 0; n < in->num_streams; n++) {
+        struct demux_stream *ds = in->streams[n]->ds;
+        size_t end = atomic_load(&ds->ring_write);
+        for (size_t i = atomic_load(&ds->ring_read); i < end; i++)
+            talloc_free(ds->ring[i & (READER_RING_SIZE - 1)].pkt);
         talloc_free(in->streams[n]);
+    }
+    release_pruned_packets(in, take_pruned_packets(in));
     mp_mutex_destroy(&in->lock);
     mp_cond_destroy(&in->wakeup);
     talloc_free(in->d_user);
@@ -1601,37 +1745,23 @@ static void add_index_entry(struct demux_queue *queue, struct demux_packet *dp,
 
     mp_assert(dp->keyframe && pts != MP_NOPTS_VALUE);
 
-    if (queue->num_index > 0) {
-        struct index_entry *last = &QUEUE_INDEX_ENTRY(queue, queue->num_index - 1);
-        if (pts - last->pts < INDEX_STEP_SIZE)
-            return;
-    }
+    struct index_block *block = NULL;
+    if (queue->index0 < queue->num_index_blocks)
+        block = queue->index[queue->num_index_blocks - 1];
 
-    if (queue->num_index == queue->index_size) {
-        // Needs to honor power-of-2 requirement.
-        size_t new_size = MPMAX(128, queue->index_size * 2);
-        mp_assert(!(new_size & (new_size - 1)));
-        MP_DBG(in, "stream %d: resize index to %zu\n", queue->ds->index,
-               new_size);
-        // Note: we could tolerate allocation failure, and just discard the
-        // entire index (and prevent the index from being recreated).
-        MP_RESIZE_ARRAY(NULL, queue->index, new_size);
-        size_t highest_index = queue->index0 + queue->num_index;
-        for (size_t n = queue->index_size; n < highest_index; n++)
-            queue->index[n] = queue->index[n - queue->index_size];
-        in->total_bytes +=
-            (new_size - queue->index_size) * sizeof(queue->index[0]);
-        queue->index_size = new_size;
+    if (!block || block->end == INDEX_BLOCK_SIZE) {
+        // Existing entries are never moved, only the block list grows.
+        block = talloc_ptrtype(NULL, block);
+        block->start = block->end = 0;
+        MP_TARRAY_APPEND(NULL, queue->index, queue->num_index_blocks, block);
+        in->total_bytes += sizeof(struct index_block);
     }
 
-    mp_assert(queue->num_index < queue->index_size);
-
-    queue->num_index += 1;
-
-    QUEUE_INDEX_ENTRY(queue, queue->num_index - 1) = (struct index_entry){
+    block->entries[block->end++] = (struct index_entry){
         .pts = pts,
         .pkt = dp,
     };
+    queue->num_index += 1;
 }
 
 // Check whether the next range in the list is, and if it appears to overlap,
@@ -1786,7 +1916,7 @@ static void attempt_range_joining(struct demux_internal *in)
 
         // And update the index with packets from q2.
         for (size_t i = 0; i < q2->num_index; i++) {
-            struct index_entry *e = &QUEUE_INDEX_ENTRY(q2, i);
+            struct index_entry *e = index_entry_at(q2, i);
             add_index_entry(q1, e->pkt, e->pts);
         }
         free_index(q2);
@@ -1862,10 +1992,10 @@ static struct demux_packet *compute_keyframe_times(struct demux_packet *pkt,
 // This has to deal with a number of corner cases, such as demuxers potentially
 // starting output at non-keyframes.
 // Can join seek ranges, which messes with in->current_range and all.
-static void adjust_seek_range_on_packet(struct demux_stream *ds,
-                                        struct demux_packet *dp)
+static void adjust_queue_seek_range(struct demux_queue *queue,
+                                    struct demux_packet *dp)
 {
-    struct demux_queue *queue = ds->queue;
+    struct demux_stream *ds = queue->ds;
 
     if (!ds->in->seekable_cache)
         return;
@@ -1917,6 +2047,12 @@ static void adjust_seek_range_on_packet(struct demux_stream *ds,
     }
 }
 
+static void adjust_seek_range_on_packet(struct demux_stream *ds,
+                                        struct demux_packet *dp)
+{
+    adjust_queue_seek_range(ds->queue, dp);
+}
+
 static struct mp_recorder *recorder_create(struct demux_internal *in,
                                            const char *dst)
 {
@@ -2050,10 +2186,14 @@ static void add_packet_locked(struct sh_stream *stream, demux_packet_t *dp)
     if (in->cache && in->d_user->opts->disk_cache && !dp->is_wrapped_avframe) {
         int64_t pos = demux_cache_write(in->cache, dp);
         if (pos >= 0) {
+            size_t len = dp->len;
             demux_packet_unref_contents(dp);
             dp->is_cached = true;
             dp->cached_data.pos = pos;
+            dp->len = len;
         }
+        if (demux_cache_take_evicted(in->cache))
+            prune_evicted_packets(in);
     }
 
     queue->correct_pos &= dp->pos >= 0 && dp->pos > queue->last_pos;
@@ -2254,8 +2394,11 @@ static bool read_packet(struct demux_internal *in)
     in->reading = true;
     in->after_seek = false;
     in->after_seek_to_start = false;
+    struct pruned_packets pruned = take_pruned_packets(in);
     mp_mutex_unlock(&in->lock);
 
+    release_pruned_packets(in, pruned);
+
     struct demuxer *demux = in->d_thread;
     struct demux_packet *pkt = NULL;
 
@@ -2289,6 +2432,100 @@ static bool read_packet(struct demux_internal *in)
     return true;
 }
 
+// Recompute the seekable start of the queue after its first keyframe was
+// pruned, and update the range if needed.
+static void update_pruned_queue(struct demux_queue *queue)
+{
+    struct demux_cached_range *range = queue->range;
+
+    mp_assert(!queue->keyframe_first); // it was just deleted, supposedly
+
+    queue->keyframe_first = queue->head;
+    // (May happen if reader_head stopped pruning the range, and there's
+    // no next range.)
+    while (queue->keyframe_first && !queue->keyframe_first->keyframe)
+        queue->keyframe_first = queue->keyframe_first->next;
+
+    if (queue->seek_start != MP_NOPTS_VALUE)
+        queue->last_pruned = queue->seek_start;
+
+    double kf_min;
+    compute_keyframe_times(queue->keyframe_first, &kf_min, NULL);
+
+    bool update_range = true;
+
+    queue->seek_start = kf_min;
+
+    if (queue->seek_start != MP_NOPTS_VALUE) {
+        queue->seek_start += queue->ds->sh->seek_preroll;
+
+        // Don't need to update if the new start is still before the
+        // range's start (or if the range was undefined anyway).
+        if (range->seek_start == MP_NOPTS_VALUE ||
+            queue->seek_start <= range->seek_start)
+        {
+            update_range = false;
+        }
+    }
+
+    if (update_range)
+        update_seek_ranges(range);
+}
+
+// Drop packets whose data was evicted from the disk cache. Packets are written
+// to the cache in queue order, so they can only be at the start of a queue,
+// and cache_can_evict() keeps segments with packets at or after reader_head.
+static void prune_evicted_packets(struct demux_internal *in)
+{
+    for (int n = 0; n < in->num_ranges; n++) {
+        struct demux_cached_range *range = in->ranges[n];
+
+        for (int i = 0; i < range->num_streams; i++) {
+            struct demux_queue *queue = range->streams[i];
+            bool kf_was_pruned = false;
+            struct demux_packet *last = NULL;
+
+            for (struct demux_packet *dp = queue->head;
+                 dp && dp != queue->ds->reader_head && dp->is_cached &&
+                 !demux_cache_is_valid(in->cache, dp->cached_data.pos);
+                 dp = dp->next)
+            {
+                kf_was_pruned |= dp == queue->keyframe_first;
+                last = dp;
+            }
+
+            if (last)
+                remove_head_packets(queue, last);
+
+            if (kf_was_pruned)
+                update_pruned_queue(queue);
+        }
+    }
+
+    free_empty_cached_ranges(in);
+}
+
+// called locked, from demux_cache_write()
+// Refuse to evict a cache segment that still holds packets the reader has not
+// read yet.
+static bool cache_can_evict(void *ctx, uint64_t end_pos)
+{
+    struct demux_internal *in = ctx;
+
+    for (int n = 0; n < in->num_streams; n++) {
+        struct demux_stream *ds = in->streams[n]->ds;
+        // Cache positions grow in queue order; the first cached one decides.
+        for (struct demux_packet *dp = ds->reader_head; dp; dp = dp->next) {
+            if (dp->is_cached) {
+                if (dp->cached_data.pos < end_pos)
+                    return false;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
 static void prune_old_packets(struct demux_internal *in)
 {
     mp_assert(in->current_range == in->ranges[in->num_ranges - 1]);
@@ -2347,8 +2584,12 @@ static void prune_old_packets(struct demux_internal *in)
         bool non_kf_prune = queue->head && !queue->head->keyframe;
         bool kf_was_pruned = false;
 
-        while (queue->head && queue->head != ds->reader_head) {
-            if (queue->head->keyframe) {
+        // Find the run of packets to prune, and remove it as a whole.
+        struct demux_packet *last = NULL;
+        for (struct demux_packet *dp = queue->head;
+             dp && dp != ds->reader_head; dp = dp->next)
+        {
+            if (dp->keyframe) {
                 // If the cache is seekable, only delete until up the next
                 // keyframe. This is not always efficient, but ensures we
                 // prune all streams fairly.
@@ -2360,44 +2601,15 @@ static void prune_old_packets(struct demux_internal *in)
                 kf_was_pruned = true;
             }
 
-            remove_head_packet(queue);
+            last = dp;
         }
 
-        // Need to update the seekable time range.
-        if (kf_was_pruned) {
-            mp_assert(!queue->keyframe_first); // it was just deleted, supposedly
-
-            queue->keyframe_first = queue->head;
-            // (May happen if reader_head stopped pruning the range, and there's
-            // no next range.)
-            while (queue->keyframe_first && !queue->keyframe_first->keyframe)
-                queue->keyframe_first = queue->keyframe_first->next;
-
-            if (queue->seek_start != MP_NOPTS_VALUE)
-                queue->last_pruned = queue->seek_start;
-
-            double kf_min;
-            compute_keyframe_times(queue->keyframe_first, &kf_min, NULL);
-
-            bool update_range = true;
-
-            queue->seek_start = kf_min;
-
-            if (queue->seek_start != MP_NOPTS_VALUE) {
-                queue->seek_start += ds->sh->seek_preroll;
-
-                // Don't need to update if the new start is still before the
-                // range's start (or if the range was undefined anyway).
-                if (range->seek_start == MP_NOPTS_VALUE ||
-                    queue->seek_start <= range->seek_start)
-                {
-                    update_range = false;
-                }
-            }
+        if (last)
+            remove_head_packets(queue, last);
 
-            if (update_range)
-                update_seek_ranges(range);
-        }
+        // Need to update the seekable time range.
+        if (kf_was_pruned)
+            update_pruned_queue(queue);
 
         if (range != in->current_range && range->seek_start == MP_NOPTS_VALUE)
             free_empty_cached_ranges(in);
@@ -2486,9 +2698,13 @@ static void update_opts(struct demuxer *demuxer)
     }
 
     if (in->seekable_cache && opts->disk_cache && !in->cache) {
-        in->cache = demux_cache_create(in->global, in->log);
-        if (!in->cache)
+        in->cache = demux_cache_create(in->global, in->log, demuxer->filename);
+        if (in->cache) {
+            demux_cache_set_evict_cb(in->cache, cache_can_evict, in);
+        } else {
             MP_ERR(in, "Failed to create file cache.\n");
+        }
+        in->cache_index_pending = in->cache && demux_cache_is_persistent(in->cache);
     }
 
     // The filename option really decides whether recording should be active.
@@ -2537,6 +2753,8 @@ static bool thread_work(struct demux_internal *in)
         execute_seek(in);
         return true;
     }
+    if (fill_reader_rings(in))
+        return true;
     if (read_packet(in))
         return true; // read_packet unlocked, so recheck conditions
     if (mp_time_ns() >= in->next_cache_update) {
@@ -2557,6 +2775,13 @@ static MP_THREAD_VOID demux_thread(void *pctx)
     while (!in->thread_terminate) {
         if (thread_work(in))
             continue;
+        if (in->pruned.head) {
+            struct pruned_packets pruned = take_pruned_packets(in);
+            mp_mutex_unlock(&in->lock);
+            release_pruned_packets(in, pruned);
+            mp_mutex_lock(&in->lock);
+            continue; // state might have changed while unlocked
+        }
         mp_cond_signal(&in->wakeup);
         mp_cond_timedwait_until(&in->wakeup, &in->lock, in->next_cache_update);
     }
@@ -2617,12 +2842,49 @@ static struct demux_packet *read_packet_from_cache(struct demux_internal *in,
     return pkt;
 }
 
+// Update the reader state for a packet that was returned to the reader.
+static void update_reader_stats(struct demux_stream *ds, double ts,
+                                bool keyframe, size_t len)
+{
+    if (ts != MP_NOPTS_VALUE)
+        ds->base_ts = ts;
+
+    if (keyframe && ts != MP_NOPTS_VALUE) {
+        // Update bitrate - only at keyframe points, because we use the
+        // (possibly) reordered packet timestamps instead of realtime.
+        double d = ts - ds->last_br_ts;
+        if (ds->last_br_ts == MP_NOPTS_VALUE || d < 0) {
+            ds->bitrate = -1;
+            ds->last_br_ts = ts;
+            ds->last_br_bytes = 0;
+        } else if (d >= 0.5) { // a window of least 500ms for UI purposes
+            ds->bitrate = ds->last_br_bytes / d;
+            ds->last_br_ts = ts;
+            ds->last_br_bytes = 0;
+        }
+    }
+    ds->last_br_bytes += len;
+}
+
+// Must be called by the user thread for every packet returned to it.
+static void update_user_filepos(struct demux_internal *in,
+                                struct demux_packet *pkt, int64_t stream_size)
+{
+    if (pkt->pos >= in->d_user->filepos)
+        in->d_user->filepos = pkt->pos;
+    in->d_user->filesize = stream_size;
+}
+
 // Returns:
 //   < 0: EOF was reached, *res is not set
 //  == 0: no new packet yet, wait, *res is not set
 //   > 0: new packet is moved to *res
+// If prefetch is set, the packet is dequeued for the reader ring, and the
+// reader state is not updated. Instead, the information needed to do that
+// when the reader takes the packet is stored in *prefetch.
 static int dequeue_packet(struct demux_stream *ds, double min_pts,
-                          struct demux_packet **res)
+                          struct demux_packet **res,
+                          struct reader_ring_entry *prefetch)
 {
     struct demux_internal *in = ds->in;
 
@@ -2719,29 +2981,14 @@ static int dequeue_packet(struct demux_stream *ds, double min_pts,
     }
 
     double ts = MP_PTS_OR_DEF(pkt->dts, pkt->pts);
-    if (ts != MP_NOPTS_VALUE)
-        ds->base_ts = ts;
-
-    if (pkt->keyframe && ts != MP_NOPTS_VALUE) {
-        // Update bitrate - only at keyframe points, because we use the
-        // (possibly) reordered packet timestamps instead of realtime.
-        double d = ts - ds->last_br_ts;
-        if (ds->last_br_ts == MP_NOPTS_VALUE || d < 0) {
-            ds->bitrate = -1;
-            ds->last_br_ts = ts;
-            ds->last_br_bytes = 0;
-        } else if (d >= 0.5) { // a window of least 500ms for UI purposes
-            ds->bitrate = ds->last_br_bytes / d;
-            ds->last_br_ts = ts;
-            ds->last_br_bytes = 0;
-        }
+    if (prefetch) {
+        prefetch->ts = ts;
+        prefetch->len = pkt->len;
+        prefetch->keyframe = pkt->keyframe;
+        prefetch->stream_size = in->stream_size;
+    } else {
+        update_reader_stats(ds, ts, pkt->keyframe, pkt->len);
     }
-    ds->last_br_bytes += pkt->len;
-
-    // This implies this function is actually called from "the" user thread.
-    if (pkt->pos >= in->d_user->filepos)
-        in->d_user->filepos = pkt->pos;
-    in->d_user->filesize = in->stream_size;
 
     pkt->pts = MP_ADD_PTS(pkt->pts, in->ts_offset);
     pkt->dts = MP_ADD_PTS(pkt->dts, in->ts_offset);
@@ -2751,11 +2998,97 @@ static int dequeue_packet(struct demux_stream *ds, double min_pts,
         pkt->end = MP_ADD_PTS(pkt->end, in->ts_offset);
     }
 
-    prune_old_packets(in);
+    if (!prefetch)
+        prune_old_packets(in);
     *res = pkt;
     return 1;
 }
 
+// Consumer side of the reader ring. Can be called without holding in->lock,
+// but only by the reader of the stream.
+static struct demux_packet *reader_ring_pop(struct demux_stream *ds)
+{
+    while (1) {
+        size_t rd = atomic_load_explicit(&ds->ring_read, memory_order_relaxed);
+        size_t wr = atomic_load_explicit(&ds->ring_write, memory_order_acquire);
+        if (rd == wr)
+            return NULL;
+
+        struct reader_ring_entry e = ds->ring[rd & (READER_RING_SIZE - 1)];
+        atomic_store_explicit(&ds->ring_read, rd + 1, memory_order_release);
+
+        if (e.gen == atomic_load_explicit(&ds->ring_gen, memory_order_acquire)) {
+            update_user_filepos(ds->in, e.pkt, e.stream_size);
+            return e.pkt;
+        }
+
+        talloc_free(e.pkt);
+    }
+}
+
+// Update the reader state for the ring entries the reader has taken since the
+// last call. Must be called locked. The producer calls this before reusing the
+// slots, so the entries are still intact.
+static void apply_ring_consumed(struct demux_stream *ds)
+{
+    size_t rd = atomic_load_explicit(&ds->ring_read, memory_order_acquire);
+    if (ds->ring_applied == rd)
+        return;
+
+    uint64_t gen = atomic_load_explicit(&ds->ring_gen, memory_order_relaxed);
+    for (; ds->ring_applied != rd; ds->ring_applied++) {
+        struct reader_ring_entry *e =
+            &ds->ring[ds->ring_applied & (READER_RING_SIZE - 1)];
+        // Stale entries were discarded, not returned.
+        if (e->gen == gen)
+            update_reader_stats(ds, e->ts, e->keyframe, e->len);
+    }
+
+    prune_old_packets(ds->in);
+}
+
+// Producer side of the reader ring. Must be called locked. Dequeue packets
+// ahead of the reader as long as there is space in the ring. Returns whether
+// any packets were added.
+static bool fill_reader_ring(struct demux_stream *ds)
+{
+    struct demux_internal *in = ds->in;
+
+    apply_ring_consumed(ds);
+
+    // Only plain forward reading of A/V streams is simple enough: everything
+    // else either depends on min_pts, or needs the reader state to be exact.
+    if (!ds->ring_active || !ds->eager || in->back_demuxing ||
+        ds->sh->attached_picture)
+        return false;
+
+    bool added = false;
+    size_t wr = atomic_load_explicit(&ds->ring_write, memory_order_relaxed);
+    while (wr - atomic_load_explicit(&ds->ring_read, memory_order_acquire) <
+           READER_RING_SIZE)
+    {
+        struct reader_ring_entry e = {
+            .gen = atomic_load_explicit(&ds->ring_gen, memory_order_relaxed),
+        };
+        if (dequeue_packet(ds, MP_NOPTS_VALUE, &e.pkt, &e) <= 0)
+            break;
+        ds->ring[wr & (READER_RING_SIZE - 1)] = e;
+        wr += 1;
+        atomic_store_explicit(&ds->ring_write, wr, memory_order_release);
+        added = true;
+    }
+
+    return added;
+}
+
+static bool fill_reader_rings(struct demux_internal *in)
+{
+    bool added = false;
+    for (int n = 0; n < in->num_streams; n++)
+        added |= fill_reader_ring(in->streams[n]->ds);
+    return added;
+}
+
 // Poll the demuxer queue, and if there's a packet, return it. Otherwise, just
 // make the demuxer thread read packets for this stream, and if there's at
 // least one packet, call the wakeup callback.
@@ -2785,16 +3118,45 @@ int demux_read_packet_async_until(struct sh_stream *sh, double min_pts,
         return -1;
     struct demux_internal *in = ds->in;
 
-    mp_mutex_lock(&in->lock);
+    if (min_pts == MP_NOPTS_VALUE) {
+        *out_pkt = reader_ring_pop(ds);
+        if (*out_pkt) {
+            stats_entry_event(in->stat_ring_hit);
+            return 1;
+        }
+    }
+
+    if (mp_mutex_trylock(&in->lock)) {
+        stats_entry_event(in->stat_lock_contended);
+        atomic_fetch_add(&in->reader_lock_contended, 1);
+        mp_mutex_lock(&in->lock);
+    }
     int r = -1;
-    while (1) {
-        r = dequeue_packet(ds, min_pts, out_pkt);
-        if (in->threading || in->blocked || r != 0)
-            break;
-        // Needs to actually read packets until we got a packet or EOF.
-        thread_work(in);
+    // The ring may have been filled since the lock-free attempt. Packets must
+    // be returned from it first to preserve their order.
+    *out_pkt = reader_ring_pop(ds);
+    if (*out_pkt) {
+        r = 1;
+    } else {
+        // Packets taken from the ring so far come before this one.
+        apply_ring_consumed(ds);
+        while (1) {
+            r = dequeue_packet(ds, min_pts, out_pkt, NULL);
+            if (in->threading || in->blocked || r != 0)
+                break;
+            // Needs to actually read packets until we got a packet or EOF.
+            thread_work(in);
+        }
+        if (r > 0)
+            update_user_filepos(in, *out_pkt, in->stream_size);
+    }
+    if (r > 0 && min_pts == MP_NOPTS_VALUE) {
+        ds->ring_active = true;
+        fill_reader_ring(ds);
     }
+    struct pruned_packets pruned = take_pruned_packets(in);
     mp_mutex_unlock(&in->lock);
+    release_pruned_packets(in, pruned);
     return r;
 }
 
@@ -2810,9 +3172,12 @@ struct demux_packet *demux_read_any_packet(struct demuxer *demuxer)
     while (read_more && !in->blocked) {
         bool all_eof = true;
         for (int n = 0; n < in->num_streams; n++) {
-            int r = dequeue_packet(in->streams[n]->ds, MP_NOPTS_VALUE, &out_pkt);
-            if (r > 0)
+            int r = dequeue_packet(in->streams[n]->ds, MP_NOPTS_VALUE,
+                                   &out_pkt, NULL);
+            if (r > 0) {
+                update_user_filepos(in, out_pkt, in->stream_size);
                 goto done;
+            }
             if (r == 0)
                 all_eof = false;
         }
@@ -3310,6 +3675,8 @@ static struct demuxer *open_given_type(struct mpv_global *global,
         .demux_ts = MP_NOPTS_VALUE,
         .owns_stream = !params->external_stream,
     };
+    in->stat_ring_hit = stats_entry(in->stats, "reader-ring-hit");
+    in->stat_lock_contended = stats_entry(in->stats, "reader-lock-contended");
     mp_mutex_init(&in->lock);
     mp_cond_init(&in->wakeup);
 
@@ -3547,8 +3914,12 @@ static void switch_current_range(struct demux_internal *in,
             struct demux_queue *queue = old->streams[n];
 
             // Remove all packets which cannot be involved in seeking.
-            while (queue->head && !queue->head->keyframe)
-                remove_head_packet(queue);
+            struct demux_packet *last = NULL;
+            for (struct demux_packet *dp = queue->head;
+                 dp && !dp->keyframe; dp = dp->next)
+                last = dp;
+            if (last)
+                remove_head_packets(queue, last);
         }
 
         // Exclude weird corner cases that break resuming.
@@ -3582,40 +3953,88 @@ static void switch_current_range(struct demux_internal *in,
 }
 
 // Search for the entry with the highest index with entry.pts <= pts true.
-static struct demux_packet *search_index(struct demux_queue *queue, double pts)
+// Returns 0 if there is no such entry. The index must not be empty.
+static size_t search_index(struct demux_queue *queue, double pts)
 {
-    size_t a = 0;
-    size_t b = queue->num_index;
+    mp_assert(queue->num_index);
 
-    while (a < b) {
+    // Coarse level: last block whose first entry is <= pts.
+    size_t a = queue->index0;
+    size_t b = queue->num_index_blocks;
+    while (b - a > 1) {
         size_t m = a + (b - a) / 2;
-        struct index_entry *e = &QUEUE_INDEX_ENTRY(queue, m);
-
-        bool m_ok = e->pts <= pts;
-
-        if (a + 1 == b)
-            return m_ok ? e->pkt : NULL;
-
-        if (m_ok) {
+        struct index_block *block = queue->index[m];
+        if (block->entries[block->start].pts <= pts) {
             a = m;
         } else {
             b = m;
         }
     }
 
-    return NULL;
+    // Dense level: last entry within the block that is <= pts.
+    struct index_block *block = queue->index[a];
+    int lo = block->start;
+    int hi = block->end;
+    while (hi - lo > 1) {
+        int m = lo + (hi - lo) / 2;
+        if (block->entries[m].pts <= pts) {
+            lo = m;
+        } else {
+            hi = m;
+        }
+    }
+
+    return (a - queue->index0) * INDEX_BLOCK_SIZE + lo -
+           queue->index[queue->index0]->start;
+}
+
+// Consider dp (with the given keyframe range pts) as seek target. Returns true
+// if the search is finished.
+static bool check_seek_target(struct demux_packet *dp, double range_pts,
+                              double pts, int flags,
+                              struct demux_packet **target)
+{
+    if (flags & SEEK_FORWARD) {
+        // Stop on the first packet that is >= pts.
+        if (*target)
+            return true;
+        if (range_pts < pts)
+            return false;
+    } else {
+        // Stop before the first packet that is > pts.
+        // This still returns a packet with > pts if there's no better one.
+        if (*target && range_pts > pts)
+            return true;
+    }
+
+    *target = dp;
+    return false;
 }
 
 static struct demux_packet *find_seek_target(struct demux_queue *queue,
                                              double pts, int flags)
 {
+    struct demux_internal *in = queue->ds->in;
+
     pts -= queue->ds->sh->seek_preroll;
 
-    struct demux_packet *start = search_index(queue, pts);
-    if (!start)
-        start = queue->head;
+    in->index_lookups += 1;
 
     struct demux_packet *target = NULL;
+    struct demux_packet *start = queue->head;
+
+    // The index contains every keyframe with known timestamps, except the
+    // most recent ones, whose keyframe ranges are not complete yet.
+    if (queue->num_index) {
+        for (size_t i = search_index(queue, pts); i < queue->num_index; i++) {
+            struct index_entry *e = index_entry_at(queue, i);
+            in->index_lookup_steps += 1;
+            if (check_seek_target(e->pkt, e->pts, pts, flags, &target))
+                return target;
+            start = e->pkt->next;
+        }
+    }
+
     struct demux_packet *next = NULL;
     for (struct demux_packet *dp = start; dp; dp = next) {
         next = dp->next;
@@ -3628,20 +4047,9 @@ static struct demux_packet *find_seek_target(struct demux_queue *queue,
         if (range_pts == MP_NOPTS_VALUE)
             continue;
 
-        if (flags & SEEK_FORWARD) {
-            // Stop on the first packet that is >= pts.
-            if (target)
-                break;
-            if (range_pts < pts)
-                continue;
-        } else {
-            // Stop before the first packet that is > pts.
-            // This still returns a packet with > pts if there's no better one.
-            if (target && range_pts > pts)
-                break;
-        }
-
-        target = dp;
+        in->index_lookup_steps += 1;
+        if (check_seek_target(dp, range_pts, pts, flags, &target))
+            break;
     }
 
     return target;
@@ -3768,6 +4176,316 @@ static void execute_cache_seek(struct demux_internal *in,
     }
 }
 
+// The persistent cache index stores the metadata of all cached packets, so that
+// a later demuxer instance can reuse the data in the persistent cache file. The
+// format is a memory dump, and only valid for the exact same mpv build (the
+// cache file contains FFmpeg side data memory dumps anyway).
+#define CACHE_INDEX_MAGIC "mpvcidx2"
+
+// Rewriting the cache file copies all data the index refers to, and blocks
+// closing the demuxer. If there is more than this, the data is dropped instead.
+#define CACHE_COMPACT_MAX_BYTES (64 * 1024 * 1024)
+
+struct cache_index_header {
+    char magic[8];
+    uint64_t file_size;     // cache file size when the index was written
+    uint32_t num_streams;
+    uint32_t num_ranges;
+};
+
+struct cache_index_packet {
+    double pts, dts, duration;
+    int64_t pos;
+    uint64_t cache_pos;
+    uint64_t len;
+    uint32_t keyframe;
+    uint32_t stream;
+};
+
+static void index_append(void *talloc_ctx, bstr *buf, const void *data,
+                         size_t size)
+{
+    bstr_xappend(talloc_ctx, buf, (bstr){(unsigned char *)data, size});
+}
+
+static void index_append_str(void *talloc_ctx, bstr *buf, const char *str)
+{
+    uint32_t len = str ? strlen(str) : 0;
+    index_append(talloc_ctx, buf, &len, sizeof(len));
+    index_append(talloc_ctx, buf, str, len);
+}
+
+static bool index_read(bstr *src, void *dst, size_t size)
+{
+    if (src->len < size)
+        return false;
+    memcpy(dst, src->start, size);
+    *src = bstr_cut(*src, size);
+    return true;
+}
+
+static bool index_read_str_equals(bstr *src, const char *str)
+{
+    uint32_t len;
+    if (!index_read(src, &len, sizeof(len)) || src->len < len)
+        return false;
+    bool equal = bstr_equals0((bstr){src->start, len}, str ? str : "");
+    *src = bstr_cut(*src, len);
+    return equal;
+}
+
+// Identifies the demuxer output the index was created for.
+static void append_stream_layout(void *talloc_ctx, bstr *buf,
+                                 struct demux_internal *in)
+{
+    index_append_str(talloc_ctx, buf, mpv_version);
+    index_append_str(talloc_ctx, buf, in->d_thread->desc->name);
+    for (int n = 0; n < in->num_streams; n++) {
+        struct sh_stream *sh = in->streams[n];
+        uint32_t type = sh->type;
+        index_append(talloc_ctx, buf, &type, sizeof(type));
+        index_append_str(talloc_ctx, buf, sh->codec->codec);
+    }
+}
+
+static bool range_is_persistable(struct demux_cached_range *range)
+{
+    if (range->seek_start == MP_NOPTS_VALUE)
+        return false;
+
+    for (int n = 0; n < range->num_streams; n++) {
+        for (struct demux_packet *dp = range->streams[n]->head; dp; dp = dp->next)
+        {
+            if (!dp->is_cached || dp->segmented)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static void save_cache_index(struct demux_internal *in)
+{
+    void *tmp = talloc_new(NULL);
+    bstr buf = {0};
+
+    uint32_t num_ranges = 0;
+    struct demux_packet **pkts = NULL;
+    size_t num_pkts = 0;
+    uint64_t data_size = 0;
+    for (int n = 0; n < in->num_ranges; n++) {
+        struct demux_cached_range *range = in->ranges[n];
+        if (!range_is_persistable(range))
+            continue;
+        num_ranges++;
+        for (int i = 0; i < range->num_streams; i++) {
+            for (struct demux_packet *dp = range->streams[i]->head; dp;
+                 dp = dp->next)
+            {
+                MP_TARRAY_APPEND(tmp, pkts, num_pkts, dp);
+                data_size += dp->len;
+            }
+        }
+    }
+
+    // Keep the previous index, which still refers to valid data. Everything
+    // appended after it can't be reached, so drop it.
+    if (!num_ranges) {
+        if (in->cache_index_size < demux_cache_get_size(in->cache))
+            demux_cache_truncate(in->cache, in->cache_index_size);
+        goto done;
+    }
+
+    // The file only grows, while pruned or unpersistable packets stay in it.
+    // Rewrite it once most of it is garbage, which keeps the cost of copying
+    // proportional to the amount of data that is reclaimed.
+    if (demux_cache_get_size(in->cache) / 2 > data_size) {
+        if (data_size > CACHE_COMPACT_MAX_BYTES) {
+            // The old index refers to data beyond the new size; it's rejected.
+            MP_VERBOSE(in, "Too much data to rewrite the cache file, "
+                       "discarding it.\n");
+            demux_cache_truncate(in->cache, 0);
+            goto done;
+        }
+        demux_cache_compact(in->cache, pkts, num_pkts);
+    }
+
+    struct cache_index_header hd = {
+        .magic = CACHE_INDEX_MAGIC,
+        .file_size = demux_cache_get_size(in->cache),
+        .num_streams = in->num_streams,
+        .num_ranges = num_ranges,
+    };
+
+    index_append(tmp, &buf, &hd, sizeof(hd));
+    append_stream_layout(tmp, &buf, in);
+
+    for (int n = 0; n < in->num_ranges; n++) {
+        struct demux_cached_range *range = in->ranges[n];
+        if (!range_is_persistable(range))
+            continue;
+
+        mp_assert(range->num_streams == in->num_streams);
+        for (int i = 0; i < range->num_streams; i++) {
+            struct demux_queue *queue = range->streams[i];
+
+            uint32_t flags[2] = {queue->is_bof, queue->is_eof};
+            index_append(tmp, &buf, flags, sizeof(flags));
+
+            uint64_t num_packets = 0;
+            for (struct demux_packet *dp = queue->head; dp; dp = dp->next)
+                num_packets++;
+            index_append(tmp, &buf, &num_packets, sizeof(num_packets));
+
+            for (struct demux_packet *dp = queue->head; dp; dp = dp->next) {
+                struct cache_index_packet p = {
+                    .pts = dp->pts,
+                    .dts = dp->dts,
+                    .duration = dp->duration,
+                    .pos = dp->pos,
+                    .cache_pos = dp->cached_data.pos,
+                    .len = dp->len,
+                    .keyframe = dp->keyframe,
+                    .stream = dp->stream,
+                };
+                index_append(tmp, &buf, &p, sizeof(p));
+            }
+        }
+    }
+
+    if (demux_cache_save_index(in->cache, buf.start, buf.len))
+        MP_VERBOSE(in, "Saved %d cached ranges to cache index.\n", hd.num_ranges);
+
+done:
+    talloc_free(tmp);
+}
+
+// Append a packet restored from the cache index to a queue that is not the
+// current one.
+static void restore_cached_packet(struct demux_queue *queue,
+                                  struct demux_packet *dp)
+{
+    struct demux_internal *in = queue->ds->in;
+
+    size_t bytes = demux_packet_estimate_total_size(dp);
+    in->total_bytes += bytes;
+    dp->cum_pos = queue->tail_cum_pos;
+    queue->tail_cum_pos += bytes;
+
+    if (queue->tail) {
+        queue->tail->next = dp;
+        queue->tail = dp;
+    } else {
+        queue->head = queue->tail = dp;
+    }
+
+    queue->correct_pos &= dp->pos >= 0 && dp->pos > queue->last_pos;
+    queue->correct_dts &= dp->dts != MP_NOPTS_VALUE && dp->dts > queue->last_dts;
+    queue->last_pos = dp->pos;
+    queue->last_dts = dp->dts;
+    double ts = MP_PTS_OR_DEF(dp->dts, dp->pts);
+    if (ts != MP_NOPTS_VALUE)
+        queue->last_ts = ts;
+
+    adjust_queue_seek_range(queue, dp);
+}
+
+static bool restore_cached_range(struct demux_internal *in, bstr *src,
+                                 uint64_t file_size)
+{
+    struct demux_cached_range *range = talloc_ptrtype(NULL, range);
+    *range = (struct demux_cached_range){
+        .seek_start = MP_NOPTS_VALUE,
+        .seek_end = MP_NOPTS_VALUE,
+    };
+    // (Insert before the current range, which must stay the last one.)
+    MP_TARRAY_INSERT_AT(in, in->ranges, in->num_ranges, in->num_ranges - 1,
+                        range);
+    add_missing_streams(in, range);
+
+    for (int n = 0; n < range->num_streams; n++) {
+        struct demux_queue *queue = range->streams[n];
+
+        uint32_t flags[2];
+        uint64_t num_packets;
+        if (!index_read(src, flags, sizeof(flags)) ||
+            !index_read(src, &num_packets, sizeof(num_packets)) ||
+            num_packets > src->len / sizeof(struct cache_index_packet))
+            return false;
+
+        for (uint64_t i = 0; i < num_packets; i++) {
+            struct cache_index_packet p;
+            if (!index_read(src, &p, sizeof(p)) || p.stream != n ||
+                p.len >= file_size || p.cache_pos >= file_size - p.len)
+                return false;
+
+            struct demux_packet *dp = new_demux_packet(in->packet_pool, 0);
+            MP_HANDLE_OOM(dp);
+            demux_packet_unref_contents(dp);
+            dp->is_cached = true;
+            dp->cached_data.pos = p.cache_pos;
+            dp->len = p.len;
+            dp->pts = p.pts;
+            dp->dts = p.dts;
+            dp->duration = p.duration;
+            dp->pos = p.pos;
+            dp->keyframe = p.keyframe;
+            dp->stream = p.stream;
+
+            restore_cached_packet(queue, dp);
+        }
+
+        queue->is_bof = flags[0];
+        if (flags[1])
+            adjust_queue_seek_range(queue, NULL);
+    }
+
+    update_seek_ranges(range);
+    return true;
+}
+
+static void load_cache_index(struct demux_internal *in)
+{
+    void *tmp = talloc_new(NULL);
+    bstr data = demux_cache_load_index(in->cache, tmp);
+    if (!data.len)
+        goto done;
+
+    bstr expected_layout = {0};
+    append_stream_layout(tmp, &expected_layout, in);
+
+    struct cache_index_header hd;
+    if (!index_read(&data, &hd, sizeof(hd)) ||
+        memcmp(hd.magic, CACHE_INDEX_MAGIC, sizeof(hd.magic)) != 0 ||
+        hd.file_size > demux_cache_get_size(in->cache) ||
+        hd.num_streams != in->num_streams ||
+        !bstr_startswith(data, expected_layout))
+    {
+        MP_WARN(in, "Cache index does not match this file; ignoring it.\n");
+        goto done;
+    }
+    data = bstr_cut(data, expected_layout.len);
+
+    int first = in->num_ranges - 1;
+    for (uint32_t n = 0; n < hd.num_ranges; n++) {
+        if (!restore_cached_range(in, &data, hd.file_size)) {
+            MP_ERR(in, "Cache index is corrupted.\n");
+            // Cleared ranges have no seek range, so this removes them.
+            for (int i = first; i < in->num_ranges - 1; i++)
+                clear_cached_range(in, in->ranges[i]);
+            free_empty_cached_ranges(in);
+            goto done;
+        }
+    }
+
+    in->cache_index_size = hd.file_size;
+    MP_VERBOSE(in, "Restored %d cached ranges from cache index.\n",
+               (int)hd.num_ranges);
+
+done:
+    talloc_free(tmp);
+}
+
 // Create a new blank cache range, and backup the old one. If the seekable
 // demuxer cache is disabled, merely reset the current range to a blank state.
 static void switch_to_fresh_cache_range(struct demux_internal *in)
@@ -4510,6 +5228,9 @@ void demux_get_reader_state(struct demuxer *demuxer, struct demux_reader_state *
 
     mp_mutex_lock(&in->lock);
 
+    for (int n = 0; n < in->num_streams; n++)
+        apply_ring_consumed(in->streams[n]->ds);
+
     *r = (struct demux_reader_state){
         .eof = in->eof,
         .ts_info = {
@@ -4524,7 +5245,20 @@ void demux_get_reader_state(struct demuxer *demuxer, struct demux_reader_state *
         .bytes_per_second = in->bytes_per_second,
         .byte_level_seeks = in->byte_level_seeks,
         .file_cache_bytes = in->cache ? demux_cache_get_size(in->cache) : -1,
+        .index_lookups = in->index_lookups,
+        .index_lookup_steps = in->index_lookup_steps,
+        .reader_lock_contended = atomic_load(&in->reader_lock_contended),
     };
+    struct demux_packet_pool_stats pool_stats;
+    demux_packet_pool_get_stats(in->packet_pool, &pool_stats);
+    r->packet_pool_hits = pool_stats.hits;
+    r->packet_pool_misses = pool_stats.misses;
+    r->packet_pool_retained_bytes = pool_stats.retained_bytes;
+    for (int n = 0; n < in->num_ranges; n++) {
+        struct demux_cached_range *range = in->ranges[n];
+        for (int i = 0; i < range->num_streams; i++)
+            r->index_entries += range->streams[i]->num_index;
+    }
     bool any_packets = false;
     for (int n = 0; n < STREAM_TYPE_COUNT; n++) {
         r->ts_per_stream[n] = r->ts_info;
@@ -4532,8 +5266,12 @@ void demux_get_reader_state(struct demuxer *demuxer, struct demux_reader_state *
     for (int n = 0; n < in->num_streams; n++) {
         struct demux_stream *ds = in->streams[n]->ds;
         if (ds->eager && !(!ds->queue->head && ds->eof) && !ds->ignore_eof) {
-            r->underrun |= !ds->reader_head && !ds->eof && !ds->still_image;
-            any_packets |= !!ds->reader_head;
+            // Packets prefetched into the reader ring were dequeued already.
+            bool ring_empty = atomic_load(&ds->ring_read) ==
+                              atomic_load(&ds->ring_write);
+            r->underrun |= !ds->reader_head && ring_empty && !ds->eof &&
+                           !ds->still_image;
+            any_packets |= !!ds->reader_head || !ring_empty;
 
             double ts_reader = ds->base_ts;
             double ts_end = ds->queue->last_ts;
@@ -55,6 +55,12 @@ struct demux_reader_state {
     uint64_t byte_level_seeks; // number of byte stream level seeks
     double ts_last; // approx. timestamp of demuxer position
     uint64_t bytes_per_second; // low level statistics
+    uint64_t index_entries; // seek index size (keyframes in all ranges)
+    uint64_t index_lookups; // number of cached seek target searches
+    uint64_t index_lookup_steps; // keyframes visited by these searches
+    uint64_t reader_lock_contended; // packet reads that had to wait for lock
+    // global packet pool statistics (demux_packet_pool_get_stats())
+    uint64_t packet_pool_hits, packet_pool_misses, packet_pool_retained_bytes;
     // Positions that can be seeked to without incurring the latency of a low
     // level seek.
     int num_seek_ranges;
@@ -138,10 +138,19 @@ struct demux_packet *new_demux_packet(struct demux_packet_pool *pool, size_t len
         return NULL;
 
     struct demux_packet *dp = packet_create(pool);
-    int r = av_new_packet(dp->avpacket, len);
-    if (r < 0) {
-        talloc_free(dp);
-        return NULL;
+    // Use a recycled payload if possible. Large packets fall back to a normal
+    // allocation.
+    struct AVBufferRef *buf = pool ? demux_packet_pool_alloc_payload(pool, len) : NULL;
+    if (buf) {
+        dp->avpacket->buf = buf;
+        dp->avpacket->data = buf->data;
+        dp->avpacket->size = len;
+    } else {
+        int r = av_new_packet(dp->avpacket, len);
+        if (r < 0) {
+            talloc_free(dp);
+            return NULL;
+        }
     }
     dp->buffer = dp->avpacket->data;
     dp->len = len;
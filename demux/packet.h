@@ -50,7 +50,8 @@ typedef struct demux_packet {
     bool back_restart : 1;  // restart point (reverse and return previous frames)
     bool back_preroll : 1;  // initial discarded frame for smooth decoder reinit
 
-    // If true, cached_data is valid, while buffer/len are not.
+    // If true, cached_data is valid, while buffer is not. len is still the
+    // size of the packet data.
     bool is_cached : 1;
 
     // If true, this is a wrapped AVFrame
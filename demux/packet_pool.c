@@ -17,24 +17,69 @@
 
 #include "packet_pool.h"
 
+#include <stdatomic.h>
+
 #include <libavcodec/packet.h>
+#include <libavutil/mem.h>
 
 #include "config.h"
 
+#include "common/common.h"
 #include "common/global.h"
 #include "osdep/threads.h"
 #include "packet.h"
 
-struct demux_packet_pool {
+// Number of independently locked free lists. Each thread uses one of them, so
+// that multiple demuxers running at the same time rarely contend.
+#define NUM_SHARDS 8
+
+// Payload size classes: 512 * 1.5^0, ..., each power of 2 is split into 2
+// classes (2^n and 1.5*2^n), which limits the wasted space to 33%.
+#define NUM_CLASSES 24
+#define CLASS_SIZE(c) ((size_t)((c) % 2 ? 3 : 2) << (8 + (c) / 2))
+
+// Maximum size of payload buffers kept in the free lists. Larger payloads are
+// freed normally if they're returned to the pool.
+#define MAX_RETAINED_BYTES (16 * 1024 * 1024)
+
+// Header in front of each pooled payload. Padded to keep the data aligned
+// like av_malloc() would.
+#define PAYLOAD_HEADER_SIZE 64
+
+struct payload {
+    struct demux_packet_pool *pool;
+    struct payload *next;
+    int size_class;
+};
+
+static_assert(sizeof(struct payload) <= PAYLOAD_HEADER_SIZE, "");
+
+struct pool_shard {
     mp_mutex lock;
     struct demux_packet *packets;
+    struct payload *payloads[NUM_CLASSES];
 };
 
-static void uninit(void *p)
+struct demux_packet_pool {
+    // The pool itself holds one reference, and each payload buffer allocated
+    // from it one more, as they can outlive the pool.
+    atomic_int refcount;
+    atomic_bool dead;
+
+    struct pool_shard shards[NUM_SHARDS];
+
+    atomic_uint_least64_t hits, misses;
+    atomic_size_t retained_bytes;
+};
+
+static atomic_uint next_shard;
+static thread_local int thread_shard = -1;
+
+static struct pool_shard *get_shard(struct demux_packet_pool *pool)
 {
-    struct demux_packet_pool *pool = p;
-    demux_packet_pool_clear(pool);
-    mp_mutex_destroy(&pool->lock);
+    if (thread_shard < 0)
+        thread_shard = atomic_fetch_add(&next_shard, 1) % NUM_SHARDS;
+    return &pool->shards[thread_shard];
 }
 
 static void free_demux_packets(struct demux_packet *dp)
@@ -46,12 +91,34 @@ static void free_demux_packets(struct demux_packet *dp)
     }
 }
 
+static void pool_unref(struct demux_packet_pool *pool)
+{
+    if (atomic_fetch_add(&pool->refcount, -1) > 1)
+        return;
+    for (int n = 0; n < NUM_SHARDS; n++)
+        mp_mutex_destroy(&pool->shards[n].lock);
+    talloc_free(pool);
+}
+
+static void uninit(void *p)
+{
+    struct demux_packet_pool *pool = *(struct demux_packet_pool **)p;
+    atomic_store(&pool->dead, true);
+    demux_packet_pool_clear(pool);
+    pool_unref(pool);
+}
+
 void demux_packet_pool_init(struct mpv_global *global)
 {
-    struct demux_packet_pool *pool = talloc(global, struct demux_packet_pool);
-    talloc_set_destructor(pool, uninit);
-    mp_mutex_init(&pool->lock);
-    pool->packets = NULL;
+    struct demux_packet_pool *pool = talloc_zero(NULL, struct demux_packet_pool);
+    atomic_init(&pool->refcount, 1);
+    for (int n = 0; n < NUM_SHARDS; n++)
+        mp_mutex_init(&pool->shards[n].lock);
+
+    // Owned by global, but the pool itself is refcounted.
+    struct demux_packet_pool **owner = talloc(global, struct demux_packet_pool *);
+    *owner = pool;
+    talloc_set_destructor(owner, uninit);
 
     mp_assert(!global->packet_pool);
     global->packet_pool = pool;
@@ -66,11 +133,29 @@ struct demux_packet_pool *demux_packet_pool_get(struct mpv_global *global)
 
 void demux_packet_pool_clear(struct demux_packet_pool *pool)
 {
-    mp_mutex_lock(&pool->lock);
-    struct demux_packet *dp = pool->packets;
-    pool->packets = NULL;
-    mp_mutex_unlock(&pool->lock);
-    free_demux_packets(dp);
+    for (int n = 0; n < NUM_SHARDS; n++) {
+        struct pool_shard *shard = &pool->shards[n];
+        struct payload *payloads[NUM_CLASSES];
+
+        mp_mutex_lock(&shard->lock);
+        struct demux_packet *dp = shard->packets;
+        shard->packets = NULL;
+        memcpy(payloads, shard->payloads, sizeof(payloads));
+        memset(shard->payloads, 0, sizeof(shard->payloads));
+        mp_mutex_unlock(&shard->lock);
+
+        free_demux_packets(dp);
+
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            while (payloads[c]) {
+                struct payload *next = payloads[c]->next;
+                atomic_fetch_sub(&pool->retained_bytes, CLASS_SIZE(c));
+                av_free(payloads[c]);
+                pool_unref(pool);
+                payloads[c] = next;
+            }
+        }
+    }
 }
 
 void demux_packet_pool_push(struct demux_packet_pool *pool,
@@ -90,29 +175,34 @@ void demux_packet_pool_prepend(struct demux_packet_pool *pool,
     mp_assert(tail);
     mp_assert(head != tail ? !!head->next : !head->next);
 
-    mp_mutex_lock(&pool->lock);
-    tail->next = pool->packets;
-    pool->packets = head;
 #if HAVE_DISABLE_PACKET_POOL
-    struct demux_packet *dp = pool->packets;
-    pool->packets = NULL;
-#endif
-    mp_mutex_unlock(&pool->lock);
-
-#if HAVE_DISABLE_PACKET_POOL
-    free_demux_packets(dp);
+    free_demux_packets(head);
+#else
+    struct pool_shard *shard = get_shard(pool);
+    mp_mutex_lock(&shard->lock);
+    tail->next = shard->packets;
+    shard->packets = head;
+    mp_mutex_unlock(&shard->lock);
 #endif
 }
 
 struct demux_packet *demux_packet_pool_pop(struct demux_packet_pool *pool)
 {
-    mp_mutex_lock(&pool->lock);
-    struct demux_packet *dp = pool->packets;
-    if (dp) {
-        pool->packets = dp->next;
-        dp->next = NULL;
+    struct pool_shard *own = get_shard(pool);
+    struct demux_packet *dp = NULL;
+
+    // Prefer the current thread's shard. Take packets from the other shards if
+    // it's empty, e.g. if packets are always freed on another thread.
+    for (int n = 0; n < NUM_SHARDS && !dp; n++) {
+        struct pool_shard *shard = &pool->shards[(own - pool->shards + n) % NUM_SHARDS];
+        mp_mutex_lock(&shard->lock);
+        dp = shard->packets;
+        if (dp) {
+            shard->packets = dp->next;
+            dp->next = NULL;
+        }
+        mp_mutex_unlock(&shard->lock);
     }
-    mp_mutex_unlock(&pool->lock);
 
     // Clear the packet from possible external references. This is done in the
     // pop function instead of prepend to distribute the load of clearing packets.
@@ -126,5 +216,96 @@ struct demux_packet *demux_packet_pool_pop(struct demux_packet_pool *pool)
         ta_free_children(dp);
     }
 
+    atomic_fetch_add_explicit(dp ? &pool->hits : &pool->misses, 1,
+                              memory_order_relaxed);
+
     return dp;
 }
+
+static void payload_free(void *opaque, uint8_t *data)
+{
+    struct payload *p = opaque;
+    struct demux_packet_pool *pool = p->pool;
+    size_t size = CLASS_SIZE(p->size_class);
+
+    bool retain = false;
+    if (!HAVE_DISABLE_PACKET_POOL && !atomic_load(&pool->dead)) {
+        retain = atomic_fetch_add(&pool->retained_bytes, size) + size
+                    <= MAX_RETAINED_BYTES;
+        if (!retain)
+            atomic_fetch_sub(&pool->retained_bytes, size);
+    }
+
+    if (retain) {
+        struct pool_shard *shard = get_shard(pool);
+        mp_mutex_lock(&shard->lock);
+        // uninit() sets dead before draining the shards, so if the shard
+        // was drained already, this sees it and the payload is freed here.
+        retain = !atomic_load(&pool->dead);
+        if (retain) {
+            p->next = shard->payloads[p->size_class];
+            shard->payloads[p->size_class] = p;
+        }
+        mp_mutex_unlock(&shard->lock);
+        if (retain)
+            return;
+        atomic_fetch_sub(&pool->retained_bytes, size);
+    }
+
+    av_free(p);
+    pool_unref(pool);
+}
+
+struct AVBufferRef *demux_packet_pool_alloc_payload(struct demux_packet_pool *pool,
+                                                    size_t len)
+{
+    size_t size = len + AV_INPUT_BUFFER_PADDING_SIZE;
+    int c = 0;
+    while (c < NUM_CLASSES && CLASS_SIZE(c) < size)
+        c++;
+    if (c == NUM_CLASSES)
+        return NULL;
+
+    struct payload *p = NULL;
+    struct pool_shard *own = get_shard(pool);
+    for (int n = 0; n < NUM_SHARDS && !p; n++) {
+        struct pool_shard *shard = &pool->shards[(own - pool->shards + n) % NUM_SHARDS];
+        mp_mutex_lock(&shard->lock);
+        p = shard->payloads[c];
+        if (p)
+            shard->payloads[c] = p->next;
+        mp_mutex_unlock(&shard->lock);
+    }
+
+    if (p) {
+        atomic_fetch_sub(&pool->retained_bytes, CLASS_SIZE(c));
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    } else {
+        p = av_malloc(PAYLOAD_HEADER_SIZE + CLASS_SIZE(c));
+        if (!p)
+            return NULL;
+        *p = (struct payload){ .pool = pool, .size_class = c };
+        atomic_fetch_add(&pool->refcount, 1);
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    }
+
+    uint8_t *data = (uint8_t *)p + PAYLOAD_HEADER_SIZE;
+    struct AVBufferRef *buf = av_buffer_create(data, CLASS_SIZE(c),
+                                               payload_free, p, 0);
+    if (!buf) {
+        payload_free(p, data);
+        return NULL;
+    }
+    memset(data + len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return buf;
+}
+
+void demux_packet_pool_get_stats(struct demux_packet_pool *pool,
+                                 struct demux_packet_pool_stats *st)
+{
+    *st = (struct demux_packet_pool_stats){
+        .hits = atomic_load_explicit(&pool->hits, memory_order_relaxed),
+        .misses = atomic_load_explicit(&pool->misses, memory_order_relaxed),
+        .retained_bytes = atomic_load(&pool->retained_bytes),
+    };
+}
@@ -17,15 +17,26 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct AVBufferRef;
 struct demux_packet_pool;
 struct demux_packet;
 struct mpv_global;
 
+struct demux_packet_pool_stats {
+    uint64_t hits;          // packets and payloads reused from the pool
+    uint64_t misses;        // packets and payloads that had to be allocated
+    size_t retained_bytes;  // size of unused payload buffers kept in the pool
+};
+
 /**
  * Initializes the demux packet pool.
  *
- * This function creates a new shaderd demux packet pool. Should be done only
- * once per mpv context.
+ * This function creates a new shared demux packet pool. Should be done only
+ * once per mpv context. Internally, the pool is split into several shards,
+ * which are picked based on the calling thread to reduce lock contention.
  *
  * @param global Pointer to the global context.
  */
@@ -86,3 +97,30 @@ void demux_packet_pool_prepend(struct demux_packet_pool *pool,
  * @return Pointer to the demux packet, or NULL if the pool is empty.
  */
 struct demux_packet *demux_packet_pool_pop(struct demux_packet_pool *pool);
+
+/**
+ * Allocates a packet payload buffer from the pool.
+ *
+ * The buffer has at least len bytes plus AV_INPUT_BUFFER_PADDING_SIZE bytes
+ * of zeroed padding. Payloads are recycled by size classes when the last
+ * reference to the buffer is dropped, up to a fixed total size. The buffer
+ * may outlive the pool. This function is thread-safe.
+ *
+ * @param pool Pointer to the demux packet pool.
+ * @param len Size of the payload without padding.
+ * @return New buffer reference, or NULL if len is too large for the pool, or
+ *         on OOM.
+ */
+struct AVBufferRef *demux_packet_pool_alloc_payload(struct demux_packet_pool *pool,
+                                                    size_t len);
+
+/**
+ * Returns usage counters of the pool.
+ *
+ * This function is thread-safe.
+ *
+ * @param pool Pointer to the demux packet pool.
+ * @param st Filled with the current counter values.
+ */
+void demux_packet_pool_get_stats(struct demux_packet_pool *pool,
+                                 struct demux_packet_pool_stats *st);
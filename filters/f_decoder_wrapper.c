@@ -39,6 +39,7 @@
 #include "common/codecs.h"
 #include "common/global.h"
 #include "common/recorder.h"
+#include "common/stats.h"
 #include "misc/dispatch.h"
 
 #include "audio/aframe.h"
@@ -150,6 +151,8 @@ const struct m_sub_options dec_wrapper_conf = {
 struct priv {
     struct mp_log *log;
     struct sh_stream *header;
+    struct stats_ctx *stats;
+    struct stat_entry *stat_decode;
 
     // --- The following fields are to be accessed by dec_dispatch (or if that
     //     field is NULL, by the mp_decoder_wrapper user thread).
@@ -1112,8 +1115,10 @@ static void decf_process(struct mp_filter *f)
     if (m_config_cache_update(p->opt_cache))
         update_queue_config(p);
 
+    stats_entry_time_start(p->stat_decode);
     feed_packet(p);
     read_frame(p);
+    stats_entry_time_end(p->stat_decode);
 }
 
 static MP_THREAD_VOID dec_thread(void *ptr)
@@ -1240,6 +1245,10 @@ struct mp_decoder_wrapper *mp_decoder_wrapper_create(struct mp_filter *parent,
         goto error;
     }
 
+    p->stats = stats_ctx_create(p, public_f->global,
+                                p->header->type == STREAM_VIDEO ? "vd" : "ad");
+    p->stat_decode = stats_entry(p->stats, "decode");
+
     if (p->queue_opts && p->queue_opts->use_queue) {
         p->queue = mp_async_queue_create();
         p->dec_dispatch = mp_dispatch_create(p);
@@ -6,7 +6,9 @@
 #include "common/common.h"
 #include "common/global.h"
 #include "common/msg.h"
+#include "common/stats.h"
 #include "demux/packet_pool.h"
+#include "misc/linked_list.h"
 #include "osdep/threads.h"
 #include "osdep/timer.h"
 #include "video/hwdec.h"
@@ -81,10 +83,16 @@ struct filter_runner {
     // If set, recursive filtering was initiated through this pin.
     struct mp_pin *recursive;
 
-    // Set of filters which need process() to be called. A filter is in this
-    // array iff mp_filter_internal.pending==true.
-    struct mp_filter **pending;
-    int num_pending;
+    // Filters which need process() to be called, one run queue for each
+    // priority. A filter is in the queue for its priority iff
+    // mp_filter_internal.pending==true. Both are run in LIFO order, which
+    // tends to push data through the graph depth first.
+    struct {
+        struct mp_filter_internal *head, *tail;
+    } pending, pending_high;
+
+    // Run count and time spent in process() per filter name.
+    struct stats_ctx *stats;
 
     // Any outside pins have changed state.
     bool external_pending;
@@ -105,6 +113,7 @@ struct filter_runner {
 struct mp_filter_internal {
     const struct mp_filter_info *info;
 
+    struct mp_filter *filter;
     struct mp_filter *parent;
     struct filter_runner *runner;
 
@@ -115,12 +124,18 @@ struct mp_filter_internal {
 
     char *name;
     bool high_priority;
+    struct stat_entry *stat_process; // created on first use
 
     bool pending;
+    struct {
+        struct mp_filter_internal *prev, *next;
+    } pending_list;
     bool async_pending;
     bool failed;
 };
 
+#define PENDING_QUEUE(r, in) ((in)->high_priority ? &(r)->pending_high : &(r)->pending)
+
 // Called when new work needs to be done on a pin belonging to the filter:
 //  - new data was requested
 //  - new data has been queued
@@ -134,14 +149,35 @@ static void add_pending(struct mp_filter *f)
     if (f->in->pending)
         return;
 
-    // This should probably really be some sort of priority queue, but for now
-    // something naive and dumb does the job too.
     f->in->pending = true;
-    if (f->in->high_priority) {
-        MP_TARRAY_INSERT_AT(r, r->pending, r->num_pending, 0, f);
-    } else {
-        MP_TARRAY_APPEND(r, r->pending, r->num_pending, f);
+    LL_PREPEND(pending_list, PENDING_QUEUE(r, f->in), f->in);
+}
+
+static void remove_pending(struct mp_filter *f)
+{
+    struct filter_runner *r = f->in->runner;
+
+    if (!f->in->pending)
+        return;
+
+    f->in->pending = false;
+    LL_REMOVE(pending_list, PENDING_QUEUE(r, f->in), f->in);
+}
+
+static void run_process(struct mp_filter *f)
+{
+    struct mp_filter_internal *in = f->in;
+
+    if (!in->stat_process) {
+        // (stats entry names are limited to 31 characters)
+        char name[32];
+        snprintf(name, sizeof(name), "%s", in->name ? in->name : in->info->name);
+        in->stat_process = stats_entry(in->runner->stats, name);
     }
+
+    stats_entry_time_start(in->stat_process);
+    in->info->process(f);
+    stats_entry_time_end(in->stat_process);
 }
 
 static void add_pending_pin(struct mp_pin *p)
@@ -239,28 +275,26 @@ bool mp_filter_graph_run(struct mp_filter *filter)
             exit_req = true;
         }
 
-        if (!r->num_pending) {
+        if (!r->pending.head && !r->pending_high.head) {
             flush_async_notifications(r);
-            if (!r->num_pending)
+            if (!r->pending.head && !r->pending_high.head)
                 break;
         }
 
         struct mp_filter *next = NULL;
 
-        if (r->pending[0]->in->high_priority) {
-            next = r->pending[0];
-            MP_TARRAY_REMOVE_AT(r->pending, r->num_pending, 0);
+        if (r->pending_high.head) {
+            next = r->pending_high.head->filter;
         } else if (!exit_req) {
-            next = r->pending[r->num_pending - 1];
-            r->num_pending -= 1;
+            next = r->pending.head->filter;
         }
 
         if (!next)
             break;
 
-        next->in->pending = false;
+        remove_pending(next);
         if (next->in->info->process)
-            next->in->info->process(next);
+            run_process(next);
 
         if (end_time && mp_time_ns() >= end_time)
             mp_filter_graph_interrupt(r->root_filter);
@@ -539,13 +573,19 @@ const struct mp_filter_info *mp_filter_get_info(struct mp_filter *f)
 
 void mp_filter_set_high_priority(struct mp_filter *f, bool pri)
 {
+    // Move it to the run queue for the new priority.
+    bool pending = f->in->pending;
+    remove_pending(f);
     f->in->high_priority = pri;
+    if (pending)
+        add_pending(f);
 }
 
 void mp_filter_set_name(struct mp_filter *f, const char *name)
 {
     talloc_free(f->in->name);
     f->in->name = talloc_strdup(f, name);
+    f->in->stat_process = NULL;
 }
 
 struct mp_pin *mp_filter_get_named_pin(struct mp_filter *f, const char *name)
@@ -770,12 +810,7 @@ static void filter_destructor(void *p)
     // There will be no more new notifications at this point (due to destroy()).
     flush_async_notifications(r);
 
-    for (int n = 0; n < r->num_pending; n++) {
-        if (r->pending[n] == f) {
-            MP_TARRAY_REMOVE_AT(r->pending, r->num_pending, n);
-            break;
-        }
-    }
+    remove_pending(f);
 
     if (f->in->parent) {
         struct mp_filter_internal *p_in = f->in->parent->in;
@@ -809,6 +844,7 @@ struct mp_filter *mp_filter_create_with_params(struct mp_filter_params *params)
     };
     *f->in = (struct mp_filter_internal){
         .info = params->info,
+        .filter = f,
         .parent = params->parent,
         .runner = params->parent ? params->parent->in->runner : NULL,
     };
@@ -822,6 +858,8 @@ struct mp_filter *mp_filter_create_with_params(struct mp_filter_params *params)
             .root_filter = f,
             .max_run_time = INFINITY,
         };
+        f->in->runner->stats =
+            stats_ctx_create(f->in->runner, params->global, "filter");
         mp_mutex_init(&f->in->runner->async_lock);
     }
 
@@ -248,7 +248,7 @@ extern "C" {
  * relational operators (<, >, <=, >=).
  */
 #define MPV_MAKE_VERSION(major, minor) (((major) << 16) | (minor) | 0UL)
-#define MPV_CLIENT_API_VERSION MPV_MAKE_VERSION(2, 5)
+#define MPV_CLIENT_API_VERSION MPV_MAKE_VERSION(2, 6)
 
 /**
  * The API user is allowed to "#define MPV_ENABLE_DEPRECATED 0" before
@@ -1227,6 +1227,30 @@ MPV_EXPORT int mpv_get_property_async(mpv_handle *ctx, uint64_t reply_userdata,
 MPV_EXPORT int mpv_observe_property(mpv_handle *mpv, uint64_t reply_userdata,
                                     const char *name, mpv_format format);
 
+/**
+ * Like mpv_observe_property() with MPV_FORMAT_NODE, but instead of the new
+ * value, mpv_event_property.data is a MPV_FORMAT_NODE_ARRAY with a JSON Patch
+ * (RFC 6902), which turns the value returned by the previous change event into
+ * the new value. Only "add", "remove" and "replace" operations are used. Paths
+ * are JSON Pointers (RFC 6901), with array indexes formatted as decimal
+ * strings.
+ *
+ * The initial change event, and the first event after the property was
+ * unavailable, contain a single "replace" operation with the path "" (the
+ * whole value). If the property becomes unavailable, MPV_FORMAT_NONE is set
+ * in mpv_event_property, the same as with mpv_observe_property().
+ *
+ * This is meant for large properties like "playlist" or "track-list", where
+ * usually only a small part changes at once.
+ *
+ * @param reply_userdata see mpv_observe_property()
+ * @param name The property name.
+ * @return error code (usually fails only on OOM)
+ */
+MPV_EXPORT int mpv_observe_property_delta(mpv_handle *mpv,
+                                          uint64_t reply_userdata,
+                                          const char *name);
+
 /**
  * Undo mpv_observe_property(). This will remove all observed properties for
  * which the given number was passed as reply_userdata to mpv_observe_property.
@@ -1998,6 +2022,8 @@ MPV_DEFINE_SYM_PTR(mpv_get_property_async)
 #define mpv_get_property_async pfn_mpv_get_property_async
 MPV_DEFINE_SYM_PTR(mpv_observe_property)
 #define mpv_observe_property pfn_mpv_observe_property
+MPV_DEFINE_SYM_PTR(mpv_observe_property_delta)
+#define mpv_observe_property_delta pfn_mpv_observe_property_delta
 MPV_DEFINE_SYM_PTR(mpv_unobserve_property)
 #define mpv_unobserve_property pfn_mpv_unobserve_property
 MPV_DEFINE_SYM_PTR(mpv_event_name)
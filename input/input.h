@@ -243,13 +243,54 @@ bool mp_ipc_start_anon_client(struct mp_ipc_ctx *ctx, struct mpv_handle *h,
                               int out_fd[2]);
 void mp_uninit_ipc(struct mp_ipc_ctx *ctx);
 
-// Serialize the given mpv_event structure to JSON. Returns an allocated string.
+// Serialize the given mpv_event structure to JSON. Returns an allocated string,
+// or NULL on encoding errors.
 struct mpv_event;
 char *mp_json_encode_event(struct mpv_event *event);
 
+// Commands of one IPC connection that are running without being waited for.
+// Free with talloc_free().
+struct mp_ipc_requests;
+struct mp_ipc_requests *mp_ipc_requests_create(void *ta_parent);
+
+// Whether a command that must finish before the next one starts is running.
+// mp_ipc_execute_line() and mp_ipc_execute_cbor() must not be called while
+// this is true; its reply arrives as MPV_EVENT_COMMAND_REPLY.
+bool mp_ipc_requests_busy(struct mp_ipc_requests *reqs);
+
+// Like mp_json_encode_event(), but append the newline terminated JSON to *dst
+// instead. Temporary data is allocated on ta_tmp. Returns false on encoding
+// errors, in which case nothing is appended. If reqs is set, replies to the
+// commands started with it are turned into the replies the client expects,
+// and nothing is appended for those that get none.
+bool mp_json_append_event(struct mp_ipc_requests *reqs, void *ta_tmp,
+                          bstr *dst, struct mpv_event *event);
+
+// Like mp_json_append_event(), but append CBOR instead.
+bool mp_cbor_append_event(struct mp_ipc_requests *reqs, void *ta_tmp,
+                          bstr *dst, struct mpv_event *event);
+
 // Given the raw IPC input buffer "buf", remove the first newline-separated
 // command, execute it and return the result (if any) as an allocated string.
 struct mpv_handle;
 char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *buf);
 
+// Execute a single IPC command line and return the result (if any) as an
+// allocated string. If reqs is not NULL, the command is not waited for; its
+// reply is written by mp_json_append_event() with the same reqs.
+char *mp_ipc_execute_line(struct mpv_handle *client,
+                          struct mp_ipc_requests *reqs, void *ctx, bstr line);
+
+// Execute the CBOR encoded command at the start of "buf", remove it from
+// "buf", and append the CBOR encoded result (if any) to "dst".
+//  returns:
+//      1: a command was executed
+//      0: "buf" does not contain a complete command yet, or reqs is busy;
+//         nothing was done
+//     -1: "buf" is not valid CBOR; an error reply was appended, and the
+//         connection should be closed, as the stream can't be resynchronized
+// reqs works as with mp_ipc_execute_line().
+int mp_ipc_execute_cbor(struct mpv_handle *client, struct mp_ipc_requests *reqs,
+                        bstr *buf, bstr *dst);
+
 #endif /* MPLAYER_INPUT_H */
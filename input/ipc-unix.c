@@ -25,6 +25,12 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 
+#include "config.h"
+
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include "osdep/io.h"
 #include "osdep/threads.h"
 
@@ -32,6 +38,7 @@
 #include "common/global.h"
 #include "common/msg.h"
 #include "input/input.h"
+#include "misc/cbor.h"
 #include "mpv/client.h"
 #include "options/m_config.h"
 #include "options/options.h"
@@ -42,13 +49,59 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+// Amount of data read from the socket at once.
+#define IPC_READ_SIZE (64 * 1024)
+// Stop reading commands and events while this much output is not sent yet.
+#define IPC_WRITE_BATCH (256 * 1024)
+
+// All clients are served by a single thread, which multiplexes the client
+// sockets and their wakeup pipes (and the listening socket, if any).
+struct ipc_loop;
+
 struct mp_ipc_ctx {
     struct mp_log *log;
-    struct mp_client_api *client_api;
-    const char *path;
+    struct ipc_loop *loop;
+};
 
-    mp_thread thread;
-    int death_pipe[2];
+// A file descriptor the loop waits on.
+struct ipc_watch {
+    int fd;
+    int events;         // wanted POLLIN/POLLOUT
+    int active;         // events registered with the backend, -1 if none
+    int revents;
+    struct client_arg *client; // NULL for the loop's own fds
+};
+
+struct ipc_loop {
+    struct mp_log *log;
+    struct mp_client_api *client_api;
+    char *path;
+
+    mp_mutex lock;
+    // -- protected by lock
+    bool stop;          // stop listening, exit once all clients are gone
+    struct client_arg **new_clients;
+    int num_new_clients;
+
+    // -- owned by the loop thread
+    int wakeup_pipe[2];
+    int listen_fd;
+    int client_num;
+    struct client_arg **clients;
+    int num_clients;
+    struct ipc_watch wakeup_watch;
+    struct ipc_watch listen_watch;
+    struct ipc_watch **ready;
+    int num_ready;
+    struct client_arg **touched;
+    int num_touched;
+#if HAVE_EPOLL
+    int epoll_fd;
+#else
+    struct pollfd *fds;
+    struct ipc_watch **fd_watches;
+    int num_fds;
+#endif
 };
 
 struct client_arg {
@@ -61,195 +114,456 @@ struct client_arg {
     bool quit_on_close;
 
     bool writable;
+    bool protocol_known;    // first bytes were checked for CBOR_MAGIC
+    bool cbor;              // use CBOR instead of JSON
+    struct cbor_scan cbor_scan; // progress on the incomplete message in "in"
+
+    bstr in;            // received data not consumed yet
+    bstr out;           // queued output; out.start[0..out_sent] was sent
+    size_t out_sent;
+    void *tmp;          // temporary encoding data, freed after each batch
+    // Running commands; no input is executed while one must finish first.
+    struct mp_ipc_requests *requests;
+
+    int pipe_fd;
+    bool want_events;   // wakeup pipe was signaled, events may be queued
+    bool closing;       // got MPV_EVENT_SHUTDOWN, send remaining output
+    bool dead;
+    bool touched;       // in ipc_loop.touched
+    struct ipc_watch sock_watch;
+    struct ipc_watch pipe_watch;
 };
 
-static int ipc_write_str(struct client_arg *client, const char *buf)
+static void watch_init(struct ipc_watch *w, int fd, struct client_arg *client)
+{
+    *w = (struct ipc_watch){ .fd = fd, .active = -1, .client = client };
+}
+
+#if HAVE_EPOLL
+
+static bool loop_init_backend(struct ipc_loop *loop)
+{
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epoll_fd >= 0;
+}
+
+static void loop_uninit_backend(struct ipc_loop *loop)
+{
+    if (loop->epoll_fd >= 0)
+        close(loop->epoll_fd);
+}
+
+// Register w->events. The EPOLL* flags used here have the same values as
+// their POLL* counterparts.
+static void loop_update_watch(struct ipc_loop *loop, struct ipc_watch *w)
+{
+    if (w->fd < 0 || w->events == w->active)
+        return;
+    struct epoll_event ev = { .events = w->events, .data.ptr = w };
+    int op = w->active < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epoll_fd, op, w->fd, &ev) < 0) {
+        MP_ERR(loop, "epoll_ctl error (%s)\n", mp_strerror(errno));
+        return;
+    }
+    w->active = w->events;
+}
+
+static void loop_remove_watch(struct ipc_loop *loop, struct ipc_watch *w)
+{
+    if (w->fd >= 0 && w->active >= 0)
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+    w->active = -1;
+}
+
+static void loop_wait(struct ipc_loop *loop)
+{
+    struct epoll_event evs[64];
+    int num = epoll_wait(loop->epoll_fd, evs, MP_ARRAY_SIZE(evs), -1);
+    if (num < 0 && errno != EINTR)
+        MP_ERR(loop, "Poll error\n");
+    for (int n = 0; n < num; n++) {
+        struct ipc_watch *w = evs[n].data.ptr;
+        w->revents = evs[n].events;
+        MP_TARRAY_APPEND(loop, loop->ready, loop->num_ready, w);
+    }
+}
+
+#else
+
+static bool loop_init_backend(struct ipc_loop *loop)
+{
+    return true;
+}
+
+static void loop_uninit_backend(struct ipc_loop *loop)
+{
+}
+
+static void loop_update_watch(struct ipc_loop *loop, struct ipc_watch *w)
+{
+    w->active = w->events;
+}
+
+static void loop_remove_watch(struct ipc_loop *loop, struct ipc_watch *w)
+{
+    w->active = -1;
+}
+
+static void add_pollfd(struct ipc_loop *loop, struct ipc_watch *w)
 {
-    size_t count = strlen(buf);
-    while (count > 0) {
-        ssize_t rc = send(client->client_fd, buf, count, MSG_NOSIGNAL);
+    if (w->fd < 0 || w->active <= 0)
+        return;
+    MP_TARRAY_GROW(loop, loop->fds, loop->num_fds);
+    MP_TARRAY_GROW(loop, loop->fd_watches, loop->num_fds);
+    loop->fds[loop->num_fds] = (struct pollfd){ .fd = w->fd, .events = w->active };
+    loop->fd_watches[loop->num_fds++] = w;
+}
+
+static void loop_wait(struct ipc_loop *loop)
+{
+    loop->num_fds = 0;
+    add_pollfd(loop, &loop->wakeup_watch);
+    add_pollfd(loop, &loop->listen_watch);
+    for (int n = 0; n < loop->num_clients; n++) {
+        add_pollfd(loop, &loop->clients[n]->sock_watch);
+        add_pollfd(loop, &loop->clients[n]->pipe_watch);
+    }
+    int num = poll(loop->fds, loop->num_fds, -1);
+    if (num < 0 && errno != EINTR)
+        MP_ERR(loop, "Poll error\n");
+    for (int n = 0; n < loop->num_fds && num > 0; n++) {
+        if (!loop->fds[n].revents)
+            continue;
+        struct ipc_watch *w = loop->fd_watches[n];
+        w->revents = loop->fds[n].revents;
+        MP_TARRAY_APPEND(loop, loop->ready, loop->num_ready, w);
+    }
+}
+
+#endif
+
+static size_t client_backlog(struct client_arg *client)
+{
+    return client->out.len - client->out_sent;
+}
+
+// Send as much queued output as the socket takes without blocking.
+static int client_send(struct client_arg *client)
+{
+    while (client_backlog(client) > 0 && client->writable) {
+        ssize_t rc = send(client->client_fd, client->out.start + client->out_sent,
+                          client_backlog(client), MSG_NOSIGNAL);
         if (rc <= 0) {
             if (rc == 0)
                 return -1;
 
             if (errno == EBADF || errno == ENOTSOCK) {
                 client->writable = false;
-                return 0;
+                break;
             }
 
-            if (errno == EINTR || errno == EAGAIN)
+            if (errno == EINTR)
                 continue;
 
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
             return rc;
         }
 
-        count -= rc;
-        buf   += rc;
+        client->out_sent += rc;
     }
 
+    client->out.len = client->out_sent = 0;
     return 0;
 }
 
-static MP_THREAD_VOID client_thread(void *p)
+static void client_queue_str(struct client_arg *client, const char *buf)
 {
-    // We don't use MSG_NOSIGNAL because the moldy fruit OS doesn't support it.
-    struct sigaction sa = { .sa_handler = SIG_IGN, .sa_flags = SA_RESTART };
-    sigfillset(&sa.sa_mask);
-    sigaction(SIGPIPE, &sa, NULL);
-
-    int rc;
-
-    struct client_arg *arg = p;
-    bstr client_msg = { talloc_strdup(NULL, ""), 0 };
+    if (client->writable)
+        bstr_xappend(client, &client->out, bstr0(buf));
+}
 
-    char *tname = talloc_asprintf(NULL, "ipc/%s", arg->client_name);
-    mp_thread_set_name(tname);
-    talloc_free(tname);
+// Returns false if the client's protocol is not known yet.
+static bool client_negotiate(struct client_arg *client)
+{
+    bstr magic = bstr0(CBOR_MAGIC);
+    bstr start = bstr_splice(client->in, 0, MPMIN(client->in.len, magic.len));
+    if (client->in.len < magic.len && bstr_startswith(magic, start))
+        return false;
 
-    int pipe_fd = mpv_get_wakeup_pipe(arg->client);
-    if (pipe_fd < 0) {
-        MP_ERR(arg, "Could not get wakeup pipe\n");
-        goto done;
+    // JSON can't start with this, so it's safe to switch based on it.
+    client->protocol_known = true;
+    if (bstr_startswith(client->in, magic)) {
+        MP_VERBOSE(client, "Switching to CBOR\n");
+        client->cbor = true;
+        memmove(client->in.start, client->in.start + magic.len,
+                client->in.len - magic.len);
+        client->in.len -= magic.len;
+        // Acknowledge the switch: anything sent after this is CBOR.
+        if (client->writable)
+            bstr_xappend(client, &client->out, magic);
     }
+    return true;
+}
 
-    MP_VERBOSE(arg, "Client connected\n");
+// Execute all complete commands in the input buffer. Commands are not waited
+// for, so that one slow command doesn't stall the other clients of the loop;
+// execution stops at a command whose reply must be sent before the next one
+// runs, and continues once the reply was received. Returns false if the input
+// is malformed and the connection has to be closed.
+static bool client_execute_input(struct client_arg *client)
+{
+    if (!client->protocol_known && !client_negotiate(client))
+        return true;
+
+    bool ok = true;
+    bstr rest = client->in;
+    if (client->cbor) {
+        int r = 1;
+        while (r > 0 && !mp_ipc_requests_busy(client->requests)) {
+            // Parse a message only once it is complete. The scan resumes where
+            // the previous read stopped, so a large message arriving in many
+            // reads is not parsed from the start each time.
+            if (cbor_scan(&client->cbor_scan, rest) == CBOR_INCOMPLETE)
+                break;
+            r = mp_ipc_execute_cbor(client->client, client->requests,
+                                    &rest, &client->out);
+            client->cbor_scan = (struct cbor_scan){0};
+        }
+        ok = r >= 0;
+    } else {
+        while (!mp_ipc_requests_busy(client->requests) &&
+               bstrchr(rest, '\n') != -1)
+        {
+            bstr line = bstr_getline(rest, &rest);
+            char *reply_msg = mp_ipc_execute_line(client->client,
+                                                  client->requests, NULL, line);
+            if (reply_msg)
+                client_queue_str(client, reply_msg);
+            talloc_free(reply_msg);
+        }
+    }
+    memmove(client->in.start, rest.start, rest.len);
+    client->in.len = rest.len;
+    if (!client->writable)
+        client->out.len = client->out_sent = 0;
+    return ok;
+}
 
-    struct pollfd fds[2] = {
-        {.events = POLLIN, .fd = pipe_fd},
-        {.events = POLLIN, .fd = arg->client_fd},
-    };
+// Read what is available from the socket and execute all complete commands.
+// Stops early if too much output is queued, or if a command must finish
+// first. Returns false on disconnect or errors.
+static bool client_read_input(struct client_arg *client)
+{
+    while (client_backlog(client) < IPC_WRITE_BATCH &&
+           !mp_ipc_requests_busy(client->requests))
+    {
+        size_t size = talloc_get_size(client->in.start);
+        if (size < client->in.len + IPC_READ_SIZE) {
+            size = MPMAX(size * 2, client->in.len + IPC_READ_SIZE);
+            client->in.start = talloc_realloc_size(client, client->in.start, size);
+        }
 
-    fcntl(arg->client_fd, F_SETFL, fcntl(arg->client_fd, F_GETFL, 0) | O_NONBLOCK);
+        ssize_t bytes = read(client->client_fd, client->in.start + client->in.len,
+                             IPC_READ_SIZE);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno == EINTR)
+                continue;
 
-    while (1) {
-        rc = poll(fds, 2, 0);
-        if (rc == 0)
-            rc = poll(fds, 2, -1);
-        if (rc < 0) {
-            MP_ERR(arg, "Poll error\n");
-            continue;
+            MP_ERR(client, "Read error (%s)\n", mp_strerror(errno));
+            return false;
         }
 
-        if (fds[0].revents & POLLIN) {
-            mp_flush_wakeup_pipe(pipe_fd);
+        if (bytes == 0) {
+            MP_VERBOSE(client, "Client disconnected\n");
+            return false;
+        }
 
-            while (1) {
-                mpv_event *event = mpv_wait_event(arg->client, 0);
+        client->in.len += bytes;
 
-                if (event->event_id == MPV_EVENT_NONE)
-                    break;
+        if (!client_execute_input(client)) {
+            client->closing = true;
+            return true;
+        }
+    }
+    return true;
+}
 
-                if (event->event_id == MPV_EVENT_SHUTDOWN)
-                    goto done;
+// Encode queued events. Stops early if too much output is queued. Returns
+// false on MPV_EVENT_SHUTDOWN and encoding errors, after which the client is
+// dropped.
+static bool client_read_events(struct client_arg *client)
+{
+    bool ok = true;
+    while (client->want_events && client_backlog(client) < IPC_WRITE_BATCH) {
+        mpv_event *event = mpv_wait_event(client->client, 0);
 
-                if (!arg->writable)
-                    continue;
+        if (event->event_id == MPV_EVENT_NONE) {
+            client->want_events = false;
+            break;
+        }
 
-                char *event_msg = mp_json_encode_event(event);
-                if (!event_msg) {
-                    MP_ERR(arg, "Encoding error\n");
-                    goto done;
-                }
+        if (event->event_id == MPV_EVENT_SHUTDOWN) {
+            ok = false;
+            break;
+        }
 
-                rc = ipc_write_str(arg, event_msg);
-                talloc_free(event_msg);
-                if (rc < 0) {
-                    MP_ERR(arg, "Write error (%s)\n", mp_strerror(errno));
-                    goto done;
-                }
-            }
+        if (!client->writable)
+            continue;
+        bool encoded;
+        if (client->cbor) {
+            encoded = mp_cbor_append_event(client->requests, client->tmp,
+                                           &client->out, event);
+        } else {
+            encoded = mp_json_append_event(client->requests, client->tmp,
+                                           &client->out, event);
+        }
+        if (!encoded) {
+            MP_ERR(client, "Encoding error\n");
+            ok = false;
+            break;
         }
+    }
+    talloc_free_children(client->tmp);
+    return ok;
+}
 
-        if (fds[1].revents & (POLLIN | POLLHUP | POLLNVAL)) {
-            while (1) {
-                char buf[128];
-                bstr append = { buf, 0 };
+static void client_update_watches(struct ipc_loop *loop,
+                                  struct client_arg *client)
+{
+    // If encoding events stopped at the batch limit, continue as soon as the
+    // socket is writable again.
+    bool backlogged = client_backlog(client) >= IPC_WRITE_BATCH;
+    bool busy = mp_ipc_requests_busy(client->requests);
+    bool want_write = client_backlog(client) || client->want_events;
+    client->sock_watch.events = (client->closing || backlogged || busy ? 0 : POLLIN) |
+                                (want_write ? POLLOUT : 0);
+    client->pipe_watch.events = client->closing ? 0 : POLLIN;
+    loop_update_watch(loop, &client->sock_watch);
+    loop_update_watch(loop, &client->pipe_watch);
+}
 
-                ssize_t bytes = read(arg->client_fd, buf, sizeof(buf));
-                if (bytes < 0) {
-                    if (errno == EAGAIN)
-                        break;
+static void client_process(struct ipc_loop *loop, struct client_arg *client)
+{
+    if (client->dead)
+        return;
 
-                    MP_ERR(arg, "Read error (%s)\n", mp_strerror(errno));
-                    goto done;
-                }
+    int sock_revents = client->sock_watch.revents;
+    int pipe_revents = client->pipe_watch.revents;
+    client->sock_watch.revents = client->pipe_watch.revents = 0;
 
-                if (bytes == 0) {
-                    MP_VERBOSE(arg, "Client disconnected\n");
-                    goto done;
-                }
+    if (pipe_revents & POLLIN) {
+        mp_flush_wakeup_pipe(client->pipe_fd);
+        client->want_events = true;
+    }
 
-                append.len = bytes;
+    if (!client->closing && (sock_revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+        if (!client_read_input(client)) {
+            client->dead = true;
+            return;
+        }
+    }
 
-                bstr_xappend(NULL, &client_msg, append);
+    if (!client->closing && !client_read_events(client))
+        client->closing = true;
 
-                while (bstrchr(client_msg, '\n') != -1) {
-                    char *reply_msg = mp_ipc_consume_next_command(arg->client,
-                        NULL, &client_msg);
+    // The reply the remaining input waited for may have arrived.
+    if (!client->closing && !mp_ipc_requests_busy(client->requests) &&
+        client->in.len && !client_execute_input(client))
+        client->closing = true;
 
-                    if (reply_msg && arg->writable) {
-                        rc = ipc_write_str(arg, reply_msg);
-                        if (rc < 0) {
-                            MP_ERR(arg, "Write error (%s)\n", mp_strerror(errno));
-                            talloc_free(reply_msg);
-                            goto done;
-                        }
-                    }
+    // All events and replies of this wakeup are sent at once.
+    if (client_send(client) < 0) {
+        MP_ERR(client, "Write error (%s)\n", mp_strerror(errno));
+        client->dead = true;
+        return;
+    }
 
-                    talloc_free(reply_msg);
-                }
-            }
-        }
+    if (client->closing && !client_backlog(client)) {
+        client->dead = true;
+        return;
     }
 
-done:
-    if (client_msg.len > 0)
-        MP_WARN(arg, "Ignoring unterminated command on disconnect.\n");
-    talloc_free(client_msg.start);
-    if (arg->close_client_fd)
-        close(arg->client_fd);
-    struct mpv_handle *h = arg->client;
-    bool quit = arg->quit_on_close;
-    talloc_free(arg);
+    client_update_watches(loop, client);
+}
+
+static MP_THREAD_VOID terminate_thread(void *p)
+{
+    mp_thread_set_name("ipc/quit");
+    mpv_terminate_destroy(p);
+    MP_THREAD_RETURN();
+}
+
+static void client_destroy(struct ipc_loop *loop, struct client_arg *client)
+{
+    if (client->in.len > 0)
+        MP_WARN(client, "Ignoring unterminated command on disconnect.\n");
+    loop_remove_watch(loop, &client->sock_watch);
+    loop_remove_watch(loop, &client->pipe_watch);
+    if (client->close_client_fd)
+        close(client->client_fd);
+    struct mpv_handle *h = client->client;
+    bool quit = client->quit_on_close;
+    talloc_free(client);
     if (quit) {
-        mpv_terminate_destroy(h);
+        // This waits until the core thread is done, which may need other
+        // clients of this loop to go away first.
+        mp_thread thread;
+        if (mp_thread_create(&thread, terminate_thread, h)) {
+            mpv_terminate_destroy(h);
+        } else {
+            mp_thread_detach(thread);
+        }
     } else {
         mpv_destroy(h);
     }
-    MP_THREAD_RETURN();
 }
 
-static bool ipc_start_client(struct mp_ipc_ctx *ctx, struct client_arg *client,
-                             bool free_on_init_fail)
+static void client_start(struct ipc_loop *loop, struct client_arg *client)
 {
-    if (!client->client)
-        client->client = mp_new_client(ctx->client_api, client->client_name);
-    if (!client->client)
-        goto err;
-
     client->log = mp_client_get_log(client->client);
+    client->tmp = talloc_new(client);
+    client->requests = mp_ipc_requests_create(client);
+    // Appending events doesn't take a talloc parent, so allocate it here.
+    client->out.start = talloc_size(client, IPC_READ_SIZE);
+
+    client->pipe_fd = mpv_get_wakeup_pipe(client->client);
+    watch_init(&client->sock_watch, client->client_fd, client);
+    watch_init(&client->pipe_watch, client->pipe_fd, client);
+    if (client->pipe_fd < 0) {
+        MP_ERR(client, "Could not get wakeup pipe\n");
+        client_destroy(loop, client);
+        return;
+    }
 
-    mp_thread client_thr;
-    if (mp_thread_create(&client_thr, client_thread, client))
-        goto err;
-    mp_thread_detach(client_thr);
+    MP_VERBOSE(client, "Client connected\n");
 
-    return true;
+    fcntl(client->client_fd, F_SETFL,
+          fcntl(client->client_fd, F_GETFL, 0) | O_NONBLOCK);
 
-err:
-    if (free_on_init_fail) {
-        if (client->client)
-            mpv_destroy(client->client);
+    // Events may have been queued before the client was added.
+    client->want_events = true;
+    MP_TARRAY_APPEND(loop, loop->clients, loop->num_clients, client);
+    client_process(loop, client);
+}
 
-        if (client->close_client_fd)
-            close(client->client_fd);
+// Hand the client to the loop thread. Fails if the loop is stopping.
+static bool loop_add_client(struct ipc_loop *loop, struct client_arg *client)
+{
+    mp_mutex_lock(&loop->lock);
+    bool ok = !loop->stop;
+    if (ok) {
+        MP_TARRAY_APPEND(loop, loop->new_clients, loop->num_new_clients, client);
+        (void)write(loop->wakeup_pipe[1], &(char){0}, 1);
     }
-
-    talloc_free(client);
-    return false;
+    mp_mutex_unlock(&loop->lock);
+    return ok;
 }
 
-static void ipc_start_client_json(struct mp_ipc_ctx *ctx, int id, int fd)
+static struct client_arg *new_json_client(struct ipc_loop *loop, int id, int fd)
 {
     struct client_arg *client = talloc_ptrtype(NULL, client);
     *client = (struct client_arg){
@@ -261,67 +575,67 @@ static void ipc_start_client_json(struct mp_ipc_ctx *ctx, int id, int fd)
         .writable = true,
     };
 
-    ipc_start_client(ctx, client, true);
+    client->client = mp_new_client(loop->client_api, client->client_name);
+    if (!client->client) {
+        if (client->close_client_fd)
+            close(client->client_fd);
+        talloc_free(client);
+        return NULL;
+    }
+    return client;
 }
 
-bool mp_ipc_start_anon_client(struct mp_ipc_ctx *ctx, struct mpv_handle *h,
-                              int out_fd[2])
+static void loop_accept(struct ipc_loop *loop)
 {
-    int pair[2];
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
-        return false;
-    mp_set_cloexec(pair[0]);
-    mp_set_cloexec(pair[1]);
-
-    struct client_arg *client = talloc_ptrtype(NULL, client);
-    *client = (struct client_arg){
-        .client = h,
-        .client_name = mpv_client_name(h),
-        .client_fd   = pair[1],
-        .close_client_fd = true,
-        .writable = true,
-    };
+    while (1) {
+        int client_fd = accept(loop->listen_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            MP_ERR(loop, "Could not accept IPC client\n");
+            loop_remove_watch(loop, &loop->listen_watch);
+            close(loop->listen_fd);
+            loop->listen_fd = loop->listen_watch.fd = -1;
+            return;
+        }
 
-    if (!ipc_start_client(ctx, client, false)) {
-        close(pair[0]);
-        close(pair[1]);
-        return false;
+        // The client API may be gone once the loop is stopped.
+        mp_mutex_lock(&loop->lock);
+        bool stop = loop->stop;
+        struct client_arg *client = NULL;
+        if (!stop)
+            client = new_json_client(loop, loop->client_num++, client_fd);
+        mp_mutex_unlock(&loop->lock);
+        if (stop)
+            close(client_fd);
+        if (client)
+            client_start(loop, client);
     }
-
-    out_fd[0] = pair[0];
-    out_fd[1] = -1;
-    return true;
 }
 
-static MP_THREAD_VOID ipc_thread(void *p)
+static void loop_listen(struct ipc_loop *loop)
 {
     int rc;
 
     int ipc_fd;
     struct sockaddr_un ipc_un = {0};
 
-    struct mp_ipc_ctx *arg = p;
-
-    mp_thread_set_name("ipc/socket");
-
-    MP_VERBOSE(arg, "Starting IPC master\n");
-
     ipc_fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (ipc_fd < 0) {
-        MP_ERR(arg, "Could not create IPC socket\n");
-        goto done;
+        MP_ERR(loop, "Could not create IPC socket\n");
+        goto err;
     }
 
     fchmod(ipc_fd, 0600);
 
-    size_t path_len = strlen(arg->path);
+    size_t path_len = strlen(loop->path);
     if (path_len >= sizeof(ipc_un.sun_path) - 1) {
-        MP_ERR(arg, "Could not create IPC socket\n");
-        goto done;
+        MP_ERR(loop, "Could not create IPC socket\n");
+        goto err;
     }
 
     ipc_un.sun_family = AF_UNIX,
-    strncpy(ipc_un.sun_path, arg->path, sizeof(ipc_un.sun_path) - 1);
+    strncpy(ipc_un.sun_path, loop->path, sizeof(ipc_un.sun_path) - 1);
 
     unlink(ipc_un.sun_path);
 
@@ -333,53 +647,203 @@ static MP_THREAD_VOID ipc_thread(void *p)
     size_t addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + path_len;
     rc = bind(ipc_fd, (struct sockaddr *) &ipc_un, addr_len);
     if (rc < 0) {
-        MP_ERR(arg, "Could not bind IPC socket\n");
-        goto done;
+        MP_ERR(loop, "Could not bind IPC socket\n");
+        goto err;
     }
 
     rc = listen(ipc_fd, 10);
     if (rc < 0) {
-        MP_ERR(arg, "Could not listen on IPC socket\n");
-        goto done;
+        MP_ERR(loop, "Could not listen on IPC socket\n");
+        goto err;
     }
 
-    MP_VERBOSE(arg, "Listening to IPC socket.\n");
+    fcntl(ipc_fd, F_SETFL, fcntl(ipc_fd, F_GETFL, 0) | O_NONBLOCK);
 
-    int client_num = 0;
+    MP_VERBOSE(loop, "Listening to IPC socket.\n");
 
-    struct pollfd fds[2] = {
-        {.events = POLLIN, .fd = arg->death_pipe[0]},
-        {.events = POLLIN, .fd = ipc_fd},
-    };
+    loop->listen_fd = ipc_fd;
+    watch_init(&loop->listen_watch, ipc_fd, NULL);
+    loop->listen_watch.events = POLLIN;
+    loop_update_watch(loop, &loop->listen_watch);
+    return;
+
+err:
+    if (ipc_fd >= 0)
+        close(ipc_fd);
+}
+
+static MP_THREAD_VOID ipc_loop_thread(void *p)
+{
+    // We don't use MSG_NOSIGNAL because the moldy fruit OS doesn't support it.
+    struct sigaction sa = { .sa_handler = SIG_IGN, .sa_flags = SA_RESTART };
+    sigfillset(&sa.sa_mask);
+    sigaction(SIGPIPE, &sa, NULL);
+
+    struct ipc_loop *loop = p;
+
+    mp_thread_set_name("ipc");
+
+    if (loop->path) {
+        MP_VERBOSE(loop, "Starting IPC master\n");
+        loop_listen(loop);
+    }
 
     while (1) {
-        rc = poll(fds, 2, -1);
-        if (rc < 0) {
-            MP_ERR(arg, "Poll error\n");
-            continue;
+        mp_mutex_lock(&loop->lock);
+        bool stop = loop->stop;
+        struct client_arg **new_clients = loop->new_clients;
+        int num_new_clients = loop->num_new_clients;
+        loop->new_clients = NULL;
+        loop->num_new_clients = 0;
+        mp_mutex_unlock(&loop->lock);
+
+        for (int n = 0; n < num_new_clients; n++)
+            client_start(loop, new_clients[n]);
+        talloc_free(new_clients);
+
+        if (stop && loop->listen_fd >= 0) {
+            loop_remove_watch(loop, &loop->listen_watch);
+            close(loop->listen_fd);
+            loop->listen_fd = loop->listen_watch.fd = -1;
         }
 
-        if (fds[0].revents & POLLIN)
-            goto done;
-
-        if (fds[1].revents & POLLIN) {
-            int client_fd = accept(ipc_fd, NULL, NULL);
-            if (client_fd < 0) {
-                MP_ERR(arg, "Could not accept IPC client\n");
-                goto done;
+        for (int n = loop->num_clients - 1; n >= 0; n--) {
+            struct client_arg *client = loop->clients[n];
+            if (client->dead) {
+                MP_TARRAY_REMOVE_AT(loop->clients, loop->num_clients, n);
+                client_destroy(loop, client);
             }
+        }
 
-            ipc_start_client_json(arg, client_num++, client_fd);
+        // Nobody can add clients anymore once stop is set.
+        if (stop && !loop->num_clients && !num_new_clients)
+            break;
+
+        loop->num_ready = 0;
+        loop_wait(loop);
+
+        // A client can be ready on both of its fds; process it only once.
+        loop->num_touched = 0;
+        for (int n = 0; n < loop->num_ready; n++) {
+            struct ipc_watch *w = loop->ready[n];
+            if (w == &loop->wakeup_watch) {
+                mp_flush_wakeup_pipe(loop->wakeup_pipe[0]);
+            } else if (w == &loop->listen_watch) {
+                loop_accept(loop);
+            } else if (!w->client->touched) {
+                w->client->touched = true;
+                MP_TARRAY_APPEND(loop, loop->touched, loop->num_touched, w->client);
+            }
+        }
+        for (int n = 0; n < loop->num_touched; n++) {
+            loop->touched[n]->touched = false;
+            client_process(loop, loop->touched[n]);
         }
     }
 
-done:
-    if (ipc_fd >= 0)
-        close(ipc_fd);
-
+    close(loop->wakeup_pipe[0]);
+    close(loop->wakeup_pipe[1]);
+    loop_uninit_backend(loop);
+    mp_mutex_destroy(&loop->lock);
+    talloc_free(loop);
     MP_THREAD_RETURN();
 }
 
+static struct ipc_loop *ipc_loop_create(struct mp_log *log,
+                                        struct mp_client_api *client_api,
+                                        const char *path)
+{
+    struct ipc_loop *loop = talloc_ptrtype(NULL, loop);
+    *loop = (struct ipc_loop){
+        .log = log ? mp_log_new(loop, log, NULL) : mp_null_log,
+        .client_api = client_api,
+        .path = talloc_strdup(loop, path),
+        .wakeup_pipe = {-1, -1},
+        .listen_fd = -1,
+    };
+    mp_mutex_init(&loop->lock);
+    watch_init(&loop->listen_watch, -1, NULL);
+
+    if (!loop_init_backend(loop))
+        goto err;
+
+    if (mp_make_wakeup_pipe(loop->wakeup_pipe) < 0)
+        goto err;
+    watch_init(&loop->wakeup_watch, loop->wakeup_pipe[0], NULL);
+    loop->wakeup_watch.events = POLLIN;
+    loop_update_watch(loop, &loop->wakeup_watch);
+
+    mp_thread thread;
+    if (mp_thread_create(&thread, ipc_loop_thread, loop))
+        goto err;
+    // The thread frees the loop itself: it keeps serving clients after
+    // mp_uninit_ipc() until they disconnect.
+    mp_thread_detach(thread);
+
+    return loop;
+
+err:
+    if (loop->wakeup_pipe[0] >= 0) {
+        close(loop->wakeup_pipe[0]);
+        close(loop->wakeup_pipe[1]);
+    }
+    loop_uninit_backend(loop);
+    mp_mutex_destroy(&loop->lock);
+    talloc_free(loop);
+    return NULL;
+}
+
+// Stop accepting new clients. The loop exits once all clients are gone, and
+// must not be accessed after this call.
+static void ipc_loop_stop(struct ipc_loop *loop)
+{
+    mp_mutex_lock(&loop->lock);
+    loop->stop = true;
+    (void)write(loop->wakeup_pipe[1], &(char){0}, 1);
+    mp_mutex_unlock(&loop->lock);
+}
+
+bool mp_ipc_start_anon_client(struct mp_ipc_ctx *ctx, struct mpv_handle *h,
+                              int out_fd[2])
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+        return false;
+    mp_set_cloexec(pair[0]);
+    mp_set_cloexec(pair[1]);
+
+    struct client_arg *client = talloc_ptrtype(NULL, client);
+    *client = (struct client_arg){
+        .client = h,
+        .client_name = mpv_client_name(h),
+        .client_fd   = pair[1],
+        .close_client_fd = true,
+        .writable = true,
+    };
+
+    // Without IPC context, the client gets a loop of its own.
+    struct ipc_loop *loop = ctx ? ctx->loop : NULL;
+    bool own_loop = !loop;
+    if (own_loop)
+        loop = ipc_loop_create(NULL, NULL, NULL);
+
+    if (!loop || !loop_add_client(loop, client)) {
+        if (own_loop && loop)
+            ipc_loop_stop(loop);
+        talloc_free(client);
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+
+    if (own_loop)
+        ipc_loop_stop(loop);
+
+    out_fd[0] = pair[0];
+    out_fd[1] = -1;
+    return true;
+}
+
 struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
                                struct mpv_global *global)
 {
@@ -388,44 +852,49 @@ struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
     struct mp_ipc_ctx *arg = talloc_ptrtype(NULL, arg);
     *arg = (struct mp_ipc_ctx){
         .log        = mp_log_new(arg, global->log, "ipc"),
-        .client_api = client_api,
-        .path       = mp_get_user_path(arg, global, opts->ipc_path),
-        .death_pipe = {-1, -1},
     };
 
+    char *path = mp_get_user_path(arg, global, opts->ipc_path);
+    int client_fd = -1;
+
     if (opts->ipc_client && opts->ipc_client[0]) {
-        int fd = -1;
         bstr str = bstr0(opts->ipc_client);
         if (bstr_eatstart0(&str, "fd://") && str.len) {
             long long ll = bstrtoll(str, &str, 0);
             if (!str.len && ll >= 0 && ll <= INT_MAX)
-                fd = ll;
+                client_fd = ll;
         }
-        if (fd < 0) {
+        if (client_fd < 0)
             MP_ERR(arg, "Invalid IPC client argument: '%s'\n", opts->ipc_client);
-        } else {
-            ipc_start_client_json(arg, -1, fd);
-        }
     }
 
     talloc_free(opts);
 
-    if (!arg->path || !arg->path[0])
+    if (!(path && path[0]) && client_fd < 0)
         goto out;
 
-    if (mp_make_wakeup_pipe(arg->death_pipe) < 0)
+    arg->loop = ipc_loop_create(arg->log, client_api,
+                                path && path[0] ? path : NULL);
+    if (!arg->loop)
         goto out;
 
-    if (mp_thread_create(&arg->thread, ipc_thread, arg))
+    if (client_fd >= 0) {
+        struct client_arg *client = new_json_client(arg->loop, -1, client_fd);
+        if (client && !loop_add_client(arg->loop, client)) {
+            mpv_destroy(client->client);
+            talloc_free(client);
+        }
+    }
+
+    if (!(path && path[0])) {
+        // Only serve the --input-ipc-client connection.
+        ipc_loop_stop(arg->loop);
         goto out;
+    }
 
     return arg;
 
 out:
-    if (arg->death_pipe[0] >= 0) {
-        close(arg->death_pipe[0]);
-        close(arg->death_pipe[1]);
-    }
     talloc_free(arg);
     return NULL;
 }
@@ -435,10 +904,6 @@ void mp_uninit_ipc(struct mp_ipc_ctx *arg)
     if (!arg)
         return;
 
-    (void)write(arg->death_pipe[1], &(char){0}, 1);
-    mp_thread_join(arg->thread);
-
-    close(arg->death_pipe[0]);
-    close(arg->death_pipe[1]);
+    ipc_loop_stop(arg->loop);
     talloc_free(arg);
 }
@@ -19,6 +19,7 @@
 
 #include "common/msg.h"
 #include "input/input.h"
+#include "misc/cbor.h"
 #include "misc/json.h"
 #include "misc/node.h"
 #include "options/m_option.h"
@@ -89,58 +90,162 @@ static void mpv_format_command_reply(void *ta_parent, mpv_event *event,
     mpv_node_map_add(ta_parent, dst, "data", &cmd->result);
 }
 
-char *mp_json_encode_event(mpv_event *event)
+// Commands of an IPC connection that are waited for without blocking.
+struct mp_ipc_requests {
+    uint64_t next_id;           // reply_userdata of the next command
+
+    // A command without "async" flag is running. Further requests are not
+    // executed until its reply was received, so that they run in order.
+    bool sync_pending;
+    uint64_t sync_id;
+    mpv_node *sync_reqid;       // "request_id" of its reply; NULL: no reply
+
+    // Running commands with "async" flag, by reply_userdata.
+    struct async_request {
+        uint64_t id;
+        int64_t reqid;          // "request_id" of the request
+    } *async;
+    int num_async;
+};
+
+struct mp_ipc_requests *mp_ipc_requests_create(void *ta_parent)
 {
-    void *ta_parent = talloc_new(NULL);
+    return talloc_zero(ta_parent, struct mp_ipc_requests);
+}
+
+bool mp_ipc_requests_busy(struct mp_ipc_requests *reqs)
+{
+    return reqs->sync_pending;
+}
+
+static void start_sync_request(struct mp_ipc_requests *reqs, uint64_t id,
+                               mpv_node *reqid_node)
+{
+    reqs->sync_pending = true;
+    reqs->sync_id = id;
+    if (reqid_node) {
+        static const struct m_option type = { .type = CONF_TYPE_NODE };
+        reqs->sync_reqid = talloc(reqs, mpv_node);
+        m_option_get_node(&type, reqs->sync_reqid, reqs->sync_reqid, reqid_node);
+    }
+}
+
+// Turn the reply to a command issued by execute_command() into what the IPC
+// client expects. Returns false if nothing is sent for it.
+static bool command_reply_to_node(struct mp_ipc_requests *reqs, void *ta_tmp,
+                                  mpv_event *event, mpv_node *dst)
+{
+    *dst = (mpv_node){.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
+
+    if (reqs && reqs->sync_pending && event->reply_userdata == reqs->sync_id) {
+        reqs->sync_pending = false;
+        if (!reqs->sync_reqid)
+            return false;
+
+        // Same as the reply execute_command() would have written if it had
+        // waited for the command.
+        mpv_event_command *cmd = event->data;
+        if (event->error >= 0)
+            mpv_node_map_add(ta_tmp, dst, "data", &cmd->result);
+        mpv_node_map_add(ta_tmp, dst, "request_id", reqs->sync_reqid);
+        mpv_node_map_add_string(ta_tmp, dst, "error",
+                                mpv_error_string(event->error));
+        TA_FREEP(&reqs->sync_reqid);
+        return true;
+    }
+
+    mpv_event reply = *event;
+    for (int n = 0; reqs && n < reqs->num_async; n++) {
+        if (reqs->async[n].id == event->reply_userdata) {
+            reply.reply_userdata = reqs->async[n].reqid;
+            MP_TARRAY_REMOVE_AT(reqs->async, reqs->num_async, n);
+            break;
+        }
+    }
+    mpv_format_command_reply(ta_tmp, &reply, dst);
+    return true;
+}
 
+// Returns false if nothing is sent for the event.
+static bool event_to_node(struct mp_ipc_requests *reqs, void *ta_tmp,
+                          mpv_event *event, mpv_node *dst)
+{
+    if (event->event_id == MPV_EVENT_COMMAND_REPLY)
+        return command_reply_to_node(reqs, ta_tmp, event, dst);
+
+    mpv_event_to_node(dst, event);
+    // Abuse mpv_event_to_node() internals.
+    talloc_steal(ta_tmp, node_get_alloc(dst));
+    return true;
+}
+
+bool mp_json_append_event(struct mp_ipc_requests *reqs, void *ta_tmp,
+                          bstr *dst, mpv_event *event)
+{
     struct mpv_node event_node;
-    if (event->event_id == MPV_EVENT_COMMAND_REPLY) {
-        event_node = (mpv_node){.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
-        mpv_format_command_reply(ta_parent, event, &event_node);
-    } else {
-        mpv_event_to_node(&event_node, event);
-        // Abuse mpv_event_to_node() internals.
-        talloc_steal(ta_parent, node_get_alloc(&event_node));
+    if (!event_to_node(reqs, ta_tmp, event, &event_node))
+        return true;
+    size_t len = dst->len;
+    if (json_append(dst, &event_node, -1) < 0) {
+        dst->len = len;
+        return false;
     }
+    bstr_xappend(NULL, dst, bstr0("\n"));
+    return true;
+}
+
+bool mp_cbor_append_event(struct mp_ipc_requests *reqs, void *ta_tmp,
+                          bstr *dst, mpv_event *event)
+{
+    struct mpv_node event_node;
+    if (!event_to_node(reqs, ta_tmp, event, &event_node))
+        return true;
+    size_t len = dst->len;
+    if (cbor_append(dst, &event_node) < 0) {
+        dst->len = len;
+        return false;
+    }
+    return true;
+}
 
-    char *output = talloc_strdup(NULL, "");
-    json_write(&output, &event_node);
-    output = ta_talloc_strdup_append(output, "\n");
+char *mp_json_encode_event(mpv_event *event)
+{
+    void *ta_parent = talloc_new(NULL);
+
+    bstr output = {0};
+    if (!mp_json_append_event(NULL, ta_parent, &output, event))
+        TA_FREEP(&output.start);
 
     talloc_free(ta_parent);
 
-    return output;
+    return output.start;
 }
 
-// Function is allowed to modify src[n].
-static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
-                                  char *src)
+// Execute the request in msg_node, which is NULL if it could not be parsed,
+// and write the reply to *reply_node. Returns false if no reply is sent now.
+// If reqs is set, commands are not waited for, and their reply is sent by
+// mp_json_append_event()/mp_cbor_append_event() once they finish.
+static bool execute_command(struct mpv_handle *client,
+                            struct mp_ipc_requests *reqs, void *ta_parent,
+                            mpv_node *msg_node, mpv_node *reply_node)
 {
     int rc;
     const char *cmd = NULL;
     struct mp_log *log = mp_client_get_log(client);
 
-    mpv_node msg_node;
-    mpv_node reply_node = {.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
+    *reply_node = (mpv_node){.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
     mpv_node *reqid_node = NULL;
     int64_t reqid = 0;
     mpv_node *async_node = NULL;
     bool async = false;
     bool send_reply = true;
 
-    rc = json_parse(ta_parent, &msg_node, &src, MAX_JSON_DEPTH);
-    if (rc < 0) {
-        mp_err(log, "malformed JSON received: '%s'\n", src);
-        rc = MPV_ERROR_INVALID_PARAMETER;
-        goto error;
-    }
-
-    if (msg_node.format != MPV_FORMAT_NODE_MAP) {
+    if (!msg_node || msg_node->format != MPV_FORMAT_NODE_MAP) {
         rc = MPV_ERROR_INVALID_PARAMETER;
         goto error;
     }
 
-    async_node = node_map_get(&msg_node, "async");
+    async_node = node_map_get(msg_node, "async");
     if (async_node) {
         if (async_node->format != MPV_FORMAT_FLAG) {
             rc = MPV_ERROR_INVALID_PARAMETER;
@@ -149,7 +254,7 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         async = async_node->u.flag;
     }
 
-    reqid_node = node_map_get(&msg_node, "request_id");
+    reqid_node = node_map_get(msg_node, "request_id");
     if (reqid_node) {
         if (reqid_node->format == MPV_FORMAT_INT64) {
             reqid = reqid_node->u.int64;
@@ -163,7 +268,7 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         }
     }
 
-    mpv_node *cmd_node = node_map_get(&msg_node, "command");
+    mpv_node *cmd_node = node_map_get(msg_node, "command");
     if (!cmd_node) {
         rc = MPV_ERROR_INVALID_PARAMETER;
         goto error;
@@ -181,15 +286,15 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
 
     if (cmd && !strcmp("client_name", cmd)) {
         const char *client_name = mpv_client_name(client);
-        mpv_node_map_add_string(ta_parent, &reply_node, "data", client_name);
+        mpv_node_map_add_string(ta_parent, reply_node, "data", client_name);
         rc = MPV_ERROR_SUCCESS;
     } else if (cmd && !strcmp("get_time_us", cmd)) {
         int64_t time_us = mpv_get_time_us(client);
-        mpv_node_map_add_int64(ta_parent, &reply_node, "data", time_us);
+        mpv_node_map_add_int64(ta_parent, reply_node, "data", time_us);
         rc = MPV_ERROR_SUCCESS;
     } else if (cmd && !strcmp("get_version", cmd)) {
         int64_t ver = mpv_client_api_version();
-        mpv_node_map_add_int64(ta_parent, &reply_node, "data", ver);
+        mpv_node_map_add_int64(ta_parent, reply_node, "data", ver);
         rc = MPV_ERROR_SUCCESS;
     } else if (cmd && !strcmp("get_property", cmd)) {
         mpv_node result_node;
@@ -207,7 +312,7 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         rc = mpv_get_property(client, cmd_node->u.list->values[1].u.string,
                               MPV_FORMAT_NODE, &result_node);
         if (rc >= 0) {
-            mpv_node_map_add(ta_parent, &reply_node, "data", &result_node);
+            mpv_node_map_add(ta_parent, reply_node, "data", &result_node);
             mpv_free_node_contents(&result_node);
         }
     } else if (cmd && !strcmp("get_property_string", cmd)) {
@@ -224,10 +329,10 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         char *result = mpv_get_property_string(client,
                                         cmd_node->u.list->values[1].u.string);
         if (result) {
-            mpv_node_map_add_string(ta_parent, &reply_node, "data", result);
+            mpv_node_map_add_string(ta_parent, reply_node, "data", result);
             mpv_free(result);
         } else {
-            mpv_node_map_add_null(ta_parent, &reply_node, "data");
+            mpv_node_map_add_null(ta_parent, reply_node, "data");
         }
     } else if (cmd && (!strcmp("set_property", cmd) ||
                        !strcmp("set_property_string", cmd)))
@@ -284,6 +389,25 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
                                   cmd_node->u.list->values[1].u.int64,
                                   cmd_node->u.list->values[2].u.string,
                                   MPV_FORMAT_STRING);
+    } else if (cmd && !strcmp("observe_property_delta", cmd)) {
+        if (cmd_node->u.list->num != 3) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+
+        if (cmd_node->u.list->values[1].format != MPV_FORMAT_INT64) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+
+        if (cmd_node->u.list->values[2].format != MPV_FORMAT_STRING) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+
+        rc = mpv_observe_property_delta(client,
+                                        cmd_node->u.list->values[1].u.int64,
+                                        cmd_node->u.list->values[2].u.string);
     } else if (cmd && !strcmp("unobserve_property", cmd)) {
         if (cmd_node->u.list->num != 2) {
             rc = MPV_ERROR_INVALID_PARAMETER;
@@ -346,14 +470,32 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
     } else {
         mpv_node result_node = {0};
 
-        if (async) {
+        if (reqs && async) {
+            uint64_t id = ++reqs->next_id;
+            rc = mpv_command_node_async(client, id, cmd_node);
+            if (rc >= 0) {
+                MP_TARRAY_APPEND(reqs, reqs->async, reqs->num_async,
+                                 (struct async_request){id, reqid});
+                send_reply = false;
+            }
+        } else if (reqs) {
+            uint64_t id = ++reqs->next_id;
+            rc = mp_client_command_node_nowait(client, id, cmd_node);
+            if (rc == 1) {
+                mpv_node reqid0 = {.format = MPV_FORMAT_INT64, .u.int64 = 0};
+                start_sync_request(reqs, id, reqid_node ? reqid_node : &reqid0);
+                send_reply = false;
+            } else if (rc >= 0) {
+                mpv_node_map_add(ta_parent, reply_node, "data", &result_node);
+            }
+        } else if (async) {
             rc = mpv_command_node_async(client, reqid, cmd_node);
             if (rc >= 0)
                 send_reply = false;
         } else {
             rc = mpv_command_node(client, cmd_node, &result_node);
             if (rc >= 0)
-                mpv_node_map_add(ta_parent, &reply_node, "data", &result_node);
+                mpv_node_map_add(ta_parent, reply_node, "data", &result_node);
         }
 
         mpv_free_node_contents(&result_node);
@@ -365,16 +507,32 @@ error:
      * the original requests.
      */
     if (reqid_node) {
-        mpv_node_map_add(ta_parent, &reply_node, "request_id", reqid_node);
+        mpv_node_map_add(ta_parent, reply_node, "request_id", reqid_node);
     } else {
-        mpv_node_map_add_int64(ta_parent, &reply_node, "request_id", 0);
+        mpv_node_map_add_int64(ta_parent, reply_node, "request_id", 0);
     }
 
-    mpv_node_map_add_string(ta_parent, &reply_node, "error", mpv_error_string(rc));
+    mpv_node_map_add_string(ta_parent, reply_node, "error", mpv_error_string(rc));
+
+    return send_reply;
+}
+
+// Function is allowed to modify src[n].
+static char *json_execute_command(struct mpv_handle *client,
+                                  struct mp_ipc_requests *reqs,
+                                  void *ta_parent, char *src)
+{
+    mpv_node msg_node;
+    mpv_node *msg = &msg_node;
+    if (json_parse(ta_parent, &msg_node, &src, MAX_JSON_DEPTH) < 0) {
+        mp_err(mp_client_get_log(client), "malformed JSON received: '%s'\n", src);
+        msg = NULL;
+    }
 
     char *output = talloc_strdup(ta_parent, "");
 
-    if (send_reply) {
+    mpv_node reply_node;
+    if (execute_command(client, reqs, ta_parent, msg, &reply_node)) {
         json_write(&output, &reply_node);
         output = ta_talloc_strdup_append(output, "\n");
     }
@@ -382,22 +540,26 @@ error:
     return output;
 }
 
-static char *text_execute_command(struct mpv_handle *client, void *tmp, char *src)
+static char *text_execute_command(struct mpv_handle *client,
+                                  struct mp_ipc_requests *reqs, char *src)
 {
-    mpv_command_string(client, src);
+    if (reqs) {
+        uint64_t id = ++reqs->next_id;
+        if (mp_client_command_string_nowait(client, id, src) == 1)
+            start_sync_request(reqs, id, NULL);
+    } else {
+        mpv_command_string(client, src);
+    }
 
     return NULL;
 }
 
-char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *buf)
+char *mp_ipc_execute_line(struct mpv_handle *client,
+                          struct mp_ipc_requests *reqs, void *ctx, bstr line)
 {
     void *tmp = talloc_new(NULL);
 
-    bstr rest;
-    bstr line = bstr_getline(*buf, &rest);
     char *line0 = bstrto0(tmp, line);
-    talloc_steal(tmp, buf->start);
-    *buf = bstrdup(NULL, rest);
 
     json_skip_whitespace(&line0);
 
@@ -405,12 +567,56 @@ char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *bu
     if (line0[0] == '\0' || line0[0] == '#') {
         // skip
     } else if (line0[0] == '{') {
-        reply_msg = json_execute_command(client, tmp, line0);
+        reply_msg = json_execute_command(client, reqs, tmp, line0);
     } else {
-        reply_msg = text_execute_command(client, tmp, line0);
+        reply_msg = text_execute_command(client, reqs, line0);
     }
 
     talloc_steal(ctx, reply_msg);
     talloc_free(tmp);
     return reply_msg;
 }
+
+int mp_ipc_execute_cbor(struct mpv_handle *client, struct mp_ipc_requests *reqs,
+                        bstr *buf, bstr *dst)
+{
+    if (reqs && mp_ipc_requests_busy(reqs))
+        return 0;
+
+    void *tmp = talloc_new(NULL);
+
+    mpv_node msg_node;
+    mpv_node *msg = &msg_node;
+    int r = cbor_parse(tmp, &msg_node, buf, MAX_CBOR_DEPTH);
+    if (r == CBOR_INCOMPLETE) {
+        talloc_free(tmp);
+        return 0;
+    }
+    if (r < 0) {
+        mp_err(mp_client_get_log(client), "malformed CBOR received\n");
+        msg = NULL;
+    }
+
+    mpv_node reply_node;
+    size_t len = dst->len;
+    if (execute_command(client, reqs, tmp, msg, &reply_node) &&
+        cbor_append(dst, &reply_node) < 0)
+    {
+        mp_err(mp_client_get_log(client), "Encoding error\n");
+        dst->len = len;
+    }
+
+    talloc_free(tmp);
+    return msg ? 1 : -1;
+}
+
+char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *buf)
+{
+    bstr rest;
+    bstr line = bstr_getline(*buf, &rest);
+    char *reply_msg = mp_ipc_execute_line(client, NULL, ctx, line);
+    char *old = buf->start;
+    *buf = bstrdup(NULL, rest);
+    talloc_free(old);
+    return reply_msg;
+}
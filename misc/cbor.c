@@ -0,0 +1,403 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* CBOR (RFC 8949) parser and writer for mpv_node.
+ *
+ * This is a binary alternative to misc/json.c. Values map directly:
+ *  - null and undefined <-> MPV_FORMAT_NONE
+ *  - true/false <-> MPV_FORMAT_FLAG
+ *  - integers <-> MPV_FORMAT_INT64 (values outside int64_t are rejected)
+ *  - half/single/double floats <-> MPV_FORMAT_DOUBLE (written as single
+ *    precision if that is lossless)
+ *  - text strings <-> MPV_FORMAT_STRING (embedded 0 bytes are rejected, UTF-8
+ *    is not validated)
+ *  - byte strings <-> MPV_FORMAT_BYTE_ARRAY
+ *  - arrays <-> MPV_FORMAT_NODE_ARRAY
+ *  - maps with text string keys <-> MPV_FORMAT_NODE_MAP
+ *
+ * Tags are skipped when parsing. Indefinite length arrays and maps are
+ * accepted, indefinite length strings are not. The writer always uses the
+ * shortest definite length encoding.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include <mpv/client.h>
+
+#include "common/common.h"
+#include "misc/bstr.h"
+
+#include "cbor.h"
+
+enum {
+    MAJOR_UINT,
+    MAJOR_NEGINT,
+    MAJOR_BYTES,
+    MAJOR_TEXT,
+    MAJOR_ARRAY,
+    MAJOR_MAP,
+    MAJOR_TAG,
+    MAJOR_SIMPLE,
+};
+
+#define INFO_INDEFINITE 31
+#define CBOR_BREAK 0xff
+
+static uint64_t read_be(const unsigned char *p, int len)
+{
+    uint64_t v = 0;
+    for (int n = 0; n < len; n++)
+        v = (v << 8) | p[n];
+    return v;
+}
+
+// Read the initial byte and argument of an item.
+static int read_head(bstr *src, int *major, int *info, uint64_t *val)
+{
+    if (!src->len)
+        return CBOR_INCOMPLETE;
+    unsigned char c = src->start[0];
+    *major = c >> 5;
+    *info = c & 31;
+    int len = 0;
+    if (*info >= 24 && *info <= 27) {
+        len = 1 << (*info - 24);
+    } else if (*info > 27 && *info < INFO_INDEFINITE) {
+        return -1; // reserved
+    }
+    if (src->len < 1 + len)
+        return CBOR_INCOMPLETE;
+    *val = *info < 24 ? *info : read_be(src->start + 1, len);
+    *src = bstr_cut(*src, 1 + len);
+    return 0;
+}
+
+static double decode_half(unsigned int h)
+{
+    int exp = (h >> 10) & 0x1f;
+    int mant = h & 0x3ff;
+    double v;
+    if (exp == 0) {
+        v = ldexp(mant, -24);
+    } else if (exp != 31) {
+        v = ldexp(mant + 1024, exp - 25);
+    } else {
+        v = mant ? NAN : INFINITY;
+    }
+    return h & 0x8000 ? -v : v;
+}
+
+static int read_list(void *ta_parent, struct mpv_node *dst, bstr *src,
+                     bool is_obj, bool indefinite, uint64_t count, int max_depth)
+{
+    if (!indefinite && count > INT_MAX)
+        return -1;
+    // Every item takes at least 1 byte, so don't allocate for absurd lengths.
+    if (!indefinite && count > src->len)
+        return CBOR_INCOMPLETE;
+
+    struct mpv_node_list *list = talloc_zero(ta_parent, struct mpv_node_list);
+    for (uint64_t n = 0; indefinite || n < count; n++) {
+        if (indefinite) {
+            if (!src->len)
+                return CBOR_INCOMPLETE;
+            if (src->start[0] == CBOR_BREAK) {
+                *src = bstr_cut(*src, 1);
+                break;
+            }
+            if (list->num == INT_MAX)
+                return -1;
+        }
+        if (is_obj) {
+            struct mpv_node keynode;
+            int r = cbor_parse(list, &keynode, src, max_depth);
+            if (r < 0)
+                return r;
+            if (keynode.format != MPV_FORMAT_STRING)
+                return -1; // key is not a string
+            MP_TARRAY_GROW(list, list->keys, list->num);
+            list->keys[list->num] = keynode.u.string;
+        }
+        MP_TARRAY_GROW(list, list->values, list->num);
+        int r = cbor_parse(ta_parent, &list->values[list->num], src, max_depth);
+        if (r < 0)
+            return r;
+        list->num++;
+    }
+    dst->format = is_obj ? MPV_FORMAT_NODE_MAP : MPV_FORMAT_NODE_ARRAY;
+    dst->u.list = list;
+    return 0;
+}
+
+/* Parse the first CBOR item in *src, and write the result into *dst.
+ * max_depth limits the recursion and tree depth.
+ * Returns:
+ *   0: success, *dst is valid, *src is advanced past the item
+ *  CBOR_INCOMPLETE: *src ends before the item does, *dst is invalid
+ *  -1: failure, *dst is invalid
+ * On errors, there may be dead allocs under ta_parent, and *src is not changed.
+ * Unlike json_parse(), *dst does not reference the input buffer.
+ */
+int cbor_parse(void *ta_parent, struct mpv_node *dst, bstr *src, int max_depth)
+{
+    max_depth -= 1;
+    if (max_depth < 0)
+        return -1;
+
+    bstr s = *src;
+    int major, info;
+    uint64_t val;
+    int r = read_head(&s, &major, &info, &val);
+    if (r < 0)
+        return r;
+    if (info == INFO_INDEFINITE && major != MAJOR_ARRAY && major != MAJOR_MAP)
+        return -1;
+
+    switch (major) {
+    case MAJOR_UINT:
+    case MAJOR_NEGINT:
+        if (val > INT64_MAX)
+            return -1;
+        dst->format = MPV_FORMAT_INT64;
+        dst->u.int64 = major == MAJOR_UINT ? (int64_t)val : -1 - (int64_t)val;
+        break;
+    case MAJOR_BYTES:
+    case MAJOR_TEXT: {
+        if (val > INT_MAX)
+            return -1;
+        if (val > s.len)
+            return CBOR_INCOMPLETE;
+        bstr data = bstr_splice(s, 0, val);
+        if (major == MAJOR_TEXT) {
+            if (bstrchr(data, '\0') >= 0)
+                return -1;
+            dst->format = MPV_FORMAT_STRING;
+            dst->u.string = bstrdup0(ta_parent, data);
+        } else {
+            struct mpv_byte_array *ba = talloc_zero(ta_parent, struct mpv_byte_array);
+            ba->data = talloc_memdup(ba, data.start, data.len);
+            ba->size = data.len;
+            dst->format = MPV_FORMAT_BYTE_ARRAY;
+            dst->u.ba = ba;
+        }
+        s = bstr_cut(s, val);
+        break;
+    }
+    case MAJOR_ARRAY:
+    case MAJOR_MAP:
+        r = read_list(ta_parent, dst, &s, major == MAJOR_MAP,
+                      info == INFO_INDEFINITE, val, max_depth);
+        if (r < 0)
+            return r;
+        break;
+    case MAJOR_TAG:
+        // Tags only add semantics which mpv_node can't express.
+        r = cbor_parse(ta_parent, dst, &s, max_depth);
+        if (r < 0)
+            return r;
+        break;
+    case MAJOR_SIMPLE:
+        switch (info) {
+        case 20:
+        case 21:
+            dst->format = MPV_FORMAT_FLAG;
+            dst->u.flag = info == 21;
+            break;
+        case 22: // null
+        case 23: // undefined
+            dst->format = MPV_FORMAT_NONE;
+            break;
+        case 25:
+            dst->format = MPV_FORMAT_DOUBLE;
+            dst->u.double_ = decode_half(val);
+            break;
+        case 26: {
+            uint32_t bits = val;
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            dst->format = MPV_FORMAT_DOUBLE;
+            dst->u.double_ = f;
+            break;
+        }
+        case 27:
+            dst->format = MPV_FORMAT_DOUBLE;
+            memcpy(&dst->u.double_, &val, sizeof(double));
+            break;
+        default:
+            return -1; // unassigned simple value, or unexpected break
+        }
+        break;
+    }
+
+    *src = s;
+    return 0;
+}
+
+/* Check whether src starts with a complete item, without decoding it. st
+ * keeps the progress, so that calling this again after more data was appended
+ * to src only looks at the new data. src must start at the same item each time.
+ * Returns:
+ *   0: the item is complete and st->pos bytes long
+ *  CBOR_INCOMPLETE: src ends before the item does
+ *  -1: the item is invalid (cbor_parse() may reject more items than this)
+ */
+int cbor_scan(struct cbor_scan *st, bstr src)
+{
+    while (!st->done) {
+        bstr s = bstr_cut(src, st->pos);
+        int major, info;
+        uint64_t val;
+        bool item_done = true;
+        if (s.len && s.start[0] == CBOR_BREAK) {
+            if (!st->depth || st->left[st->depth - 1] != UINT64_MAX)
+                return -1;
+            s = bstr_cut(s, 1);
+            st->depth--;
+        } else {
+            int r = read_head(&s, &major, &info, &val);
+            if (r < 0)
+                return r;
+            if (major == MAJOR_BYTES || major == MAJOR_TEXT) {
+                if (info == INFO_INDEFINITE || val > INT_MAX)
+                    return -1;
+                if (val > s.len)
+                    return CBOR_INCOMPLETE;
+                s = bstr_cut(s, val);
+            } else if (major == MAJOR_ARRAY || major == MAJOR_MAP) {
+                uint64_t count = info == INFO_INDEFINITE ? UINT64_MAX : val;
+                if (count != UINT64_MAX) {
+                    if (count > INT_MAX)
+                        return -1;
+                    if (major == MAJOR_MAP)
+                        count *= 2; // keys and values
+                }
+                if (count) {
+                    if (st->depth == MAX_CBOR_DEPTH)
+                        return -1;
+                    st->left[st->depth++] = count;
+                    item_done = false;
+                }
+            } else if (major == MAJOR_TAG) {
+                item_done = false; // applies to the next item
+            }
+        }
+        st->pos = src.len - s.len;
+
+        if (!item_done)
+            continue;
+        // Close the arrays and maps this item was the last one of.
+        while (st->depth && st->left[st->depth - 1] != UINT64_MAX &&
+               --st->left[st->depth - 1] == 0)
+            st->depth--;
+        st->done = !st->depth;
+    }
+    return 0;
+}
+
+static void append_head(bstr *b, int major, uint64_t val)
+{
+    unsigned char buf[9];
+    int len;
+    if (val < 24) {
+        len = 0;
+        buf[0] = (major << 5) | val;
+    } else if (val <= UINT8_MAX) {
+        len = 1;
+        buf[0] = (major << 5) | 24;
+    } else if (val <= UINT16_MAX) {
+        len = 2;
+        buf[0] = (major << 5) | 25;
+    } else if (val <= UINT32_MAX) {
+        len = 4;
+        buf[0] = (major << 5) | 26;
+    } else {
+        len = 8;
+        buf[0] = (major << 5) | 27;
+    }
+    for (int n = 0; n < len; n++)
+        buf[1 + n] = val >> (8 * (len - 1 - n));
+    bstr_xappend(NULL, b, (bstr){buf, 1 + len});
+}
+
+static void append_str(bstr *b, int major, bstr str)
+{
+    append_head(b, major, str.len);
+    bstr_xappend(NULL, b, str);
+}
+
+// Append src as CBOR to *b. Returns 0 on success, <0 on unknown formats.
+int cbor_append(bstr *b, const struct mpv_node *src)
+{
+    switch (src->format) {
+    case MPV_FORMAT_NONE:
+        append_head(b, MAJOR_SIMPLE, 22);
+        return 0;
+    case MPV_FORMAT_FLAG:
+        append_head(b, MAJOR_SIMPLE, src->u.flag ? 21 : 20);
+        return 0;
+    case MPV_FORMAT_INT64:
+        if (src->u.int64 >= 0) {
+            append_head(b, MAJOR_UINT, src->u.int64);
+        } else {
+            append_head(b, MAJOR_NEGINT, -1 - src->u.int64);
+        }
+        return 0;
+    case MPV_FORMAT_DOUBLE: {
+        double d = src->u.double_;
+        float f = d;
+        unsigned char buf[9];
+        if (f == d || isnan(d)) {
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            buf[0] = (MAJOR_SIMPLE << 5) | 26;
+            for (int n = 0; n < 4; n++)
+                buf[1 + n] = bits >> (8 * (3 - n));
+            bstr_xappend(NULL, b, (bstr){buf, 5});
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            buf[0] = (MAJOR_SIMPLE << 5) | 27;
+            for (int n = 0; n < 8; n++)
+                buf[1 + n] = bits >> (8 * (7 - n));
+            bstr_xappend(NULL, b, (bstr){buf, 9});
+        }
+        return 0;
+    }
+    case MPV_FORMAT_STRING:
+        append_str(b, MAJOR_TEXT, bstr0(src->u.string));
+        return 0;
+    case MPV_FORMAT_BYTE_ARRAY:
+        append_str(b, MAJOR_BYTES, (bstr){src->u.ba->data, src->u.ba->size});
+        return 0;
+    case MPV_FORMAT_NODE_ARRAY:
+    case MPV_FORMAT_NODE_MAP: {
+        struct mpv_node_list *list = src->u.list;
+        bool is_obj = src->format == MPV_FORMAT_NODE_MAP;
+        append_head(b, is_obj ? MAJOR_MAP : MAJOR_ARRAY, list->num);
+        for (int n = 0; n < list->num; n++) {
+            if (is_obj)
+                append_str(b, MAJOR_TEXT, bstr0(list->keys[n]));
+            if (cbor_append(b, &list->values[n]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    }
+    return -1; // unknown format
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_CBOR_H
+#define MP_CBOR_H
+
+#define MAX_CBOR_DEPTH 50
+
+// Returned by cbor_parse() if the input ends in the middle of an item.
+#define CBOR_INCOMPLETE (-2)
+
+// Self-described CBOR tag (RFC 8949 section 3.4.6), used as magic number.
+#define CBOR_MAGIC "\xd9\xd9\xf7"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct bstr;
+struct mpv_node;
+
+int cbor_parse(void *ta_parent, struct mpv_node *dst, struct bstr *src,
+               int max_depth);
+
+// State of cbor_scan(). Zero-initialize it before scanning a new item.
+struct cbor_scan {
+    size_t pos;                     // bytes of the item scanned so far
+    int depth;                      // open arrays and maps
+    uint64_t left[MAX_CBOR_DEPTH];  // items left in each, UINT64_MAX: indefinite
+    bool done;
+};
+
+int cbor_scan(struct cbor_scan *st, struct bstr src);
+int cbor_append(struct bstr *b, const struct mpv_node *src);
+
+#endif
@@ -56,6 +56,72 @@
 
 #include "json.h"
 
+/* Word-at-a-time scanning: 8 input bytes are tested at once, and only words
+ * containing an interesting byte are looked at byte by byte. This is portable
+ * C (no SIMD intrinsics), and loads never go past the end of the input. */
+
+#define WORD_ONES  (UINT64_MAX / 255)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+static inline uint64_t load_word(const void *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+// Set the high bit of each byte of w that is not 0. This is exact (unlike the
+// common "haszero" trick), because the addition can't carry across bytes.
+static inline uint64_t nonzero_bytes(uint64_t w)
+{
+    return (((w & ~WORD_HIGHS) + ~WORD_HIGHS) | w) & WORD_HIGHS;
+}
+
+// Set the high bit of each byte of w that is equal to c.
+static inline uint64_t eq_bytes(uint64_t w, unsigned char c)
+{
+    return ~nonzero_bytes(w ^ (WORD_ONES * c)) & WORD_HIGHS;
+}
+
+static inline bool is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Parser state, which lives for one json_parse() call.
+struct json_ctx {
+    void *ta_parent;
+    char *end;                  // terminating '\0' of the input
+    // Bump allocator for the parsed tree.
+    char *arena;
+    size_t arena_left;
+    size_t block_size;
+    // Entries of the lists currently being parsed, innermost list last.
+    struct mpv_node *values;
+    char **keys;
+    int num;
+};
+
+#define ARENA_ALIGN 8
+#define ARENA_MAX_BLOCK (1 << 20)
+
+// The tree is allocated in a few large blocks under ta_parent, instead of
+// separately for each list, because it's only ever freed as a whole.
+static void *arena_alloc(struct json_ctx *ctx, size_t size)
+{
+    size = MP_ALIGN_UP(size, ARENA_ALIGN);
+    if (size > ctx->arena_left) {
+        size_t block = MPMAX(size, ctx->block_size);
+        ctx->block_size = MPMIN(ctx->block_size * 2, ARENA_MAX_BLOCK);
+        ctx->arena = talloc_size(ctx->ta_parent, block);
+        ctx->arena_left = block;
+    }
+    void *p = ctx->arena;
+    ctx->arena += size;
+    ctx->arena_left -= size;
+    return p;
+}
+
 static bool eat_c(char **s, char c)
 {
     if (**s == c) {
@@ -65,22 +131,32 @@ static bool eat_c(char **s, char c)
     return false;
 }
 
-static void eat_ws(char **src)
+// end can be NULL if it's not known.
+static void eat_ws(char **src, const char *end)
 {
-    while (1) {
-        char c = **src;
-        if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
-            return;
-        *src += 1;
+    char *cur = *src;
+    // Usually there is no whitespace at all (minified JSON).
+    if (!is_ws(*cur))
+        return;
+    while (end && end - cur >= 8) {
+        uint64_t w = load_word(cur);
+        uint64_t ws = eq_bytes(w, ' ') | eq_bytes(w, '\t') |
+                      eq_bytes(w, '\n') | eq_bytes(w, '\r');
+        if (ws != WORD_HIGHS)
+            break;
+        cur += 8;
     }
+    while (is_ws(*cur))
+        cur++;
+    *src = cur;
 }
 
 void json_skip_whitespace(char **src)
 {
-    eat_ws(src);
+    eat_ws(src, NULL);
 }
 
-static int read_id(void *ta_parent, struct mpv_node *dst, char **src)
+static int read_id(struct json_ctx *ctx, struct mpv_node *dst, char **src)
 {
     char *start = *src;
     if (!mp_isalpha(**src) && **src != '_')
@@ -91,27 +167,46 @@ static int read_id(void *ta_parent, struct mpv_node *dst, char **src)
         **src = '\0'; // we're allowed to mutate it => can avoid the strndup
         *src += 1;
     } else {
-        start = talloc_strndup(ta_parent, start, *src - start);
+        size_t len = *src - start;
+        char *s = arena_alloc(ctx, len + 1);
+        memcpy(s, start, len);
+        s[len] = '\0';
+        start = s;
     }
     dst->format = MPV_FORMAT_STRING;
     dst->u.string = start;
     return 0;
 }
 
-static int read_str(void *ta_parent, struct mpv_node *dst, char **src)
+// Return the first '"', '\\' or '\0' at or after cur.
+static char *find_str_special(char *cur, const char *end)
+{
+    while (end - cur >= 8) {
+        uint64_t w = load_word(cur);
+        if ((eq_bytes(w, '"') | eq_bytes(w, '\\')) || ~nonzero_bytes(w) & WORD_HIGHS)
+            break;
+        cur += 8;
+    }
+    while (cur[0] && cur[0] != '"' && cur[0] != '\\')
+        cur++;
+    return cur;
+}
+
+static int read_str(struct json_ctx *ctx, struct mpv_node *dst, char **src)
 {
     if (!eat_c(src, '"'))
         return -1; // not a string
     char *str = *src;
     char *cur = str;
     bool has_escapes = false;
-    while (cur[0] && cur[0] != '"') {
-        if (cur[0] == '\\') {
-            has_escapes = true;
-            // skip >\"< and >\\< (latter to handle >\\"< correctly)
-            if (cur[1] == '"' || cur[1] == '\\')
-                cur++;
-        }
+    while (1) {
+        cur = find_str_special(cur, ctx->end);
+        if (cur[0] != '\\')
+            break;
+        has_escapes = true;
+        // skip >\"< and >\\< (latter to handle >\\"< correctly)
+        if (cur[1] == '"' || cur[1] == '\\')
+            cur++;
         cur++;
     }
     if (cur[0] != '"')
@@ -123,7 +218,7 @@ static int read_str(void *ta_parent, struct mpv_node *dst, char **src)
     if (has_escapes) {
         bstr unescaped = {0};
         bstr r = bstr0(str);
-        if (!mp_append_escaped_string(ta_parent, &unescaped, &r))
+        if (!mp_append_escaped_string(ctx->ta_parent, &unescaped, &r))
             return -1; // broken escapes
         str = unescaped.start; // the function guarantees null-termination
     }
@@ -132,7 +227,10 @@ static int read_str(void *ta_parent, struct mpv_node *dst, char **src)
     return 0;
 }
 
-static int read_sub(void *ta_parent, struct mpv_node *dst, char **src,
+static int parse_value(struct json_ctx *ctx, struct mpv_node *dst, char **src,
+                       int max_depth);
+
+static int read_sub(struct json_ctx *ctx, struct mpv_node *dst, char **src,
                     int max_depth)
 {
     bool is_arr = eat_c(src, '[');
@@ -140,59 +238,90 @@ static int read_sub(void *ta_parent, struct mpv_node *dst, char **src,
     if (!is_arr && !is_obj)
         return -1; // not an array or object
     char term = is_obj ? '}' : ']';
-    struct mpv_node_list *list = talloc_zero(ta_parent, struct mpv_node_list);
+    int first = ctx->num;
     while (1) {
-        eat_ws(src);
+        eat_ws(src, ctx->end);
         if (eat_c(src, term))
             break;
-        if (list->num > 0 && !eat_c(src, ','))
+        if (ctx->num > first && !eat_c(src, ','))
             return -1; // missing ','
-        eat_ws(src);
+        eat_ws(src, ctx->end);
         // non-standard extension: allow a trailing ","
         if (eat_c(src, term))
             break;
+        struct mpv_node keynode = {0};
         if (is_obj) {
-            struct mpv_node keynode;
             // non-standard extension: allow unquoted strings as keys
-            if (read_id(list, &keynode, src) < 0 &&
-                read_str(list, &keynode, src) < 0)
+            if (read_id(ctx, &keynode, src) < 0 &&
+                read_str(ctx, &keynode, src) < 0)
                 return -1; // key is not a string
-            eat_ws(src);
+            eat_ws(src, ctx->end);
             // non-standard extension: allow "=" instead of ":"
             if (!eat_c(src, ':') && !eat_c(src, '='))
                 return -1; // ':' missing
-            eat_ws(src);
-            MP_TARRAY_GROW(list, list->keys, list->num);
-            list->keys[list->num] = keynode.u.string;
+            eat_ws(src, ctx->end);
         }
-        MP_TARRAY_GROW(list, list->values, list->num);
-        if (json_parse(ta_parent, &list->values[list->num], src, max_depth) < 0)
+        // Nested lists use the entry stack too, so it can be reallocated.
+        struct mpv_node value;
+        if (parse_value(ctx, &value, src, max_depth) < 0)
             return -1;
-        list->num++;
+        MP_TARRAY_GROW(NULL, ctx->values, ctx->num);
+        MP_TARRAY_GROW(NULL, ctx->keys, ctx->num);
+        ctx->values[ctx->num] = value;
+        ctx->keys[ctx->num] = keynode.u.string;
+        ctx->num++;
+    }
+    int num = ctx->num - first;
+    struct mpv_node_list *list = arena_alloc(ctx, sizeof(*list));
+    *list = (struct mpv_node_list){ .num = num };
+    if (num) {
+        list->values = arena_alloc(ctx, num * sizeof(list->values[0]));
+        memcpy(list->values, &ctx->values[first], num * sizeof(list->values[0]));
+        if (is_obj) {
+            list->keys = arena_alloc(ctx, num * sizeof(list->keys[0]));
+            memcpy(list->keys, &ctx->keys[first], num * sizeof(list->keys[0]));
+        }
     }
+    ctx->num = first;
     dst->format = is_obj ? MPV_FORMAT_NODE_MAP : MPV_FORMAT_NODE_ARRAY;
     dst->u.list = list;
     return 0;
 }
 
-/* Parse the string in *src as JSON, and write the result into *dst.
- * max_depth limits the recursion and JSON tree depth.
- * Warning: this overwrites the input string (what *src points to)!
- * Returns:
- *   0: success, *dst is valid, *src points to the end (the caller must check
- *      whether *src really terminates)
- *  -1: failure, *dst is invalid, there may be dead allocs under ta_parent
- *      (ta_free_children(ta_parent) is the only way to free them)
- * The input string can be mutated in both cases. *dst might contain string
- * elements, which point into the (mutated) input string.
- */
-int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
+// Parse plain decimal integers, which are the most common numbers, without
+// going through both strtoll() and strtod(). Returns false if the number
+// might be anything else; the result is the same as strtoll() otherwise.
+static bool read_simple_int(char **src, int64_t *out)
+{
+    char *cur = *src;
+    bool neg = eat_c(&cur, '-');
+    // Leading 0s select octal or hex with strtoll(), and a lone 0 is rare.
+    if (cur[0] < '1' || cur[0] > '9')
+        return false;
+    uint64_t v = 0;
+    int digits = 0;
+    while (cur[0] >= '0' && cur[0] <= '9') {
+        v = v * 10 + (cur[0] - '0');
+        cur++;
+        // Stay far away from overflows.
+        if (++digits > 18)
+            return false;
+    }
+    if (cur[0] == '.' || cur[0] == 'e' || cur[0] == 'E')
+        return false;
+    *out = neg ? -(int64_t)v : (int64_t)v;
+    *src = cur;
+    return true;
+}
+
+static int parse_value(struct json_ctx *ctx, struct mpv_node *dst, char **src,
+                       int max_depth)
 {
     max_depth -= 1;
     if (max_depth < 0)
         return -1;
 
-    eat_ws(src);
+    eat_ws(src, ctx->end);
 
     char c = **src;
     if (!c)
@@ -212,10 +341,14 @@ int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
         dst->u.flag = 0;
         return 0;
     } else if (c == '"') {
-        return read_str(ta_parent, dst, src);
+        return read_str(ctx, dst, src);
     } else if (c == '[' || c == '{') {
-        return read_sub(ta_parent, dst, src, max_depth);
+        return read_sub(ctx, dst, src, max_depth);
     } else if (c == '-' || (c >= '0' && c <= '9')) {
+        if (read_simple_int(src, &dst->u.int64)) {
+            dst->format = MPV_FORMAT_INT64;
+            return 0;
+        }
         // The number could be either a float or an int. JSON doesn't make a
         // difference, but the client API does.
         char *nsrci = *src, *nsrcf = *src;
@@ -244,6 +377,33 @@ int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
     return -1; // character doesn't start a valid token
 }
 
+/* Parse the string in *src as JSON, and write the result into *dst.
+ * max_depth limits the recursion and JSON tree depth.
+ * Warning: this overwrites the input string (what *src points to)!
+ * Returns:
+ *   0: success, *dst is valid, *src points to the end (the caller must check
+ *      whether *src really terminates)
+ *  -1: failure, *dst is invalid, there may be dead allocs under ta_parent
+ *      (ta_free_children(ta_parent) is the only way to free them)
+ * The input string can be mutated in both cases. *dst might contain string
+ * elements, which point into the (mutated) input string.
+ * The lists in *dst are not separate talloc allocations, so they can't be
+ * extended (e.g. with node_map_add()) or freed individually.
+ */
+int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
+{
+    size_t len = strlen(*src);
+    struct json_ctx ctx = {
+        .ta_parent = ta_parent,
+        .end = *src + len,
+        .block_size = MPCLAMP(MP_ALIGN_UP(len * 2, 256), 256, ARENA_MAX_BLOCK),
+    };
+    int r = parse_value(&ctx, dst, src, max_depth);
+    talloc_free(ctx.values);
+    talloc_free(ctx.keys);
+    return r;
+}
+
 
 #define APPEND(b, s) bstr_xappend(NULL, (b), bstr0(s))
 
@@ -255,30 +415,47 @@ static const char special_escape[] = {
     ['\t'] = 't',
 };
 
+// Return the first byte at or after cur, which needs to be escaped.
+static unsigned char *find_escape(unsigned char *cur, unsigned char *end)
+{
+    while (end - cur >= 8) {
+        uint64_t w = load_word(cur);
+        // Control characters are the bytes with none of the bits 0xE0 set.
+        uint64_t ctrl = ~nonzero_bytes(w & (WORD_ONES * 0xE0)) & WORD_HIGHS;
+        if (ctrl | eq_bytes(w, '"') | eq_bytes(w, '\\'))
+            break;
+        cur += 8;
+    }
+    while (cur < end && cur[0] >= 32 && cur[0] != '"' && cur[0] != '\\')
+        cur++;
+    return cur;
+}
+
 static void write_json_str(bstr *b, unsigned char *str)
 {
     mp_assert(str);
 
+    unsigned char *end = str + strlen(str);
     APPEND(b, "\"");
     while (1) {
-        unsigned char *cur = str;
-        while (cur[0] >= 32 && cur[0] != '"' && cur[0] != '\\')
-            cur++;
-        if (!cur[0])
-            break;
+        unsigned char *cur = find_escape(str, end);
         bstr_xappend(NULL, b, (bstr){str, cur - str});
-        if (cur[0] == '\"') {
-            bstr_xappend(NULL, b, (bstr){"\\\"", 2});
-        } else if (cur[0] == '\\') {
-            bstr_xappend(NULL, b, (bstr){"\\\\", 2});
-        } else if (cur[0] < sizeof(special_escape) && special_escape[cur[0]]) {
-            bstr_xappend_asprintf(NULL, b, "\\%c", special_escape[cur[0]]);
-        } else {
-            bstr_xappend_asprintf(NULL, b, "\\u%04x", (unsigned char)cur[0]);
+        if (cur == end)
+            break;
+        char esc[6] = {'\\', cur[0]};
+        int len = 2;
+        if (cur[0] < sizeof(special_escape) && special_escape[cur[0]]) {
+            esc[1] = special_escape[cur[0]];
+        } else if (cur[0] < 32) {
+            static const char hex[] = "0123456789abcdef";
+            memcpy(esc + 1, "u00", 3);
+            esc[4] = hex[cur[0] >> 4];
+            esc[5] = hex[cur[0] & 15];
+            len = 6;
         }
+        bstr_xappend(NULL, b, (bstr){esc, len});
         str = cur + 1;
     }
-    APPEND(b, str);
     APPEND(b, "\"");
 }
 
@@ -300,9 +477,20 @@ int json_append(bstr *b, const struct mpv_node *src, int indent)
     case MPV_FORMAT_FLAG:
         APPEND(b, src->u.flag ? "true" : "false");
         return 0;
-    case MPV_FORMAT_INT64:
-        bstr_xappend_asprintf(NULL, b, "%"PRId64, src->u.int64);
+    case MPV_FORMAT_INT64: {
+        // Same as "%"PRId64, but much faster.
+        char buf[24];
+        char *end = buf + sizeof(buf), *cur = end;
+        uint64_t v = src->u.int64 < 0 ? -(uint64_t)src->u.int64 : src->u.int64;
+        do {
+            *--cur = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        if (src->u.int64 < 0)
+            *--cur = '-';
+        bstr_xappend(NULL, b, (bstr){cur, end - cur});
         return 0;
+    }
     case MPV_FORMAT_DOUBLE: {
         const char *px = (isfinite(src->u.double_) || indent == 0) ? "" : "\"";
         bstr_xappend_asprintf(NULL, b, "%s%f%s", px, src->u.double_, px);
@@ -1,10 +1,210 @@
 #include "node.h"
 
+#include <stdatomic.h>
+
 #include <mpv/client.h>
 
 #include "common/common.h"
+#include "osdep/threads.h"
 #include "bstr.h"
 
+// Maps which reach this many entries with node_map_add() get a hash index,
+// which node_map_bget() uses. The index lives in a registry keyed by the
+// mpv_node_list pointer, because mpv_node_list is public API and can't get
+// new fields. It's freed together with the list. The registry is split into
+// shards with a lock each, so that threads using different maps rarely
+// contend. Lookups on lists which were never registered, such as json_parse()
+// results, don't take the lock: each shard has a 64 bit filter of the lists
+// registered in it, and lookups only check the registry if their bit is set.
+#define MAP_INDEX_MIN 16
+#define INDEX_SHARDS 64
+
+struct map_index {
+    struct mpv_node_list *list;
+    struct map_index *next;     // next registry entry in the same bucket
+    int num;                    // number of list->keys in slots
+    bool stale;                 // list was changed in place, rebuild slots
+    int *slots;                 // index + 1 into list->keys, 0 for unused
+    size_t mask;                // number of slots - 1 (slots are a power of 2)
+};
+
+struct index_shard {
+    // Bits set by index_register(); cleared only when the shard is empty.
+    atomic_uint_least64_t filter;
+
+    mp_mutex lock;
+    // -- protected by lock
+    struct map_index **table;
+    size_t mask;
+    size_t num;
+};
+
+static struct index_shard index_shards[INDEX_SHARDS];
+static mp_once index_shards_once = MP_STATIC_ONCE_INITIALIZER;
+
+static void index_shards_init(void)
+{
+    for (int n = 0; n < INDEX_SHARDS; n++)
+        mp_mutex_init(&index_shards[n].lock);
+}
+
+static size_t hash_key(bstr key)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (int n = 0; n < key.len; n++)
+        h = (h ^ key.start[n]) * 16777619u;
+    return h;
+}
+
+static size_t hash_list(struct mpv_node_list *list)
+{
+    uint64_t h = (uintptr_t)list * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+static struct index_shard *get_shard(struct mpv_node_list *list)
+{
+    return &index_shards[hash_list(list) % INDEX_SHARDS];
+}
+
+static uint64_t filter_bit(struct mpv_node_list *list)
+{
+    return 1ULL << (hash_list(list) / INDEX_SHARDS % 64);
+}
+
+// Whether list may have been registered. If this returns false, it wasn't.
+static bool maybe_registered(struct mpv_node_list *list)
+{
+    return atomic_load(&get_shard(list)->filter) & filter_bit(list);
+}
+
+// Returns the shard of list, locked.
+static struct index_shard *lock_shard(struct mpv_node_list *list)
+{
+    mp_exec_once(&index_shards_once, index_shards_init);
+    struct index_shard *shard = get_shard(list);
+    mp_mutex_lock(&shard->lock);
+    return shard;
+}
+
+static struct map_index **find_index(struct index_shard *shard,
+                                     struct mpv_node_list *list)
+{
+    size_t i = (hash_list(list) / INDEX_SHARDS) & shard->mask;
+    struct map_index **e = &shard->table[i];
+    while (*e && (*e)->list != list)
+        e = &(*e)->next;
+    return e;
+}
+
+static void index_destroy(void *p)
+{
+    struct index_shard *shard = lock_shard(p);
+    struct map_index **e = find_index(shard, p);
+    *e = (*e)->next;
+    shard->num--;
+    if (!shard->num) {
+        TA_FREEP(&shard->table);
+        shard->mask = 0;
+        atomic_store(&shard->filter, 0);
+    }
+    mp_mutex_unlock(&shard->lock);
+}
+
+// Does nothing if list is registered already. This happens if the map reaches
+// MAP_INDEX_MIN again after entries were removed in place.
+static void index_register(struct mpv_node_list *list)
+{
+    struct index_shard *shard = lock_shard(list);
+    if (shard->table && *find_index(shard, list)) {
+        mp_mutex_unlock(&shard->lock);
+        return;
+    }
+    if (shard->num >= shard->mask) {
+        size_t size = shard->table ? (shard->mask + 1) * 2 : 16;
+        struct map_index **table = talloc_zero_array(NULL, struct map_index *,
+                                                     size);
+        for (size_t n = 0; shard->table && n <= shard->mask; n++) {
+            struct map_index *e = shard->table[n];
+            while (e) {
+                struct map_index *next = e->next;
+                size_t i = (hash_list(e->list) / INDEX_SHARDS) & (size - 1);
+                e->next = table[i];
+                table[i] = e;
+                e = next;
+            }
+        }
+        talloc_free(shard->table);
+        shard->table = table;
+        shard->mask = size - 1;
+    }
+    struct map_index *index = talloc_zero(list, struct map_index);
+    index->list = list;
+    struct map_index **e = find_index(shard, list);
+    mp_assert(!*e);
+    *e = index;
+    shard->num++;
+    atomic_fetch_or(&shard->filter, filter_bit(list));
+    mp_mutex_unlock(&shard->lock);
+    talloc_set_destructor(list, index_destroy);
+}
+
+// Bring the index up to date with entries appended to the list since the
+// last lookup, or rebuild it if the list was changed in place.
+static void index_update(struct map_index *index)
+{
+    struct mpv_node_list *list = index->list;
+    if (index->stale || index->mask + 1 < list->num * 2) {
+        size_t size = 32;
+        while (size < list->num * 2)
+            size *= 2;
+        talloc_free(index->slots);
+        index->slots = talloc_zero_array(index, int, size);
+        index->mask = size - 1;
+        index->num = 0;
+        index->stale = false;
+    }
+    for (; index->num < list->num; index->num++) {
+        const char *key = list->keys[index->num];
+        size_t i = hash_key(bstr0(key)) & index->mask;
+        while (index->slots[i]) {
+            // Duplicate keys: the first entry wins, like a linear search.
+            if (strcmp(list->keys[index->slots[i] - 1], key) == 0)
+                break;
+            i = (i + 1) & index->mask;
+        }
+        if (!index->slots[i])
+            index->slots[i] = index->num + 1;
+    }
+}
+
+// Returns the index of key in list, -1 if it's not there, or -2 if the list
+// has no index.
+static int index_lookup(struct mpv_node_list *list, bstr key)
+{
+    if (!maybe_registered(list))
+        return -2;
+
+    int res = -2;
+    struct index_shard *shard = lock_shard(list);
+    struct map_index *index = shard->table ? *find_index(shard, list) : NULL;
+    if (index) {
+        index_update(index);
+        res = -1;
+        size_t i = hash_key(key) & index->mask;
+        while (index->slots[i]) {
+            if (bstr_equals0(key, list->keys[index->slots[i] - 1])) {
+                res = index->slots[i] - 1;
+                break;
+            }
+            i = (i + 1) & index->mask;
+        }
+    }
+    mp_mutex_unlock(&shard->lock);
+    return res;
+}
+
 // Init a node with the given format. If parent is not NULL, it is set as
 // parent allocation according to m_option_type_node rules (which means
 // the mpv_node_list allocs are used for chaining the TA allocations).
@@ -45,6 +245,8 @@ struct mpv_node *node_array_add(struct mpv_node *dst, int format)
 // Add an entry to a MPV_FORMAT_NODE_MAP. Keep in mind that this does
 // not check for already existing entries under the same key.
 // m_option_type_node memory management rules apply.
+// If existing entries of a map are removed, reordered or renamed in place,
+// node_map_changed() must be called before the next node_map_bget().
 struct mpv_node *node_map_add(struct mpv_node *dst, const char *key, int format)
 {
     mp_assert(key);
@@ -61,6 +263,8 @@ struct mpv_node *node_map_badd(struct mpv_node *dst, struct bstr key, int format
     MP_TARRAY_GROW(list, list->keys, list->num);
     list->keys[list->num] = bstrdup0(list, key);
     node_init(&list->values[list->num], format, dst);
+    if (list->num + 1 == MAP_INDEX_MIN)
+        index_register(list);
     return &list->values[list->num++];
 }
 
@@ -100,6 +304,21 @@ void node_map_add_flag(struct mpv_node *dst, const char *key, bool v)
     node_map_add(dst, key, MPV_FORMAT_FLAG)->u.flag = v;
 }
 
+// Tell node_map_bget() that the keys of the map were changed in place, other
+// than by appending with node_map_add().
+void node_map_changed(struct mpv_node *dst)
+{
+    mp_assert(dst->format == MPV_FORMAT_NODE_MAP && dst->u.list);
+    if (!maybe_registered(dst->u.list))
+        return;
+    struct index_shard *shard = lock_shard(dst->u.list);
+    struct map_index *index =
+        shard->table ? *find_index(shard, dst->u.list) : NULL;
+    if (index)
+        index->stale = true;
+    mp_mutex_unlock(&shard->lock);
+}
+
 mpv_node *node_map_get(mpv_node *src, const char *key)
 {
     return node_map_bget(src, bstr0(key));
@@ -110,6 +329,12 @@ mpv_node *node_map_bget(mpv_node *src, struct bstr key)
     if (src->format != MPV_FORMAT_NODE_MAP)
         return NULL;
 
+    if (src->u.list->num >= MAP_INDEX_MIN) {
+        int i = index_lookup(src->u.list, key);
+        if (i != -2)
+            return i >= 0 ? &src->u.list->values[i] : NULL;
+    }
+
     for (int i = 0; i < src->u.list->num; i++) {
         if (bstr_equals0(key, src->u.list->keys[i]))
             return &src->u.list->values[i];
@@ -167,5 +392,189 @@ bool equal_mpv_node(const struct mpv_node *a, const struct mpv_node *b)
 {
     if (a->format != b->format)
         return false;
+    // Nodes reference byte arrays, instead of embedding them.
+    if (a->format == MPV_FORMAT_BYTE_ARRAY)
+        return equal_mpv_value(a->u.ba, b->u.ba, a->format);
     return equal_mpv_value(&a->u, &b->u, a->format);
 }
+
+// Deep copy src to dst, following m_option_type_node rules with parent as
+// allocation parent.
+static void copy_node(struct mpv_node *dst, const struct mpv_node *src,
+                      struct mpv_node *parent)
+{
+    void *ta_parent = parent ? parent->u.list : NULL;
+    switch (src->format) {
+    case MPV_FORMAT_STRING:
+        *dst = (struct mpv_node){ .format = MPV_FORMAT_STRING };
+        dst->u.string = talloc_strdup(ta_parent, src->u.string);
+        break;
+    case MPV_FORMAT_BYTE_ARRAY:
+        node_init(dst, MPV_FORMAT_BYTE_ARRAY, parent);
+        dst->u.ba->data = talloc_memdup(dst->u.ba, src->u.ba->data,
+                                        src->u.ba->size);
+        dst->u.ba->size = src->u.ba->size;
+        break;
+    case MPV_FORMAT_NODE_ARRAY:
+    case MPV_FORMAT_NODE_MAP: {
+        struct mpv_node_list *list = src->u.list;
+        node_init(dst, src->format, parent);
+        for (int n = 0; n < list->num; n++) {
+            struct mpv_node *entry = src->format == MPV_FORMAT_NODE_MAP
+                ? node_map_add(dst, list->keys[n], MPV_FORMAT_NONE)
+                : node_array_add(dst, MPV_FORMAT_NONE);
+            copy_node(entry, &list->values[n], dst);
+        }
+        break;
+    }
+    default:
+        *dst = *src;
+    }
+}
+
+struct diff_ctx {
+    struct mpv_node *patch;
+    bstr path;
+};
+
+static void add_op(struct diff_ctx *ctx, const char *op,
+                   const struct mpv_node *val)
+{
+    struct mpv_node *entry = node_array_add(ctx->patch, MPV_FORMAT_NODE_MAP);
+    node_map_add_string(entry, "op", op);
+    node_map_add_bstr(entry, "path", ctx->path);
+    if (val)
+        copy_node(node_map_add(entry, "value", MPV_FORMAT_NONE), val, entry);
+}
+
+// Append a JSON pointer reference token to the path. Returns the previous
+// path length, to which the caller must reset it.
+static size_t push_key(struct diff_ctx *ctx, bstr key)
+{
+    size_t len = ctx->path.len;
+    bstr_xappend(NULL, &ctx->path, bstr0("/"));
+    for (size_t n = 0; n < key.len; n++) {
+        if (key.start[n] == '~') {
+            bstr_xappend(NULL, &ctx->path, bstr0("~0"));
+        } else if (key.start[n] == '/') {
+            bstr_xappend(NULL, &ctx->path, bstr0("~1"));
+        } else {
+            bstr_xappend(NULL, &ctx->path, (bstr){key.start + n, 1});
+        }
+    }
+    return len;
+}
+
+static size_t push_index(struct diff_ctx *ctx, int index)
+{
+    size_t len = ctx->path.len;
+    bstr_xappend_asprintf(NULL, &ctx->path, "/%d", index);
+    return len;
+}
+
+// Return the index of key in list, or -1. hint is tried first, because the
+// keys of successive values of a property usually have the same order.
+static int find_key(struct mpv_node_list *list, const char *key, int hint)
+{
+    if (hint < list->num && !strcmp(list->keys[hint], key))
+        return hint;
+    for (int n = 0; n < list->num; n++) {
+        if (!strcmp(list->keys[n], key))
+            return n;
+    }
+    return -1;
+}
+
+static void diff_node(struct diff_ctx *ctx, const struct mpv_node *a,
+                      const struct mpv_node *b);
+
+static void diff_map(struct diff_ctx *ctx, struct mpv_node_list *a,
+                     struct mpv_node_list *b)
+{
+    for (int n = 0; n < a->num; n++) {
+        if (find_key(b, a->keys[n], n) < 0) {
+            size_t len = push_key(ctx, bstr0(a->keys[n]));
+            add_op(ctx, "remove", NULL);
+            ctx->path.len = len;
+        }
+    }
+    for (int n = 0; n < b->num; n++) {
+        int i = find_key(a, b->keys[n], n);
+        size_t len = push_key(ctx, bstr0(b->keys[n]));
+        if (i < 0) {
+            add_op(ctx, "add", &b->values[n]);
+        } else {
+            diff_node(ctx, &a->values[i], &b->values[n]);
+        }
+        ctx->path.len = len;
+    }
+}
+
+// Entries are matched by index after skipping the common start and end, so
+// inserting or removing a run of entries produces only add/remove operations
+// for them.
+static void diff_array(struct diff_ctx *ctx, struct mpv_node_list *a,
+                       struct mpv_node_list *b)
+{
+    int num = MPMIN(a->num, b->num);
+    int start = 0;
+    while (start < num && equal_mpv_node(&a->values[start], &b->values[start]))
+        start++;
+    int end = 0;
+    while (start + end < num &&
+           equal_mpv_node(&a->values[a->num - 1 - end],
+                          &b->values[b->num - 1 - end]))
+        end++;
+
+    int a_end = a->num - end, b_end = b->num - end;
+    int n = start;
+    for (; n < a_end && n < b_end; n++) {
+        size_t len = push_index(ctx, n);
+        diff_node(ctx, &a->values[n], &b->values[n]);
+        ctx->path.len = len;
+    }
+    // Remove from the back, so the indexes of earlier operations stay valid.
+    for (int i = a_end - 1; i >= n; i--) {
+        size_t len = push_index(ctx, i);
+        add_op(ctx, "remove", NULL);
+        ctx->path.len = len;
+    }
+    for (int i = n; i < b_end; i++) {
+        size_t len = push_index(ctx, i);
+        add_op(ctx, "add", &b->values[i]);
+        ctx->path.len = len;
+    }
+}
+
+static void diff_node(struct diff_ctx *ctx, const struct mpv_node *a,
+                      const struct mpv_node *b)
+{
+    if (a->format == b->format && a->format == MPV_FORMAT_NODE_MAP) {
+        diff_map(ctx, a->u.list, b->u.list);
+    } else if (a->format == b->format && a->format == MPV_FORMAT_NODE_ARRAY) {
+        diff_array(ctx, a->u.list, b->u.list);
+    } else if (!equal_mpv_node(a, b)) {
+        add_op(ctx, "replace", b);
+    }
+}
+
+// Write a JSON Patch (RFC 6902) to dst, which turns a into b when applied.
+// If a is NULL, the patch replaces the whole document with b. dst is
+// overwritten and follows m_option_type_node memory management rules (with
+// no parent). The patch is minimal for changed, added or removed map keys,
+// and for array entries added or removed at a single position.
+void node_diff(struct mpv_node *dst, const struct mpv_node *a,
+               const struct mpv_node *b)
+{
+    struct diff_ctx ctx = {
+        .patch = dst,
+        .path = {.start = talloc_strdup(NULL, "")},
+    };
+    node_init(dst, MPV_FORMAT_NODE_ARRAY, NULL);
+    if (a) {
+        diff_node(&ctx, a, b);
+    } else {
+        add_op(&ctx, "replace", b);
+    }
+    talloc_free(ctx.path.start);
+}
@@ -18,7 +18,10 @@ void node_map_add_double(struct mpv_node *dst, const char *key, double v);
 void node_map_add_flag(struct mpv_node *dst, const char *key, bool v);
 struct mpv_node *node_map_get(struct mpv_node *src, const char *key);
 struct mpv_node *node_map_bget(struct mpv_node *src, struct bstr key);
+void node_map_changed(struct mpv_node *dst);
 bool equal_mpv_value(const void *a, const void *b, int format);
 bool equal_mpv_node(const struct mpv_node *a, const struct mpv_node *b);
+void node_diff(struct mpv_node *dst, const struct mpv_node *a,
+               const struct mpv_node *b);
 
 #endif
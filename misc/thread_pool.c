@@ -13,6 +13,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdatomic.h>
+
 #include "common/common.h"
 #include "osdep/threads.h"
 #include "osdep/timer.h"
@@ -26,6 +28,26 @@
 struct work {
     void (*fn)(void *ctx);
     void *fn_ctx;
+    enum mp_thread_pool_prio prio;
+};
+
+// Ring of work items. The owning worker takes the newest item (it was likely
+// queued by the item the worker just ran), other workers take the oldest.
+struct work_deque {
+    struct work *items;
+    int head, num, alloc;
+};
+
+struct worker {
+    struct mp_thread_pool *pool;
+    mp_thread thread;
+    bool active;                // protected by pool->lock; thread is running
+
+    mp_mutex lock;              // protects queues
+    struct work_deque queues[MP_THREAD_POOL_PRIO_COUNT];
+
+    // Number of items in queues, to skip empty workers without locking.
+    atomic_int num_work;
 };
 
 struct mp_thread_pool {
@@ -34,81 +56,171 @@ struct mp_thread_pool {
     mp_mutex lock;
     mp_cond wakeup;
 
-    // --- the following fields are protected by lock
+    // max_threads slots; each running thread occupies an active slot.
+    struct worker *workers;
 
-    mp_thread *threads;
-    int num_threads;
+    // Number of items in all queues. Only incremented with lock held.
+    atomic_int num_work;
 
     // Number of threads which have taken up work and are still processing it.
-    int busy_threads;
+    atomic_int busy_threads;
 
-    bool terminate;
+    atomic_int_least64_t completed[MP_THREAD_POOL_PRIO_COUNT];
+    atomic_int_least64_t stolen;
+    atomic_int_least64_t busy_ns;
 
-    struct work *work;
-    int num_work;
+    // Only changed with lock held; atomic so that the stats can be read
+    // without it.
+    atomic_int num_threads;
+
+    // --- the following fields are protected by lock
+
+    int idle_threads;           // threads waiting on wakeup
+    int next_worker;            // round-robin position for new work
+
+    bool terminate;
 };
 
+static thread_local struct worker *current_worker;
+
+static void deque_push(void *ta_parent, struct work_deque *q, struct work work)
+{
+    if (q->num == q->alloc) {
+        int alloc = MPMAX(q->alloc * 2, 16);
+        struct work *items = talloc_array(ta_parent, struct work, alloc);
+        for (int n = 0; n < q->num; n++)
+            items[n] = q->items[(q->head + n) % q->alloc];
+        talloc_free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->alloc = alloc;
+    }
+    q->items[(q->head + q->num) % q->alloc] = work;
+    q->num += 1;
+}
+
+static bool deque_pop(struct work_deque *q, bool oldest, struct work *out)
+{
+    if (!q->num)
+        return false;
+    if (oldest) {
+        *out = q->items[q->head];
+        q->head = (q->head + 1) % q->alloc;
+    } else {
+        *out = q->items[(q->head + q->num - 1) % q->alloc];
+    }
+    q->num -= 1;
+    return true;
+}
+
+static bool pop_work(struct mp_thread_pool *pool, struct worker *w, int prio,
+                     bool oldest, struct work *out)
+{
+    if (!atomic_load(&w->num_work))
+        return false;
+
+    mp_mutex_lock(&w->lock);
+    bool ok = deque_pop(&w->queues[prio], oldest, out);
+    if (ok)
+        atomic_fetch_sub(&w->num_work, 1);
+    mp_mutex_unlock(&w->lock);
+
+    // Count the thread as busy before the item stops being queued, so that the
+    // item is always visible in at least one of them.
+    if (ok) {
+        atomic_fetch_add(&pool->busy_threads, 1);
+        atomic_fetch_sub(&pool->num_work, 1);
+    }
+    return ok;
+}
+
+// Take the next item for w: higher priorities first, and within a priority,
+// w's own queue first, then the queues of the other workers.
+static bool take_work(struct mp_thread_pool *pool, struct worker *w,
+                      struct work *out)
+{
+    if (!atomic_load(&pool->num_work))
+        return false;
+
+    int self = w - pool->workers;
+    for (int prio = MP_THREAD_POOL_PRIO_COUNT - 1; prio >= 0; prio--) {
+        if (pop_work(pool, w, prio, false, out))
+            return true;
+        for (int n = 1; n < pool->max_threads; n++) {
+            struct worker *victim = &pool->workers[(self + n) % pool->max_threads];
+            if (pop_work(pool, victim, prio, true, out)) {
+                atomic_fetch_add(&pool->stolen, 1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 static MP_THREAD_VOID worker_thread(void *arg)
 {
-    struct mp_thread_pool *pool = arg;
+    struct worker *w = arg;
+    struct mp_thread_pool *pool = w->pool;
 
     mp_thread_set_name("worker");
-
-    mp_mutex_lock(&pool->lock);
+    current_worker = w;
 
     int64_t destroy_deadline = 0;
-    bool got_timeout = false;
     while (1) {
-        struct work work = {0};
-        if (pool->num_work > 0) {
-            work = pool->work[pool->num_work - 1];
-            pool->num_work -= 1;
-        }
+        struct work work;
+        if (take_work(pool, w, &work)) {
+            int64_t start = mp_time_ns();
 
-        if (!work.fn) {
-            if (got_timeout || pool->terminate)
-                break;
-
-            if (pool->num_threads > pool->min_threads) {
-                if (!destroy_deadline)
-                    destroy_deadline = mp_time_ns() + MP_TIME_S_TO_NS(DESTROY_TIMEOUT);
-                if (mp_cond_timedwait_until(&pool->wakeup, &pool->lock, destroy_deadline))
-                    got_timeout = pool->num_threads > pool->min_threads;
-            } else {
-                mp_cond_wait(&pool->wakeup, &pool->lock);
-            }
-            continue;
-        }
+            work.fn(work.fn_ctx);
 
-        pool->busy_threads += 1;
-        mp_mutex_unlock(&pool->lock);
+            atomic_fetch_add(&pool->busy_ns, mp_time_ns() - start);
+            atomic_fetch_add(&pool->completed[work.prio], 1);
+            atomic_fetch_sub(&pool->busy_threads, 1);
 
-        work.fn(work.fn_ctx);
+            destroy_deadline = 0;
+            continue;
+        }
 
         mp_mutex_lock(&pool->lock);
-        pool->busy_threads -= 1;
 
-        destroy_deadline = 0;
-        got_timeout = false;
-    }
+        // Work is queued with the lock held, so this can't miss any.
+        if (atomic_load(&pool->num_work)) {
+            mp_mutex_unlock(&pool->lock);
+            continue;
+        }
 
-    // If no termination signal was given, it must mean we died because of a
-    // timeout, and nobody is waiting for us. We have to remove ourselves.
-    if (!pool->terminate) {
-        for (int n = 0; n < pool->num_threads; n++) {
-            if (mp_thread_id_equal(mp_thread_get_id(pool->threads[n]),
-                                   mp_thread_current_id()))
-            {
-                mp_thread_detach(pool->threads[n]);
-                MP_TARRAY_REMOVE_AT(pool->threads, pool->num_threads, n);
-                mp_mutex_unlock(&pool->lock);
-                MP_THREAD_RETURN();
-            }
+        if (pool->terminate) {
+            mp_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        bool got_timeout = false;
+        pool->idle_threads += 1;
+        if (pool->num_threads > pool->min_threads) {
+            if (!destroy_deadline)
+                destroy_deadline = mp_time_ns() + MP_TIME_S_TO_NS(DESTROY_TIMEOUT);
+            got_timeout = mp_cond_timedwait_until(&pool->wakeup, &pool->lock,
+                                                  destroy_deadline);
+        } else {
+            mp_cond_wait(&pool->wakeup, &pool->lock);
+        }
+        pool->idle_threads -= 1;
+
+        // If no termination signal was given, nobody is waiting for us, and we
+        // have to remove ourselves. Our queues are empty, as num_work is 0.
+        if (got_timeout && pool->num_threads > pool->min_threads &&
+            !pool->terminate && !atomic_load(&pool->num_work))
+        {
+            mp_thread_detach(w->thread);
+            w->active = false;
+            pool->num_threads -= 1;
+            mp_mutex_unlock(&pool->lock);
+            MP_THREAD_RETURN();
         }
-        MP_ASSERT_UNREACHABLE();
+
+        mp_mutex_unlock(&pool->lock);
     }
 
-    mp_mutex_unlock(&pool->lock);
     MP_THREAD_RETURN();
 }
 
@@ -116,38 +228,46 @@ static void thread_pool_dtor(void *ctx)
 {
     struct mp_thread_pool *pool = ctx;
 
-
     mp_mutex_lock(&pool->lock);
-
     pool->terminate = true;
     mp_cond_broadcast(&pool->wakeup);
-
-    mp_thread *threads = pool->threads;
-    int num_threads = pool->num_threads;
-
-    pool->threads = NULL;
-    pool->num_threads = 0;
-
     mp_mutex_unlock(&pool->lock);
 
-    for (int n = 0; n < num_threads; n++)
-        mp_thread_join(threads[n]);
+    // With terminate set, threads don't remove themselves anymore, and no new
+    // threads are added.
+    for (int n = 0; n < pool->max_threads; n++) {
+        struct worker *w = &pool->workers[n];
+        if (w->active) {
+            mp_thread_join(w->thread);
+            w->active = false;
+            pool->num_threads -= 1;
+        }
+    }
 
-    mp_assert(pool->num_work == 0);
+    mp_assert(atomic_load(&pool->num_work) == 0);
     mp_assert(pool->num_threads == 0);
+    for (int n = 0; n < pool->max_threads; n++)
+        mp_mutex_destroy(&pool->workers[n].lock);
     mp_cond_destroy(&pool->wakeup);
     mp_mutex_destroy(&pool->lock);
 }
 
+// called locked
 static bool add_thread(struct mp_thread_pool *pool)
 {
-    mp_thread thread;
+    for (int n = 0; n < pool->max_threads; n++) {
+        struct worker *w = &pool->workers[n];
+        if (w->active)
+            continue;
 
-    if (mp_thread_create(&thread, worker_thread, pool) != 0)
-        return false;
+        if (mp_thread_create(&w->thread, worker_thread, w) != 0)
+            return false;
 
-    MP_TARRAY_APPEND(pool, pool->threads, pool->num_threads, thread);
-    return true;
+        w->active = true;
+        pool->num_threads += 1;
+        return true;
+    }
+    return false;
 }
 
 struct mp_thread_pool *mp_thread_pool_create(void *ta_parent, int init_threads,
@@ -166,6 +286,12 @@ struct mp_thread_pool *mp_thread_pool_create(void *ta_parent, int init_threads,
     pool->min_threads = min_threads;
     pool->max_threads = max_threads;
 
+    pool->workers = talloc_zero_array(pool, struct worker, max_threads);
+    for (int n = 0; n < max_threads; n++) {
+        pool->workers[n].pool = pool;
+        mp_mutex_init(&pool->workers[n].lock);
+    }
+
     mp_mutex_lock(&pool->lock);
     for (int n = 0; n < init_threads; n++)
         add_thread(pool);
@@ -178,21 +304,45 @@ struct mp_thread_pool *mp_thread_pool_create(void *ta_parent, int init_threads,
     return pool;
 }
 
-static bool thread_pool_add(struct mp_thread_pool *pool, void (*fn)(void *ctx),
-                            void *fn_ctx, bool allow_queue)
+// called locked
+// Pick the queue for new work. Work queued by a worker goes to its own queue,
+// where it runs next unless another thread steals it. Other work is spread
+// over all workers.
+static struct worker *target_worker(struct mp_thread_pool *pool)
+{
+    struct worker *w = current_worker;
+    if (w && w->pool == pool)
+        return w;
+
+    for (int n = 0; n < pool->max_threads; n++) {
+        w = &pool->workers[pool->next_worker];
+        pool->next_worker = (pool->next_worker + 1) % pool->max_threads;
+        if (w->active)
+            return w;
+    }
+    MP_ASSERT_UNREACHABLE();
+}
+
+static bool thread_pool_add(struct mp_thread_pool *pool,
+                            enum mp_thread_pool_prio prio,
+                            void (*fn)(void *ctx), void *fn_ctx,
+                            bool allow_queue)
 {
     bool ok = true;
 
     mp_assert(fn);
+    mp_assert(prio >= 0 && prio < MP_THREAD_POOL_PRIO_COUNT);
 
     mp_mutex_lock(&pool->lock);
-    struct work work = {fn, fn_ctx};
+    struct work work = {fn, fn_ctx, prio};
 
     // If there are not enough threads to process all at once, but we can
     // create a new thread, then do so. If work is queued quickly, it can
     // happen that not all available threads have picked up work yet (up to
     // num_threads - busy_threads threads), which has to be accounted for.
-    if (pool->busy_threads + pool->num_work + 1 > pool->num_threads &&
+    int busy_threads = atomic_load(&pool->busy_threads);
+    int num_work = atomic_load(&pool->num_work);
+    if (busy_threads + num_work + 1 > pool->num_threads &&
         pool->num_threads < pool->max_threads)
     {
         if (!add_thread(pool)) {
@@ -202,8 +352,15 @@ static bool thread_pool_add(struct mp_thread_pool *pool, void (*fn)(void *ctx),
     }
 
     if (ok) {
-        MP_TARRAY_INSERT_AT(pool, pool->work, pool->num_work, 0, work);
-        mp_cond_signal(&pool->wakeup);
+        struct worker *w = target_worker(pool);
+        mp_mutex_lock(&w->lock);
+        deque_push(pool, &w->queues[prio], work);
+        atomic_fetch_add(&w->num_work, 1);
+        mp_mutex_unlock(&w->lock);
+
+        atomic_fetch_add(&pool->num_work, 1);
+        if (pool->idle_threads)
+            mp_cond_signal(&pool->wakeup);
     }
 
     mp_mutex_unlock(&pool->lock);
@@ -213,11 +370,121 @@ static bool thread_pool_add(struct mp_thread_pool *pool, void (*fn)(void *ctx),
 bool mp_thread_pool_queue(struct mp_thread_pool *pool, void (*fn)(void *ctx),
                           void *fn_ctx)
 {
-    return thread_pool_add(pool, fn, fn_ctx, true);
+    return thread_pool_add(pool, MP_THREAD_POOL_PRIO_BACKGROUND, fn, fn_ctx,
+                           true);
+}
+
+bool mp_thread_pool_queue_prio(struct mp_thread_pool *pool,
+                               enum mp_thread_pool_prio prio,
+                               void (*fn)(void *ctx), void *fn_ctx)
+{
+    return thread_pool_add(pool, prio, fn, fn_ctx, true);
 }
 
 bool mp_thread_pool_run(struct mp_thread_pool *pool, void (*fn)(void *ctx),
                         void *fn_ctx)
 {
-    return thread_pool_add(pool, fn, fn_ctx, false);
+    return thread_pool_add(pool, MP_THREAD_POOL_PRIO_BACKGROUND, fn, fn_ctx,
+                           false);
+}
+
+// Shared by the caller of mp_thread_pool_parallel_for() and its helper work
+// items. Helpers that start late may outlive the call, so this is refcounted.
+struct parallel_for {
+    void (*fn)(void *ctx, int n);
+    void *fn_ctx;
+    int count;
+
+    atomic_int next;            // next index to run
+    atomic_int done;            // number of finished indexes
+    atomic_int refs;
+
+    mp_mutex lock;
+    mp_cond wakeup;             // signaled when done reaches count
+};
+
+static void parallel_for_unref(struct parallel_for *pf)
+{
+    if (atomic_fetch_sub(&pf->refs, 1) > 1)
+        return;
+    mp_cond_destroy(&pf->wakeup);
+    mp_mutex_destroy(&pf->lock);
+    talloc_free(pf);
+}
+
+static void parallel_for_run(struct parallel_for *pf)
+{
+    int n;
+    while ((n = atomic_fetch_add(&pf->next, 1)) < pf->count) {
+        pf->fn(pf->fn_ctx, n);
+        if (atomic_fetch_add(&pf->done, 1) + 1 == pf->count) {
+            mp_mutex_lock(&pf->lock);
+            mp_cond_signal(&pf->wakeup);
+            mp_mutex_unlock(&pf->lock);
+        }
+    }
+}
+
+static void parallel_for_helper(void *ctx)
+{
+    struct parallel_for *pf = ctx;
+    parallel_for_run(pf);
+    parallel_for_unref(pf);
+}
+
+void mp_thread_pool_parallel_for(struct mp_thread_pool *pool, int count,
+                                 void (*fn)(void *ctx, int n), void *fn_ctx)
+{
+    if (count < 1)
+        return;
+
+    if (!pool || count == 1) {
+        for (int n = 0; n < count; n++)
+            fn(fn_ctx, n);
+        return;
+    }
+
+    struct parallel_for *pf = talloc_zero(NULL, struct parallel_for);
+    pf->fn = fn;
+    pf->fn_ctx = fn_ctx;
+    pf->count = count;
+    atomic_store(&pf->refs, 1);
+    mp_mutex_init(&pf->lock);
+    mp_cond_init(&pf->wakeup);
+
+    int helpers = MPMIN(count - 1, pool->max_threads);
+    for (int n = 0; n < helpers; n++) {
+        atomic_fetch_add(&pf->refs, 1);
+        if (!thread_pool_add(pool, MP_THREAD_POOL_PRIO_REALTIME,
+                             parallel_for_helper, pf, true))
+        {
+            atomic_fetch_sub(&pf->refs, 1);
+            break;
+        }
+    }
+
+    parallel_for_run(pf);
+
+    mp_mutex_lock(&pf->lock);
+    while (atomic_load(&pf->done) < count)
+        mp_cond_wait(&pf->wakeup, &pf->lock);
+    mp_mutex_unlock(&pf->lock);
+
+    parallel_for_unref(pf);
+}
+
+void mp_thread_pool_get_stats(struct mp_thread_pool *pool,
+                              struct mp_thread_pool_stats *stats)
+{
+    // See pop_work() for the order.
+    int queued = atomic_load(&pool->num_work);
+    *stats = (struct mp_thread_pool_stats){
+        .num_threads = atomic_load(&pool->num_threads),
+        .busy_threads = atomic_load(&pool->busy_threads),
+        .queued = queued,
+        .stolen = atomic_load(&pool->stolen),
+        .busy_ns = atomic_load(&pool->busy_ns),
+    };
+    for (int n = 0; n < MP_THREAD_POOL_PRIO_COUNT; n++)
+        stats->completed[n] = atomic_load(&pool->completed[n]);
 }
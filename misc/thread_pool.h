@@ -2,8 +2,18 @@
 #define MPV_MP_THREAD_POOL_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
 struct mp_thread_pool;
 
+// Work items of higher priority are always picked up first. Within the same
+// priority, there is no ordering guarantee.
+enum mp_thread_pool_prio {
+    MP_THREAD_POOL_PRIO_BACKGROUND, // I/O, loading, async commands (default)
+    MP_THREAD_POOL_PRIO_REALTIME,   // latency-sensitive, e.g. slices of a frame
+    MP_THREAD_POOL_PRIO_COUNT,
+};
+
 // Create a thread pool with the given number of worker threads. This can return
 // NULL if the worker threads could not be created. The thread pool can be
 // destroyed with talloc_free(pool), or indirectly with talloc_free(ta_parent).
@@ -14,6 +24,8 @@ struct mp_thread_pool;
 // remaining threads will be created on demand, but never destroyed.
 // If init_threads > 0, then mp_thread_pool_queue() can never fail.
 // If init_threads == 0, mp_thread_pool_create() itself can never fail.
+// Each worker thread has its own queue. Idle threads take work from the queues
+// of busy threads, so a thread pool can be shared by unrelated users.
 struct mp_thread_pool *mp_thread_pool_create(void *ta_parent, int init_threads,
                                              int min_threads, int max_threads);
 
@@ -24,12 +36,45 @@ struct mp_thread_pool *mp_thread_pool_create(void *ta_parent, int init_threads,
 // pool destruction.
 // This function is explicitly thread-safe.
 // Cannot fail if thread pool was created with at least 1 thread.
+// The item has MP_THREAD_POOL_PRIO_BACKGROUND priority.
 bool mp_thread_pool_queue(struct mp_thread_pool *pool, void (*fn)(void *ctx),
                           void *fn_ctx);
 
+// Like mp_thread_pool_queue(), but with the given priority.
+bool mp_thread_pool_queue_prio(struct mp_thread_pool *pool,
+                               enum mp_thread_pool_prio prio,
+                               void (*fn)(void *ctx), void *fn_ctx);
+
 // Like mp_thread_pool_queue(), but only queue the item and succeed if a thread
 // can be reserved for the item (i.e. minimal wait time instead of unbounded).
 bool mp_thread_pool_run(struct mp_thread_pool *pool, void (*fn)(void *ctx),
                         void *fn_ctx);
 
+// Call fn(fn_ctx, n) for every n in [0, count), and return when all calls have
+// returned. The calling thread runs calls too, while worker threads help with
+// MP_THREAD_POOL_PRIO_REALTIME priority. This never fails: if there are no
+// worker threads available (or pool is NULL), all calls run on the calling
+// thread. It can be used from within work items of the same pool.
+void mp_thread_pool_parallel_for(struct mp_thread_pool *pool, int count,
+                                 void (*fn)(void *ctx, int n), void *fn_ctx);
+
+struct mp_thread_pool_stats {
+    int num_threads;            // worker threads that exist
+    int busy_threads;           // worker threads running a work item
+    int queued;                 // work items waiting for a thread
+    int64_t completed[MP_THREAD_POOL_PRIO_COUNT]; // work items run, per prio
+    int64_t stolen;             // work items taken from another thread's queue
+    int64_t busy_ns;            // total time spent in finished work items;
+                                // divide the difference between two calls by
+                                // the time between them for the average
+                                // number of busy threads
+};
+
+// Return a snapshot of the pool's usage counters. Thread-safe, and doesn't
+// take any locks, so it's cheap enough to call frequently. The counters are
+// read one after another, so they may not be exactly consistent with each
+// other.
+void mp_thread_pool_get_stats(struct mp_thread_pool *pool,
+                              struct mp_thread_pool_stats *stats);
+
 #endif
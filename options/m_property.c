@@ -34,16 +34,30 @@
 #include "common/msg.h"
 #include "common/common.h"
 
-static int m_property_multiply(struct mp_log *log,
-                               const struct m_property *prop_list,
+struct m_property_index {
+    const struct m_property *list;
+    // Open addressing table of list indexes + 1; 0 marks an empty slot.
+    int *slots;
+    size_t mask;
+};
+
+// Either a pre-resolved property, or the index to resolve names with.
+struct prop_ref {
+    const struct m_property_index *index;
+    struct m_property *prop;
+};
+
+static int ref_do(struct mp_log *log, struct prop_ref ref, const char *name,
+                  int action, void *arg, void *ctx);
+
+static int m_property_multiply(struct mp_log *log, struct prop_ref ref,
                                const char *property, double f, void *ctx)
 {
     union m_option_value val = m_option_value_default;
     struct m_option opt = {0};
     int r;
 
-    r = m_property_do(log, prop_list, property, M_PROPERTY_GET_CONSTRICTED_TYPE,
-                      &opt, ctx);
+    r = ref_do(log, ref, property, M_PROPERTY_GET_CONSTRICTED_TYPE, &opt, ctx);
     if (r != M_PROPERTY_OK)
         return r;
     mp_assert(opt.type);
@@ -51,11 +65,11 @@ static int m_property_multiply(struct mp_log *log,
     if (!opt.type->multiply)
         return M_PROPERTY_NOT_IMPLEMENTED;
 
-    r = m_property_do(log, prop_list, property, M_PROPERTY_GET, &val, ctx);
+    r = ref_do(log, ref, property, M_PROPERTY_GET, &val, ctx);
     if (r != M_PROPERTY_OK)
         return r;
     opt.type->multiply(&opt, &val, f);
-    r = m_property_do(log, prop_list, property, M_PROPERTY_SET, &val, ctx);
+    r = ref_do(log, ref, property, M_PROPERTY_SET, &val, ctx);
     m_option_free(&opt, &val);
     return r;
 }
@@ -70,16 +84,66 @@ struct m_property *m_property_list_find(const struct m_property *list,
     return NULL;
 }
 
-static int do_action(const struct m_property *prop_list, const char *name,
+static size_t hash_name(bstr name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (int n = 0; n < name.len; n++)
+        h = (h ^ name.start[n]) * 16777619u;
+    return h;
+}
+
+struct m_property_index *m_property_index_create(void *ta_parent,
+                                                 const struct m_property *list)
+{
+    struct m_property_index *index = talloc_zero(ta_parent,
+                                                 struct m_property_index);
+    index->list = list;
+    int num = 0;
+    while (list && list[num].name)
+        num++;
+    size_t size = 16;
+    while (size < num * 2)
+        size *= 2;
+    index->slots = talloc_zero_array(index, int, size);
+    index->mask = size - 1;
+    for (int n = 0; n < num; n++) {
+        size_t i = hash_name(bstr0(list[n].name)) & index->mask;
+        while (index->slots[i]) {
+            // Duplicate names: the first entry wins, like a linear search.
+            if (strcmp(list[index->slots[i] - 1].name, list[n].name) == 0)
+                break;
+            i = (i + 1) & index->mask;
+        }
+        if (!index->slots[i])
+            index->slots[i] = n + 1;
+    }
+    return index;
+}
+
+struct m_property *m_property_index_find(const struct m_property_index *index,
+                                         bstr name)
+{
+    size_t i = hash_name(name) & index->mask;
+    while (index->slots[i]) {
+        const struct m_property *prop = &index->list[index->slots[i] - 1];
+        if (bstr_equals0(name, prop->name))
+            return (struct m_property *)prop;
+        i = (i + 1) & index->mask;
+    }
+    return NULL;
+}
+
+static int do_action(struct prop_ref ref, const char *name,
                      int action, void *arg, void *ctx)
 {
-    struct m_property *prop;
+    struct m_property *prop = ref.prop;
     struct m_property_action_arg ka;
     const char *sep = strchr(name, '/');
     if (sep && sep[1]) {
-        char base[128];
-        snprintf(base, sizeof(base), "%.*s", (int)(sep - name), name);
-        prop = m_property_list_find(prop_list, base);
+        if (!prop)
+            prop = m_property_index_find(ref.index,
+                                         bstr_splice(bstr0(name), 0, sep - name));
         ka = (struct m_property_action_arg) {
             .key = sep + 1,
             .action = action,
@@ -87,22 +151,22 @@ static int do_action(const struct m_property *prop_list, const char *name,
         };
         action = M_PROPERTY_KEY_ACTION;
         arg = &ka;
-    } else
-        prop = m_property_list_find(prop_list, name);
+    } else if (!prop) {
+        prop = m_property_index_find(ref.index, bstr0(name));
+    }
     if (!prop)
         return M_PROPERTY_UNKNOWN;
     return prop->call(ctx, prop, action, arg);
 }
 
-// (as a hack, log can be NULL on read-only paths)
-int m_property_do(struct mp_log *log, const struct m_property *prop_list,
-                  const char *name, int action, void *arg, void *ctx)
+static int ref_do(struct mp_log *log, struct prop_ref ref, const char *name,
+                  int action, void *arg, void *ctx)
 {
     union m_option_value val = m_option_value_default;
     int r;
 
     struct m_option opt = {0};
-    r = do_action(prop_list, name, M_PROPERTY_GET_TYPE, &opt, ctx);
+    r = do_action(ref, name, M_PROPERTY_GET_TYPE, &opt, ctx);
     if (r <= 0)
         return r;
     mp_assert(opt.type);
@@ -110,10 +174,10 @@ int m_property_do(struct mp_log *log, const struct m_property *prop_list,
     switch (action) {
     case M_PROPERTY_FIXED_LEN_PRINT:
     case M_PROPERTY_PRINT: {
-        if ((r = do_action(prop_list, name, action, arg, ctx)) >= 0)
+        if ((r = do_action(ref, name, action, arg, ctx)) >= 0)
             return r;
         // Fallback to m_option
-        if ((r = do_action(prop_list, name, M_PROPERTY_GET, &val, ctx)) <= 0)
+        if ((r = do_action(ref, name, M_PROPERTY_GET, &val, ctx)) <= 0)
             return r;
         char *str = m_option_pretty_print(&opt, &val, action == M_PROPERTY_FIXED_LEN_PRINT);
         m_option_free(&opt, &val);
@@ -121,7 +185,7 @@ int m_property_do(struct mp_log *log, const struct m_property *prop_list,
         return str != NULL;
     }
     case M_PROPERTY_GET_STRING: {
-        if ((r = do_action(prop_list, name, M_PROPERTY_GET, &val, ctx)) <= 0)
+        if ((r = do_action(ref, name, M_PROPERTY_GET, &val, ctx)) <= 0)
             return r;
         char *str = m_option_print(&opt, &val);
         m_option_free(&opt, &val);
@@ -130,49 +194,49 @@ int m_property_do(struct mp_log *log, const struct m_property *prop_list,
     }
     case M_PROPERTY_SET_STRING: {
         struct mpv_node node = { .format = MPV_FORMAT_STRING, .u.string = arg };
-        return m_property_do(log, prop_list, name, M_PROPERTY_SET_NODE, &node, ctx);
+        return ref_do(log, ref, name, M_PROPERTY_SET_NODE, &node, ctx);
     }
     case M_PROPERTY_MULTIPLY: {
-        return m_property_multiply(log, prop_list, name, *(double *)arg, ctx);
+        return m_property_multiply(log, ref, name, *(double *)arg, ctx);
     }
     case M_PROPERTY_SWITCH: {
         if (!log)
             return M_PROPERTY_ERROR;
         struct m_property_switch_arg *sarg = arg;
-        if ((r = do_action(prop_list, name, M_PROPERTY_SWITCH, arg, ctx)) !=
+        if ((r = do_action(ref, name, M_PROPERTY_SWITCH, arg, ctx)) !=
             M_PROPERTY_NOT_IMPLEMENTED)
             return r;
         // Fallback to m_option
-        r = m_property_do(log, prop_list, name, M_PROPERTY_GET_CONSTRICTED_TYPE,
+        r = ref_do(log, ref, name, M_PROPERTY_GET_CONSTRICTED_TYPE,
                           &opt, ctx);
         if (r <= 0)
             return r;
         mp_assert(opt.type);
         if (!opt.type->add)
             return M_PROPERTY_NOT_IMPLEMENTED;
-        if ((r = do_action(prop_list, name, M_PROPERTY_GET, &val, ctx)) <= 0)
+        if ((r = do_action(ref, name, M_PROPERTY_GET, &val, ctx)) <= 0)
             return r;
         opt.type->add(&opt, &val, sarg->inc, sarg->wrap);
-        r = do_action(prop_list, name, M_PROPERTY_SET, &val, ctx);
+        r = do_action(ref, name, M_PROPERTY_SET, &val, ctx);
         m_option_free(&opt, &val);
         return r;
     }
     case M_PROPERTY_GET_CONSTRICTED_TYPE: {
-        r = do_action(prop_list, name, action, arg, ctx);
+        r = do_action(ref, name, action, arg, ctx);
         if (r >= 0 || r == M_PROPERTY_UNAVAILABLE)
             return r;
-        if ((r = do_action(prop_list, name, M_PROPERTY_GET_TYPE, arg, ctx)) >= 0)
+        if ((r = do_action(ref, name, M_PROPERTY_GET_TYPE, arg, ctx)) >= 0)
             return r;
         return M_PROPERTY_NOT_IMPLEMENTED;
     }
     case M_PROPERTY_SET: {
-        return do_action(prop_list, name, M_PROPERTY_SET, arg, ctx);
+        return do_action(ref, name, M_PROPERTY_SET, arg, ctx);
     }
     case M_PROPERTY_GET_NODE: {
-        if ((r = do_action(prop_list, name, M_PROPERTY_GET_NODE, arg, ctx)) !=
+        if ((r = do_action(ref, name, M_PROPERTY_GET_NODE, arg, ctx)) !=
             M_PROPERTY_NOT_IMPLEMENTED)
             return r;
-        if ((r = do_action(prop_list, name, M_PROPERTY_GET, &val, ctx)) <= 0)
+        if ((r = do_action(ref, name, M_PROPERTY_GET, &val, ctx)) <= 0)
             return r;
         struct mpv_node *node = arg;
         int err = m_option_get_node(&opt, NULL, node, &val);
@@ -189,7 +253,7 @@ int m_property_do(struct mp_log *log, const struct m_property *prop_list,
     case M_PROPERTY_SET_NODE: {
         if (!log)
             return M_PROPERTY_ERROR;
-        if ((r = do_action(prop_list, name, M_PROPERTY_SET_NODE, arg, ctx)) !=
+        if ((r = do_action(ref, name, M_PROPERTY_SET_NODE, arg, ctx)) !=
             M_PROPERTY_NOT_IMPLEMENTED)
             return r;
         int err = m_option_set_node_or_string(log, &opt, name, &val, arg);
@@ -198,16 +262,31 @@ int m_property_do(struct mp_log *log, const struct m_property *prop_list,
         } else if (err < 0) {
             r = M_PROPERTY_INVALID_FORMAT;
         } else {
-            r = do_action(prop_list, name, M_PROPERTY_SET, &val, ctx);
+            r = do_action(ref, name, M_PROPERTY_SET, &val, ctx);
         }
         m_option_free(&opt, &val);
         return r;
     }
     default:
-        return do_action(prop_list, name, action, arg, ctx);
+        return do_action(ref, name, action, arg, ctx);
     }
 }
 
+// (as a hack, log can be NULL on read-only paths)
+int m_property_do(struct mp_log *log, const struct m_property_index *index,
+                  const char *name, int action, void *arg, void *ctx)
+{
+    return ref_do(log, (struct prop_ref){ .index = index }, name, action, arg,
+                  ctx);
+}
+
+int m_property_do_prop(struct mp_log *log, struct m_property *prop,
+                       const char *name, int action, void *arg, void *ctx)
+{
+    return ref_do(log, (struct prop_ref){ .prop = prop }, name, action, arg,
+                  ctx);
+}
+
 bool m_property_split_path(const char *path, bstr *prefix, char **rem)
 {
     char *next = strchr(path, '/');
@@ -235,11 +314,11 @@ static void m_property_unkey(int *action, void **arg)
     }
 }
 
-static int m_property_do_bstr(const struct m_property *prop_list, bstr name,
+static int m_property_do_bstr(const struct m_property_index *index, bstr name,
                               int action, void *arg, void *ctx)
 {
     char *name0 = bstrdup0(NULL, name);
-    int ret = m_property_do(NULL, prop_list, name0, action, arg, ctx);
+    int ret = m_property_do(NULL, index, name0, action, arg, ctx);
     talloc_free(name0);
     return ret;
 }
@@ -252,7 +331,7 @@ static void append_str(char **s, int *len, bstr append)
     *len = *len + append.len;
 }
 
-static int expand_property(const struct m_property *prop_list, char **ret,
+static int expand_property(const struct m_property_index *index, char **ret,
                            int *ret_len, bstr prop, bool silent_error, void *ctx)
 {
     bool cond_yes = bstr_eatstart0(&prop, "?");
@@ -268,7 +347,7 @@ static int expand_property(const struct m_property *prop_list, char **ret,
     method = fixed_len ? M_PROPERTY_FIXED_LEN_PRINT : method;
 
     char *s = NULL;
-    int r = m_property_do_bstr(prop_list, prop, method, &s, ctx);
+    int r = m_property_do_bstr(index, prop, method, &s, ctx);
     bool skip;
     if (comp) {
         skip = ((s && bstr_equals0(comp_with, s)) != cond_yes);
@@ -285,7 +364,7 @@ static int expand_property(const struct m_property *prop_list, char **ret,
     return skip;
 }
 
-char *m_properties_expand_string(const struct m_property *prop_list,
+char *m_properties_expand_string(const struct m_property_index *index,
                                  const char *str0, void *ctx)
 {
     char *ret = NULL;
@@ -319,7 +398,7 @@ char *m_properties_expand_string(const struct m_property *prop_list,
 #endif
 
             if (!skip) {
-                skip = expand_property(prop_list, &ret, &ret_len, name,
+                skip = expand_property(index, &ret, &ret_len, name,
                                        have_fallback, ctx);
                 if (skip)
                     skip_level = level;
@@ -154,13 +154,27 @@ struct m_property {
 struct m_property *m_property_list_find(const struct m_property *list,
                                         const char *name);
 
+// Hash table for looking up properties by name. The list must stay valid and
+// unchanged for the lifetime of the index.
+struct m_property_index;
+struct m_property_index *m_property_index_create(void *ta_parent,
+                                                 const struct m_property *list);
+struct m_property *m_property_index_find(const struct m_property_index *index,
+                                         bstr name);
+
 // Access a property.
 // action: one of m_property_action
 // ctx: opaque value passed through to property implementation
 // returns: one of mp_property_return
-int m_property_do(struct mp_log *log, const struct m_property* prop_list,
+int m_property_do(struct mp_log *log, const struct m_property_index *index,
                   const char* property_name, int action, void* arg, void *ctx);
 
+// Like m_property_do(), but with the property already resolved. prop must be
+// the entry for the part of property_name before the first '/'.
+int m_property_do_prop(struct mp_log *log, struct m_property *prop,
+                       const char *property_name, int action, void *arg,
+                       void *ctx);
+
 // Given a path of the form "a/b/c", this function will set *prefix to "a",
 // and rem to "b/c", and return true.
 // If there is no '/' in the path, set prefix to path, and rem to "", and
@@ -183,7 +197,7 @@ void m_properties_print_help_list(struct mp_log *log,
 // STR is recursively expanded using the same rules.
 // "$$" can be used to escape "$", and "$}" to escape "}".
 // "$>" disables parsing of "$" for the rest of the string.
-char* m_properties_expand_string(const struct m_property *prop_list,
+char* m_properties_expand_string(const struct m_property_index *index,
                                  const char *str, void *ctx);
 
 // Trivial helpers for implementing properties.
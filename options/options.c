@@ -514,6 +514,8 @@ static const m_option_t mp_opts[] = {
         .flags = M_OPT_PRE_PARSE | UPDATE_TERM},
     {"dump-stats", OPT_STRING(dump_stats),
         .flags = UPDATE_TERM | M_OPT_PRE_PARSE | M_OPT_FILE},
+    {"perf-info-reset", OPT_BOOL(perf_info_reset)},
+    {"dump-trace", OPT_STRING(dump_trace), .flags = UPDATE_TERM | M_OPT_FILE},
     {"msg-color", OPT_BOOL(msg_color), .flags = M_OPT_PRE_PARSE | UPDATE_TERM},
 #ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
     {"log-file", OPT_STRING(log_file),
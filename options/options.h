@@ -158,6 +158,8 @@ typedef struct MPOpts {
     bool property_print_help;
     bool use_terminal;
     char *dump_stats;
+    bool perf_info_reset;
+    char *dump_trace;
     int verbose;
     bool msg_really_quiet;
     char **msg_levels;
@@ -88,10 +88,12 @@ struct observe_property {
     struct mpv_handle *owner;
     char *name;
     int id;                 // ==mp_get_property_id(name)
+    struct m_property *handle; // ==mp_get_property_handle(name)
     uint64_t event_mask;    // ==mp_get_property_event_mask(name)
     int64_t reply_id;
     mpv_format format;
     const struct m_option *type;
+    bool delta;             // return JSON patches (always MPV_FORMAT_NODE)
     // -- protected by owner->lock
     size_t refcount;
     uint64_t change_ts;     // logical timestamp incremented on each change
@@ -100,6 +102,11 @@ struct observe_property {
     union m_option_value value;
     uint64_t value_ret_ts;  // logical timestamp of value returned to user
     union m_option_value value_ret;
+    // For delta: the value the last returned patch resulted in. If
+    // base_is_value is set, this is value/value_valid instead.
+    bool base_is_value;
+    bool base_valid;
+    union m_option_value base;
     bool waiting_for_hook;  // flag for draining old property changes on a hook
 };
 
@@ -1248,6 +1255,26 @@ int mpv_command_node_async(mpv_handle *ctx, uint64_t ud, mpv_node *args)
     return run_async_cmd(ctx, ud, mp_input_parse_cmd_node(ctx->log, args));
 }
 
+static int run_cmd_nowait(mpv_handle *ctx, uint64_t ud, struct mp_cmd *cmd)
+{
+    if (cmd && (cmd->flags & MP_ASYNC_CMD))
+        return run_client_command(ctx, cmd, NULL);
+    int r = run_async_cmd(ctx, ud, cmd);
+    return r < 0 ? r : 1;
+}
+
+int mp_client_command_node_nowait(mpv_handle *ctx, uint64_t ud, mpv_node *args)
+{
+    return run_cmd_nowait(ctx, ud, mp_input_parse_cmd_node(ctx->log, args));
+}
+
+int mp_client_command_string_nowait(mpv_handle *ctx, uint64_t ud,
+                                    const char *args)
+{
+    return run_cmd_nowait(ctx, ud,
+        mp_input_parse_cmd(ctx->mpctx->input, bstr0((char*)args), ctx->name));
+}
+
 void mpv_abort_async_command(mpv_handle *ctx, uint64_t reply_userdata)
 {
     abort_async(ctx->mpctx, ctx, MPV_EVENT_COMMAND_REPLY, reply_userdata);
@@ -1380,6 +1407,7 @@ int mpv_set_property_async(mpv_handle *ctx, uint64_t ud, const char *name,
 struct getproperty_request {
     struct MPContext *mpctx;
     const char *name;
+    struct m_property *handle; // optional, pre-resolved name
     mpv_format format;
     void *data;
     int status;
@@ -1394,6 +1422,15 @@ static void free_prop_data(void *ptr)
     m_option_free(type, prop->data);
 }
 
+static int getproperty_do(struct getproperty_request *req, int action,
+                          void *arg)
+{
+    if (req->handle)
+        return mp_property_do_handle(req->handle, req->name, action, arg,
+                                     req->mpctx);
+    return mp_property_do(req->name, action, arg, req->mpctx);
+}
+
 static void getproperty_fn(void *arg)
 {
     struct getproperty_request *req = arg;
@@ -1405,11 +1442,11 @@ static void getproperty_fn(void *arg)
     int err = -1;
     switch (req->format) {
     case MPV_FORMAT_OSD_STRING:
-        err = mp_property_do(req->name, M_PROPERTY_PRINT, data, req->mpctx);
+        err = getproperty_do(req, M_PROPERTY_PRINT, data);
         break;
     case MPV_FORMAT_STRING: {
         char *s = NULL;
-        err = mp_property_do(req->name, M_PROPERTY_GET_STRING, &s, req->mpctx);
+        err = getproperty_do(req, M_PROPERTY_GET_STRING, &s);
         if (err == M_PROPERTY_OK)
             *(char **)data = s;
         break;
@@ -1419,13 +1456,12 @@ static void getproperty_fn(void *arg)
     case MPV_FORMAT_INT64:
     case MPV_FORMAT_DOUBLE: {
         struct mpv_node node = {{0}};
-        err = mp_property_do(req->name, M_PROPERTY_GET_NODE, &node, req->mpctx);
+        err = getproperty_do(req, M_PROPERTY_GET_NODE, &node);
         if (err == M_PROPERTY_NOT_IMPLEMENTED) {
             // Go through explicit string conversion. Same reasoning as on the
             // GET code path.
             char *s = NULL;
-            err = mp_property_do(req->name, M_PROPERTY_GET_STRING, &s,
-                                 req->mpctx);
+            err = getproperty_do(req, M_PROPERTY_GET_STRING, &s);
             if (err != M_PROPERTY_OK)
                 break;
             node.format = MPV_FORMAT_STRING;
@@ -1530,11 +1566,12 @@ static void property_free(void *p)
     if (prop->type) {
         m_option_free(prop->type, &prop->value);
         m_option_free(prop->type, &prop->value_ret);
+        m_option_free(prop->type, &prop->base);
     }
 }
 
-int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
-                         const char *name, mpv_format format)
+static int observe_property(mpv_handle *ctx, uint64_t userdata,
+                            const char *name, mpv_format format, bool delta)
 {
     const struct m_option *type = get_mp_type_get(format);
     if (format != MPV_FORMAT_NONE && !type)
@@ -1551,14 +1588,17 @@ int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
         .owner = ctx,
         .name = talloc_strdup(prop, name),
         .id = mp_get_property_id(ctx->mpctx, name),
+        .handle = mp_get_property_handle(ctx->mpctx, name),
         .event_mask = mp_get_property_event_mask(name),
         .reply_id = userdata,
         .format = format,
         .type = type,
+        .delta = delta,
         .change_ts = 1, // force initial event
         .refcount = 1,
         .value = m_option_value_default,
         .value_ret = m_option_value_default,
+        .base = m_option_value_default,
     };
     ctx->properties_change_ts += 1;
     MP_TARRAY_APPEND(ctx, ctx->properties, ctx->num_properties, prop);
@@ -1571,6 +1611,18 @@ int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
     return 0;
 }
 
+int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
+                         const char *name, mpv_format format)
+{
+    return observe_property(ctx, userdata, name, format, false);
+}
+
+int mpv_observe_property_delta(mpv_handle *ctx, uint64_t userdata,
+                               const char *name)
+{
+    return observe_property(ctx, userdata, name, MPV_FORMAT_NODE, true);
+}
+
 int mpv_unobserve_property(mpv_handle *ctx, uint64_t userdata)
 {
     mp_mutex_lock(&ctx->lock);
@@ -1685,6 +1737,7 @@ static void send_client_property_changes(struct mpv_handle *ctx)
             struct getproperty_request req = {
                 .mpctx = ctx->mpctx,
                 .name = prop->name,
+                .handle = prop->handle,
                 .format = prop->format,
                 .data = &val,
             };
@@ -1718,6 +1771,18 @@ static void send_client_property_changes(struct mpv_handle *ctx)
             if (prop->value_ts == 0)
                 changed = true; // initial event
 
+            // The old value is the base of the next patch, if the client
+            // has seen it. Keep it instead of copying it on every event.
+            if (changed && prop->delta && prop->base_is_value) {
+                m_option_free(type, &prop->base);
+                prop->base_valid = prop->value_valid;
+                if (prop->value_valid) {
+                    memcpy(&prop->base, &prop->value, type->type->size);
+                    memset(&prop->value, 0, type->type->size);
+                }
+                prop->base_is_value = false;
+            }
+
             prop->value_valid = val_valid;
             if (changed && val_valid) {
                 // move val to prop->value
@@ -1807,8 +1872,23 @@ static bool gen_property_change_event(struct mpv_handle *ctx)
             ctx->cur_property = prop;
             prop->refcount += 1;
 
-            if (prop->value_valid)
+            if (prop->value_valid && prop->delta) {
+                struct mpv_node *base = NULL;
+                if (prop->base_is_value) {
+                    base = (struct mpv_node *)&prop->value;
+                } else if (prop->base_valid) {
+                    base = (struct mpv_node *)&prop->base;
+                }
+                m_option_free(prop->type, &prop->value_ret);
+                node_diff((struct mpv_node *)&prop->value_ret, base,
+                          (struct mpv_node *)&prop->value);
+            } else if (prop->value_valid) {
                 m_option_copy(prop->type, &prop->value_ret, &prop->value);
+            }
+            if (prop->delta) {
+                m_option_free(prop->type, &prop->base);
+                prop->base_is_value = true;
+            }
 
             ctx->cur_property_event = (struct mpv_event_property){
                 .name = prop->name,
@@ -39,6 +39,17 @@ struct mpv_global *mp_client_get_global(struct mpv_handle *ctx);
 void mp_client_broadcast_event_external(struct mp_client_api *api, int event,
                                         void *data);
 
+// Like mpv_command_node() and mpv_command_string(), but return before the
+// command has finished. Its result is sent as MPV_EVENT_COMMAND_REPLY with the
+// given reply_userdata, and 1 is returned. Commands with the "async" prefix,
+// which the synchronous functions don't wait for either, and commands that
+// fail to start are not replied to: their result is returned directly.
+struct mpv_node;
+int mp_client_command_node_nowait(struct mpv_handle *ctx, uint64_t ud,
+                                  struct mpv_node *args);
+int mp_client_command_string_nowait(struct mpv_handle *ctx, uint64_t ud,
+                                    const char *args);
+
 // m_option.c
 void *node_get_alloc(struct mpv_node *node);
 
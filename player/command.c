@@ -87,6 +87,7 @@
 struct command_ctx {
     // All properties, terminated with a {0} item.
     struct m_property *properties;
+    struct m_property_index *prop_index;
 
     double last_seek_time;
     double last_seek_pts;
@@ -1560,6 +1561,14 @@ static int mp_property_demuxer_cache_state(void *ctx, struct m_property *prop,
         node_map_add_double(r, "debug-seeking", s.seeking);
     node_map_add_int64(r, "debug-low-level-seeks", s.low_level_seeks);
     node_map_add_int64(r, "debug-byte-level-seeks", s.byte_level_seeks);
+    node_map_add_int64(r, "debug-index-entries", s.index_entries);
+    node_map_add_int64(r, "debug-index-lookups", s.index_lookups);
+    node_map_add_int64(r, "debug-index-lookup-steps", s.index_lookup_steps);
+    node_map_add_int64(r, "debug-reader-lock-contended", s.reader_lock_contended);
+    node_map_add_int64(r, "debug-packet-pool-hits", s.packet_pool_hits);
+    node_map_add_int64(r, "debug-packet-pool-misses", s.packet_pool_misses);
+    node_map_add_int64(r, "debug-packet-pool-retained-bytes",
+                       s.packet_pool_retained_bytes);
     if (s.ts_last != MP_NOPTS_VALUE)
         node_map_add_double(r, "debug-ts-last", s.ts_last);
 
@@ -2952,7 +2961,8 @@ static int mp_property_perf_info(void *ctx, struct m_property *p, int action,
         *(struct m_option *)arg = (struct m_option){.type = CONF_TYPE_NODE};
         return M_PROPERTY_OK;
     case M_PROPERTY_GET: {
-        stats_global_query(mpctx->global, (struct mpv_node *)arg);
+        stats_global_query(mpctx->global, (struct mpv_node *)arg,
+                           mpctx->opts->perf_info_reset);
         return M_PROPERTY_OK;
     }
     }
@@ -4035,6 +4045,7 @@ static int do_op_udata(struct udata_ctx* ctx, int action, void *arg)
 
             // And decrement the count
             node->u.list->num--;
+            node_map_changed(node);
 
             return M_PROPERTY_OK;
         }
@@ -4571,11 +4582,22 @@ uint64_t mp_get_property_event_mask(const char *name)
 int mp_get_property_id(struct MPContext *mpctx, const char *name)
 {
     struct command_ctx *ctx = mpctx->command_ctx;
-    for (int n = 0; ctx->properties[n].name; n++) {
-        if (match_property(ctx->properties[n].name, name))
-            return n;
-    }
-    return -1;
+    if (strncmp(name, "options/", 8) == 0)
+        name += 8;
+    bstr base = bstr_splice(bstr0(name), 0, strcspn(name, "/"));
+    struct m_property *prop = m_property_index_find(ctx->prop_index, base);
+    return prop ? prop - ctx->properties : -1;
+}
+
+// Return the property for name, for use with mp_property_do_handle(). Unlike
+// mp_get_property_id(), "options/..." resolves to the "options" property.
+// Return NULL if property unknown.
+struct m_property *mp_get_property_handle(struct MPContext *mpctx,
+                                          const char *name)
+{
+    struct command_ctx *ctx = mpctx->command_ctx;
+    bstr base = bstr_splice(bstr0(name), 0, strcspn(name, "/"));
+    return m_property_index_find(ctx->prop_index, base);
 }
 
 static bool is_property_set(int action, void *val)
@@ -4596,12 +4618,9 @@ static bool is_property_set(int action, void *val)
     }
 }
 
-int mp_property_do(const char *name, int action, void *val,
-                   struct MPContext *ctx)
+static void log_property_set(const char *name, int action, void *val, int r,
+                             struct MPContext *ctx)
 {
-    struct command_ctx *cmd = ctx->command_ctx;
-    int r = m_property_do(ctx->log, cmd->properties, name, action, val, ctx);
-
     if (mp_msg_test(ctx->log, MSGL_V) && is_property_set(action, val)) {
         struct m_option option_type = {0};
         void *data = val;
@@ -4619,13 +4638,31 @@ int mp_property_do(const char *name, int action, void *val,
                    name, t ? "=" : "", t ? t : "", r);
         talloc_free(t);
     }
+}
+
+int mp_property_do(const char *name, int action, void *val,
+                   struct MPContext *ctx)
+{
+    struct command_ctx *cmd = ctx->command_ctx;
+    int r = m_property_do(ctx->log, cmd->prop_index, name, action, val, ctx);
+    log_property_set(name, action, val, r, ctx);
+    return r;
+}
+
+// Like mp_property_do(), but skips looking up the property. prop must have
+// been returned by mp_get_property_handle() for the same name.
+int mp_property_do_handle(struct m_property *prop, const char *name,
+                          int action, void *val, struct MPContext *ctx)
+{
+    int r = m_property_do_prop(ctx->log, prop, name, action, val, ctx);
+    log_property_set(name, action, val, r, ctx);
     return r;
 }
 
 char *mp_property_expand_string(struct MPContext *mpctx, const char *str)
 {
     struct command_ctx *ctx = mpctx->command_ctx;
-    return m_properties_expand_string(ctx->properties, str, mpctx);
+    return m_properties_expand_string(ctx->prop_index, str, mpctx);
 }
 
 // Before expanding properties, parse C-style escapes like "\n"
@@ -5229,7 +5266,7 @@ static void change_property_cmd(struct mp_cmd_ctx *cmd,
     struct m_property *prop = NULL;
     if (cmd->cmd->coalesce) {
         struct command_ctx *ctx = cmd->mpctx->command_ctx;
-        prop = m_property_list_find(ctx->properties, name);
+        prop = m_property_index_find(ctx->prop_index, bstr0(name));
         if (prop)
             prop->coalesce = true;
     }
@@ -6749,6 +6786,22 @@ static void cmd_delete_watch_later_config(void *p)
     mp_delete_watch_later_conf(mpctx, filename);
 }
 
+static void cmd_dump_trace(void *p)
+{
+    struct mp_cmd_ctx *cmd = p;
+    struct MPContext *mpctx = cmd->mpctx;
+
+    char *filename = cmd->args[0].v.s;
+    if (!filename || !filename[0])
+        filename = mpctx->opts->dump_trace;
+    if (!filename || !filename[0]) {
+        MP_ERR(mpctx, "No trace file given.\n");
+        cmd->success = false;
+        return;
+    }
+    cmd->success = mp_write_trace(mpctx, filename);
+}
+
 static void cmd_mouse(void *p)
 {
     struct mp_cmd_ctx *cmd = p;
@@ -7479,6 +7532,8 @@ const struct mp_cmd_def mp_cmds[] = {
     { "write-watch-later-config", cmd_write_watch_later_config },
     { "delete-watch-later-config", cmd_delete_watch_later_config,
         {{"filename", OPT_STRING(v.s), .flags = MP_CMD_OPT_ARG} }},
+    { "dump-trace", cmd_dump_trace,
+        {{"filename", OPT_STRING(v.s), .flags = MP_CMD_OPT_ARG} }},
 
     { "mouse", cmd_mouse, { {"x", OPT_INT(v.i)},
                             {"y", OPT_INT(v.i)},
@@ -7620,6 +7675,7 @@ void command_init(struct MPContext *mpctx)
 
         ctx->properties[count++] = prop;
     }
+    ctx->prop_index = m_property_index_create(ctx, ctx->properties);
 
     node_init(&ctx->mdata, MPV_FORMAT_NODE_ARRAY, NULL);
     talloc_steal(ctx, ctx->mdata.u.list);
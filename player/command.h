@@ -28,6 +28,7 @@ struct mp_cmd;
 struct mp_log;
 struct mpv_node;
 struct m_config_option;
+struct m_property;
 
 void command_init(struct MPContext *mpctx);
 void command_uninit(struct MPContext *mpctx);
@@ -84,6 +85,10 @@ char *mp_property_expand_escaped_string(struct MPContext *mpctx, const char *str
 void property_print_help(struct MPContext *mpctx);
 int mp_property_do(const char* name, int action, void* val,
                    struct MPContext *mpctx);
+struct m_property *mp_get_property_handle(struct MPContext *mpctx,
+                                          const char *name);
+int mp_property_do_handle(struct m_property *prop, const char *name,
+                          int action, void *val, struct MPContext *mpctx);
 
 void mp_option_change_callback(void *ctx, struct m_config_option *co, uint64_t flags,
                                bool self_update);
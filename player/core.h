@@ -239,6 +239,10 @@ typedef struct MPContext {
     struct MPOpts *opts;
     struct mp_log *log;
     struct stats_ctx *stats;
+    struct stat_entry *stat_iterations;
+    struct stat_entry *stat_pool_threads;
+    struct stat_entry *stat_pool_busy;
+    struct stat_entry *stat_pool_queued;
     struct m_config *mconfig;
     struct input_ctx *input;
     struct mp_client_api *clients;
@@ -563,6 +567,7 @@ struct MPContext *mp_create(void);
 void mp_destroy(struct MPContext *mpctx);
 void mp_print_version(struct mp_log *log, int always);
 void mp_update_logging(struct MPContext *mpctx, bool preinit);
+bool mp_write_trace(struct MPContext *mpctx, const char *filename);
 void issue_refresh_seek(struct MPContext *mpctx, enum seek_precision min_prec);
 
 // misc.c
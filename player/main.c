@@ -124,6 +124,9 @@ void mp_update_logging(struct MPContext *mpctx, bool preinit)
 
     mp_msg_update_msglevels(mpctx->global, mpctx->opts);
 
+    stats_set_trace(mpctx->global, mpctx->opts->dump_trace &&
+                                   mpctx->opts->dump_trace[0]);
+
     bool enable = mpctx->opts->use_terminal;
     bool enabled = cas_terminal_owner(mpctx, mpctx);
     if (enable != enabled) {
@@ -188,6 +191,9 @@ void mp_destroy(struct MPContext *mpctx)
 
     osd_free(mpctx->osd);
 
+    if (mpctx->opts->dump_trace && mpctx->opts->dump_trace[0])
+        mp_write_trace(mpctx, mpctx->opts->dump_trace);
+
 #if HAVE_COCOA
     cocoa_set_input_context(NULL);
 #endif
@@ -210,6 +216,20 @@ void mp_destroy(struct MPContext *mpctx)
     talloc_free(mpctx);
 }
 
+// Write the events recorded with --dump-trace to the given file.
+bool mp_write_trace(struct MPContext *mpctx, const char *filename)
+{
+    char *path = mp_get_user_path(NULL, mpctx->global, filename);
+    bool ok = stats_write_trace(mpctx->global, path);
+    if (ok) {
+        MP_VERBOSE(mpctx, "Trace written to '%s'.\n", path);
+    } else {
+        MP_ERR(mpctx, "Failed to write trace to '%s'.\n", path);
+    }
+    talloc_free(path);
+    return ok;
+}
+
 static bool handle_help_options(struct MPContext *mpctx)
 {
     struct MPOpts *opts = mpctx->opts;
@@ -291,6 +311,10 @@ struct MPContext *mp_create(void)
     mpctx->statusline = mp_log_new(mpctx, mpctx->log, "!statusline");
 
     mpctx->stats = stats_ctx_create(mpctx, mpctx->global, "main");
+    mpctx->stat_iterations = stats_entry(mpctx->stats, "iterations");
+    mpctx->stat_pool_threads = stats_entry(mpctx->stats, "thread pool threads");
+    mpctx->stat_pool_busy = stats_entry(mpctx->stats, "thread pool busy");
+    mpctx->stat_pool_queued = stats_entry(mpctx->stats, "thread pool queued");
 
     // Create the config context and register the options
     mpctx->mconfig = m_config_new(mpctx, mpctx->log, &mp_opt_root);
@@ -38,6 +38,7 @@
 #include "filters/filter_internal.h"
 #include "input/input.h"
 #include "misc/dispatch.h"
+#include "misc/thread_pool.h"
 #include "options/m_config_frontend.h"
 #include "options/m_property.h"
 #include "options/options.h"
@@ -48,13 +49,23 @@
 #include "sub/osd.h"
 #include "video/out/vo.h"
 
+static void update_thread_pool_stats(struct MPContext *mpctx)
+{
+    struct mp_thread_pool_stats st;
+    mp_thread_pool_get_stats(mpctx->thread_pool, &st);
+    stats_entry_value(mpctx->stat_pool_threads, st.num_threads);
+    stats_entry_value(mpctx->stat_pool_busy, st.busy_threads);
+    stats_entry_value(mpctx->stat_pool_queued, st.queued);
+}
+
 // Wait until mp_wakeup_core() is called, since the last time
 // mp_wait_events() was called.
 void mp_wait_events(struct MPContext *mpctx)
 {
     mp_client_send_property_changes(mpctx);
 
-    stats_event(mpctx->stats, "iterations");
+    stats_entry_event(mpctx->stat_iterations);
+    update_thread_pool_stats(mpctx);
 
     bool sleeping = mpctx->sleeptime > 0;
     if (sleeping)
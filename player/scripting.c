@@ -350,6 +350,7 @@ static void init_sym_table(struct mp_script_args *args, void *lib) {
     INIT_SYM(mpv_get_property_osd_string);
     INIT_SYM(mpv_get_property_async);
     INIT_SYM(mpv_observe_property);
+    INIT_SYM(mpv_observe_property_delta);
     INIT_SYM(mpv_unobserve_property);
     INIT_SYM(mpv_event_name);
     INIT_SYM(mpv_event_to_node);
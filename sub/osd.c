@@ -168,6 +168,10 @@ struct osd_state *osd_create(struct mpv_global *global)
     };
     mp_mutex_init(&osd->lock);
     osd->opts = osd->opts_cache->opts;
+    osd->stat_sub_render = stats_entry(osd->stats, "sub-render");
+    osd->stat_osd_render = stats_entry(osd->stats, "osd-render");
+    osd->stat_draw = stats_entry(osd->stats, "draw");
+    osd->stat_draw_bmp = stats_entry(osd->stats, "draw-bmp");
 
     for (int n = 0; n < MAX_OSD_PARTS; n++) {
         struct osd_object *obj = talloc(osd, struct osd_object);
@@ -390,13 +394,14 @@ struct sub_bitmap_list *osd_render(struct osd_state *osd, struct mp_osd_res res,
         if ((draw_flags & OSD_DRAW_OSD_ONLY) && obj->is_sub)
             continue;
 
-        char *stat_type_render = obj->is_sub ? "sub-render" : "osd-render";
-        stats_time_start(osd->stats, stat_type_render);
+        struct stat_entry *stat_render =
+            obj->is_sub ? osd->stat_sub_render : osd->stat_osd_render;
+        stats_entry_time_start(stat_render);
 
         struct sub_bitmaps *imgs =
             render_object(osd, obj, res, video_pts, formats);
 
-        stats_time_end(osd->stats, stat_type_render);
+        stats_entry_time_end(stat_render);
 
         if (imgs && imgs->num_parts > 0) {
             if (formats[imgs->format]) {
@@ -432,12 +437,12 @@ void osd_draw(struct osd_state *osd, struct mp_osd_res res,
     struct sub_bitmap_list *list =
         osd_render(osd, res, video_pts, draw_flags, formats);
 
-    stats_time_start(osd->stats, "draw");
+    stats_entry_time_start(osd->stat_draw);
 
     for (int n = 0; n < list->num_items; n++)
         cb(cb_ctx, list->items[n]);
 
-    stats_time_end(osd->stats, "draw");
+    stats_entry_time_end(osd->stat_draw);
 
     talloc_free(list);
 }
@@ -474,13 +479,13 @@ void osd_draw_on_image_p(struct osd_state *osd, struct mp_osd_res res,
     if (!osd->draw_cache)
         osd->draw_cache = mp_draw_sub_alloc(osd, osd->global);
 
-    stats_time_start(osd->stats, "draw-bmp");
+    stats_entry_time_start(osd->stat_draw_bmp);
 
     if (!mp_draw_sub_bitmaps(osd->draw_cache, dest, list))
         MP_WARN(osd, "Failed rendering OSD.\n");
     talloc_steal(osd, osd->draw_cache);
 
-    stats_time_end(osd->stats, "draw-bmp");
+    stats_entry_time_end(osd->stat_draw_bmp);
 
     mp_mutex_unlock(&osd->lock);
 
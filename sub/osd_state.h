@@ -81,6 +81,8 @@ struct osd_state {
     struct mpv_global *global;
     struct mp_log *log;
     struct stats_ctx *stats;
+    struct stat_entry *stat_sub_render, *stat_osd_render, *stat_draw,
+                      *stat_draw_bmp;
 
     struct mp_draw_sub_cache *draw_cache;
 };
@@ -39,6 +39,20 @@
 #include "dec_sub.h"
 #include "ass_mp.h"
 #include "sd.h"
+#include "seen_packets.h"
+
+// Events of ass_track sorted by start time, plus a segment tree holding the
+// maximum end time over that order. This answers "which events are visible at
+// time t" without walking every event of the track.
+struct ass_event_index {
+    int *order;             // indexes into ass_track->events, sorted by Start
+    int num;                // ass_track->events[0..num-1] are indexed
+    long long *max_end;     // tree nodes; node n has children 2n and 2n+1
+    int size;               // number of leaves (power of 2, >= num)
+    bool tree_dirty;        // max_end needs to be rebuilt
+    int *found;             // query results
+    int num_found;
+};
 
 struct sd_ass_priv {
     struct ass_library *ass_library;
@@ -57,16 +71,11 @@ struct sd_ass_priv {
     struct mp_image_params video_params;
     struct mp_image_params last_params;
     struct mp_osd_res osd;
-    struct seen_packet *seen_packets;
-    int num_seen_packets;
-    int *packets_animated;
+    struct seen_packets *seen_packets;
+    int *packets_animated;  // indexed by demux_packet.seen_pos
     int num_packets_animated;
     bool check_animated;
-};
-
-struct seen_packet {
-    int64_t pos;
-    double pts;
+    struct ass_event_index event_index;
 };
 
 #undef OPT_BASE_STRUCT
@@ -107,6 +116,128 @@ static const struct sd_filter_functions *const filters[] = {
     NULL,
 };
 
+static long long event_end(ASS_Event *event)
+{
+    return event->Start + (long long)event->Duration;
+}
+
+// Drop the index, e.g. after events were removed from the track.
+static void event_index_invalidate(struct sd_ass_priv *ctx)
+{
+    ctx->event_index.num = 0;
+    ctx->event_index.tree_dirty = true;
+}
+
+static void event_index_update_node(struct sd_ass_priv *ctx, int pos)
+{
+    struct ass_event_index *idx = &ctx->event_index;
+    int node = idx->size + pos;
+    idx->max_end[node] = event_end(&ctx->ass_track->events[idx->order[pos]]);
+    for (node /= 2; node >= 1; node /= 2)
+        idx->max_end[node] = MPMAX(idx->max_end[2 * node], idx->max_end[2 * node + 1]);
+}
+
+static void event_index_build_tree(struct sd_ass_priv *ctx)
+{
+    struct ass_event_index *idx = &ctx->event_index;
+    int size = 16;
+    while (size < idx->num)
+        size *= 2;
+    if (size != idx->size) {
+        idx->max_end = talloc_realloc(ctx, idx->max_end, long long, size * 2);
+        idx->size = size;
+    }
+    for (int n = 0; n < size; n++) {
+        idx->max_end[size + n] = n < idx->num ?
+            event_end(&ctx->ass_track->events[idx->order[n]]) : LLONG_MIN;
+    }
+    for (int n = size - 1; n >= 1; n--)
+        idx->max_end[n] = MPMAX(idx->max_end[2 * n], idx->max_end[2 * n + 1]);
+    idx->tree_dirty = false;
+}
+
+// Index all events libass added since the last call. Events usually arrive in
+// order, in which case this is O(log n) per event.
+static void event_index_update(struct sd_ass_priv *ctx)
+{
+    struct ass_event_index *idx = &ctx->event_index;
+    ASS_Track *track = ctx->ass_track;
+    if (idx->num > track->n_events)
+        event_index_invalidate(ctx);
+    while (idx->num < track->n_events) {
+        int n = idx->num;
+        long long start = track->events[n].Start;
+        int a = 0, b = idx->num;
+        if (b && track->events[idx->order[b - 1]].Start <= start) {
+            a = b;
+        } else {
+            while (a < b) {
+                int mid = a + (b - a) / 2;
+                if (track->events[idx->order[mid]].Start <= start) {
+                    a = mid + 1;
+                } else {
+                    b = mid;
+                }
+            }
+        }
+        MP_TARRAY_INSERT_AT(ctx, idx->order, idx->num, a, n);
+        if (a + 1 < idx->num || idx->num > idx->size)
+            idx->tree_dirty = true;
+        if (!idx->tree_dirty)
+            event_index_update_node(ctx, a);
+    }
+    if (idx->tree_dirty)
+        event_index_build_tree(ctx);
+}
+
+static void event_index_collect(struct sd_ass_priv *ctx, int node,
+                                int lo, int hi, int limit, long long min_end,
+                                int max_found)
+{
+    struct ass_event_index *idx = &ctx->event_index;
+    if (lo >= limit || idx->max_end[node] <= min_end ||
+        idx->num_found >= max_found)
+        return;
+    if (node >= idx->size) {
+        MP_TARRAY_APPEND(ctx, idx->found, idx->num_found, idx->order[lo]);
+        return;
+    }
+    int mid = lo + (hi - lo) / 2;
+    event_index_collect(ctx, 2 * node, lo, mid, limit, min_end, max_found);
+    event_index_collect(ctx, 2 * node + 1, mid, hi, limit, min_end, max_found);
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Find events with Start <= max_start and Start + Duration > min_end, and
+// return their indexes in track order in ctx->event_index.found. At most
+// max_found events are returned.
+static int event_index_query(struct sd_ass_priv *ctx, long long max_start,
+                             long long min_end, int max_found)
+{
+    struct ass_event_index *idx = &ctx->event_index;
+    ASS_Track *track = ctx->ass_track;
+    event_index_update(ctx);
+
+    int a = 0, b = idx->num;
+    while (a < b) {
+        int mid = a + (b - a) / 2;
+        if (track->events[idx->order[mid]].Start <= max_start) {
+            a = mid + 1;
+        } else {
+            b = mid;
+        }
+    }
+
+    idx->num_found = 0;
+    event_index_collect(ctx, 1, 0, idx->size, a, min_end, max_found);
+    qsort(idx->found, idx->num_found, sizeof(idx->found[0]), compare_int);
+    return idx->num_found;
+}
+
 // Add default styles, if the track does not have any styles yet.
 // Apply style overrides if the user provides any.
 static void mp_ass_add_default_styles(struct sd *sd, ASS_Track *track, struct mp_subtitle_opts *opts,
@@ -256,6 +387,7 @@ static void assobjects_init(struct sd *sd)
 
     ctx->ass_track = ass_new_track(ctx->ass_library);
     ctx->ass_track->track_type = TRACK_TYPE_ASS;
+    event_index_invalidate(ctx);
 
     ctx->shadow_track = ass_new_track(ctx->ass_library);
     ctx->shadow_track->PlayResX = MP_ASS_FONT_PLAYRESX;
@@ -299,6 +431,7 @@ static int init(struct sd *sd)
 {
     struct sd_ass_priv *ctx = talloc_zero(sd, struct sd_ass_priv);
     sd->priv = ctx;
+    ctx->seen_packets = seen_packets_create(ctx);
 
     // Note: accept "null" as alias for "ass", so EDL delay_open subtitle
     //       streams work.
@@ -396,7 +529,13 @@ static void filter_and_add(struct sd *sd, struct demux_packet *pkt)
                 if (ctx->check_animated && pkt->animated != 1)
                     pkt->animated = is_animated(event->Text);
             }
-            MP_TARRAY_APPEND(ctx, ctx->packets_animated, ctx->num_packets_animated, pkt->animated);
+            // Packets dropped by filters leave gaps.
+            MP_TARRAY_GROW(ctx, ctx->packets_animated, pkt->seen_pos);
+            while (ctx->num_packets_animated < pkt->seen_pos)
+                ctx->packets_animated[ctx->num_packets_animated++] = -1;
+            ctx->packets_animated[pkt->seen_pos] = pkt->animated;
+            ctx->num_packets_animated = MPMAX(ctx->num_packets_animated,
+                                              pkt->seen_pos + 1);
         } else {
             if (ctx->check_animated && ctx->packets_animated[pkt->seen_pos] == -1) {
                 for (int n = track->n_events - 1; n >= 0; n--) {
@@ -422,26 +561,8 @@ static void filter_and_add(struct sd *sd, struct demux_packet *pkt)
 static bool check_packet_seen(struct sd *sd, struct demux_packet *packet)
 {
     struct sd_ass_priv *priv = sd->priv;
-    int a = 0;
-    int b = priv->num_seen_packets;
-    while (a < b) {
-        int mid = a + (b - a) / 2;
-        struct seen_packet *seen_packet = &priv->seen_packets[mid];
-        if (packet->pos == seen_packet->pos && packet->pts == seen_packet->pts) {
-            packet->seen_pos = mid;
-            return true;
-        }
-        if (packet->pos > seen_packet->pos ||
-            (packet->pos == seen_packet->pos && packet->pts > seen_packet->pts)) {
-            a = mid + 1;
-        } else {
-            b = mid;
-        }
-    }
-    packet->seen_pos = a;
-    MP_TARRAY_INSERT_AT(priv, priv->seen_packets, priv->num_seen_packets, a,
-                        (struct seen_packet){packet->pos, packet->pts});
-    return false;
+    return seen_packets_check(priv->seen_packets, packet->pos, packet->pts,
+                              &packet->seen_pos);
 }
 
 #define UNKNOWN_DURATION (INT_MAX / 1000)
@@ -487,6 +608,8 @@ static void decode(struct sd *sd, struct demux_packet *packet)
                 } else if (track->events[n].Start == track->events[n + 1].Start) {
                     track->events[n].Duration = track->events[n + 1].Duration;
                 }
+                // End times of already indexed events changed.
+                ctx->event_index.tree_dirty = true;
             }
             if (n > 0 && track->events[n].Start != track->events[n - 1].Start)
                 break;
@@ -498,6 +621,8 @@ static void decode(struct sd *sd, struct demux_packet *packet)
         packet->seen = check_packet_seen(sd, packet);
         filter_and_add(sd, packet);
     }
+
+    event_index_update(ctx);
 }
 
 // Calculate the height used for scaling subtitle text size so --sub-scale-with-window
@@ -668,20 +793,15 @@ static long long find_timestamp(struct sd *sd, double pts)
     int threshold = SUB_GAP_THRESHOLD * 1000;
     int keep = SUB_GAP_KEEP * 1000;
 
-    // Find the "current" event.
-    ASS_Event *ev[2] = {0};
-    int n_ev = 0;
-    for (int n = 0; n < track->n_events; n++) {
-        ASS_Event *event = &track->events[n];
-        if (ts >= event->Start - threshold && ts <= END(event) + threshold) {
-            if (n_ev >= MP_ARRAY_SIZE(ev))
-                return ts; // multiple overlaps - give up (probably complex subs)
-            ev[n_ev++] = event;
-        }
-    }
-
+    // Find the "current" event. Give up on multiple overlaps (probably complex
+    // subs), so there's no need to find more than 3 events.
+    int n_ev = event_index_query(priv, ts + threshold, ts - threshold - 1, 3);
     if (n_ev != 2)
         return ts;
+    ASS_Event *ev[2] = {
+        &track->events[priv->event_index.found[0]],
+        &track->events[priv->event_index.found[1]],
+    };
 
     // Simple/minor heuristic against destroying typesetting.
     if (ev[0]->Style != ev[1]->Style || has_overrides(ev[0]->Text) ||
@@ -772,7 +892,11 @@ static struct sub_bitmaps *get_bitmaps(struct sd *sd, struct mp_osd_res dim,
         fill_plaintext(sd, pts);
 
     int changed;
+    int n_events = ctx->ass_track->n_events;
     ASS_Image *imgs = ass_render_frame(renderer, track, ts, &changed);
+    // libass may have pruned old events, which shifts the remaining ones.
+    if (ctx->ass_track->n_events != n_events)
+        event_index_invalidate(ctx);
     mp_ass_packer_pack(ctx->packer, &imgs, 1, changed, !converted, format, res);
 
 done:
@@ -864,44 +988,43 @@ static bstr get_text_buf(struct sd *sd, double pts, enum sd_text_type type)
 
     b->len = 0;
 
-    for (int i = 0; i < track->n_events; ++i) {
-        ASS_Event *event = track->events + i;
-        if (ipts >= event->Start && ipts < event->Start + event->Duration) {
-            if (event->Text) {
-                int start = b->len;
-                if (type == SD_TEXT_TYPE_PLAIN) {
-                    ass_to_plaintext(b, event->Text);
-                } else if (type == SD_TEXT_TYPE_ASS_FULL) {
-                    long long s = event->Start;
-                    long long e = s + event->Duration;
-
-                    ASS_Style *style = (event->Style < 0 || event->Style >= track->n_styles) ? NULL : &track->styles[event->Style];
-
-                    int sh = (s / 60 / 60 / 1000);
-                    int sm = (s / 60 / 1000) % 60;
-                    int ss = (s / 1000) % 60;
-                    int sc = (s / 10) % 100;
-                    int eh = (e / 60 / 60 / 1000);
-                    int em = (e / 60 / 1000) % 60;
-                    int es = (e / 1000) % 60;
-                    int ec = (e / 10) % 100;
-
-                    bstr_xappend_asprintf(NULL, b, "Dialogue: %d,%d:%02d:%02d.%02d,%d:%02d:%02d.%02d,%s,%s,%04d,%04d,%04d,%s,%s",
-                        event->Layer,
-                        sh, sm, ss, sc,
-                        eh, em, es, ec,
-                        (style && style->Name) ? style->Name : "", event->Name,
-                        event->MarginL, event->MarginR, event->MarginV,
-                        event->Effect, event->Text);
-                } else {
-                    bstr_xappend(NULL, b, bstr0(event->Text));
-                }
-                if (is_whitespace_only(bstr_cut(*b, start))) {
-                    b->len = start;
-                } else {
-                    append(b, '\n');
-                }
-            }
+    int num = event_index_query(ctx, ipts, ipts, INT_MAX);
+    for (int i = 0; i < num; ++i) {
+        ASS_Event *event = track->events + ctx->event_index.found[i];
+        if (!event->Text)
+            continue;
+        int start = b->len;
+        if (type == SD_TEXT_TYPE_PLAIN) {
+            ass_to_plaintext(b, event->Text);
+        } else if (type == SD_TEXT_TYPE_ASS_FULL) {
+            long long s = event->Start;
+            long long e = s + event->Duration;
+
+            ASS_Style *style = (event->Style < 0 || event->Style >= track->n_styles) ? NULL : &track->styles[event->Style];
+
+            int sh = (s / 60 / 60 / 1000);
+            int sm = (s / 60 / 1000) % 60;
+            int ss = (s / 1000) % 60;
+            int sc = (s / 10) % 100;
+            int eh = (e / 60 / 60 / 1000);
+            int em = (e / 60 / 1000) % 60;
+            int es = (e / 1000) % 60;
+            int ec = (e / 10) % 100;
+
+            bstr_xappend_asprintf(NULL, b, "Dialogue: %d,%d:%02d:%02d.%02d,%d:%02d:%02d.%02d,%s,%s,%04d,%04d,%04d,%s,%s",
+                event->Layer,
+                sh, sm, ss, sc,
+                eh, em, es, ec,
+                (style && style->Name) ? style->Name : "", event->Name,
+                event->MarginL, event->MarginR, event->MarginV,
+                event->Effect, event->Text);
+        } else {
+            bstr_xappend(NULL, b, bstr0(event->Text));
+        }
+        if (is_whitespace_only(bstr_cut(*b, start))) {
+            b->len = start;
+        } else {
+            append(b, '\n');
         }
     }
 
@@ -926,19 +1049,18 @@ static struct sd_times get_times(struct sd *sd, double pts)
 
     long long ipts = find_timestamp(sd, pts);
 
-    for (int i = 0; i < track->n_events; ++i) {
-        ASS_Event *event = track->events + i;
-        if (ipts >= event->Start && ipts < event->Start + event->Duration) {
-            double start = event->Start / 1000.0;
-            double end = event->Duration == UNKNOWN_DURATION ?
-                MP_NOPTS_VALUE : (event->Start + event->Duration) / 1000.0;
+    int num = event_index_query(ctx, ipts, ipts, INT_MAX);
+    for (int i = 0; i < num; ++i) {
+        ASS_Event *event = track->events + ctx->event_index.found[i];
+        double start = event->Start / 1000.0;
+        double end = event->Duration == UNKNOWN_DURATION ?
+            MP_NOPTS_VALUE : (event->Start + event->Duration) / 1000.0;
 
-            if (res.start == MP_NOPTS_VALUE || res.start > start)
-                res.start = start;
+        if (res.start == MP_NOPTS_VALUE || res.start > start)
+            res.start = start;
 
-            if (res.end == MP_NOPTS_VALUE || res.end < end)
-                res.end = end;
-        }
+        if (res.end == MP_NOPTS_VALUE || res.end < end)
+            res.end = end;
     }
 
     return res;
@@ -991,7 +1113,9 @@ static void reset(struct sd *sd)
     struct sd_ass_priv *ctx = sd->priv;
     if (sd->opts->sub_clear_on_seek || ctx->clear_once) {
         ass_flush_events(ctx->ass_track);
-        ctx->num_seen_packets = 0;
+        event_index_invalidate(ctx);
+        seen_packets_clear(ctx->seen_packets);
+        ctx->num_packets_animated = 0;
         sd->preload_ok = false;
         ctx->clear_once = false;
     }
@@ -0,0 +1,102 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "mpv_talloc.h"
+
+#include "common/common.h"
+#include "seen_packets.h"
+
+struct entry {
+    int64_t pos;
+    double pts;
+    int index;          // index + 1, 0 for unused slots
+};
+
+struct seen_packets {
+    struct entry *entries;
+    size_t mask;        // number of slots - 1 (slots are a power of 2)
+    int num;
+};
+
+struct seen_packets *seen_packets_create(void *ta_parent)
+{
+    return talloc_zero(ta_parent, struct seen_packets);
+}
+
+static size_t hash_packet(int64_t pos, double pts)
+{
+    uint64_t bits = 0;
+    if (pts != 0) // +0.0 and -0.0 compare equal
+        memcpy(&bits, &pts, sizeof(bits));
+    uint64_t h = (uint64_t)pos * 0x9E3779B97F4A7C15ULL;
+    h ^= bits + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static struct entry *find_slot(struct entry *entries, size_t mask,
+                               int64_t pos, double pts)
+{
+    size_t i = hash_packet(pos, pts) & mask;
+    while (entries[i].index) {
+        if (entries[i].pos == pos && entries[i].pts == pts)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &entries[i];
+}
+
+static void grow(struct seen_packets *s)
+{
+    size_t size = s->entries ? (s->mask + 1) * 2 : 256;
+    struct entry *entries = talloc_zero_array(s, struct entry, size);
+    for (size_t n = 0; s->entries && n <= s->mask; n++) {
+        struct entry *e = &s->entries[n];
+        if (e->index)
+            *find_slot(entries, size - 1, e->pos, e->pts) = *e;
+    }
+    talloc_free(s->entries);
+    s->entries = entries;
+    s->mask = size - 1;
+}
+
+bool seen_packets_check(struct seen_packets *s, int64_t pos, double pts,
+                        int *index)
+{
+    // Keep the load factor below 1/2.
+    if (!s->entries || s->num >= (s->mask + 1) / 2)
+        grow(s);
+    struct entry *e = find_slot(s->entries, s->mask, pos, pts);
+    if (e->index) {
+        *index = e->index - 1;
+        return true;
+    }
+    *e = (struct entry){pos, pts, ++s->num};
+    *index = e->index - 1;
+    return false;
+}
+
+void seen_packets_clear(struct seen_packets *s)
+{
+    if (s->entries)
+        memset(s->entries, 0, (s->mask + 1) * sizeof(s->entries[0]));
+    s->num = 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set of already decoded subtitle packets, identified by (pos, pts).
+struct seen_packets;
+
+struct seen_packets *seen_packets_create(void *ta_parent);
+
+// Test if the packet with the given file position and pts was already added.
+// Return false if the packet is new (and add it), and true if it was already
+// seen. *index is set to the number of distinct packets that were added before
+// this one, so it is stable for the lifetime of the set and can be used to
+// index per-packet data.
+bool seen_packets_check(struct seen_packets *s, int64_t pos, double pts,
+                        int *index);
+
+// Remove all packets. Indexes start from 0 again.
+void seen_packets_clear(struct seen_packets *s);
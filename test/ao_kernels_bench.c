@@ -0,0 +1,109 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavutil/cpu.h>
+
+#include "audio/out/kernels.h"
+#include "common/common.h"
+#include "mpv_talloc.h"
+#include "osdep/timer.h"
+
+// One buffer of 8 channel 192 kHz audio, 10 ms, interleaved.
+#define NUM_SAMPLES (8 * 1920)
+#define MIN_SAMPLES (500 * 1000 * 1000)
+#define GAIN 0.7f
+
+enum { U8, S16, S32, FLOAT, DOUBLE, PACK_S24, PAD_S24, NUM_OPS };
+
+static const char *const op_names[NUM_OPS] = {
+    "gain u8", "gain s16", "gain s32", "gain float", "gain double",
+    "pack s24", "pad s24",
+};
+
+static const int op_bytes[NUM_OPS] = {1, 2, 4, 4, 8, 4, 4};
+
+static void run_op(const struct ao_kernels *k, int op, void *data)
+{
+    int gi = lrint(256.0 * GAIN);
+    switch (op) {
+    case U8:        k->gain_u8(data, NUM_SAMPLES, gi); break;
+    case S16:       k->gain_s16(data, NUM_SAMPLES, gi); break;
+    case S32:       k->gain_s32(data, NUM_SAMPLES, gi); break;
+    case FLOAT:     k->gain_float(data, NUM_SAMPLES, GAIN); break;
+    case DOUBLE:    k->gain_double(data, NUM_SAMPLES, GAIN); break;
+    case PACK_S24:  k->pack_s24(data, NUM_SAMPLES); break;
+    case PAD_S24:   k->pad_s24(data, NUM_SAMPLES); break;
+    }
+}
+
+static void fill(void *data, int op)
+{
+    uint32_t seed = 1;
+    for (int n = 0; n < NUM_SAMPLES; n++) {
+        seed = seed * 1664525 + 1013904223;
+        switch (op) {
+        case U8:        ((uint8_t *)data)[n] = seed >> 24; break;
+        case S16:       ((int16_t *)data)[n] = seed >> 16; break;
+        case FLOAT:     ((float *)data)[n] = (int32_t)seed / 2147483648.0; break;
+        case DOUBLE:    ((double *)data)[n] = (int32_t)seed / 2147483648.0; break;
+        default:        ((int32_t *)data)[n] = seed; break;
+        }
+    }
+}
+
+// Time |k| on every operation, and check that it matches the C reference.
+static void run(const struct ao_kernels *k, void *tmp)
+{
+    for (int op = 0; op < NUM_OPS; op++) {
+        size_t size = NUM_SAMPLES * op_bytes[op];
+        void *ref = talloc_size(tmp, size);
+        void *data = talloc_size(tmp, size);
+        fill(ref, op);
+        fill(data, op);
+        run_op(&ao_kernels_c, op, ref);
+        run_op(k, op, data);
+        if (memcmp(ref, data, size)) {
+            printf("%s: %s differs from the C reference\n", k->name, op_names[op]);
+            abort();
+        }
+
+        // Gain converges to 0 and 24 bit conversion to garbage; refill the
+        // buffer every round so that all rounds do the same work.
+        int rounds = MPMAX(MIN_SAMPLES / NUM_SAMPLES, 1);
+        int64_t total = 0;
+        for (int r = 0; r < rounds; r++) {
+            memcpy(data, ref, size);
+            int64_t t0 = mp_time_ns();
+            run_op(k, op, data);
+            total += mp_time_ns() - t0;
+        }
+        printf("%-7s %-12s %8.3f ns/sample\n", k->name, op_names[op],
+               total / (double)rounds / NUM_SAMPLES);
+    }
+}
+
+int main(void)
+{
+    mp_time_init();
+    void *tmp = talloc_new(NULL);
+
+    static const int flags[] = {-1, 0, AV_CPU_FLAG_SSE4, AV_CPU_FLAG_AVX2,
+                               AV_CPU_FLAG_AVX512};
+    int cpu_flags = av_get_cpu_flags();
+    const struct ao_kernels *last = NULL;
+    for (int n = 0; n < MP_ARRAY_SIZE(flags); n++) {
+        const struct ao_kernels *k = &ao_kernels_c;
+        if (flags[n] >= 0) {
+            if ((cpu_flags & flags[n]) != flags[n])
+                continue;
+            k = ao_kernels_get(flags[n]);
+        }
+        if (k != last)
+            run(k, tmp);
+        last = k;
+    }
+
+    talloc_free(tmp);
+    return 0;
+}
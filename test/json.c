@@ -1,5 +1,7 @@
 #include <mpv/client.h>
 
+#include "misc/bstr.h"
+#include "misc/cbor.h"
 #include "misc/json.h"
 #include "misc/node.h"
 #include "test_utils.h"
@@ -63,8 +65,80 @@ static const struct entry entries[] = {
         NODE_MAP(L("a"), L(NODE_STR("b")))},
     { TEXT({_a12="b"}), TEXT({"_a12":"b"}),
         NODE_MAP(L("_a12"), L(NODE_STR("b")))},
+    // Long enough for word-at-a-time scanning.
+    { "\"0123456789abcdef\\n0123456789\\\\x\\\"y\"",
+      "\"0123456789abcdef\\n0123456789\\\\x\\\"y\"",
+        NODE_STR("0123456789abcdef\n0123456789\\x\"y")},
+    { "\"\\u0001abcdefghijklmnop\\u001f\"",
+      "\"\\u0001abcdefghijklmnop\\u001f\"",
+        NODE_STR("\001abcdefghijklmnop\037")},
+    { "[                 1,\n\n\n\n\n\n\n\n\t\t\t\t 2               ]",
+      "[1,2]", NODE_ARRAY(NODE_INT64(1), NODE_INT64(2))},
+    { "[-9223372036854775808,9223372036854775807]",
+      "[-9223372036854775808,9223372036854775807]",
+        NODE_ARRAY(NODE_INT64(INT64_MIN), NODE_INT64(INT64_MAX))},
+    { "\"0123456789abcdef", .expect_fail = true},
 };
 
+struct cbor_entry {
+    const char *src;
+    size_t len;
+    struct mpv_node out_data;
+    bool expect_fail;
+};
+
+#define CBOR(s) s, sizeof(s) - 1
+
+// Encodings cbor_append() doesn't produce itself.
+static const struct cbor_entry cbor_entries[] = {
+    { CBOR("\x1b\x7f\xff\xff\xff\xff\xff\xff\xff"), NODE_INT64(INT64_MAX)},
+    { CBOR("\x3b\x7f\xff\xff\xff\xff\xff\xff\xff"), NODE_INT64(INT64_MIN)},
+    { CBOR("\xf9\x3c\x00"), NODE_FLOAT(1.0)},
+    { CBOR("\xf9\xc4\x00"), NODE_FLOAT(-4.0)},
+    { CBOR("\xfb\x3f\xb9\x99\x99\x99\x99\x99\x9a"), NODE_FLOAT(0.1)},
+    { CBOR("\xf7"), NODE_NONE()},
+    { CBOR("\xd9\xd9\xf7\x01"), NODE_INT64(1)},
+    { CBOR("\x9f\x01\x02\xff"), NODE_ARRAY(NODE_INT64(1), NODE_INT64(2))},
+    { CBOR("\xbf\x61\x61\x01\xff"), NODE_MAP(L("a"), L(NODE_INT64(1)))},
+    { CBOR("\x1b\x80\x00\x00\x00\x00\x00\x00\x00"), .expect_fail = true},
+    { CBOR("\x1c"), .expect_fail = true},
+    { CBOR("\x62\x61\x00"), .expect_fail = true},
+    { CBOR("\x5f\x41\x61\xff"), .expect_fail = true},
+    { CBOR("\xa1\x01\x02"), .expect_fail = true},
+    { CBOR("\xff"), .expect_fail = true},
+};
+
+// The result must be equal to expected, and every truncation of the encoded
+// data must be reported as such, also when scanned incrementally.
+static void test_cbor_roundtrip(void *tmp, const struct mpv_node *src,
+                                const struct mpv_node *expected)
+{
+    bstr data = {0};
+    assert_true(cbor_append(&data, src) >= 0);
+    talloc_steal(tmp, data.start);
+
+    struct mpv_node res;
+    bstr rest = data;
+    assert_int_equal(cbor_parse(tmp, &res, &rest, MAX_CBOR_DEPTH), 0);
+    assert_int_equal(rest.len, 0);
+    assert_true(equal_mpv_node(expected, &res));
+
+    for (int len = 0; len < data.len; len++) {
+        rest = (bstr){data.start, len};
+        assert_int_equal(cbor_parse(tmp, &res, &rest, MAX_CBOR_DEPTH),
+                         CBOR_INCOMPLETE);
+        assert_int_equal(rest.len, len);
+    }
+
+    struct cbor_scan *st = talloc_zero(tmp, struct cbor_scan);
+    for (int len = 0; len < data.len; len++) {
+        assert_int_equal(cbor_scan(st, (bstr){data.start, len}),
+                         CBOR_INCOMPLETE);
+    }
+    assert_int_equal(cbor_scan(st, data), 0);
+    assert_int_equal(st->pos, data.len);
+}
+
 int main(void)
 {
     for (int n = 0; n < MP_ARRAY_SIZE(entries); n++) {
@@ -83,7 +157,33 @@ int main(void)
         assert_true(json_write(&d, &res) >= 0);
         assert_string_equal(e->out_txt, d);
         assert_true(equal_mpv_node(&e->out_data, &res));
+        test_cbor_roundtrip(tmp, &res, &e->out_data);
+        talloc_free(tmp);
+    }
+
+    for (int n = 0; n < MP_ARRAY_SIZE(cbor_entries); n++) {
+        const struct cbor_entry *e = &cbor_entries[n];
+        void *tmp = talloc_new(NULL);
+        bstr src = {(unsigned char *)e->src, e->len};
+        struct mpv_node res;
+        bool ok = cbor_parse(tmp, &res, &src, MAX_CBOR_DEPTH) >= 0;
+        assert_true(ok != e->expect_fail);
+        if (ok) {
+            assert_int_equal(src.len, 0);
+            assert_true(equal_mpv_node(&e->out_data, &res));
+            test_cbor_roundtrip(tmp, &res, &e->out_data);
+        }
         talloc_free(tmp);
     }
+
+    // Values which can't be written as JSON.
+    void *tmp = talloc_new(NULL);
+    struct mpv_byte_array ba = {.data = "\0\1\2", .size = 3};
+    struct mpv_node bytes = {.format = MPV_FORMAT_BYTE_ARRAY, .u.ba = &ba};
+    test_cbor_roundtrip(tmp, &bytes, &bytes);
+    struct mpv_node inf = NODE_FLOAT(-INFINITY);
+    test_cbor_roundtrip(tmp, &inf, &inf);
+    talloc_free(tmp);
+
     return 0;
 }
@@ -0,0 +1,75 @@
+#include <stdio.h>
+
+#include <mpv/client.h>
+
+#include "common/common.h"
+#include "misc/bstr.h"
+#include "misc/json.h"
+#include "misc/node.h"
+#include "mpv_talloc.h"
+#include "osdep/timer.h"
+
+#define NUM_ENTRIES 10000
+#define MIN_BYTES (200 * 1000 * 1000)
+
+// Something like the track-list or playlist property of a long playlist.
+static struct mpv_node make_doc(void *tmp)
+{
+    struct mpv_node doc;
+    node_init(&doc, MPV_FORMAT_NODE_ARRAY, NULL);
+    talloc_steal(tmp, doc.u.list);
+    for (int n = 0; n < NUM_ENTRIES; n++) {
+        struct mpv_node *e = node_array_add(&doc, MPV_FORMAT_NODE_MAP);
+        node_map_add_string(e, "filename", mp_tprintf(80,
+            "/home/user/Videos/Some Series/Season 1/Episode %d.mkv", n));
+        node_map_add_string(e, "title", mp_tprintf(80,
+            "Episode %d: \"The Quoted\" \\ Title\t(1080p)", n));
+        node_map_add_int64(e, "id", n + 1);
+        node_map_add_double(e, "duration", 1420.5 + n);
+        node_map_add_flag(e, "playing", n == 100);
+        struct mpv_node *tags = node_map_add(e, "tags", MPV_FORMAT_NODE_ARRAY);
+        for (int i = 0; i < 3; i++) {
+            struct mpv_node *t = node_array_add(tags, MPV_FORMAT_NONE);
+            t->format = MPV_FORMAT_STRING;
+            t->u.string = talloc_asprintf(tags->u.list, "tag%d", i);
+        }
+    }
+    return doc;
+}
+
+int main(void)
+{
+    mp_time_init();
+    void *tmp = talloc_new(NULL);
+    struct mpv_node doc = make_doc(tmp);
+
+    char *text = talloc_strdup(tmp, "");
+    json_write(&text, &doc);
+    size_t len = strlen(text);
+    int rounds = MPMAX(MIN_BYTES / len, 1);
+
+    int64_t t0 = mp_time_ns();
+    for (int r = 0; r < rounds; r++) {
+        char *out = talloc_strdup(NULL, "");
+        json_write(&out, &doc);
+        talloc_free(out);
+    }
+    int64_t t1 = mp_time_ns();
+    for (int r = 0; r < rounds; r++) {
+        void *ctx = talloc_new(NULL);
+        char *src = talloc_strdup(ctx, text);
+        struct mpv_node res;
+        if (json_parse(ctx, &res, &src, MAX_JSON_DEPTH) < 0)
+            abort();
+        talloc_free(ctx);
+    }
+    int64_t t2 = mp_time_ns();
+
+    double bytes = (double)len * rounds;
+    printf("document: %zu bytes\n", len);
+    printf("write: %7.1f MB/s\n", bytes / ((t1 - t0) / 1e9) / 1e6);
+    printf("parse: %7.1f MB/s\n", bytes / ((t2 - t1) / 1e9) / 1e6);
+
+    talloc_free(tmp);
+    return 0;
+}
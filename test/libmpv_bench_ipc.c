@@ -0,0 +1,144 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libmpv_common.h"
+
+#define NUM_REQUESTS 100000
+
+struct reader {
+    char line[4096];
+    size_t line_len;
+    int replies;
+    int events;
+    uint64_t bytes;
+};
+
+static void reader_feed(struct reader *r, const char *buf, size_t len)
+{
+    r->bytes += len;
+    for (size_t n = 0; n < len; n++) {
+        if (buf[n] != '\n') {
+            if (r->line_len < sizeof(r->line) - 1)
+                r->line[r->line_len++] = buf[n];
+            continue;
+        }
+        r->line[r->line_len] = '\0';
+        if (strstr(r->line, "\"request_id\""))
+            r->replies++;
+        if (strstr(r->line, "\"event\""))
+            r->events++;
+        r->line_len = 0;
+    }
+}
+
+// Send num commands (pipelined, without waiting for replies), and read until
+// every command was replied to. fmt gets the request ID and a value.
+static void run(int fd, const char *name, const char *fmt, int num)
+{
+    size_t size = num * (strlen(fmt) + 64);
+    char *cmds = malloc(size);
+    if (!cmds)
+        fail("out of memory\n");
+    size_t len = 0;
+    for (int n = 0; n < num; n++)
+        len += snprintf(cmds + len, size - len, fmt, n, n % 100);
+
+    struct reader r = {0};
+    size_t sent = 0;
+    int64_t start = mpv_get_time_ns(ctx);
+    while (r.replies < num) {
+        struct pollfd pfd = {
+            .fd = fd,
+            .events = POLLIN | (sent < len ? POLLOUT : 0),
+        };
+        if (poll(&pfd, 1, 10000) <= 0)
+            fail("%s: timeout after %d replies\n", name, r.replies);
+        if (pfd.revents & POLLOUT) {
+            ssize_t w = write(fd, cmds + sent, len - sent);
+            if (w < 0 && errno != EAGAIN && errno != EINTR)
+                fail("%s: write error\n", name);
+            if (w > 0)
+                sent += w;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            char buf[64 * 1024];
+            ssize_t rd = read(fd, buf, sizeof(buf));
+            if (rd == 0)
+                fail("%s: disconnected\n", name);
+            if (rd < 0 && errno != EAGAIN && errno != EINTR)
+                fail("%s: read error\n", name);
+            if (rd > 0)
+                reader_feed(&r, buf, rd);
+        }
+    }
+    double secs = (mpv_get_time_ns(ctx) - start) / 1e9;
+    free(cmds);
+
+    if (!name)
+        return;
+    printf("%-16s %8d replies %8d events %10.0f msgs/s %8.2f MB/s out %8.2f MB/s in\n",
+           name, r.replies, r.events, (r.replies + r.events) / secs,
+           len / secs / 1e6, r.bytes / secs / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 1)
+        return 1;
+
+    ctx = mpv_create();
+    if (!ctx)
+        return 1;
+
+    atexit(exit_cleanup);
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+        fail("socketpair failed\n");
+    fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+
+    char fd_arg[32];
+    snprintf(fd_arg, sizeof(fd_arg), "fd://%d", pair[1]);
+    check_api_error(mpv_set_option_string(ctx, "input-ipc-client", fd_arg));
+    check_api_error(mpv_set_option_string(ctx, "vo", "null"));
+    check_api_error(mpv_set_option_string(ctx, "ao", "null"));
+    check_api_error(mpv_initialize(ctx));
+
+    run(pair[0], "get_property",
+        "{\"request_id\":%d,\"command\":[\"get_property\",\"volume\"]}\n",
+        NUM_REQUESTS);
+
+    // Every set produces a reply and (usually) a property-change event.
+    run(pair[0], NULL,
+        "{\"request_id\":%d,\"command\":[\"observe_property\",1,\"volume\"]}\n",
+        1);
+    run(pair[0], "set_property",
+        "{\"request_id\":%d,\"command\":[\"set_property\",\"volume\",%d]}\n",
+        NUM_REQUESTS);
+
+    // The IPC client owns the player, closing it quits.
+    close(pair[0]);
+    while (mpv_wait_event(ctx, -1)->event_id != MPV_EVENT_SHUTDOWN) {}
+
+    return 0;
+}
@@ -0,0 +1,233 @@
+#include <mpv/client.h>
+
+#include "misc/bstr.h"
+#include "misc/json.h"
+#include "misc/node.h"
+#include "test_utils.h"
+
+struct entry {
+    const char *a;
+    const char *b;
+    const char *patch;
+};
+
+static const struct entry entries[] = {
+    { NULL, "1", "[{\"op\":\"replace\",\"path\":\"\",\"value\":1}]" },
+    { "1", "1", "[]" },
+    { "1", "2", "[{\"op\":\"replace\",\"path\":\"\",\"value\":2}]" },
+    { "1", "[1]", "[{\"op\":\"replace\",\"path\":\"\",\"value\":[1]}]" },
+    { "{\"a\":1,\"b\":2}", "{\"a\":1,\"c\":3}",
+      "[{\"op\":\"remove\",\"path\":\"/b\"},"
+      "{\"op\":\"add\",\"path\":\"/c\",\"value\":3}]" },
+    { "{\"a/~\":{\"x\":1}}", "{\"a/~\":{\"x\":2}}",
+      "[{\"op\":\"replace\",\"path\":\"/a~1~0/x\",\"value\":2}]" },
+    { "[1,2,3]", "[1,4,2,3]",
+      "[{\"op\":\"add\",\"path\":\"/1\",\"value\":4}]" },
+    { "[1,2,3,4]", "[1,4]",
+      "[{\"op\":\"remove\",\"path\":\"/2\"},{\"op\":\"remove\",\"path\":\"/1\"}]" },
+    { "[1,2,3]", "[1,5,3]",
+      "[{\"op\":\"replace\",\"path\":\"/1\",\"value\":5}]" },
+    { "[{\"a\":1},{\"a\":2}]", "[{\"a\":1},{\"a\":2,\"b\":true}]",
+      "[{\"op\":\"add\",\"path\":\"/1/b\",\"value\":true}]" },
+    { "[1,1]", "[1,1,1]",
+      "[{\"op\":\"add\",\"path\":\"/2\",\"value\":1}]" },
+};
+
+static struct mpv_node parse(void *tmp, const char *text)
+{
+    struct mpv_node res;
+    char *s = talloc_strdup(tmp, text);
+    assert_int_equal(json_parse(tmp, &res, &s, MAX_JSON_DEPTH), 0);
+    return res;
+}
+
+// Minimal JSON Patch application, enough for the operations node_diff()
+// produces. Nodes are moved around instead of copied.
+static void apply_patch(struct mpv_node *dst, struct mpv_node *patch)
+{
+    for (int n = 0; n < patch->u.list->num; n++) {
+        struct mpv_node *op_node = &patch->u.list->values[n];
+        const char *op = node_map_get(op_node, "op")->u.string;
+        bstr path = bstr0(node_map_get(op_node, "path")->u.string);
+        struct mpv_node *val = node_map_get(op_node, "value");
+
+        if (!path.len) {
+            assert_string_equal(op, "replace");
+            *dst = *val;
+            continue;
+        }
+
+        struct mpv_node *cur = dst;
+        while (1) {
+            assert_true(bstr_eatstart0(&path, "/"));
+            int next = bstrchr(path, '/');
+            bstr token = next < 0 ? path : bstr_splice(path, 0, next);
+            path = next < 0 ? (bstr){0} : bstr_cut(path, next);
+
+            char *key = bstrto0(patch->u.list, token);
+            struct mpv_node_list *list = cur->u.list;
+            int index = -1;
+            if (cur->format == MPV_FORMAT_NODE_ARRAY) {
+                index = atoi(key);
+            } else {
+                key = talloc_strdup(list, key);
+                for (char *p = key, *d = key; ; p++, d++) {
+                    if (p[0] == '~')
+                        *d = *++p == '0' ? '~' : '/';
+                    else
+                        *d = *p;
+                    if (!*p)
+                        break;
+                }
+                for (int i = 0; i < list->num; i++) {
+                    if (!strcmp(list->keys[i], key))
+                        index = i;
+                }
+            }
+
+            if (path.len) {
+                cur = &list->values[index];
+                continue;
+            }
+
+            if (!strcmp(op, "replace")) {
+                list->values[index] = *val;
+            } else if (!strcmp(op, "remove")) {
+                if (list->keys) {
+                    MP_TARRAY_REMOVE_AT(list->keys, list->num, index);
+                    list->num++;
+                }
+                MP_TARRAY_REMOVE_AT(list->values, list->num, index);
+                if (list->keys)
+                    node_map_changed(cur);
+            } else if (cur->format == MPV_FORMAT_NODE_MAP) {
+                assert_string_equal(op, "add");
+                MP_TARRAY_APPEND(list, list->keys, list->num, key);
+                list->num--;
+                MP_TARRAY_APPEND(list, list->values, list->num, *val);
+            } else {
+                assert_string_equal(op, "add");
+                MP_TARRAY_INSERT_AT(list, list->values, list->num, index, *val);
+            }
+            break;
+        }
+    }
+}
+
+static void test_diff(void *tmp, struct mpv_node *a, struct mpv_node *b,
+                      const char *expected)
+{
+    struct mpv_node patch;
+    node_diff(&patch, a, b);
+    talloc_steal(tmp, patch.u.list);
+
+    if (expected) {
+        char *d = talloc_strdup(tmp, "");
+        assert_true(json_write(&d, &patch) >= 0);
+        assert_string_equal(d, expected);
+    }
+
+    struct mpv_node res = {0};
+    if (a) {
+        // Apply to a deep copy, as a is also compared against below. Trees
+        // from json_parse() can't be extended, so copy it with node_diff().
+        struct mpv_node copy;
+        node_diff(&copy, NULL, a);
+        talloc_steal(tmp, copy.u.list);
+        res = *node_map_get(&copy.u.list->values[0], "value");
+    }
+    apply_patch(&res, &patch);
+    assert_true(equal_mpv_node(&res, b));
+}
+
+static struct mpv_node make_playlist(void *tmp, bool insert, int current)
+{
+    struct mpv_node res;
+    node_init(&res, MPV_FORMAT_NODE_ARRAY, NULL);
+    talloc_steal(tmp, res.u.list);
+    for (int n = 0; n < 10000; n++) {
+        if (insert && n == 5000) {
+            struct mpv_node *e = node_array_add(&res, MPV_FORMAT_NODE_MAP);
+            node_map_add_string(e, "filename", "new.mkv");
+            node_map_add_int64(e, "id", 10001);
+        }
+        struct mpv_node *e = node_array_add(&res, MPV_FORMAT_NODE_MAP);
+        node_map_add_string(e, "filename", talloc_asprintf(tmp, "%d.mkv", n));
+        node_map_add_int64(e, "id", n + 1);
+        if (n == current)
+            node_map_add_flag(e, "current", true);
+    }
+    return res;
+}
+
+int main(void)
+{
+    for (int n = 0; n < MP_ARRAY_SIZE(entries); n++) {
+        const struct entry *e = &entries[n];
+        void *tmp = talloc_new(NULL);
+        struct mpv_node a, b = parse(tmp, e->b);
+        if (e->a)
+            a = parse(tmp, e->a);
+        test_diff(tmp, e->a ? &a : NULL, &b, e->patch);
+        talloc_free(tmp);
+    }
+
+    // Maps large enough to be indexed.
+    void *tmp = talloc_new(NULL);
+    struct mpv_node map;
+    node_init(&map, MPV_FORMAT_NODE_MAP, NULL);
+    talloc_steal(tmp, map.u.list);
+    for (int n = 0; n < 1000; n++) {
+        node_map_add_int64(&map, talloc_asprintf(tmp, "k%d", n), n);
+        // Lookups between additions must see the new entries.
+        if (n % 7 == 0)
+            assert_int_equal(node_map_get(&map, talloc_asprintf(tmp, "k%d", n))->u.int64, n);
+    }
+    node_map_add_int64(&map, "k10", -1);
+    for (int n = 0; n < 1000; n++)
+        assert_int_equal(node_map_get(&map, talloc_asprintf(tmp, "k%d", n))->u.int64, n);
+    assert_true(!node_map_get(&map, "k1000"));
+    assert_int_equal(node_map_bget(&map, (bstr){"k12", 2})->u.int64, 1);
+
+    // Removing an entry in place, then adding one, keeps the number of entries.
+    struct mpv_node_list *list = map.u.list;
+    MP_TARRAY_REMOVE_AT(list->keys, list->num, 0);
+    list->num++;
+    MP_TARRAY_REMOVE_AT(list->values, list->num, 0);
+    node_map_changed(&map);
+    node_map_add_int64(&map, "new", 1000);
+    assert_true(!node_map_get(&map, "k0"));
+    assert_int_equal(node_map_get(&map, "k1")->u.int64, 1);
+    assert_int_equal(node_map_get(&map, "new")->u.int64, 1000);
+
+    // A map that shrinks below the index size and grows back to it.
+    struct mpv_node small;
+    node_init(&small, MPV_FORMAT_NODE_MAP, NULL);
+    talloc_steal(tmp, small.u.list);
+    for (int n = 0; n < 16; n++)
+        node_map_add_int64(&small, talloc_asprintf(tmp, "k%d", n), n);
+    list = small.u.list;
+    MP_TARRAY_REMOVE_AT(list->keys, list->num, 3);
+    list->num++;
+    MP_TARRAY_REMOVE_AT(list->values, list->num, 3);
+    node_map_changed(&small);
+    node_map_add_int64(&small, "k3", 3);
+    for (int n = 0; n < 16; n++)
+        assert_int_equal(node_map_get(&small, talloc_asprintf(tmp, "k%d", n))->u.int64, n);
+    talloc_free(tmp);
+
+    // Large playlist-like arrays.
+    tmp = talloc_new(NULL);
+    struct mpv_node a = make_playlist(tmp, false, 100);
+    struct mpv_node b = make_playlist(tmp, true, 100);
+    struct mpv_node c = make_playlist(tmp, true, 9000);
+    test_diff(tmp, &a, &b,
+              "[{\"op\":\"add\",\"path\":\"/5000\",\"value\":"
+              "{\"filename\":\"new.mkv\",\"id\":10001}}]");
+    test_diff(tmp, &b, &c,
+              "[{\"op\":\"remove\",\"path\":\"/100/current\"},"
+              "{\"op\":\"add\",\"path\":\"/9001/current\",\"value\":true}]");
+    talloc_free(tmp);
+
+    return 0;
+}
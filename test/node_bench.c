@@ -0,0 +1,52 @@
+#include <stdio.h>
+
+#include <mpv/client.h>
+
+#include "common/common.h"
+#include "misc/node.h"
+#include "mpv_talloc.h"
+#include "osdep/timer.h"
+
+#define NUM_OPS 2000000
+
+// Build maps with "size" entries and look up every key, until NUM_OPS
+// additions and lookups were done, and print the time per operation.
+static void run(int size)
+{
+    void *tmp = talloc_new(NULL);
+    char **keys = talloc_array(tmp, char *, size);
+    for (int n = 0; n < size; n++)
+        keys[n] = talloc_asprintf(tmp, "key-%d", n);
+
+    int rounds = MPMAX(NUM_OPS / size, 1);
+    int64_t build = 0, lookup = 0;
+    int64_t sum = 0;
+    for (int r = 0; r < rounds; r++) {
+        struct mpv_node map;
+        int64_t t0 = mp_time_ns();
+        node_init(&map, MPV_FORMAT_NODE_MAP, NULL);
+        for (int n = 0; n < size; n++)
+            node_map_add_int64(&map, keys[n], n);
+        int64_t t1 = mp_time_ns();
+        for (int n = 0; n < size; n++)
+            sum += node_map_get(&map, keys[n])->u.int64;
+        int64_t t2 = mp_time_ns();
+        talloc_free(map.u.list);
+        build += t1 - t0;
+        lookup += t2 - t1;
+    }
+
+    int64_t ops = (int64_t)rounds * size;
+    printf("%6d entries: build %6.1f ns/entry, lookup %6.1f ns/lookup (%"PRId64")\n",
+           size, build / (double)ops, lookup / (double)ops, sum);
+    talloc_free(tmp);
+}
+
+int main(void)
+{
+    mp_time_init();
+    static const int sizes[] = {4, 15, 16, 64, 1000, 10000};
+    for (int n = 0; n < MP_ARRAY_SIZE(sizes); n++)
+        run(sizes[n]);
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "audio/filter/af_scaletempo2_internals.h"
+#include "common/common.h"
+#include "mpv_talloc.h"
+#include "osdep/timer.h"
+
+#define RATE 48000
+#define CHANNELS 2
+#define SECONDS 20
+#define SPEED 1.5
+
+// Some tones plus noise, so the search has something to find.
+static void make_input(float **planes, int frames)
+{
+    uint32_t seed = 1;
+    for (int c = 0; c < CHANNELS; c++) {
+        for (int n = 0; n < frames; n++) {
+            double t = n / (double)RATE;
+            seed = seed * 1664525 + 1013904223;
+            planes[c][n] = 0.4 * sin(2 * M_PI * 220 * t + c)
+                         + 0.2 * sin(2 * M_PI * 331 * t)
+                         + 0.1 * (seed / (double)UINT32_MAX - 0.5);
+        }
+    }
+}
+
+// Run the whole input through scaletempo2, return the time taken in seconds
+// and write the output to |out|.
+static double run(float search_ms, int force_fft, float **in, float **out,
+                  int out_frames)
+{
+    struct mp_scaletempo2_opts opts = {
+        .min_playback_rate = 0.25,
+        .max_playback_rate = 8.0,
+        .ola_window_size_ms = 12,
+        .wsola_search_interval_ms = search_ms,
+    };
+    struct mp_scaletempo2 *p = talloc_zero(NULL, struct mp_scaletempo2);
+    p->opts = &opts;
+    p->force_fft = force_fft;
+    mp_scaletempo2_init(p, CHANNELS, RATE);
+
+    int in_frames = RATE * SECONDS, in_pos = 0, out_pos = 0;
+    int64_t t0 = mp_time_ns();
+    while (out_pos < out_frames) {
+        uint8_t *planes[CHANNELS];
+        for (int c = 0; c < CHANNELS; c++)
+            planes[c] = (uint8_t *)(in[c] + in_pos);
+        in_pos += mp_scaletempo2_fill_input_buffer(p, planes,
+                                                   in_frames - in_pos, SPEED);
+        if (in_pos == in_frames)
+            mp_scaletempo2_set_final(p);
+
+        float *dest[CHANNELS];
+        for (int c = 0; c < CHANNELS; c++)
+            dest[c] = out[c] + out_pos;
+        int got = mp_scaletempo2_fill_buffer(p, dest,
+                                             MPMIN(1024, out_frames - out_pos), SPEED);
+        if (!got && in_pos == in_frames)
+            break;
+        out_pos += got;
+    }
+    int64_t t1 = mp_time_ns();
+
+    talloc_free(p);
+    return (t1 - t0) / 1e9;
+}
+
+int main(void)
+{
+    mp_time_init();
+    void *tmp = talloc_new(NULL);
+
+    int in_frames = RATE * SECONDS;
+    int out_frames = in_frames / SPEED;
+    float *in[CHANNELS], *out_direct[CHANNELS], *out_fft[CHANNELS];
+    for (int c = 0; c < CHANNELS; c++) {
+        in[c] = talloc_array(tmp, float, in_frames);
+        out_direct[c] = talloc_zero_array(tmp, float, out_frames);
+        out_fft[c] = talloc_zero_array(tmp, float, out_frames);
+    }
+    make_input(in, in_frames);
+
+    printf("%ds of %d channel audio at speed %.2f, seconds per run:\n",
+           SECONDS, CHANNELS, SPEED);
+    static const float search_ms[] = {5, 10, 20, 40, 80, 160, 320};
+    for (int n = 0; n < MP_ARRAY_SIZE(search_ms); n++) {
+        double direct = run(search_ms[n], -1, in, out_direct, out_frames);
+        double fft = run(search_ms[n], 1, in, out_fft, out_frames);
+
+        // Both paths should pick (nearly) the same blocks.
+        double diff = 0, sum = 0;
+        for (int c = 0; c < CHANNELS; c++) {
+            for (int i = 0; i < out_frames; i++) {
+                double d = out_direct[c][i] - out_fft[c][i];
+                diff += d * d;
+                sum += out_direct[c][i] * out_direct[c][i];
+            }
+        }
+
+        double def = run(search_ms[n], 0, in, out_fft, out_frames);
+        printf("search-interval=%3.0f: direct %6.3f fft %6.3f auto %6.3f "
+               "(relative difference %.2g)\n", search_ms[n], direct, fft, def,
+               sqrt(diff / MPMAX(sum, 1e-9)));
+    }
+
+    talloc_free(tmp);
+    return 0;
+}
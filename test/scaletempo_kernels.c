@@ -0,0 +1,76 @@
+#include <stdio.h>
+
+#include <libavutil/cpu.h>
+
+#include "audio/filter/af_scaletempo_kernels.h"
+#include "test_utils.h"
+
+#define MAX_SAMPLES 1000
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void)
+{
+    seed = seed * 1664525 + 1013904223;
+    return seed;
+}
+
+// Compare |k| against the C reference for all sizes up to MAX_SAMPLES and with
+// misaligned pointers.
+static void test_kernels(const struct mp_scaletempo_kernels *k)
+{
+    const struct mp_scaletempo_kernels *ref = &mp_scaletempo_kernels_c;
+    printf("testing %s kernels\n", k->name);
+
+    float fa[MAX_SAMPLES + 1], fb[MAX_SAMPLES + 1], fblend[MAX_SAMPLES + 1];
+    int16_t sa[MAX_SAMPLES + 1], sb[MAX_SAMPLES + 1];
+    int32_t sblend[MAX_SAMPLES + 1];
+    for (int i = 0; i < MAX_SAMPLES + 1; i++) {
+        fa[i] = (int32_t)rnd() / (double)INT32_MAX;
+        fb[i] = (int32_t)rnd() / (double)INT32_MAX;
+        fblend[i] = rnd() / (double)UINT32_MAX;
+        // Include full scale values, which overflow the s16 blend product.
+        sa[i] = i % 7 ? (int16_t)rnd() : INT16_MIN;
+        sb[i] = i % 11 ? (int16_t)rnd() : INT16_MAX;
+        sblend[i] = rnd() % 65537;
+    }
+
+    for (int n = 0; n <= MAX_SAMPLES; n += n < 70 ? 1 : 37) {
+        for (int off = 0; off < 2; off++) {
+            if (n + off > MAX_SAMPLES)
+                continue;
+
+            float rf = ref->sad_float(fa + off, fb, n);
+            assert_float_equal(k->sad_float(fa + off, fb, n), rf, 1e-5 * (n + 1));
+            assert_int_equal(k->sad_s16(sa + off, sb, n),
+                             ref->sad_s16(sa + off, sb, n));
+
+            float fout[2][MAX_SAMPLES];
+            ref->blend_float(fout[0], fa + off, fb, fblend, n);
+            k->blend_float(fout[1] + off, fa + off, fb, fblend, n);
+            for (int i = 0; i < n; i++)
+                assert_float_equal(fout[1][i + off], fout[0][i], 1e-6);
+
+            int16_t sout[2][MAX_SAMPLES + 1];
+            ref->blend_s16(sout[0], sa + off, sb, sblend, n);
+            k->blend_s16(sout[1] + off, sa + off, sb, sblend, n);
+            assert_memcmp(sout[1] + off, sout[0], n * sizeof(int16_t));
+        }
+    }
+}
+
+int main(void)
+{
+    static const int flags[] = {0, AV_CPU_FLAG_AVX2, AV_CPU_FLAG_AVX512};
+    int cpu_flags = av_get_cpu_flags();
+    const struct mp_scaletempo_kernels *last = NULL;
+    for (int n = 0; n < MP_ARRAY_SIZE(flags); n++) {
+        if ((cpu_flags & flags[n]) != flags[n])
+            continue;
+        const struct mp_scaletempo_kernels *k = mp_scaletempo_kernels_get(flags[n]);
+        if (k != last)
+            test_kernels(k);
+        last = k;
+    }
+    return 0;
+}
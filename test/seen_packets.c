@@ -0,0 +1,79 @@
+#include "common/common.h"
+#include "misc/random.h"
+#include "mpv_talloc.h"
+#include "sub/seen_packets.h"
+#include "test_utils.h"
+
+// Enough packets that a quadratic implementation would take a long time.
+#define NUM_PACKETS 100000
+
+struct packet {
+    int64_t pos;
+    double pts;
+};
+
+static void shuffle(struct packet *p, int num, mp_rand_state *rnd)
+{
+    for (int n = num - 1; n > 0; n--) {
+        int i = mp_rand_in_range32(rnd, 0, n + 1);
+        MPSWAP(struct packet, p[n], p[i]);
+    }
+}
+
+int main(void)
+{
+    void *ta_ctx = talloc_new(NULL);
+    struct seen_packets *s = seen_packets_create(ta_ctx);
+    mp_rand_state rnd = mp_rand_seed(1);
+
+    struct packet *packets = talloc_array(ta_ctx, struct packet, NUM_PACKETS);
+    for (int n = 0; n < NUM_PACKETS; n++) {
+        // Pairs of packets share the same file position, like multiple
+        // events demuxed from the same block.
+        packets[n] = (struct packet){ n / 2 * 100, n * 0.5 };
+    }
+    shuffle(packets, NUM_PACKETS, &rnd);
+
+    // New packets get consecutive indexes in insertion order.
+    for (int n = 0; n < NUM_PACKETS; n++) {
+        int index = -1;
+        assert_false(seen_packets_check(s, packets[n].pos, packets[n].pts, &index));
+        assert_int_equal(index, n);
+    }
+
+    // Revisiting in any order (e.g. after a seek) finds the same indexes.
+    int *order = talloc_array(ta_ctx, int, NUM_PACKETS);
+    for (int n = 0; n < NUM_PACKETS; n++)
+        order[n] = n;
+    for (int n = NUM_PACKETS - 1; n > 0; n--) {
+        int i = mp_rand_in_range32(&rnd, 0, n + 1);
+        MPSWAP(int, order[n], order[i]);
+    }
+    for (int n = 0; n < NUM_PACKETS; n++) {
+        struct packet *p = &packets[order[n]];
+        int index = -1;
+        assert_true(seen_packets_check(s, p->pos, p->pts, &index));
+        assert_int_equal(index, order[n]);
+    }
+
+    // Same position with a different pts is a different packet.
+    int index = -1;
+    assert_false(seen_packets_check(s, packets[0].pos, -1.0, &index));
+    assert_int_equal(index, NUM_PACKETS);
+    assert_true(seen_packets_check(s, packets[0].pos, -1.0, &index));
+    assert_int_equal(index, NUM_PACKETS);
+
+    // -0.0 and +0.0 compare equal.
+    assert_false(seen_packets_check(s, -1, 0.0, &index));
+    assert_true(seen_packets_check(s, -1, -0.0, &index));
+    assert_int_equal(index, NUM_PACKETS + 1);
+
+    seen_packets_clear(s);
+    assert_false(seen_packets_check(s, packets[5].pos, packets[5].pts, &index));
+    assert_int_equal(index, 0);
+    assert_false(seen_packets_check(s, packets[0].pos, packets[0].pts, &index));
+    assert_int_equal(index, 1);
+
+    talloc_free(ta_ctx);
+    return 0;
+}
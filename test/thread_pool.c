@@ -0,0 +1,182 @@
+#include <stdatomic.h>
+
+#include "misc/thread_pool.h"
+#include "misc/thread_tools.h"
+#include "mpv_talloc.h"
+#include "test_utils.h"
+
+#define NUM_ITEMS 1000
+
+static atomic_int counter;
+
+static void count_fn(void *ctx)
+{
+    atomic_fetch_add(&counter, 1);
+}
+
+// Queued work is done before the pool is destroyed, also with threads that
+// are created on demand.
+static void test_queue(int init_threads, int min_threads, int max_threads)
+{
+    struct mp_thread_pool *pool =
+        mp_thread_pool_create(NULL, init_threads, min_threads, max_threads);
+    assert_true(pool);
+
+    atomic_store(&counter, 0);
+    for (int n = 0; n < NUM_ITEMS; n++)
+        assert_true(mp_thread_pool_queue(pool, count_fn, NULL));
+
+    talloc_free(pool);
+    assert_int_equal(atomic_load(&counter), NUM_ITEMS);
+}
+
+struct order {
+    struct mp_waiter started;
+    struct mp_waiter start;
+    int num_done;
+    enum mp_thread_pool_prio done[8];
+};
+
+static struct order order;
+
+static void block_fn(void *ctx)
+{
+    mp_waiter_wakeup(&order.started, 0);
+    mp_waiter_wait(&order.start);
+}
+
+static void background_fn(void *ctx)
+{
+    order.done[order.num_done++] = MP_THREAD_POOL_PRIO_BACKGROUND;
+}
+
+static void realtime_fn(void *ctx)
+{
+    order.done[order.num_done++] = MP_THREAD_POOL_PRIO_REALTIME;
+}
+
+// With a single thread, all realtime items run before background items.
+static void test_priority(void)
+{
+    struct mp_thread_pool *pool = mp_thread_pool_create(NULL, 1, 1, 1);
+    assert_true(pool);
+
+    order = (struct order){
+        .started = MP_WAITER_INITIALIZER,
+        .start = MP_WAITER_INITIALIZER,
+    };
+    assert_true(mp_thread_pool_queue(pool, block_fn, NULL));
+    // The worker must be busy, or it could pick up items while they're queued.
+    mp_waiter_wait(&order.started);
+    for (int n = 0; n < 4; n++) {
+        assert_true(mp_thread_pool_queue(pool, background_fn, NULL));
+        assert_true(mp_thread_pool_queue_prio(pool, MP_THREAD_POOL_PRIO_REALTIME,
+                                              realtime_fn, NULL));
+    }
+    mp_waiter_wakeup(&order.start, 0);
+
+    talloc_free(pool);
+    assert_int_equal(order.num_done, 8);
+    for (int n = 0; n < 8; n++) {
+        assert_int_equal(order.done[n], n < 4 ? MP_THREAD_POOL_PRIO_REALTIME
+                                              : MP_THREAD_POOL_PRIO_BACKGROUND);
+    }
+}
+
+struct pfor {
+    struct mp_thread_pool *pool;
+    atomic_int calls[NUM_ITEMS];
+};
+
+static void pfor_fn(void *ctx, int n)
+{
+    struct pfor *p = ctx;
+    atomic_fetch_add(&p->calls[n], 1);
+}
+
+static void pfor_nested_fn(void *ctx, int n)
+{
+    struct pfor *p = ctx;
+    mp_thread_pool_parallel_for(p->pool, NUM_ITEMS, pfor_fn, p);
+}
+
+static void pfor_in_item_fn(void *ctx)
+{
+    struct pfor *p = ctx;
+    mp_thread_pool_parallel_for(p->pool, NUM_ITEMS, pfor_fn, p);
+}
+
+static void check_calls(struct pfor *p, int expected)
+{
+    for (int n = 0; n < NUM_ITEMS; n++)
+        assert_int_equal(atomic_load(&p->calls[n]), expected);
+}
+
+// Every index is run exactly once, also when called from work items.
+static void test_parallel_for(struct mp_thread_pool *pool)
+{
+    struct pfor *p = talloc_zero(NULL, struct pfor);
+    p->pool = pool;
+
+    mp_thread_pool_parallel_for(pool, NUM_ITEMS, pfor_fn, p);
+    check_calls(p, 1);
+
+    mp_thread_pool_parallel_for(pool, 8, pfor_nested_fn, p);
+    check_calls(p, 9);
+
+    if (pool) {
+        for (int n = 0; n < 4; n++)
+            assert_true(mp_thread_pool_queue(pool, pfor_in_item_fn, p));
+        struct mp_thread_pool_stats st;
+        do {
+            mp_thread_pool_get_stats(pool, &st);
+        } while (st.queued || st.busy_threads);
+        check_calls(p, 13);
+    }
+
+    talloc_free(p);
+}
+
+static void test_stats(void)
+{
+    struct mp_thread_pool *pool = mp_thread_pool_create(NULL, 2, 2, 2);
+    assert_true(pool);
+
+    atomic_store(&counter, 0);
+    for (int n = 0; n < NUM_ITEMS; n++)
+        assert_true(mp_thread_pool_queue(pool, count_fn, NULL));
+    mp_thread_pool_parallel_for(pool, 3, pfor_fn, &(struct pfor){0});
+
+    struct mp_thread_pool_stats st;
+    do {
+        mp_thread_pool_get_stats(pool, &st);
+    } while (st.queued || st.busy_threads);
+
+    assert_int_equal(st.num_threads, 2);
+    assert_int_equal(st.completed[MP_THREAD_POOL_PRIO_BACKGROUND], NUM_ITEMS);
+    // Helpers that found no index left still count.
+    assert_int_equal(st.completed[MP_THREAD_POOL_PRIO_REALTIME], 2);
+    assert_true(st.busy_ns >= 0);
+
+    talloc_free(pool);
+}
+
+int main(void)
+{
+    test_queue(1, 1, 1);
+    test_queue(4, 4, 4);
+    test_queue(0, 0, 8);
+    test_queue(0, 2, 30);
+    test_priority();
+
+    test_parallel_for(NULL);
+    struct mp_thread_pool *pool = mp_thread_pool_create(NULL, 0, 0, 8);
+    test_parallel_for(pool);
+    talloc_free(pool);
+    pool = mp_thread_pool_create(NULL, 1, 1, 1);
+    test_parallel_for(pool);
+    talloc_free(pool);
+
+    test_stats();
+    return 0;
+}
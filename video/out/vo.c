@@ -176,6 +176,7 @@ struct vo_internal {
     double reported_display_fps;
 
     struct stats_ctx *stats;
+    struct stat_entry *stat_draw, *stat_flip, *stat_iterations;
 };
 
 extern const struct m_sub_options gl_video_conf;
@@ -298,6 +299,9 @@ static struct vo *vo_create(bool probing, struct mpv_global *global,
         .estimated_vsync_jitter = -1,
         .stats = stats_ctx_create(vo, global, "vo"),
     };
+    vo->in->stat_draw = stats_entry(vo->in->stats, "video-draw");
+    vo->in->stat_flip = stats_entry(vo->in->stats, "video-flip");
+    vo->in->stat_iterations = stats_entry(vo->in->stats, "iterations");
     mp_dispatch_set_wakeup_fn(vo->in->dispatch, dispatch_wakeup_cb, vo);
     mp_mutex_init(&vo->in->lock);
     mp_cond_init(&vo->in->wakeup);
@@ -1011,15 +1015,15 @@ static bool render_frame(struct vo *vo)
         if (can_queue)
             wakeup_core(vo);
 
-        stats_time_start(in->stats, "video-draw");
+        stats_entry_time_start(in->stat_draw);
 
         in->visible = vo->driver->draw_frame(vo, frame);
 
-        stats_time_end(in->stats, "video-draw");
+        stats_entry_time_end(in->stat_draw);
 
         wait_until(vo, target);
 
-        stats_time_start(in->stats, "video-flip");
+        stats_entry_time_start(in->stat_flip);
 
         vo->driver->flip_page(vo);
 
@@ -1034,7 +1038,7 @@ static bool render_frame(struct vo *vo)
         if (vsync.last_queue_display_time <= 0)
             vsync.last_queue_display_time = mp_time_ns();
 
-        stats_time_end(in->stats, "video-flip");
+        stats_entry_time_end(in->stat_flip);
 
         mp_mutex_lock(&in->lock);
         in->dropped_frame = prev_drop_count < vo->in->drop_count;
@@ -1147,7 +1151,7 @@ static MP_THREAD_VOID vo_thread(void *ptr)
         mp_dispatch_queue_process(vo->in->dispatch, 0);
         if (in->terminate)
             break;
-        stats_event(in->stats, "iterations");
+        stats_entry_event(in->stat_iterations);
         vo->driver->control(vo, VOCTRL_CHECK_EVENTS, NULL);
         bool working = render_frame(vo);
         int64_t now = mp_time_ns();